@@ -0,0 +1,196 @@
+/**
+ * @file aot.h
+ * @brief Runtime support for scripts translated to C (clox --emit-c)
+ *
+ * A translated script keeps its values on the VM's stack, in slots fixed at
+ * translation time, and runs the common cases of each instruction as inline
+ * C, without the checks its operand types make unnecessary. Anything else
+ * (strings, arrays, classes and instances, and every runtime error) is
+ * handed to the interpreter one instruction at a time, which is why the
+ * program also carries the script's bytecode. Calls are handed over too, and
+ * functions and methods run in the interpreter until they return. The
+ * translation so behaves exactly like the interpreter.
+ *
+ * A translated program is built against libclox, e.g.
+ * cc -O2 -Iinclude script.c builddir/libclox.a -lpthread -lm
+ * */
+
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <math.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * Compiled body of a translated script, running on the current VM
+ * */
+typedef InterpretResult (*AotScript)();
+
+/**
+ * Start the VM of a translated program, with the script's bytecode.
+ *
+ * @param code Bytecode of the script
+ * @param lines Line number of each byte of code
+ * @param count Number of bytes of code
+ * */
+void aotInit(const uint8_t *code, const int *lines, int count);
+
+/**
+ * Add the next constant of the script
+ *
+ * @param value Constant (a number, not an object)
+ * */
+void aotConstant(Value value);
+
+/**
+ * Add the next constant of the script, a string
+ *
+ * @param chars Characters of the string
+ * @param length Number of characters
+ * */
+void aotStringConstant(const char *chars, int length);
+
+/**
+ * Start the next constant of the script, a function. The constants added
+ * until the matching aotEndFunction are the function's.
+ *
+ * @param name Characters of the function's name
+ * @param length Number of characters in the name
+ * @param arity Number of parameters
+ * @param maxSlots Most stack slots a call uses
+ * @param code Bytecode of the body
+ * @param lines Line number of each byte of code
+ * @param count Number of bytes of code
+ * */
+void aotBeginFunction(const char *name, int length, int arity, int maxSlots,
+                      const uint8_t *code, const int *lines, int count);
+
+/**
+ * Finish the function started by the last aotBeginFunction, adding it to
+ * the constants of the script (or of the function around it)
+ * */
+void aotEndFunction();
+
+/**
+ * Add the next constant of the script, a numeric array
+ *
+ * @param elements Elements of the array
+ * @param count Number of elements
+ * */
+void aotArrayConstant(const double *elements, int count);
+
+/**
+ * Create the next global slot of the script (slots have to be created in the
+ * order the compiler numbered them)
+ *
+ * @param chars Characters of the global's name
+ * @param length Number of characters
+ * */
+void aotGlobal(const char *chars, int length);
+
+/**
+ * Run a translated script, then free the VM
+ *
+ * @param script Compiled body of the script
+ *
+ * @returns Exit status for the process (the same as clox running the script)
+ * */
+int aotRun(AotScript script);
+
+/**
+ * Have the interpreter execute a single instruction of the script
+ *
+ * @param offset Offset of the instruction
+ * @param depth Number of values on the stack before the instruction
+ *
+ * @returns False if the instruction failed (after reporting the error)
+ * */
+bool aotStep(int offset, int depth);
+
+/**
+ * Have the interpreter make a call, running the function until it returns
+ *
+ * @param offset Offset of the call instruction
+ * @param depth Number of values on the stack before the call
+ *
+ * @returns False if the call failed (after reporting the error)
+ * */
+bool aotCall(int offset, int depth);
+
+/**
+ * Print the value on top of the stack
+ *
+ * @param depth Number of values on the stack
+ * */
+void aotPrint(int depth);
+
+// Execute an instruction in the interpreter, leaving the script if it fails
+#define AOT_STEP(offset, depth)                                                \
+  do {                                                                         \
+    if (!aotStep(offset, depth))                                               \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+  } while (false)
+
+// Make a call in the interpreter, leaving the script if it fails
+#define AOT_CALL(offset, depth)                                                \
+  do {                                                                         \
+    if (!aotCall(offset, depth))                                               \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+  } while (false)
+
+/**
+ * Add two integers, as a double if the sum doesn't fit
+ * */
+static inline Value aotAdd(int64_t a, int64_t b) {
+  int64_t result;
+  if (!__builtin_add_overflow(a, b, &result))
+    return INT_VAL(result);
+  return NUMBER_VAL((double)a + (double)b);
+}
+
+/**
+ * Subtract two integers, as a double if the difference doesn't fit
+ * */
+static inline Value aotSubtract(int64_t a, int64_t b) {
+  int64_t result;
+  if (!__builtin_sub_overflow(a, b, &result))
+    return INT_VAL(result);
+  return NUMBER_VAL((double)a - (double)b);
+}
+
+/**
+ * Multiply two integers, as a double if the product isn't an integer
+ * */
+static inline Value aotMultiply(int64_t a, int64_t b) {
+  int64_t result;
+  if (!intProduct(a, b, &result))
+    return INT_VAL(result);
+  return NUMBER_VAL((double)a * (double)b);
+}
+
+/**
+ * Divide two integers, as a double if the quotient isn't an integer
+ * */
+static inline Value aotDivide(int64_t a, int64_t b) {
+  int64_t result;
+  if (!exactQuotient(a, b, &result))
+    return INT_VAL(result);
+  return NUMBER_VAL((double)a / (double)b);
+}
+
+/**
+ * Negate an integer (-0 and -INT64_MIN are only doubles)
+ * */
+static inline Value aotNegate(int64_t a) {
+  if (a != 0 && a != INT64_MIN)
+    return INT_VAL(-a);
+  return NUMBER_VAL(-(double)a);
+}
+
+#endif // !clox_aot_h
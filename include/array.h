@@ -0,0 +1,75 @@
+/**
+ * @file array.h
+ * @brief Element-wise kernels over packed arrays of doubles
+ *
+ * The kernels process whole arrays with SIMD instructions, so arithmetic on a
+ * numeric array costs a single instruction dispatch however long the array
+ * is. On x86-64 every kernel is compiled both for AVX and for the SSE2
+ * baseline, and the version matching the processor is picked when the
+ * program is loaded.
+ * */
+
+#ifndef clox_array_h
+#define clox_array_h
+
+#include "common.h"
+
+/**
+ * Element-wise binary operations.
+ * */
+typedef enum {
+  ARRAY_ADD,      //! a + b
+  ARRAY_SUBTRACT, //! a - b
+  ARRAY_MULTIPLY, //! a * b
+  ARRAY_DIVIDE,   //! a / b
+  ARRAY_GREATER,  //! 1 where a > b, 0 elsewhere
+  ARRAY_LESS,     //! 1 where a < b, 0 elsewhere
+} ArrayOp;
+
+/**
+ * Apply a binary operation element-wise
+ *
+ * @param op Operation to apply
+ * @param a Elements of the left operand
+ * @param aScalar Whether the left operand is a single number, used with
+ * every element of the right one
+ * @param b Elements of the right operand
+ * @param bScalar Whether the right operand is a single number
+ * @param result Filled with count results (may be the same as a or b)
+ * @param count Number of elements
+ * */
+void arrayBinary(ArrayOp op, const double *a, bool aScalar, const double *b,
+                 bool bScalar, double *result, int count);
+
+/**
+ * Negate every element
+ * */
+void arrayNegate(const double *a, double *result, int count);
+
+/**
+ * Invert a mask (as produced by the comparisons): 1 where an element is 0,
+ * 0 elsewhere
+ * */
+void arrayNot(const double *a, double *result, int count);
+
+/**
+ * Add up the elements (0 for no elements)
+ * */
+double arraySum(const double *a, int count);
+
+/**
+ * Get the smallest element (infinity for no elements)
+ * */
+double arrayMin(const double *a, int count);
+
+/**
+ * Get the largest element (-infinity for no elements)
+ * */
+double arrayMax(const double *a, int count);
+
+/**
+ * Get the dot product of two arrays of the same length
+ * */
+double arrayDot(const double *a, const double *b, int count);
+
+#endif // !clox_array_h
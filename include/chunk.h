@@ -6,6 +6,8 @@
 #ifndef clox_chunk_h
 #define clox_chunk_h
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "value.h"
 
@@ -13,22 +15,75 @@
  * Define the types of opcode
  * */
 typedef enum {
-  OP_CONSTANT, //! Get a constant from Constant array
-  OP_NIL,      //! A nil value
-  OP_TRUE,     //! Boolean true
-  OP_FALSE,    //! Boolean false
-  OP_EQUAL,    //! Check equality
-  OP_GREATER,  //! Check greater
-  OP_LESS,     //! Check less
-  OP_ADD,      //! Binary addition
-  OP_SUBTRACT, //! Binary subtraction
-  OP_MULTIPLY, //! Binary multiplication
-  OP_DIVIDE,   //! Binary Division
-  OP_NOT,      //! Unary logical not
-  OP_NEGATE,   //! Unary negate
-  OP_RETURN,   //! Return (from function)
+  OP_CONSTANT,      //! Get a constant from Constant array
+  OP_NIL,           //! A nil value
+  OP_TRUE,          //! Boolean true
+  OP_FALSE,         //! Boolean false
+  OP_POP,           //! Discard the top of the stack
+  OP_DEFINE_GLOBAL, //! Define a global (16 bit slot operand)
+  OP_GET_GLOBAL,    //! Read a global (16 bit slot operand)
+  OP_SET_GLOBAL,    //! Assign a global (16 bit slot operand)
+  OP_GET_LOCAL,     //! Read a local of the frame (8 bit slot operand)
+  OP_SET_LOCAL,     //! Assign a local of the frame (8 bit slot operand)
+  OP_GET_PROPERTY,  //! Read a property (name and 16 bit cache operands)
+  OP_SET_PROPERTY,  //! Assign a field (name and 16 bit cache operands)
+  OP_EQUAL,         //! Check equality
+  OP_GREATER,       //! Check greater
+  OP_LESS,          //! Check less
+  OP_ADD,           //! Binary addition
+  OP_SUBTRACT,      //! Binary subtraction
+  OP_MULTIPLY,      //! Binary multiplication
+  OP_DIVIDE,        //! Binary Division
+  OP_NOT,           //! Unary logical not
+  OP_NEGATE,        //! Unary negate
+  OP_PRINT,         //! Print the top of the stack
+  OP_JUMP,          //! Jump forward (32 bit offset operand)
+  OP_JUMP_IF_FALSE, //! Jump forward if the top of the stack is falsey
+  OP_JUMP_IF_TRUE,  //! Jump forward if the top of the stack is truthy
+  OP_ARRAY,         //! Pack numbers into an array (8 bit count operand)
+  OP_SUM,           //! Sum of an array's elements
+  OP_MIN,           //! Smallest element of an array
+  OP_MAX,           //! Largest element of an array
+  OP_DOT,           //! Dot product of two arrays
+  OP_MAP,           //! Build a map from key/value pairs (8 bit pair count)
+  OP_GET_INDEX,     //! Read the value of a key of a map
+  OP_SET_INDEX,     //! Assign the value of a key of a map
+  OP_CALL,          //! Call a function (8 bit argument count operand)
+  OP_INVOKE,        //! Call a method (name, argument count and cache)
+  OP_GET_SUPER,     //! Read a superclass method (name and cache operands)
+  OP_SUPER_INVOKE,  //! Call a superclass method (name, count and cache)
+  OP_CLASS,         //! Create a class (name operand)
+  OP_INHERIT,       //! Copy a superclass's methods into a subclass
+  OP_METHOD,        //! Add a method to a class (name operand)
+  OP_RETURN,        //! Return (from function)
 } OpCode;
 
+// Shapes an inline cache remembers, beyond that entries are replaced in turn
+#define CACHE_WAYS 4
+
+typedef struct ObjShape ObjShape;
+typedef struct ObjFunction ObjFunction;
+
+/**
+ * What a property instruction found on receivers of one shape.
+ * */
+typedef struct {
+  ObjShape *shape;     //! Shape of the receivers (NULL for an unused entry)
+  ObjShape *next;      //! Shape after adding the field (set only), or NULL
+  ObjFunction *method; //! Method found, or NULL for a field
+  int index;           //! Index of the field in the receivers' fields
+} CacheEntry;
+
+/**
+ * Inline cache of a property instruction, remembering the lookups of the
+ * last few receiver shapes seen there (one for a monomorphic site, up to
+ * CACHE_WAYS for a polymorphic one).
+ * */
+typedef struct {
+  CacheEntry entries[CACHE_WAYS]; //! Lookups, by receiver shape
+  int next;                       //! Entry the next miss replaces
+} InlineCache;
+
 /**
  * A dynamic array of opcodes (which are single bytes).
  * */
@@ -38,8 +93,25 @@ typedef struct {
   uint8_t *code;        //! Pointer to code array
   int *lines;           //! Line numbers of the instructions
   ValueArray constants; //! Array of constant values
+  InlineCache *caches;  //! Caches of the property instructions, by operand
+  int cacheCount;       //! Number of caches
 } Chunk;
 
+/**
+ * A compiled, reference counted chunk packed into a single allocation.
+ *
+ * Created from a fully compiled Chunk by freezeChunk. The bytecode, constants
+ * and line numbers are laid out back to back in one cache-line-aligned block
+ * sized exactly to their contents. Running a frozen chunk only writes to
+ * its inline caches (which, like its constants, hold objects of the VM that
+ * compiled it), so any number of that VM's fibers can share it.
+ * */
+typedef struct FrozenChunk {
+  atomic_int refCount; //! Number of owners currently holding the chunk
+  size_t size;         //! Size of the whole allocation (in bytes)
+  Chunk chunk;         //! View of the packed data
+} FrozenChunk;
+
 /**
  * Initialize a new chunk.
  *
@@ -70,4 +142,63 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
  * */
 int addConstant(Chunk *chunk, Value value);
 
+/**
+ * Pack a compiled chunk into a frozen, shareable chunk.
+ *
+ * The contents of the chunk are copied into the frozen chunk and the chunk
+ * itself is freed (leaving it empty, as if freshly initialized).
+ *
+ * @param chunk Chunk to freeze
+ *
+ * @returns Frozen chunk with a reference count of one
+ * */
+FrozenChunk *freezeChunk(Chunk *chunk);
+
+/**
+ * Take an additional reference to a frozen chunk.
+ *
+ * @param frozen Frozen chunk to retain
+ *
+ * @returns The same frozen chunk, for convenience
+ * */
+FrozenChunk *retainChunk(FrozenChunk *frozen);
+
+/**
+ * Drop a reference to a frozen chunk, freeing it once no owners remain.
+ *
+ * @param frozen Frozen chunk to release
+ * */
+void releaseChunk(FrozenChunk *frozen);
+
+/**
+ * Allocate the inline caches of a chunk's property instructions, once its
+ * code is complete
+ *
+ * @param chunk Chunk whose caches to allocate
+ * */
+void initCaches(Chunk *chunk);
+
+/**
+ * Get the length of an instruction (with its operands)
+ *
+ * @param instruction Opcode of the instruction
+ *
+ * @returns Number of bytes the instruction takes up
+ * */
+int instructionLength(uint8_t instruction);
+
+/**
+ * Get how many values an instruction pushes onto the stack (negative for
+ * values popped)
+ *
+ * @param chunk Chunk holding the instruction
+ * @param offset Offset of the instruction
+ * */
+int stackEffect(Chunk *chunk, int offset);
+
+/**
+ * Check whether an instruction is a jump (with a 32 bit offset operand)
+ * */
+bool isJump(uint8_t instruction);
+
 #endif // !clox_chunk_h
@@ -0,0 +1,312 @@
+/**
+ * @file clox.h
+ * @brief C API for embedding clox (libclox)
+ *
+ * A host creates a VM, compiles source into a script once, then evaluates
+ * the script as many times as it needs to. Inputs are passed in as globals
+ * and results come back as typed values, without converting to and from
+ * text.
+ *
+ * Calls using a VM lock it, so a VM can be used from any thread (although
+ * only one thread runs code in it at a time), and different VMs run in
+ * parallel. Many evaluations can also run concurrently as fibers,
+ * multiplexed over the worker threads of a scheduler, each running a
+ * quantum of instructions at a time.
+ *
+ * Values belong to the VM that created them. A string value handed to the
+ * host stays valid while it's the result of the last evaluation or the value
+ * of a global, otherwise only until the next call that can run code or
+ * allocate in its VM (compiling, evaluating, creating a string or setting a
+ * global).
+ *
+ * Compile and runtime errors are reported on stderr, and print statements
+ * write to stdout.
+ *
+ * Before creating any VM, the host can add functions of its own, which
+ * every VM then defines as globals next to the built-in ones. Functions
+ * taking and returning numbers are best registered as such: scripts call
+ * them on unboxed doubles, about as fast as C calls them.
+ * */
+
+#ifndef clox_clox_h
+#define clox_clox_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define CLOX_API __attribute__((visibility("default")))
+#else
+#define CLOX_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A virtual machine, with its own globals and heap.
+ * */
+typedef struct VM CloxVM;
+
+/**
+ * Compiled source code, which can be evaluated any number of times.
+ * */
+typedef struct FrozenChunk CloxScript;
+
+/**
+ * A set of worker threads running fibers.
+ * */
+typedef struct Scheduler CloxScheduler;
+
+/**
+ * A concurrent evaluation of a script.
+ * */
+typedef struct Fiber CloxFiber;
+
+/**
+ * A value (read with the cloxAs functions, according to its cloxType).
+ * */
+typedef struct {
+  uint64_t opaque[2]; //! Representation used by the VM
+} CloxValue;
+
+/**
+ * Result of compiling or evaluating.
+ * */
+typedef enum {
+  CLOX_OK,            //! No errors
+  CLOX_COMPILE_ERROR, //! Error occured during compilation
+  CLOX_RUNTIME_ERROR, //! Error occured during runtime
+} CloxStatus;
+
+/**
+ * Types of values.
+ * */
+typedef enum {
+  CLOX_NIL,    //! nil
+  CLOX_BOOL,   //! true or false
+  CLOX_NUMBER, //! A double
+  CLOX_STRING, //! A string
+  CLOX_OBJECT, //! Any other object (opaque to the host)
+} CloxType;
+
+/**
+ * A function the host adds to every VM (see cloxRegisterNative).
+ *
+ * It's called with its VM locked by the calling thread, so it can create its
+ * result with cloxString.
+ *
+ * @param vm VM the function is called in
+ * @param argCount Number of arguments (the arity it was registered with)
+ * @param args The arguments, in place on the VM's stack
+ * @param result Set to the result (nil if left alone), or to a string
+ * describing the error when returning false
+ *
+ * @returns False for a runtime error
+ * */
+typedef bool (*CloxNative)(CloxVM *vm, int argCount, const CloxValue *args,
+                           CloxValue *result);
+
+/**
+ * Add a function to every VM created from now on, as a global
+ *
+ * Functions are registered for the whole process, before creating the VMs
+ * that use them (or loading images saved with them).
+ *
+ * @param name Name of the global
+ * @param arity Number of parameters (at most 255)
+ * @param function The implementation
+ *
+ * @returns False if the name is already taken by another function
+ * */
+CLOX_API bool cloxRegisterNative(const char *name, int arity,
+                                 CloxNative function);
+
+/**
+ * Add a function of one number to every VM created from now on, like
+ * cloxRegisterNative (arguments that aren't numbers are runtime errors)
+ * */
+CLOX_API bool cloxRegisterUnaryNative(const char *name,
+                                      double (*function)(double));
+
+/**
+ * Add a function of two numbers to every VM created from now on, like
+ * cloxRegisterNative (arguments that aren't numbers are runtime errors)
+ * */
+CLOX_API bool cloxRegisterBinaryNative(const char *name,
+                                       double (*function)(double, double));
+
+/**
+ * Create a new VM
+ * */
+CLOX_API CloxVM *cloxNewVM(void);
+
+/**
+ * Create a new VM, with the globals saved in an image by cloxSaveImage
+ * (restoring is about as cheap as mapping the file)
+ *
+ * @param path Path of the image
+ *
+ * @returns The VM, or NULL if the image couldn't be read or was written by
+ * another build of clox
+ * */
+CLOX_API CloxVM *cloxNewVMFromImage(const char *path);
+
+/**
+ * Save the globals of a VM, and everything they reference, to an image that
+ * new VMs can start from (scripts aren't saved, compile them again)
+ *
+ * @param vm VM to save
+ * @param path Path of the image to write
+ *
+ * @returns False if the image couldn't be written
+ * */
+CLOX_API bool cloxSaveImage(CloxVM *vm, const char *path);
+
+/**
+ * Free a VM, and every script, fiber and value belonging to it (its fibers
+ * must have finished)
+ * */
+CLOX_API void cloxFreeVM(CloxVM *vm);
+
+/**
+ * Compile source code into a script
+ *
+ * Globals are resolved when compiling, so the script keeps working with
+ * whatever values they're given later.
+ *
+ * @param vm VM to compile for
+ * @param source Source code (null-terminated)
+ *
+ * @returns The script, or NULL if there was a compile error
+ * */
+CLOX_API CloxScript *cloxCompile(CloxVM *vm, const char *source);
+
+/**
+ * Free a script
+ * */
+CLOX_API void cloxFreeScript(CloxVM *vm, CloxScript *script);
+
+/**
+ * Evaluate a script
+ *
+ * @param vm VM the script was compiled for
+ * @param script Script to evaluate
+ * @param result If not NULL, set to the value of the script's final
+ * statement if that's an expression statement, nil otherwise (or on errors)
+ *
+ * @returns CLOX_OK, or CLOX_RUNTIME_ERROR
+ * */
+CLOX_API CloxStatus cloxEvaluate(CloxVM *vm, CloxScript *script,
+                                 CloxValue *result);
+
+/**
+ * Define (or assign) a global, for scripts to read
+ *
+ * @returns False if the VM already has the most globals it can hold
+ * */
+CLOX_API bool cloxSetGlobal(CloxVM *vm, const char *name, CloxValue value);
+
+/**
+ * Read a global
+ *
+ * @returns False (leaving value unset) if the global isn't defined
+ * */
+CLOX_API bool cloxGetGlobal(CloxVM *vm, const char *name, CloxValue *value);
+
+/**
+ * Start a scheduler
+ *
+ * @param workers Number of worker threads (0 for one per online processor)
+ * @param quantum Instructions a fiber runs before letting another one run on
+ * its worker (0 for the default)
+ *
+ * @returns The scheduler, or NULL if its threads couldn't be started
+ * */
+CLOX_API CloxScheduler *cloxNewScheduler(int workers, uint64_t quantum);
+
+/**
+ * Wait for every fiber of a scheduler to finish, then stop it (the fibers
+ * still need to be joined)
+ * */
+CLOX_API void cloxFreeScheduler(CloxScheduler *scheduler);
+
+/**
+ * Start evaluating a script concurrently, as a fiber of a scheduler
+ *
+ * Fibers of the same VM take turns, fibers of different VMs run in
+ * parallel.
+ *
+ * @returns The fiber, which must be joined
+ * */
+CLOX_API CloxFiber *cloxSpawn(CloxScheduler *scheduler, CloxVM *vm,
+                              CloxScript *script);
+
+/**
+ * Wait for a fiber to finish, and free it
+ *
+ * @param scheduler Scheduler the fiber was spawned on
+ * @param fiber Fiber to wait for
+ * @param result If not NULL, set like the result of cloxEvaluate
+ *
+ * @returns CLOX_OK, or CLOX_RUNTIME_ERROR
+ * */
+CLOX_API CloxStatus cloxJoin(CloxScheduler *scheduler, CloxFiber *fiber,
+                             CloxValue *result);
+
+/**
+ * The nil value
+ * */
+CLOX_API CloxValue cloxNil(void);
+
+/**
+ * Create a boolean value
+ * */
+CLOX_API CloxValue cloxBool(bool boolean);
+
+/**
+ * Create a number value
+ * */
+CLOX_API CloxValue cloxNumber(double number);
+
+/**
+ * Create a string value from a copy of some characters
+ * */
+CLOX_API CloxValue cloxString(CloxVM *vm, const char *chars, size_t length);
+
+/**
+ * Get the type of a value
+ * */
+CLOX_API CloxType cloxType(CloxValue value);
+
+/**
+ * Get the boolean of a CLOX_BOOL value
+ * */
+CLOX_API bool cloxAsBool(CloxValue value);
+
+/**
+ * Get the double of a CLOX_NUMBER value
+ * */
+CLOX_API double cloxAsNumber(CloxValue value);
+
+/**
+ * Get the characters of a CLOX_STRING value
+ *
+ * Short strings are stored in the value itself, so the characters are only
+ * valid as long as the value they were read from (as well as the value
+ * being valid).
+ *
+ * @param value String value
+ * @param length Set to the number of characters
+ *
+ * @returns The characters (not necessarily null-terminated)
+ * */
+CLOX_API const char *cloxAsString(const CloxValue *value, size_t *length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !clox_clox_h
@@ -9,7 +9,18 @@
 #include <stddef.h>
 #include <stdint.h> // Explicit sized integers
 
+// Size (in bytes) of a cache line, used to align shared read-only data
+#define CACHE_LINE_SIZE 64
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+// Record executed instructions into a binary ring buffer (see trace.h)
+// #define DEBUG_BINARY_TRACE
+// Run a full collection on every allocation
+// #define DEBUG_STRESS_GC
+// Do file I/O on a pool of threads even where io_uring is available
+// #define DEBUG_IO_THREADS
+// Allocate everything with malloc, so tools like ASan see every object
+// #define DEBUG_NO_SLABS
 
 #endif
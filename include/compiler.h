@@ -13,4 +13,10 @@
  * @returns True if there was no error, false otherwise*/
 bool compile(const char *source, Chunk *chunk);
 
+/**
+ * Mark the objects the compiler is holding on to (the constants of the chunk
+ * being compiled), so a collection mid-compile doesn't free them
+ * */
+void markCompilerRoots();
+
 #endif // !clox_compiler_h
@@ -22,4 +22,13 @@ void dissasembleChunk(Chunk *chunk, const char *name);
  * */
 int dissasembleInstruction(Chunk *chunk, int offset);
 
+/**
+ * Get the name of an opcode.
+ *
+ * @param opcode The opcode
+ *
+ * @return Name of the opcode (e.g. "OP_ADD")
+ * */
+const char *opcodeName(uint8_t opcode);
+
 #endif // !clox_debug_h
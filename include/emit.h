@@ -0,0 +1,34 @@
+/**
+ * @file emit.h
+ * @brief Translation of compiled scripts into C programs (clox --emit-c)
+ *
+ * The translation follows the bytecode, so it sees the script after the
+ * compiler's optimizations. The value on each stack slot is typed as far as
+ * the script pins it down (literals, and what operators make of them), and
+ * the C for an instruction only checks the types that aren't known. See
+ * aot.h for the runtime the program runs on.
+ * */
+
+#ifndef clox_emit_h
+#define clox_emit_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+/**
+ * Translate a compiled script into a standalone C program.
+ *
+ * Global slots are numbered by the current VM, so the script must have been
+ * compiled by it.
+ *
+ * @param chunk Compiled script
+ * @param sourcePath Path of the script (for the comment heading the program)
+ * @param file File to write the C source to
+ *
+ * @returns False if the C source couldn't be written
+ * */
+bool emitC(Chunk *chunk, const char *sourcePath, FILE *file);
+
+#endif // !clox_emit_h
@@ -0,0 +1,201 @@
+/**
+ * @file fiber.h
+ * @brief Fibers (suspendable runs of a chunk) and an M:N scheduler
+ *
+ * A fiber holds everything run() works on (frames, ip and stack), so it can
+ * give up its thread after a quantum of instructions and continue later, on
+ * any thread. Its stack and frames start small and grow as calls nest (up to
+ * STACK_MAX and FRAMES_MAX), so a fiber that never calls deep stays a few
+ * kilobytes. The scheduler multiplexes fibers over a fixed set of worker
+ * threads. Each worker has its own queue of runnable fibers, and workers
+ * that run out steal from the others.
+ *
+ * Fibers of the same VM share its heap and globals, so only one of them runs
+ * at a time: it has the VM's turn, and the others are parked on the VM
+ * rather than queued until it lets go, when the turn is handed to the one
+ * parked longest. Fibers of different VMs run in parallel.
+ *
+ * A fiber that calls a native doing I/O (see io.h) gives up its worker and
+ * the VM's turn until the I/O completes, then is queued again.
+ * */
+
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "io.h"
+#include "value.h"
+#include "vm.h"
+
+// Default number of instructions a fiber runs before yielding
+#define FIBER_QUANTUM_DEFAULT 10000
+// Most worker threads in a scheduler
+#define SCHEDULER_WORKERS_MAX 256
+// Values a new fiber's stack holds (enough for the script's frame and the
+// headroom), it grows up to STACK_MAX and the headroom
+#define FIBER_STACK_INITIAL (FRAME_SLOTS + STACK_HEADROOM)
+// Calls a new fiber's frames hold, they grow up to FRAMES_MAX
+#define FIBER_FRAMES_INITIAL 4
+
+typedef struct Scheduler Scheduler;
+
+/**
+ * Make the result of a native that waited for I/O, once the request has
+ * completed (in the native's VM, taking ownership of the request)
+ *
+ * @param request The completed request
+ * @param args Arguments of the native
+ * */
+typedef Value (*IoFinish)(IoRequest *request, Value *args);
+
+/**
+ * A run of a compiled chunk that can be suspended and resumed.
+ * */
+struct Fiber {
+  VM *vm;                   //! VM the fiber runs in
+  FrozenChunk *chunk;       //! Chunk being run (retained by the fiber)
+  uint8_t *ip;              //! Next instruction, while suspended
+  Value *stackTop;          //! Top of the stack, while suspended
+  int frameCount;           //! Number of calls in progress, while suspended
+  InterpretResult status;   //! How the run ended (once done)
+  Value result;             //! Value of the final expression (once done)
+  atomic_bool done;         //! Whether the run has ended
+  Scheduler *scheduler;     //! Scheduler running the fiber, if any
+  IoRequest *io;            //! I/O the fiber is suspended on, if any
+  IoFinish finishIo;        //! Makes the result of the suspended native
+  Value *ioArgs;            //! Arguments of the suspended native
+  atomic_int ioHolds;       //! Parties yet to let go of a suspended fiber
+  struct Fiber *prev;       //! Previous fiber of the VM
+  struct Fiber *next;       //! Next fiber of the VM
+  struct Fiber *nextParked; //! Next fiber waiting for the VM's turn
+  bool hasTurn;             //! Handed the VM's turn while waiting for it
+  Value *stack;             //! The fiber's own stack
+  int stackCapacity;        //! Number of values stack holds
+  CallFrame *frames;        //! The fiber's own frames
+  int frameCapacity;        //! Number of calls frames holds
+};
+
+/**
+ * Queue of runnable fibers belonging to one worker.
+ *
+ * The owner runs fibers from the head and puts yielded ones back at the
+ * tail, other workers steal from the tail.
+ * */
+typedef struct {
+  pthread_mutex_t lock; //! Protects the queue
+  Fiber **fibers;       //! Ring buffer of fibers
+  int capacity;         //! Capacity of fibers (a power of two)
+  int head;             //! Index of the first fiber
+  int count;            //! Number of fibers queued
+} FiberQueue;
+
+/**
+ * A worker thread of a scheduler.
+ * */
+typedef struct {
+  Scheduler *scheduler; //! Scheduler the worker belongs to
+  int index;            //! Index among the scheduler's workers
+  FiberQueue queue;     //! Fibers to run next
+  pthread_t thread;     //! The worker thread
+} Worker;
+
+/**
+ * An M:N scheduler, running fibers on a fixed set of worker threads.
+ * */
+struct Scheduler {
+  Worker *workers;         //! The worker threads
+  int workerCount;         //! Number of workers
+  int threadCount;         //! Number of workers whose thread started
+  uint64_t quantum;        //! Instructions a fiber runs before yielding
+  atomic_int queued;       //! Fibers queued (over all workers)
+  atomic_int suspended;    //! Fibers suspended on I/O
+  atomic_uint nextWorker;  //! Worker to give the next new fiber to
+  pthread_mutex_t idle;    //! Held while sleeping for work, or finishing
+  pthread_cond_t wake;     //! Signalled when fibers are queued
+  pthread_cond_t finished; //! Signalled when a fiber finishes
+  bool stopping;           //! Set when the workers should exit
+};
+
+/**
+ * Create a fiber that runs a compiled chunk in the current VM
+ *
+ * @param frozen Chunk to run (retained by the fiber)
+ * */
+Fiber *newFiber(FrozenChunk *frozen);
+
+/**
+ * Free a fiber of the current VM (which must not be queued or running)
+ * */
+void freeFiber(Fiber *fiber);
+
+/**
+ * Make room in the stack and frames of the fiber running in the current VM
+ * for one more call, moving the stack if it grows
+ *
+ * @param slots Number of values the stack must hold (with the headroom)
+ *
+ * @returns False if no fiber is running, or the call would pass FRAMES_MAX or
+ * STACK_MAX
+ * */
+bool growFiber(int slots);
+
+/**
+ * Run a fiber in its VM (whose lock the caller holds) for a quantum of
+ * instructions, or until it finishes
+ *
+ * @returns INTERPRET_YIELD if the fiber can be resumed, otherwise how the
+ * run ended
+ * */
+InterpretResult resumeFiber(Fiber *fiber, uint64_t quantum);
+
+/**
+ * Start a scheduler's worker threads
+ *
+ * @param scheduler Scheduler to start
+ * @param workers Number of worker threads (0 for one per online processor)
+ * @param quantum Instructions a fiber runs before yielding (0 for
+ * FIBER_QUANTUM_DEFAULT)
+ *
+ * @returns False if no worker thread could be started
+ * */
+bool startScheduler(Scheduler *scheduler, int workers, uint64_t quantum);
+
+/**
+ * Wait for every queued fiber to finish, then stop the worker threads
+ * */
+void stopScheduler(Scheduler *scheduler);
+
+/**
+ * Queue a new fiber to run on one of the scheduler's workers
+ * */
+void scheduleFiber(Scheduler *scheduler, Fiber *fiber);
+
+/**
+ * Wait for a fiber to finish
+ * */
+void waitForFiber(Scheduler *scheduler, Fiber *fiber);
+
+/**
+ * Carry out an I/O request for the native being called in the current VM.
+ *
+ * A fiber running on a scheduler is suspended until the request completes,
+ * keeping the native's arguments on its stack, and run() gives up the thread
+ * before the next instruction. Anywhere else, the thread waits for the
+ * request. Either way, finish then makes the native's result.
+ *
+ * A wait that's still going at vm->deadline (CLOCK_MONOTONIC nanoseconds,
+ * if not 0) cancels the request, so the native fails, and run() yields
+ * before the next instruction: whoever resumes the fiber finds the time is
+ * up.
+ *
+ * @param request Request to carry out (its complete and data are set here)
+ * @param finish Makes the native's result from the completed request
+ * @param args Arguments of the native
+ * */
+void awaitIo(IoRequest *request, IoFinish finish, Value *args);
+
+#endif // !clox_fiber_h
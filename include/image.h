@@ -0,0 +1,53 @@
+/**
+ * @file image.h
+ * @brief Snapshot images of an initialized VM, for instant warm startup
+ *
+ * An image holds the globals of a VM and every object they reach, written
+ * out in their in-memory layout. Restoring an image maps the file and uses
+ * its objects in place: only the VM's own arrays (the global slots and the
+ * interned strings) and what objects change at runtime (the fields of
+ * instances, the tables of classes and shapes) are copied out of it, with
+ * their object pointers relocated to wherever the file got mapped. So
+ * starting from an image costs about as much as mapping it, however much
+ * work built the globals.
+ *
+ * Objects in an image aren't on the VM's list of objects, so the collector
+ * never frees them (they're unmapped with the VM). Images are only readable
+ * by the build of clox that wrote them.
+ * */
+
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+
+/**
+ * Write an image of the current VM's globals.
+ *
+ * Ropes are flattened, so the image holds no ropes. Inline caches aren't
+ * saved: a restored function starts with empty ones. Files are saved closed,
+ * with no lines left to read.
+ *
+ * @param path Path of the image file to write
+ *
+ * @returns False if the image couldn't be written
+ * */
+bool saveImage(const char *path);
+
+/**
+ * Restore an image into the current VM, which must be freshly initialized.
+ *
+ * @param path Path of the image file
+ *
+ * @returns False if the image couldn't be read or wasn't written by this
+ * build, leaving the VM as it was
+ * */
+bool loadImage(const char *path);
+
+/**
+ * Unmap the current VM's image, if it has one (objects in it must no longer
+ * be used).
+ * */
+void unmapImage();
+
+#endif // !clox_image_h
@@ -0,0 +1,89 @@
+/**
+ * @file io.h
+ * @brief Asynchronous file I/O, shared by every VM of the process
+ *
+ * Requests can be queued from any thread, and are carried out by one I/O
+ * thread over io_uring. Each time it wakes up, the I/O thread submits
+ * everything queued since it last did in a single system call, so the
+ * requests of VMs running concurrently are batched together. Where io_uring
+ * isn't available, a small pool of threads makes blocking calls instead.
+ *
+ * A request runs until it's complete rather than for one transfer: a read
+ * goes on (growing its buffer) until the end of the file or a given byte,
+ * and a write until everything is written. Transfers start at the file's
+ * current position and move it along, like read() and write().
+ *
+ * A wait for a request can be given a deadline, at which the request is
+ * cancelled: on io_uring even a transfer that blocks (reading a pipe, say)
+ * is stopped, while the pool only stops before the next transfer.
+ * */
+
+#ifndef clox_io_h
+#define clox_io_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Requests in flight at once on the ring (more wait their turn)
+#define IO_RING_ENTRIES 256
+// Threads making blocking calls, without io_uring
+#define IO_POOL_THREADS 4
+
+/**
+ * What a request does.
+ * */
+typedef enum {
+  IO_READ,  //! Read into the buffer
+  IO_WRITE, //! Write the buffer out
+} IoOperation;
+
+typedef struct IoRequest IoRequest;
+
+/**
+ * A read or write of a file.
+ *
+ * The caller fills in everything up to complete (and data, if it needs it),
+ * and must leave the request and its buffer alone until it completes.
+ * */
+struct IoRequest {
+  IoOperation operation; //! What to do
+  int fd;                //! File to do it on
+  int until;             //! Byte a read stops after, or -1 for the end
+  char *buffer;          //! Data (reads grow it with realloc)
+  size_t size;           //! Capacity of a read's buffer, or bytes to write
+  size_t length;         //! Bytes read into buffer (reads append) or written
+  int error;             //! errno of a transfer that failed, or 0
+  bool end;              //! Whether a read reached the end of the file
+  // Called on the I/O thread once the request is done
+  void (*complete)(IoRequest *request);
+  void *data;            //! For complete to use
+  IoRequest *next;       //! Next request in a queue
+  IoRequest *nextCancel; //! Next request to cancel
+  bool cancelled;        //! Whether the request is being cancelled
+};
+
+/**
+ * Queue a request, which completes asynchronously (a write of nothing
+ * completes at once, on the calling thread)
+ *
+ * @param request Request to carry out
+ * */
+void submitIo(IoRequest *request);
+
+/**
+ * Carry out a request, waiting for it to complete (for threads that have
+ * nothing else to do meanwhile)
+ *
+ * @param request Request to carry out (complete and data are set by
+ * waitForIo)
+ * @param deadline Time to cancel the request at (CLOCK_MONOTONIC
+ * nanoseconds), or 0 to wait as long as it takes. A cancelled request
+ * still completes before waitForIo returns, failing with ECANCELED.
+ *
+ * @returns False if the deadline passed
+ * */
+bool waitForIo(IoRequest *request, uint64_t deadline);
+
+#endif // !clox_io_h
@@ -0,0 +1,92 @@
+/**
+ * @file map.h
+ * @brief Operations on maps, hash tables in the style of Swiss tables
+ *
+ * A map's slots are split into groups of MAP_GROUP_SIZE, each slot with a
+ * control byte: MAP_EMPTY, MAP_DELETED, or the low 7 bits of the hash of the
+ * key in it. A lookup picks a group from the rest of the hash, compares the
+ * 7 bits against all the group's control bytes at once (a single SSE2
+ * comparison on x86-64), and only looks at the keys of the slots that
+ * matched. Groups are probed in triangular steps until the key is found, or
+ * a group with an empty slot says it was never added.
+ *
+ * Removing a key from a group that still has an empty slot empties its slot
+ * again: no lookup ever went past that group, so nothing needs a tombstone.
+ * Only removals from full groups leave MAP_DELETED, and growing (or
+ * rebuilding a map with too many tombstones) drops them.
+ * */
+
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Slots whose control bytes are compared at once
+#define MAP_GROUP_SIZE 16
+// Control byte of a slot that never held an entry since the map was built
+#define MAP_EMPTY 0x80
+// Control byte of a slot whose entry was removed
+#define MAP_DELETED 0xfe
+// A map grows (or drops its tombstones) past this fraction of used slots
+#define MAP_MAX_LOAD_NUMERATOR 7
+#define MAP_MAX_LOAD_DENOMINATOR 8
+
+/**
+ * How full a map is, and how far lookups of its keys probe.
+ * */
+typedef struct {
+  int count;        //! Number of entries
+  int capacity;     //! Number of slots
+  int deleted;      //! Number of tombstones
+  double load;      //! Entries per slot
+  int maxProbe;     //! Most groups probed to find a key
+  double meanProbe; //! Mean number of groups probed to find a key
+} MapStats;
+
+/**
+ * Look up a key
+ *
+ * @param map Map to search
+ * @param key Key to look up (ropes are flattened)
+ * @param value Set to the value associated with the key, if found
+ *
+ * @returns True if the key was found
+ * */
+bool mapGet(ObjMap *map, Value key, Value *value);
+
+/**
+ * Add or replace an entry (the key and value must be reachable, growing the
+ * map allocates)
+ *
+ * @returns True if the key is new to the map
+ * */
+bool mapSet(ObjMap *map, Value key, Value value);
+
+/**
+ * Remove an entry
+ *
+ * @returns True if the key was in the map
+ * */
+bool mapDelete(ObjMap *map, Value key);
+
+/**
+ * Rebuild a map from the entries of slots that aren't its own (an image's),
+ * with hashes computed afresh, as pointer keys may have moved
+ *
+ * @param map Map to rebuild, whose slots are replaced
+ * */
+void rebuildMap(ObjMap *map);
+
+/**
+ * Free a map's slots, leaving it empty
+ * */
+void clearMap(ObjMap *map);
+
+/**
+ * Measure how full a map is and how long its probe sequences are
+ * */
+void mapStats(ObjMap *map, MapStats *stats);
+
+#endif // !clox_map_h
@@ -2,6 +2,12 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "value.h"
+
+#define ALLOCATE(type, count)                                                  \
+  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+
+#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -12,6 +18,77 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Heap size (in bytes) at which the first collection starts
+#define GC_INITIAL_HEAP (1024 * 1024)
+// How much the heap may grow past the live data before the next collection
+#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between increments while a collection is in progress
+#define GC_STEP_BYTES (64 * 1024)
+// Bytes allocated between increments while behind on work
+#define GC_CATCH_UP_BYTES (4 * 1024)
+// Each increment owes one unit of work (an object traced or swept) per this
+// many bytes allocated since the previous one, so a cycle outpaces the
+// program allocating
+#define GC_BYTES_PER_UNIT 16
+// Default longest pause (in nanoseconds) of a single increment
+#define GC_PAUSE_BUDGET_DEFAULT 500000
+
+/**
+ * Keep the tri-color invariant while marking: a value stored into a traced
+ * object (or a root that isn't rescanned) must not stay white.
+ * */
+#define WRITE_BARRIER(value)                                                   \
+  do {                                                                         \
+    if (vm->gc.phase == GC_MARK)                                               \
+      markValue(value);                                                        \
+  } while (false)
+
+/**
+ * Phases of an incremental collection.
+ * */
+typedef enum {
+  GC_IDLE,  //! No collection in progress
+  GC_MARK,  //! Tracing from the roots, a bounded amount per increment
+  GC_SWEEP, //! Freeing unmarked objects, a bounded amount per increment
+} GCPhase;
+
+/**
+ * Statistics of one collection cycle.
+ * */
+typedef struct {
+  uint64_t increments;   //! Number of increments (pauses)
+  uint64_t totalPauseNs; //! Time spent in all increments
+  uint64_t maxPauseNs;   //! Longest single increment
+  size_t bytesReclaimed; //! Bytes freed by the sweep
+  size_t heapBefore;     //! Heap size when the cycle started
+  size_t heapAfter;      //! Heap size when the cycle finished
+} GCCycleStats;
+
+/**
+ * State of the incremental garbage collector.
+ *
+ * An object is marked when its mark equals the current epoch, so starting a
+ * cycle (incrementing the epoch) unmarks every object at once.
+ * */
+typedef struct {
+  GCPhase phase;          //! What the next increment does
+  uint8_t epoch;          //! Mark value of objects marked this cycle
+  size_t bytesAllocated;  //! Bytes currently allocated through reallocate
+  size_t nextGC;          //! Heap size that starts the next cycle
+  size_t nextStep;        //! Heap size that runs the next increment
+  size_t lastStep;        //! Heap size after the previous increment
+  int64_t debt;           //! Units of work owed by the cycle in progress
+  uint64_t pauseBudgetNs; //! Longest pause of a single increment
+  Obj **grayStack;        //! Marked objects whose children aren't yet marked
+  int grayCount;          //! Number of objects in grayStack
+  int grayCapacity;       //! Capacity of grayStack
+  Obj **sweepLink;        //! Link to the next object to sweep
+  uint64_t cycles;        //! Number of completed cycles
+  GCCycleStats current;   //! Statistics of the cycle in progress
+  GCCycleStats last;      //! Statistics of the last completed cycle
+  bool logCycles;         //! Report each completed cycle on stderr
+} GC;
+
 /**
  * Reallocate memory for an array (grow, shrink, free, etc.)
  *
@@ -21,4 +98,56 @@
  * */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+/**
+ * Allocate a block of memory with a given alignment
+ *
+ * @param alignment Required alignment (a power of two, in bytes)
+ * @param size Size of the block (a multiple of alignment, in bytes)
+ *
+ * @returns Pointer to the aligned block
+ * */
+void *allocateAligned(size_t alignment, size_t size);
+
+/**
+ * Free a block of memory allocated with allocateAligned
+ *
+ * @param pointer Pointer to the block
+ * @param size Size of the block (in bytes)
+ * */
+void freeAligned(void *pointer, size_t size);
+
+/**
+ * Prepare the garbage collector of the VM (before anything is allocated)
+ * */
+void initGC();
+
+/**
+ * Mark an object as reachable (in the current collection cycle)
+ * */
+void markObject(Obj *object);
+
+/**
+ * Mark the object a value refers to (if any) as reachable
+ * */
+void markValue(Value value);
+
+/**
+ * Run a collection cycle to completion (finishing any cycle in progress)
+ * */
+void collectGarbage();
+
+/**
+ * Write the statistics of a completed cycle
+ *
+ * @param file File to write to
+ * @param cycle Number of the cycle
+ * @param stats Statistics of the cycle
+ * */
+void writeGCStats(FILE *file, uint64_t cycle, const GCCycleStats *stats);
+
+/**
+ * Free every object allocated by the VM
+ * */
+void freeObjects();
+
 #endif // !clox_memory_h
@@ -0,0 +1,81 @@
+/**
+ * @file native.h
+ * @brief Functions implemented in C, defined as globals of every VM
+ *
+ * Files are read and written asynchronously (see io.h): a fiber calling one
+ * of the file natives gives up its worker until the I/O completes (see
+ * awaitIo), and anything else waits for it.
+ * - readFile(path): contents of the file, or nil if it can't be read
+ * - writeFile(path, text): replaces the file's contents with a string,
+ *   returning false if it can't be written
+ * - openFile(path): file to read lines from, or nil if it can't be opened
+ * - readLine(file): next line of a file (without its newline), or nil once
+ *   there are no more
+ *
+ * - hasKey(map, key): whether a map has an entry for a key
+ * - removeKey(map, key): removes a key's entry from a map, returning whether
+ *   it had one
+ * - mapSize(map): number of entries of a map
+ * - mapStats(map): how full a map is and how far finding its keys probes, as
+ *   a map of count, capacity, deleted, load, maxProbe and meanProbe (see
+ *   MapStats)
+ *
+ * The math functions of C are natives too (sqrt, exp, log, sin, cos, tan,
+ * atan, floor, ceil, abs, pow, atan2 and hypot), declared as numeric so
+ * they're called on unboxed doubles. The host can register more natives for
+ * the whole process (see clox.h), which VMs created afterwards define next
+ * to the built-in ones.
+ * */
+
+#ifndef clox_native_h
+#define clox_native_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Bytes read at a time from a file being read line by line (at least)
+#define NATIVE_READ_SIZE 4096
+
+/**
+ * Define the natives as globals of the current VM
+ * */
+void defineNatives();
+
+/**
+ * Register a native for every VM created from now on
+ *
+ * @param name Name of the native (copied)
+ * @param arity Number of parameters (1 or 2 for numeric natives)
+ * @param kind How the native is called
+ * @param function The implementation
+ *
+ * @returns False if there's already a native with the name, or the arity is
+ * more than a call can pass
+ * */
+bool registerNative(const char *name, int arity, NativeKind kind,
+                    NativeFunction function);
+
+/**
+ * Find the implementation of a native by name (for natives restored from an
+ * image, saved by another process)
+ *
+ * @param native Native whose name (a string, never a rope) is set, the rest
+ * is set from the native of the process with that name
+ *
+ * @returns False if there's no such native
+ * */
+bool findNative(ObjNative *native);
+
+/**
+ * Call a native added by the host (see CloxNative)
+ *
+ * @param native The native, of kind NATIVE_HOST
+ * @param argCount Number of arguments
+ * @param args The arguments, on the VM's stack (the result goes in args[-1])
+ *
+ * @returns False if the call failed (after reporting a runtime error)
+ * */
+bool callHostNative(ObjNative *native, int argCount, Value *args);
+
+#endif // !clox_native_h
@@ -0,0 +1,67 @@
+/**
+ * @file number.h
+ * @brief Conversion between decimal strings and doubles
+ * */
+
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Size of a buffer large enough for any number formatted by formatNumber
+#define NUMBER_BUFFER_SIZE 32
+
+/**
+ * Parse a decimal number literal into the nearest double.
+ *
+ * Works directly on the characters of a token (which need not be null
+ * terminated) and is independent of the current locale. The result is
+ * correctly rounded (round to nearest, ties to even), matching strtod.
+ *
+ * @param start Pointer to the first character of the literal
+ * @param length Number of characters in the literal
+ *
+ * @returns The value of the literal
+ * */
+double parseNumber(const char *start, int length);
+
+/**
+ * Parse a decimal integer literal exactly.
+ *
+ * @param start Pointer to the first character of the literal
+ * @param length Number of characters in the literal
+ * @param value Set to the value of the literal
+ *
+ * @returns False if the literal has a fractional part or doesn't fit in an
+ * int64_t (and has to be parsed with parseNumber instead)
+ * */
+bool parseInteger(const char *start, int length, int64_t *value);
+
+/**
+ * Format a double as the shortest decimal string that parses back to it.
+ *
+ * Numbers whose decimal exponent is in [-6, 21) are written out in full
+ * (e.g. 100, 0.1, 0.000001), others in scientific notation (e.g. 1e+21,
+ * 1.5e-7). Infinities and NaN are written as inf, -inf and nan.
+ *
+ * @param value Number to format
+ * @param buffer Buffer of at least NUMBER_BUFFER_SIZE characters, which is
+ * filled with the null-terminated result
+ *
+ * @returns Length of the formatted number, not including the null terminator
+ * */
+int formatNumber(double value, char *buffer);
+
+/**
+ * Format an integer in decimal, the same way formatNumber formats a double
+ * of the same value.
+ *
+ * @param value Integer to format
+ * @param buffer Buffer of at least NUMBER_BUFFER_SIZE characters, which is
+ * filled with the null-terminated result
+ *
+ * @returns Length of the formatted number, not including the null terminator
+ * */
+int formatInteger(int64_t value, char *buffer);
+
+#endif // !clox_number_h
@@ -0,0 +1,414 @@
+/**
+ * @file object.h
+ * @brief Heap allocated objects (strings, numeric arrays, maps, functions,
+ * classes and files)
+ *
+ * Strings come in three representations, all of them immutable:
+ * - up to SMALL_STRING_MAX bytes are stored inline in the Value itself
+ * - longer strings are ObjStrings, interned in vm->strings so that equal
+ *   strings are always the same object
+ * - long concatenations are ObjRopes, which just point at their two halves
+ *   and are flattened into an interned ObjString the first time the
+ *   characters are needed (so repeated concatenation isn't quadratic)
+ *
+ * Each string has exactly one of the first two representations (based on its
+ * length), so equality is a bit or pointer comparison, apart from ropes.
+ *
+ * Numeric arrays are immutable, packed arrays of doubles. Arithmetic on them
+ * works element-wise (see array.h).
+ *
+ * Maps associate any values with any values, in a hash table probed a group
+ * of slots at a time (see map.h).
+ *
+ * Functions own the chunk their body compiled to. Natives are functions
+ * implemented in C (see native.h).
+ *
+ * Instances don't keep their fields in a table: the names of the fields, in
+ * the order they were added, make up the instance's shape (a hidden class),
+ * and the values sit in an array in that order. Instances given the same
+ * fields in the same order share one shape, so a property instruction
+ * remembers where it found a name for a shape (see InlineCache) and only
+ * looks names up the first time it meets each shape.
+ * */
+
+#ifndef clox_object_h
+#define clox_object_h
+
+#include "chunk.h"
+#include "clox.h"
+#include "common.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+
+// Concatenations at least this long become ropes instead of being copied
+#define ROPE_MIN_LENGTH 64
+
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_HEAP_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_STRING(value)                                                       \
+  (IS_SMALL_STRING(value) || IS_HEAP_STRING(value) || IS_ROPE(value))
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_FILE(value) isObjType(value, OBJ_FILE)
+
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_HEAP_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_FILE(value) ((ObjFile *)AS_OBJ(value))
+
+/**
+ * Types of heap objects.
+ * */
+typedef enum {
+  OBJ_STRING,       //! Interned string
+  OBJ_ROPE,         //! Lazy concatenation of two strings
+  OBJ_ARRAY,        //! Packed array of doubles
+  OBJ_MAP,          //! Hash map from values to values
+  OBJ_FUNCTION,     //! Compiled function
+  OBJ_SHAPE,        //! Names of an instance's fields
+  OBJ_CLASS,        //! Class, with its methods
+  OBJ_INSTANCE,     //! Instance of a class
+  OBJ_BOUND_METHOD, //! Method read from an instance, bound to it
+  OBJ_NATIVE,       //! Function implemented in C
+  OBJ_FILE,         //! File being read line by line
+} ObjType;
+
+/**
+ * Header shared by all heap objects.
+ * */
+struct Obj {
+  ObjType type;     //! Type of the object
+  uint8_t mark;     //! GC epoch in which the object was last marked
+  struct Obj *next; //! Next object in the VM's list of all objects
+};
+
+/**
+ * An interned string, longer than SMALL_STRING_MAX.
+ * */
+struct ObjString {
+  Obj obj;       //! Object header
+  int length;    //! Number of characters
+  uint32_t hash; //! Hash of the characters
+  char chars[];  //! The characters (null-terminated)
+};
+
+/**
+ * A string formed by concatenating two strings, at least ROPE_MIN_LENGTH
+ * long.
+ * */
+typedef struct {
+  Obj obj;         //! Object header
+  int length;      //! Number of characters (of left and right together)
+  Value left;      //! First part (nil once flattened)
+  Value right;     //! Second part (nil once flattened)
+  ObjString *flat; //! Interned string with the contents, NULL until needed
+} ObjRope;
+
+/**
+ * An immutable array of doubles, stored inline.
+ * */
+typedef struct {
+  Obj obj;           //! Object header
+  int count;         //! Number of elements
+  double elements[]; //! The elements
+} ObjArray;
+
+/**
+ * An entry of a map, in a full slot.
+ * */
+typedef struct {
+  Value key;     //! Key of the entry (never a rope)
+  Value value;   //! Value associated with the key
+  uint32_t hash; //! Hash of the key (see mapHash), kept for growing
+} MapEntry;
+
+/**
+ * A mutable map from values to values.
+ *
+ * Each slot has a control byte, saying whether it's empty, deleted or full,
+ * and for a full slot holding 7 bits of its key's hash (see map.h).
+ * */
+typedef struct {
+  Obj obj;           //! Object header
+  int count;         //! Number of entries
+  int deleted;       //! Number of slots marked deleted (tombstones)
+  int capacity;      //! Number of slots (0 or a power of two, whole groups)
+  uint8_t *control;  //! Control byte of each slot
+  MapEntry *entries; //! Entry of each slot, valid in full slots
+} ObjMap;
+
+typedef struct ObjClass ObjClass;
+
+/**
+ * A function, compiled from a fun declaration (or a method of a class).
+ * */
+struct ObjFunction {
+  Obj obj;         //! Object header
+  int arity;       //! Number of parameters
+  int maxSlots;    //! Most stack slots a call uses (counting the callee's)
+  Value name;      //! Name of the function (a string)
+  ObjClass *owner; //! Class it's a method of (where super starts), or NULL
+  Chunk chunk;     //! Bytecode of the body
+};
+
+/**
+ * The names of an instance's fields, in the order they were added.
+ *
+ * Each shape is its parent with one more field. Adding a field moves an
+ * instance to the child shape for the name, which is created the first time
+ * and found in the parent's transitions from then on. A class's instances
+ * all start out with its root shape (with no fields), so the shape also
+ * tells the instance's class.
+ * */
+struct ObjShape {
+  Obj obj;           //! Object header
+  ObjClass *klass;   //! Class of the instances with the shape
+  ObjShape *parent;  //! Shape with the last field removed (NULL for a root)
+  Value name;        //! Name of the last field (nil for a root)
+  int count;         //! Number of fields
+  Table transitions; //! Child shape for each name of a field added next
+};
+
+/**
+ * A class, created by a class declaration.
+ * */
+struct ObjClass {
+  Obj obj;                  //! Object header
+  Value name;               //! Name of the class (a string)
+  ObjClass *superclass;     //! Class it inherits from, or NULL
+  ObjShape *shape;          //! Root shape of its instances
+  ObjFunction *initializer; //! The init method, or NULL
+  int fieldCount;           //! Most fields an instance has had (a size hint)
+  Table methods;            //! Methods by name, inherited ones copied in
+};
+
+/**
+ * An instance of a class.
+ * */
+typedef struct {
+  Obj obj;         //! Object header
+  ObjShape *shape; //! Names of the fields (and the class)
+  Value *fields;   //! Values of the fields, in the order of the shape
+  int capacity;    //! Capacity of fields
+} ObjInstance;
+
+/**
+ * A method read from an instance as a property, remembering the instance
+ * for when it's called.
+ * */
+typedef struct {
+  Obj obj;             //! Object header
+  Value receiver;      //! Instance the method was read from
+  ObjFunction *method; //! The method
+} ObjBoundMethod;
+
+/**
+ * Implementation of a native.
+ *
+ * @param argCount Number of arguments
+ * @param args The arguments, on the VM's stack (the result goes in args[-1],
+ * the callee's slot)
+ *
+ * @returns False if the call failed (after reporting a runtime error)
+ * */
+typedef bool (*NativeFn)(int argCount, Value *args);
+
+/**
+ * How a native is called, which determines its implementation's signature.
+ * */
+typedef enum {
+  NATIVE_VALUES, //! Takes the arguments as values (a NativeFn)
+  NATIVE_UNARY,  //! Takes a number and returns one, unboxed
+  NATIVE_BINARY, //! Takes two numbers and returns one, unboxed
+  NATIVE_HOST,   //! Added by the host through the embedding API (clox.h)
+} NativeKind;
+
+/**
+ * Implementation of a native, according to its kind.
+ * */
+typedef union {
+  NativeFn values;                  //! For NATIVE_VALUES
+  double (*unary)(double);          //! For NATIVE_UNARY
+  double (*binary)(double, double); //! For NATIVE_BINARY
+  CloxNative host;                  //! For NATIVE_HOST
+} NativeFunction;
+
+/**
+ * A function implemented in C.
+ *
+ * Numeric natives are called without going through values: the VM checks
+ * their arguments are numbers and calls them on the doubles directly.
+ * */
+typedef struct {
+  Obj obj;                 //! Object header
+  Value name;              //! Name of the native (a string)
+  int arity;               //! Number of parameters
+  NativeKind kind;         //! How the native is called
+  NativeFunction function; //! The implementation
+} ObjNative;
+
+/**
+ * A file opened for reading line by line, with what was read of it but not
+ * returned yet.
+ * */
+typedef struct {
+  Obj obj;         //! Object header
+  int fd;          //! File descriptor, or -1 once the end was read
+  bool reading;    //! Whether a read is in progress (and has the buffer)
+  char *buffer;    //! Bytes read (from malloc, the I/O thread grows it)
+  size_t start;    //! Start of the bytes not returned yet
+  size_t end;      //! End of the bytes read
+  size_t capacity; //! Capacity of buffer
+} ObjFile;
+
+/**
+ * Check if a value is an object of a particular type
+ * */
+static inline bool isObjType(Value value, ObjType type) {
+  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+/**
+ * Hash the characters of a string (FNV-1a)
+ *
+ * @param chars Characters to hash
+ * @param length Number of characters
+ * */
+uint32_t hashString(const char *chars, int length);
+
+/**
+ * Hash any value that can be a table key (not a rope)
+ * */
+uint32_t hashValue(Value value);
+
+/**
+ * Create a string value from a copy of some characters
+ *
+ * @param chars Characters of the string
+ * @param length Number of characters
+ *
+ * @returns An inline small string, or the interned heap string
+ * */
+Value copyString(const char *chars, int length);
+
+/**
+ * Concatenate two string values
+ *
+ * @param a First string
+ * @param b Second string
+ *
+ * @returns String value with the characters of a followed by those of b
+ * */
+Value concatenateStrings(Value a, Value b);
+
+/**
+ * Get the length of any string value
+ * */
+int stringLength(Value string);
+
+/**
+ * Get the interned string for a heap string value, flattening ropes
+ *
+ * @param string An ObjString or ObjRope value
+ * */
+ObjString *flattenString(Value string);
+
+/**
+ * Allocate an array (its elements are left for the caller to fill in)
+ *
+ * @param count Number of elements
+ * */
+ObjArray *newArray(int count);
+
+/**
+ * Allocate an empty map
+ * */
+ObjMap *newMap();
+
+/**
+ * Allocate a function with an empty chunk, for the compiler to fill in
+ * */
+ObjFunction *newFunction();
+
+/**
+ * Allocate a class with no methods
+ *
+ * @param name Name of the class (a string)
+ * */
+ObjClass *newClass(Value name);
+
+/**
+ * Allocate an instance of a class, with no fields
+ *
+ * @param klass Class of the instance
+ * */
+ObjInstance *newInstance(ObjClass *klass);
+
+/**
+ * Allocate a method bound to the instance it was read from
+ *
+ * @param receiver The instance
+ * @param method The method
+ * */
+ObjBoundMethod *newBoundMethod(Value receiver, ObjFunction *method);
+
+/**
+ * Allocate a native
+ *
+ * @param name Name of the native (a string)
+ * @param arity Number of parameters
+ * @param kind How the native is called
+ * @param function The implementation
+ * */
+ObjNative *newNative(Value name, int arity, NativeKind kind,
+                     NativeFunction function);
+
+/**
+ * Allocate a file to read lines from, with nothing read yet
+ *
+ * @param fd File descriptor, which the file object owns
+ * */
+ObjFile *newFile(int fd);
+
+/**
+ * Find the index of a field in a shape
+ *
+ * @param shape Shape to search
+ * @param name Name of the field
+ *
+ * @returns Index of the field, or -1 if the shape has no such field
+ * */
+int shapeField(ObjShape *shape, Value name);
+
+/**
+ * Get the shape with one more field than another, creating it the first
+ * time it's needed
+ *
+ * @param shape Shape to add the field to
+ * @param name Name of the new field
+ * */
+ObjShape *shapeTransition(ObjShape *shape, Value name);
+
+/**
+ * Write an object to an output buffer
+ *
+ * @param output Output buffer to write to
+ * @param value Object value to write
+ * */
+void writeObject(OutputBuffer *output, Value value);
+
+#endif // !clox_object_h
@@ -0,0 +1,61 @@
+/**
+ * @file output.h
+ * @brief Buffered output of results
+ * */
+
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Default size of the VM's output buffer (in bytes)
+#define OUTPUT_BUFFER_SIZE 65536
+
+/**
+ * A buffer collecting output, written to a file in large blocks.
+ * */
+typedef struct {
+  FILE *file;      //! File the buffer is flushed to
+  char *data;      //! Storage for the buffered output
+  size_t count;    //! Number of bytes currently buffered
+  size_t capacity; //! Size of the storage (in bytes)
+} OutputBuffer;
+
+/**
+ * Initialize an output buffer over caller provided storage
+ *
+ * @param output Pointer to the output buffer to initialize
+ * @param file File the output is eventually written to
+ * @param data Storage for the buffered output
+ * @param capacity Size of the storage (in bytes)
+ * */
+void initOutput(OutputBuffer *output, FILE *file, char *data,
+                size_t capacity);
+
+/**
+ * Append characters to the output buffer, flushing it when full
+ *
+ * @param output Pointer to the output buffer
+ * @param chars Characters to write
+ * @param length Number of characters to write
+ * */
+void writeOutput(OutputBuffer *output, const char *chars, size_t length);
+
+/**
+ * Append a single character to the output buffer
+ *
+ * @param output Pointer to the output buffer
+ * @param c Character to write
+ * */
+void writeOutputChar(OutputBuffer *output, char c);
+
+/**
+ * Write everything buffered so far to the file
+ *
+ * @param output Pointer to the output buffer
+ * */
+void flushOutput(OutputBuffer *output);
+
+#endif // !clox_output_h
@@ -0,0 +1,81 @@
+/**
+ * @file perf.h
+ * @brief Hardware performance counters around compilation and execution
+ *
+ * Counts cycles, instructions, branch mispredictions and cache misses with
+ * Linux perf_event_open, separately for compile() and run(), and writes them
+ * (normalized per executed bytecode instruction for run()) as JSON.
+ *
+ * The counters are one group, always on the hardware together, and count
+ * every thread of the process (including the lexer threads). When the
+ * kernel has to share the hardware with other events, counts are scaled up
+ * from the time the group was counting, which is reported as the fraction
+ * counterRunning of each phase.
+ * */
+
+#ifndef clox_perf_h
+#define clox_perf_h
+
+#include "common.h"
+
+// File the counters are written to when no path is given
+#define PERF_FILE_DEFAULT "clox-perf.json"
+
+/**
+ * The hardware events counted.
+ * */
+typedef enum {
+  PERF_CYCLES,        //! CPU cycles
+  PERF_INSTRUCTIONS,  //! Retired machine instructions
+  PERF_BRANCHES,      //! Retired branch instructions
+  PERF_BRANCH_MISSES, //! Mispredicted branches
+  PERF_L1I_MISSES,    //! Level 1 instruction cache misses
+  PERF_CACHE_MISSES,  //! Last level cache misses
+  PERF_COUNTER_COUNT, //! Number of counters
+} PerfCounter;
+
+/**
+ * The separately measured phases of interpretation.
+ * */
+typedef enum {
+  PERF_PHASE_COMPILE, //! compile()
+  PERF_PHASE_RUN,     //! run()
+  PERF_PHASE_COUNT,   //! Number of phases
+} PerfPhase;
+
+/**
+ * Open the counters and start collecting (counters the kernel or hardware
+ * doesn't support are reported as null).
+ * */
+void startPerf();
+
+/**
+ * Whether counters are being collected (startPerf was called).
+ * */
+bool perfEnabled();
+
+/**
+ * Start counting a phase.
+ *
+ * @param phase Phase being entered
+ * */
+void beginPerfPhase(PerfPhase phase);
+
+/**
+ * Stop counting a phase, adding the counts to its totals.
+ *
+ * @param phase Phase being left
+ * */
+void endPerfPhase(PerfPhase phase);
+
+/**
+ * Write the totals as JSON and close the counters.
+ *
+ * @param path Path of the file to write
+ * @param executedInstructions Number of bytecode instructions run() executed
+ *
+ * @returns True if the file was written, false otherwise
+ * */
+bool stopPerf(const char *path, uint64_t executedInstructions);
+
+#endif // !clox_perf_h
@@ -0,0 +1,68 @@
+/**
+ * @file profile.h
+ * @brief Sampling profiler mapping executed bytecode to source lines
+ *
+ * A SIGPROF timer marks a sample as pending, and the VM records the
+ * instruction it is about to execute (resolved to its source line and
+ * opcode) the next time it checks. The signal handler itself only sets a
+ * flag, so it is async-signal-safe and sees the real instruction pointer even
+ * when run() keeps it in a register. Each sample also records the calls in
+ * progress, by their functions' names, for the collapsed stacks.
+ * */
+
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// Interval between samples (in microseconds of CPU time)
+#define PROFILE_INTERVAL_US 1000
+// File collapsed stacks are written to when no path is given
+#define PROFILE_FILE_DEFAULT "clox.folded"
+
+/**
+ * Set by the profiling timer when a sample should be taken.
+ * */
+extern volatile sig_atomic_t profileSamplePending;
+
+/**
+ * Start sampling (discarding any earlier samples).
+ * */
+void startProfile();
+
+/**
+ * Stop sampling, keeping the samples taken so far.
+ * */
+void stopProfile();
+
+/**
+ * Record a sample of the instruction about to be executed.
+ *
+ * @param frames Calls in progress, the script's first
+ * @param frameCount Number of calls in progress
+ * @param offset Offset of the instruction in the last frame's chunk
+ * */
+void recordProfileSample(CallFrame *frames, int frameCount, int offset);
+
+/**
+ * Write a per-line hotness report, hottest lines first.
+ *
+ * @param file File to write the report to
+ * */
+void writeProfileReport(FILE *file);
+
+/**
+ * Write the samples as collapsed stacks, as consumed by flamegraph.pl.
+ *
+ * @param path Path of the file to write
+ *
+ * @returns True if the file was written, false otherwise
+ * */
+bool writeProfileStacks(const char *path);
+
+#endif // !clox_profile_h
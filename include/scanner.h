@@ -1,6 +1,15 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
+// Sources at least this long are scanned in parallel (by default)
+#define SCAN_PARALLEL_MIN (1024 * 1024)
+// Smallest piece of a source given to a thread of its own
+#define SCAN_PIECE_MIN (256 * 1024)
+// Most threads used to scan one source
+#define SCAN_THREADS_MAX 64
+
 /**
  * The possible types of tokens
  * */
@@ -10,7 +19,10 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
+  TOKEN_COLON,
   TOKEN_DOT,
   TOKEN_MINUS,
   TOKEN_PLUS,
@@ -63,6 +75,40 @@ typedef struct {
   int line;          //! The line of the source code the token is on
 } Token;
 
+/**
+ * Tokens scanned from one piece of a source, as a structure of arrays (13
+ * bytes a token, rather than sizeof(Token)).
+ * */
+typedef struct {
+  uint8_t *types;     //! Type of each token
+  uint32_t *starts;   //! Offset of each token in the source
+  uint32_t *lengths;  //! Length of each token (message index for errors)
+  uint32_t *lines;    //! Line of each token, counted from the piece's first
+  size_t count;       //! Number of tokens
+  size_t capacity;    //! Capacity of the arrays
+  int firstLine;      //! Line of the source the piece starts on
+  uint32_t from;      //! Offset scanning of the piece started at
+  uint32_t start;     //! Offset of the first token, past whitespace/comments
+  uint32_t startLine; //! Line (counted like lines) the first token is on
+  uint32_t stop;      //! Offset scanning stopped at (the next piece's start)
+  uint32_t stopLine;  //! Line (counted like lines) scanning stopped on
+} TokenBlock;
+
+/**
+ * Every token of a source (the blocks in order, ending with TOKEN_EOF), read
+ * back one at a time with readToken.
+ * */
+typedef struct {
+  const char *source; //! Source the tokens were scanned from
+  TokenBlock *blocks; //! Tokens of each piece of the source
+  int blockCount;     //! Number of blocks
+  int block;          //! Block of the next token to read
+  size_t next;        //! Index (in its block) of the next token to read
+} TokenBuffer;
+
+// Threads to scan large sources with (0 for one per online processor)
+extern int scanThreads;
+
 /**
  * Initialize the Scanner from a source code string
  *
@@ -77,4 +123,31 @@ void initScanner(const char *source);
  * */
 Token scanToken();
 
+/**
+ * Scan a whole source into a token buffer, splitting it into pieces that are
+ * scanned in parallel.
+ *
+ * Pieces start after a newline. A piece that turns out to start inside a
+ * (multi-line) string literal is scanned again from the end of the literal,
+ * so the tokens are the same as scanToken would produce.
+ *
+ * @param source Source code string (null-terminated)
+ * @param length Length of the source
+ * @param tokens Buffer to fill, freed with freeTokens
+ *
+ * @returns False (without filling tokens) if the source is too long to
+ * scan this way (more than UINT32_MAX characters)
+ * */
+bool scanTokens(const char *source, size_t length, TokenBuffer *tokens);
+
+/**
+ * Read the next token from a token buffer (TOKEN_EOF once they run out)
+ * */
+Token readToken(TokenBuffer *tokens);
+
+/**
+ * Free the memory of a token buffer
+ * */
+void freeTokens(TokenBuffer *tokens);
+
 #endif // !clox_scanner_h
@@ -0,0 +1,85 @@
+/**
+ * @file serve.h
+ * @brief Evaluation daemon over a Unix domain socket (clox --serve)
+ *
+ * The daemon keeps a pool of worker threads, each with its own warm VM
+ * (started from an image, if given) and a cache of the scripts it compiled,
+ * so a request costs neither a process start nor recompiling source it has
+ * seen before. An epoll loop accepts connections and reads requests, which
+ * the workers evaluate. A client can send any number of requests without
+ * waiting (pipelining), and the responses come back in the order the
+ * requests were sent.
+ *
+ * Every request starts from the globals of the image: after each one the
+ * worker puts back the values they had, and undefines the globals the
+ * request defined. The objects the globals hold aren't copied, though, so
+ * changes a request makes to them (fields set, map entries) stay, and state
+ * every request needs belongs in the image.
+ *
+ * Requests and responses are frames of big-endian 32 bit fields:
+ * - request: source length, timeout in milliseconds (0 for the daemon's
+ *   default), then the source
+ * - response: status, length of the printed output, length of the error
+ *   messages, then the output and the errors
+ *
+ * The status is the exit status clox would have run the source with, or
+ * SERVE_TIMEOUT. A request runs out of time between two quanta of its
+ * instructions, or while it waits for a file (the read or write is then
+ * cancelled, see awaitIo).
+ * */
+
+#ifndef clox_serve_h
+#define clox_serve_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Bytes of the fields before a request's source
+#define SERVE_REQUEST_HEADER 8
+// Bytes of the fields before a response's output
+#define SERVE_RESPONSE_HEADER 12
+// Longest source a request can carry (longer requests close the connection)
+#define SERVE_SOURCE_MAX (16 * 1024 * 1024)
+// Status of a request that ran out of time
+#define SERVE_TIMEOUT 124
+
+/**
+ * Settings of the daemon.
+ * */
+typedef struct {
+  const char *imagePath; //! Image every worker's VM starts from, or NULL
+  int workers;           //! Number of worker threads (0 for one per CPU)
+  uint32_t timeout;      //! Default timeout in milliseconds (0 for none)
+} ServeOptions;
+
+/**
+ * Run the daemon until it's interrupted (SIGINT or SIGTERM)
+ *
+ * @param socketPath Path of the Unix domain socket to listen on
+ * @param options Settings of the daemon
+ *
+ * @returns Exit status for the process
+ * */
+int serve(const char *socketPath, const ServeOptions *options);
+
+/**
+ * Store a 32 bit field of a frame
+ * */
+static inline void putField(uint8_t *field, uint32_t value) {
+  field[0] = (uint8_t)(value >> 24);
+  field[1] = (uint8_t)(value >> 16);
+  field[2] = (uint8_t)(value >> 8);
+  field[3] = (uint8_t)value;
+}
+
+/**
+ * Read a 32 bit field of a frame
+ * */
+static inline uint32_t getField(const uint8_t *field) {
+  return (uint32_t)field[0] << 24 | (uint32_t)field[1] << 16 |
+         (uint32_t)field[2] << 8 | field[3];
+}
+
+#endif // !clox_serve_h
@@ -0,0 +1,97 @@
+/**
+ * @file slab.h
+ * @brief Size-class slab allocator behind reallocate
+ *
+ * Small allocations (objects, and the arrays of small tables, maps, chunks)
+ * are rounded up to one of SLAB_CLASSES sizes and carved out of blocks of
+ * SLAB_BLOCK_SIZE bytes mapped from the OS. Every slot of a block has the
+ * same size, and blocks are aligned to their size, so freeing a slot finds
+ * its block by masking the pointer: no per-allocation header is needed, and
+ * objects of a size sit next to each other.
+ *
+ * Each class allocates from a current block, first from the slots freed in
+ * it and then from the part never used. Blocks that get slots back go on the
+ * class's list of available blocks, and a block whose every slot is freed is
+ * unmapped (but for one spare). Anything larger than SLAB_MAX_SIZE goes to
+ * malloc.
+ *
+ * The heap belongs to a VM, and a VM runs on one thread at a time, so the
+ * allocator takes no locks.
+ * */
+
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+// Bytes of each block slots are carved out of (a power of two)
+#define SLAB_BLOCK_SIZE (64 * 1024)
+// Largest allocation served from a slab
+#define SLAB_MAX_SIZE 512
+// Number of slot sizes (see slotSizes in slab.c)
+#define SLAB_CLASSES 16
+
+typedef struct SlabBlock SlabBlock;
+
+/**
+ * Blocks of one slot size.
+ * */
+typedef struct {
+  SlabBlock *current;   //! Block slots are allocated from
+  SlabBlock *available; //! Other blocks with free slots
+} SlabClass;
+
+/**
+ * Allocator of a VM's memory.
+ * */
+typedef struct {
+  SlabClass classes[SLAB_CLASSES]; //! Blocks of each slot size
+  SlabBlock *blocks;               //! Every block of the heap in use
+  SlabBlock *spare;                //! An empty block kept for reuse
+  size_t blockCount;               //! Number of blocks mapped
+  size_t requestedBytes;           //! Bytes asked for in slots
+  size_t largeBytes;               //! Bytes allocated with malloc
+} SlabHeap;
+
+/**
+ * How much of the memory held by a heap is in use.
+ * */
+typedef struct {
+  size_t blocks;         //! Number of blocks mapped
+  size_t blockBytes;     //! Bytes of the blocks
+  size_t slotBytes;      //! Bytes of the slots allocated
+  size_t requestedBytes; //! Bytes asked for in those slots
+  size_t largeBytes;     //! Bytes allocated with malloc
+  double fragmentation;  //! Fraction of the block bytes not asked for
+} SlabStats;
+
+/**
+ * Prepare an empty heap
+ * */
+void initSlabs(SlabHeap *heap);
+
+/**
+ * Unmap every block of a heap, and with them everything allocated in slots
+ * (allocations from malloc must have been freed)
+ * */
+void freeSlabs(SlabHeap *heap);
+
+/**
+ * Allocate, grow, shrink or free memory (realloc with explicit sizes)
+ *
+ * @param heap Heap the memory belongs to
+ * @param pointer Memory to reallocate, NULL to allocate
+ * @param oldSize Size it was allocated with (in bytes)
+ * @param newSize Size needed, 0 to free (in bytes)
+ *
+ * @returns The memory, NULL if freed
+ * */
+void *slabReallocate(SlabHeap *heap, void *pointer, size_t oldSize,
+                     size_t newSize);
+
+/**
+ * Measure how much of a heap's memory is in use
+ * */
+void slabStats(SlabHeap *heap, SlabStats *stats);
+
+#endif // !clox_slab_h
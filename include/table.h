@@ -0,0 +1,91 @@
+/**
+ * @file table.h
+ * @brief Hash tables keyed by values
+ * */
+
+#ifndef clox_table_h
+#define clox_table_h
+
+#include "common.h"
+#include "value.h"
+
+/**
+ * A key/value pair in a table.
+ * */
+typedef struct {
+  Value key;   //! Key of the entry (nil for empty slots/tombstones)
+  Value value; //! Value associated with the key
+} Entry;
+
+/**
+ * Hash table with open addressing and linear probing.
+ * */
+typedef struct {
+  int count;      //! Number of entries in use (including tombstones)
+  int capacity;   //! Number of slots in the entries array
+  Entry *entries; //! Slots of the table
+} Table;
+
+/**
+ * Initialize an empty table
+ *
+ * @param table Pointer to the table to initialize
+ * */
+void initTable(Table *table);
+
+/**
+ * Free the memory associated with a table
+ *
+ * @param table Pointer to the table to free
+ * */
+void freeTable(Table *table);
+
+/**
+ * Look up a key in the table
+ *
+ * Keys may be any value but nil, strings must not be ropes (see
+ * flattenString).
+ *
+ * @param table Table to search
+ * @param key Key to look up
+ * @param value Set to the value associated with the key, if found
+ *
+ * @returns True if the key was found, false otherwise
+ * */
+bool tableGet(Table *table, Value key, Value *value);
+
+/**
+ * Add or replace an entry in the table
+ *
+ * @param table Table to add the entry to
+ * @param key Key of the entry
+ * @param value Value of the entry
+ *
+ * @returns True if the key is new to the table, false if it was replaced
+ * */
+bool tableSet(Table *table, Value key, Value value);
+
+/**
+ * Remove an entry from the table
+ *
+ * @param table Table to remove the entry from
+ * @param key Key of the entry to remove
+ *
+ * @returns True if an entry was removed, false if the key wasn't present
+ * */
+bool tableDelete(Table *table, Value key);
+
+/**
+ * Find a string key by its contents (used to intern strings)
+ *
+ * @param table Table to search
+ * @param chars Characters of the string
+ * @param length Number of characters
+ * @param hash Hash of the string (see hashString)
+ *
+ * @returns The key with the same contents, or NULL if there is none
+ * */
+ObjString *tableFindString(Table *table, const char *chars, int length,
+                           uint32_t hash);
+
+#endif // !clox_table_h
@@ -0,0 +1,198 @@
+/**
+ * @file trace.h
+ * @brief Compact binary execution traces
+ *
+ * With DEBUG_BINARY_TRACE defined the VM records one small event per executed
+ * instruction into an in-memory ring buffer, instead of printing as
+ * DEBUG_TRACE_EXECUTION does. The buffer is dumped to a file on a runtime
+ * error or when the process receives SIGUSR1, and the clox-trace tool turns
+ * the dump back into readable dissasembly.
+ *
+ * Each event names the chunk it ran in (the script's, or a function's) by
+ * its index in a table of the chunks the trace refers to, and the dump
+ * writes every chunk of the table. The table keeps its chunks alive (their
+ * functions are roots, scripts are retained) until the trace is reset.
+ * */
+
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "chunk.h"
+#include "common.h"
+
+// Number of events kept in the ring buffer (must be a power of two)
+#define TRACE_CAPACITY 65536
+// Environment variable naming the file traces are dumped to
+#define TRACE_FILE_ENV "CLOX_TRACE_FILE"
+// File traces are dumped to if TRACE_FILE_ENV is not set
+#define TRACE_FILE_DEFAULT "clox.trace"
+// Most chunks a trace refers to, events in others aren't shown
+#define TRACE_CHUNKS_MAX 4096
+// Chunk index of events in a chunk past TRACE_CHUNKS_MAX
+#define TRACE_CHUNK_UNKNOWN 0xffff
+// Slots of the hash from chunks to their index (a power of two)
+#define TRACE_CHUNK_SLOTS (2 * TRACE_CHUNKS_MAX)
+
+/**
+ * A single executed instruction.
+ * */
+typedef struct {
+  uint64_t timestamp;  //! Time the instruction started (see TRACE_CYCLES)
+  uint32_t offset;     //! Offset of the instruction in its chunk
+  uint16_t stackDepth; //! Number of values on the stack before it ran
+  uint16_t chunk;      //! Index of the chunk it ran in
+} TraceEvent;
+
+/**
+ * A chunk events were recorded in.
+ * */
+typedef struct {
+  ObjFunction *function; //! Function whose chunk it is, NULL for a script
+  FrozenChunk *script;   //! The script's chunk (retained), for a script
+} TraceChunk;
+
+/**
+ * Ring buffer holding the most recent TRACE_CAPACITY events.
+ *
+ * Written by a single VM without locks, the head is published with release
+ * semantics so a dump always sees fully written events.
+ * */
+typedef struct {
+  _Atomic uint64_t head;               //! Number of events ever recorded
+  Chunk *current;                      //! Chunk of the last event
+  uint16_t currentIndex;               //! Index of that chunk
+  int chunkCount;                      //! Number of chunks in chunks
+  TraceChunk chunks[TRACE_CHUNKS_MAX]; //! Chunks the events refer to
+  uint16_t slots[TRACE_CHUNK_SLOTS];   //! Index + 1 of each chunk, by hash
+  TraceEvent events[TRACE_CAPACITY];   //! Event storage, indexed by head
+} TraceBuffer;
+
+/**
+ * A chunk read back from a trace file.
+ * */
+typedef struct {
+  FrozenChunk *frozen; //! Its code and constants (kept by the VM)
+  char *name;          //! Name of its function, NULL for a script
+} TracedChunk;
+
+// Trace file flag: timestamps are CPU cycles rather than nanoseconds
+#define TRACE_CYCLES 0x1
+
+/**
+ * Set when a trace dump has been requested with SIGUSR1.
+ * */
+extern volatile sig_atomic_t traceDumpRequested;
+
+/**
+ * Read the clock used for event timestamps (the cycle counter when
+ * available).
+ * */
+static inline uint64_t traceTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * Make a chunk the trace's current one, adding it to the chunks the trace
+ * refers to the first time (see traceInstruction).
+ * */
+void traceChunk(TraceBuffer *trace, Chunk *chunk, ObjFunction *function);
+
+/**
+ * Record an instruction in the trace.
+ *
+ * @param trace Trace buffer to record into
+ * @param chunk Chunk the instruction is in
+ * @param function Function whose chunk it is (NULL for a script, whose
+ * chunk must be frozen)
+ * @param offset Offset of the instruction in the chunk
+ * @param stackDepth Number of values on the stack
+ * */
+static inline void traceInstruction(TraceBuffer *trace, Chunk *chunk,
+                                    ObjFunction *function, uint32_t offset,
+                                    uint16_t stackDepth) {
+  // The chunk only changes on calls and returns
+  if (chunk != trace->current)
+    traceChunk(trace, chunk, function);
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  TraceEvent *event = &trace->events[head & (TRACE_CAPACITY - 1)];
+  event->timestamp = traceTimestamp();
+  event->offset = offset;
+  event->stackDepth = stackDepth;
+  event->chunk = trace->currentIndex;
+  atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+/**
+ * Prepare an empty trace buffer, and make SIGUSR1 request a dump.
+ *
+ * @param trace Trace buffer to initialize
+ * */
+void initTrace(TraceBuffer *trace);
+
+/**
+ * Empty a trace buffer, letting go of the chunks it refers to.
+ *
+ * @param trace Trace buffer to reset
+ * */
+void resetTrace(TraceBuffer *trace);
+
+/**
+ * Mark the functions and script constants of the chunks a trace refers to.
+ *
+ * @param trace Trace buffer whose chunks are marked
+ * */
+void markTrace(TraceBuffer *trace);
+
+/**
+ * Path traces are dumped to (from TRACE_FILE_ENV, or TRACE_FILE_DEFAULT).
+ * */
+const char *traceFilePath();
+
+/**
+ * Write the trace, along with the chunks it refers to, to a file.
+ *
+ * @param trace Trace buffer to dump
+ * @param path Path of the file to write
+ *
+ * @returns True if the file was written, false otherwise
+ * */
+bool dumpTrace(TraceBuffer *trace, const char *path);
+
+/**
+ * Read a trace file written by dumpTrace.
+ *
+ * String constants are interned in, and global slots added to, the VM,
+ * which must be freshly initialized. The chunks are kept by the VM.
+ *
+ * @param path Path of the file to read
+ * @param chunks Set to a newly allocated array of the traced chunks, by
+ * index (the array and names must be freed by the caller with free)
+ * @param chunkCount Set to the number of chunks read
+ * @param events Set to a newly allocated array of the events, oldest first
+ * (must be freed by the caller with FREE_ARRAY)
+ * @param eventCount Set to the number of events read
+ * @param totalEvents Set to the number of events recorded overall (more than
+ * eventCount if the ring buffer wrapped)
+ * @param flags Set to the trace file flags (e.g. TRACE_CYCLES)
+ *
+ * @returns True if the file was read, false if it is missing or malformed
+ * */
+bool loadTrace(const char *path, TracedChunk **chunks, int *chunkCount,
+               TraceEvent **events, uint64_t *eventCount,
+               uint64_t *totalEvents, uint32_t *flags);
+
+#endif // !clox_trace_h
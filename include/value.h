@@ -7,40 +7,161 @@
 #define clox_value_h
 
 #include "common.h"
+#include "output.h"
+
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+
+// Longest string stored inline in a value rather than on the heap
+#define SMALL_STRING_MAX 7
 
 /**
  * Possible types of values in Lox */
 typedef enum {
-  VAL_BOOL,   //! A boolean
-  VAL_NIL,    //! Nil value
-  VAL_NUMBER, //! Floating point number
+  VAL_BOOL,         //! A boolean
+  VAL_NIL,          //! Nil value
+  VAL_UNDEFINED,    //! Marks a global with no value yet, never seen by Lox
+  VAL_NUMBER,       //! Floating point number
+  VAL_INT,          //! Integral number, kept exact as a 64 bit integer
+  VAL_SMALL_STRING, //! String of at most SMALL_STRING_MAX bytes, stored inline
+  VAL_OBJ,          //! Heap allocated object
 } ValueType;
 
 /**
- * Values in lox, a tagged union possibly representing bools, numbers, or nil
- * values
+ * Characters of a small string, stored directly in the value.
+ *
+ * Unused characters are always zero, so two small strings are equal exactly
+ * when their bits are.
+ * */
+typedef struct {
+  char chars[SMALL_STRING_MAX]; //! The characters (not null-terminated)
+  uint8_t length;               //! Number of characters
+} SmallString;
+
+/**
+ * Values in lox, a tagged union possibly representing bools, numbers, nil,
+ * strings or heap objects
  * */
 typedef struct {
   ValueType type; //! The type of the value
   union {
-    bool boolean;  //! Bool value
-    double number; //! Floating point number
-  } as;            //! The actual data represented by the value
+    bool boolean;      //! Bool value
+    double number;     //! Floating point number
+    int64_t integer;   //! Integral number
+    SmallString small; //! Inline string
+    Obj *obj;          //! Pointer to heap object
+    uint64_t bits;     //! Raw bits, for comparing small strings at once
+  } as;                //! The actual data represented by the value
 } Value;
 
 // Macros for converting c values to lox values
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
+#define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
 // Macros for converting lox values to c values
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+// A number in either representation, as a double
+#define AS_DOUBLE(value)                                                       \
+  (IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value))
+#define AS_SMALL_STRING(value) ((value).as.small)
+#define AS_OBJ(value) ((value).as.obj)
 
 // Macros for checking the type of a lox value
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value.type) == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+// Whether a value is a number in either representation
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+#define IS_SMALL_STRING(value) ((value).type == VAL_SMALL_STRING)
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
+
+/**
+ * Check whether an integer converts to a double exactly (so it can be equal
+ * to one)
+ * */
+static inline bool isExactDouble(int64_t integer) {
+  // 2^63 itself doesn't fit back into an int64_t
+  double number = (double)integer;
+  return number < 9223372036854775808.0 && (int64_t)number == integer;
+}
+
+/**
+ * Compare an integer with a double exactly (converting the integer to a
+ * double can round it onto the double)
+ *
+ * @returns -1, 0 or 1 as the integer is less than, equal to or greater than
+ * the double, and 0 if the double is NaN (so < 0 and > 0 are both false, as
+ * comparisons with NaN are)
+ * */
+static inline int compareIntDouble(int64_t integer, double number) {
+  // Outside the range of integers (or NaN), the double decides
+  if (!(number < 9223372036854775808.0))
+    return number > 0 ? -1 : 0;
+  if (number < -9223372036854775808.0)
+    return 1;
+  // Within it, truncating is exact, and the integer is compared with the
+  // whole part first, then the fraction breaks a tie
+  int64_t whole = (int64_t)number;
+  if (integer != whole)
+    return integer < whole ? -1 : 1;
+  double rest = number - (double)whole;
+  return (rest < 0) - (rest > 0);
+}
+
+/**
+ * Compare two numbers, in either representation, exactly
+ *
+ * @returns As compareIntDouble
+ * */
+static inline int compareNumbers(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b))
+    return (AS_INT(a) > AS_INT(b)) - (AS_INT(a) < AS_INT(b));
+  if (IS_INT(a))
+    return compareIntDouble(AS_INT(a), AS_NUMBER(b));
+  if (IS_INT(b))
+    return -compareIntDouble(AS_INT(b), AS_NUMBER(a));
+  return (AS_NUMBER(a) > AS_NUMBER(b)) - (AS_NUMBER(a) < AS_NUMBER(b));
+}
+
+/**
+ * Multiply two integers, in the form of the overflow checking builtins
+ *
+ * @returns True (overflow) unless the product is an integer, which a zero
+ * product of a negative number isn't (it's -0) */
+static inline bool intProduct(int64_t a, int64_t b, int64_t *result) {
+  if (__builtin_mul_overflow(a, b, result))
+    return true;
+  return *result == 0 && (a < 0 || b < 0);
+}
+
+/**
+ * Divide two integers, in the form of the overflow checking builtins
+ *
+ * @returns True (overflow) unless the quotient is an integer (dividing zero
+ * by a negative number gives -0) */
+static inline bool exactQuotient(int64_t a, int64_t b, int64_t *result) {
+  if (b == 0 || (a == INT64_MIN && b == -1) || a % b != 0 ||
+      (a == 0 && b < 0))
+    return true;
+  *result = a / b;
+  return false;
+}
+
+/**
+ * Check whether a value counts as false in a condition (only nil and false
+ * do)
+ * */
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
 
 /**
  * Array of constant values (associated with a chunk)
@@ -78,9 +199,19 @@ void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
 
 /**
- * Print a value.
+ * Print a value (immediately, to stdout).
  *
  * @param value Value to be printed
  * */
 void printValue(Value value);
+
+/**
+ * Write a value to an output buffer.
+ *
+ * Numbers are written in their shortest round-trip form.
+ *
+ * @param output Output buffer to write to
+ * @param value Value to be written
+ * */
+void writeValue(OutputBuffer *output, Value value);
 #endif // !clox_value_h
@@ -1,19 +1,97 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <pthread.h>
+
 #include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "output.h"
+#include "slab.h"
+#include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+#ifdef DEBUG_BINARY_TRACE
+#include "trace.h"
+#endif
+
+// Most calls in progress at once (counting the script)
+#define FRAMES_MAX 64
+// Most values a single frame (a call, or the script) holds at once, checked
+// at compile time
+#define FRAME_SLOTS 256
+#define STACK_MAX (FRAMES_MAX * FRAME_SLOTS)
+// Slots kept free above the frames for the values the runtime pushes while
+// running an instruction (an object kept from the GC while it allocates),
+// which the compiler doesn't count
+#define STACK_HEADROOM 8
+
+typedef struct Fiber Fiber;
+// Most global variables a VM can hold (slots are 16 bit operands)
+#define GLOBALS_MAX (UINT16_MAX + 1)
 
 /**
- * Virtual Machine.
+ * A call in progress.
+ *
+ * Frames live in one contiguous array, and a frame's slots are a window onto
+ * the value stack starting at the callee, so the arguments a caller pushed
+ * are the callee's first locals without being copied.
  * */
 typedef struct {
-  Chunk *chunk;           //! Chunk of bytecode being interpreted
-  uint8_t *ip;            //! Pointer to the current instruction
-  Value stack[STACK_MAX]; //! Stack of values the VM is operating on
-  Value *stackTop;        //! Pointer to the top of the stack
+  ObjFunction *function; //! Function being run (NULL for the script)
+  Chunk *chunk;          //! Chunk being run
+  uint8_t *ip;           //! Where the frame continues, while it's calling
+  Value *slots;          //! First stack slot of the frame
+} CallFrame;
+
+/**
+ * Virtual Machine.
+ *
+ * Each VM has its own heap, so values can't be shared between VMs.
+ * */
+typedef struct VM {
+  Chunk *chunk;             //! Chunk of bytecode being interpreted
+  uint8_t *ip;              //! Pointer to the current instruction
+  Value *stack;             //! Stack of values the VM is operating on
+  Value *stackTop;          //! Pointer to the top of the stack
+  int stackCapacity;        //! Number of values the stack holds
+  CallFrame *frames;        //! Calls in progress, the script's first
+  int frameCount;           //! Number of calls in progress
+  int frameCapacity;        //! Number of calls frames holds
+  int returnFrames;         //! Returns down to this many frames leave run()
+  uint64_t yieldAt;         //! Instruction count at which run() yields
+  uint64_t deadline;        //! When waits for I/O give up (see awaitIo)
+  Fiber *fiber;             //! Fiber switched into the VM, if any
+  Fiber *fibers;            //! Every fiber of the VM (stacks are roots)
+  pthread_mutex_t lock;     //! Held while a fiber or the API uses the VM
+  pthread_mutex_t turnLock; //! Protects fiberRunning and the parked fibers
+  bool fiberRunning;        //! Whether one of the VM's fibers has its turn
+  Fiber *parked;            //! Fibers waiting for their turn, oldest first
+  Fiber *lastParked;        //! The fiber that waited for its turn last
+  // Stack used when not running a fiber
+  Value baseStack[STACK_MAX + STACK_HEADROOM];
+  OutputBuffer output;       //! Buffered results, written out in blocks
+  FILE *errors;              //! File compile and runtime errors go to
+  uint64_t instructionCount; //! Number of instructions executed so far
+  Table strings;             //! Interned strings (a set, values are unused)
+  Obj *objects;              //! List of every allocated object
+  Table globalSlots;         //! Slot index of each global, by name
+  ValueArray globalNames;    //! Name of the global in each slot
+  ValueArray globalValues;   //! Value of the global in each slot
+  ValueArray savedGlobals;   //! Values restoreGlobals puts back (roots)
+  GC gc;                     //! Garbage collector state
+  SlabHeap slabs;            //! Memory of the heap (see slab.h)
+  Value result;              //! Value of the last script's final expression
+  FrozenChunk **scripts;     //! Compiled chunks kept for reuse (roots)
+  int scriptCount;           //! Number of chunks in scripts
+  int scriptCapacity;        //! Capacity of scripts
+  void *image;               //! Mapped snapshot image, if any (see image.h)
+  size_t imageSize;          //! Size of the mapped image
+  // Frames used when not running a fiber
+  CallFrame baseFrames[FRAMES_MAX];
+#ifdef DEBUG_BINARY_TRACE
+  TraceBuffer trace; //! Most recently executed instructions
+#endif
 } VM;
 
 /**
@@ -23,22 +101,107 @@ typedef enum {
   INTERPRET_OK,            //! No errors
   INTERPRET_COMPILE_ERROR, //! Error occured during compilation
   INTERPRET_RUNTIME_ERROR, //! Error occured during runtime
+  INTERPRET_YIELD,         //! Stopped after a quantum, and can be resumed
 } InterpretResult;
 
+// VM the calling thread is working with
+extern _Thread_local VM *vm;
+
 /**
- * Initialize the VM.
+ * Initialize a VM, with the natives defined (see native.h), and make it the
+ * current VM of the calling thread.
+ *
+ * @param instance VM to initialize
+ * @param imagePath Image to restore the globals from (see image.h), or NULL
+ * to start empty
+ *
+ * @returns False if the image couldn't be restored (the VM is then empty)
  * */
-void initVM();
+bool initVM(VM *instance, const char *imagePath);
 /**
- * Free VM associated memory.
+ * Free the memory associated with the current VM.
  * */
 void freeVM();
 
+/**
+ * Report a runtime error with a stack trace, and reset the stack
+ *
+ * @param format printf style format of the message
+ * */
+void runtimeError(const char *format, ...);
+
 /**
  * Interpret a Chunk of Bytecode
  * */
 InterpretResult interpret(const char *source);
 
+/**
+ * Run the VM's top frame from vm->ip until the script returns (or a call
+ * returns to vm->returnFrames frames), it fails, or it reaches vm->yieldAt
+ * instructions
+ * */
+InterpretResult run();
+
+/**
+ * Compile source code into a chunk that can be run any number of times.
+ *
+ * @param source The source code string
+ *
+ * @returns The compiled chunk (released with releaseChunk), or NULL if there
+ * was a compile error
+ * */
+FrozenChunk *compileSource(const char *source);
+
+/**
+ * Run a compiled chunk to completion.
+ *
+ * The value of a final expression statement is left in vm->result (nil if
+ * the chunk doesn't end with one).
+ *
+ * @param frozen Chunk to run
+ * */
+InterpretResult runChunk(FrozenChunk *frozen);
+
+/**
+ * Keep a compiled chunk for reuse: it stays alive with the VM (which holds
+ * the reference the chunk was created with) and its constants are roots.
+ *
+ * @param frozen Chunk to keep
+ * */
+void keepScript(FrozenChunk *frozen);
+
+/**
+ * Stop keeping a chunk, handing its reference back to the caller.
+ *
+ * @param frozen Chunk kept with keepScript
+ * */
+void dropScript(FrozenChunk *frozen);
+
+/**
+ * Get the slot of a global variable, adding a new (undefined) slot the first
+ * time a name is seen.
+ *
+ * Globals are resolved to slots once, at compile time, so the VM accesses
+ * them by index rather than by name.
+ *
+ * @param name Name of the global (a string value)
+ *
+ * @return Index of the slot, or -1 if there are already GLOBALS_MAX globals
+ * */
+int globalSlot(Value name);
+
+/**
+ * Remember the current values of the globals, for restoreGlobals.
+ * */
+void saveGlobals();
+
+/**
+ * Put back the values the globals had at the last saveGlobals, leaving the
+ * globals defined since then undefined (their slots stay numbered, so code
+ * compiled meanwhile can still run).
+ * */
+void restoreGlobals();
+
 /**
  * Push a value onto the VMs stack.
  *
@@ -0,0 +1,115 @@
+// Std library includes
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "aot.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "output.h"
+#include "value.h"
+#include "vm.h"
+
+// The one VM a translated program runs in
+static VM aotVM;
+// Bytecode of the translated script, for the instructions the interpreter
+// executes (and the line numbers of errors)
+static Chunk aotChunk;
+
+void aotInit(const uint8_t *code, const int *lines, int count) {
+  initVM(&aotVM, NULL);
+  initChunk(&aotChunk);
+  for (int i = 0; i < count; i++) {
+    writeChunk(&aotChunk, code[i], lines[i]);
+  }
+  initCaches(&aotChunk);
+  // The VM's chunk is a root, which keeps the constants alive
+  vm->chunk = &aotChunk;
+  vm->frames[0].function = NULL;
+  vm->frames[0].chunk = &aotChunk;
+  vm->frames[0].ip = NULL;
+  vm->frames[0].slots = vm->stack;
+  vm->frameCount = 1;
+}
+
+void aotConstant(Value value) {
+  // Functions whose constants are being added are on the stack (keeping
+  // them alive), innermost on top
+  Chunk *chunk = vm->stackTop > vm->stack
+                     ? &AS_FUNCTION(vm->stackTop[-1])->chunk
+                     : &aotChunk;
+  // Growing the constants can start a collection. A function already marked
+  // doesn't mark its new constant, hence the barrier
+  addConstant(chunk, value);
+  WRITE_BARRIER(value);
+}
+
+void aotStringConstant(const char *chars, int length) {
+  aotConstant(copyString(chars, length));
+}
+
+void aotBeginFunction(const char *name, int length, int arity, int maxSlots,
+                      const uint8_t *code, const int *lines, int count) {
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function));
+  function->arity = arity;
+  function->maxSlots = maxSlots;
+  function->name = copyString(name, length);
+  WRITE_BARRIER(function->name);
+  for (int i = 0; i < count; i++) {
+    writeChunk(&function->chunk, code[i], lines[i]);
+  }
+  initCaches(&function->chunk);
+}
+
+void aotEndFunction() {
+  // Adding the constant keeps it on the stack again while the constants grow
+  aotConstant(pop());
+}
+
+void aotArrayConstant(const double *elements, int count) {
+  ObjArray *array = newArray(count);
+  if (count > 0)
+    memcpy(array->elements, elements, sizeof(double) * count);
+  aotConstant(OBJ_VAL(array));
+}
+
+void aotGlobal(const char *chars, int length) {
+  globalSlot(copyString(chars, length));
+}
+
+int aotRun(AotScript script) {
+  InterpretResult result = script();
+  vm->chunk = NULL;
+  // Before the VM, whose heap the chunk's arrays are in
+  freeChunk(&aotChunk);
+  freeVM();
+  return result == INTERPRET_OK ? EXIT_SUCCESS : 70;
+}
+
+bool aotStep(int offset, int depth) {
+  vm->ip = vm->chunk->code + offset;
+  vm->stackTop = vm->stack + depth;
+  // run() gives up the thread after the quantum, here of one instruction
+  vm->yieldAt = vm->instructionCount + 1;
+  return run() == INTERPRET_YIELD;
+}
+
+bool aotCall(int offset, int depth) {
+  vm->ip = vm->chunk->code + offset;
+  vm->stackTop = vm->stack + depth;
+  // run() comes back once the call returns to the script's frame
+  vm->returnFrames = 1;
+  vm->yieldAt = UINT64_MAX;
+  InterpretResult result = run();
+  vm->returnFrames = 0;
+  return result == INTERPRET_OK;
+}
+
+void aotPrint(int depth) {
+  // Writing a rope flattens (allocates) it, so the stack has to be complete
+  vm->stackTop = vm->stack + depth;
+  writeValue(&vm->output, vm->stackTop[-1]);
+  writeOutputChar(&vm->output, '\n');
+}
@@ -0,0 +1,176 @@
+// Std library includes
+#include <math.h>
+
+// Local Includes
+#include "array.h"
+#include "common.h"
+
+// The kernels are written with the compiler's vector extensions, a Vector
+// holding LANES doubles. Compiled for AVX a Vector is one register, for the
+// SSE2 baseline the compiler splits it into two.
+
+#define LANES 4
+
+typedef double Vector __attribute__((vector_size(LANES * sizeof(double))));
+// Result of comparing Vectors, all ones in the lanes where it holds
+typedef int64_t Mask __attribute__((vector_size(LANES * sizeof(double))));
+// A Vector at any (double aligned) address, for loading and storing
+typedef double UnalignedVector
+    __attribute__((vector_size(LANES * sizeof(double)), aligned(sizeof(double)),
+                   may_alias));
+
+#define LOAD(pointer) ((Vector)*(const UnalignedVector *)(pointer))
+#define STORE(pointer, vector) (*(UnalignedVector *)(pointer) = (vector))
+#define SPLAT(number) ((Vector){number, number, number, number})
+// Turn a Mask into 1 and 0 elements
+#define MASK_TO_ONES(mask) ((Vector)((mask) & (Mask)SPLAT(1.0)))
+
+// Compile kernels for AVX as well as the baseline, where the compiler can
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SIMD_KERNEL __attribute__((target_clones("avx", "default")))
+#endif
+#endif
+#ifndef SIMD_KERNEL
+#define SIMD_KERNEL
+#endif
+
+/**
+ * Loop applying an expression of the elements x (of a) and y (of b), as
+ * vectors then for the elements left over */
+#define BINARY_LOOP(vectorExpression, scalarExpression)                        \
+  do {                                                                         \
+    int i = 0;                                                                 \
+    for (; i + LANES <= count; i += LANES) {                                   \
+      Vector x = LOAD(a + i * aStep);                                          \
+      Vector y = LOAD(b + i * bStep);                                          \
+      STORE(result + i, vectorExpression);                                     \
+    }                                                                          \
+    for (; i < count; i++) {                                                   \
+      double x = a[i * aStep];                                                 \
+      double y = b[i * bStep];                                                 \
+      result[i] = scalarExpression;                                            \
+    }                                                                          \
+  } while (false)
+
+SIMD_KERNEL
+void arrayBinary(ArrayOp op, const double *a, bool aScalar, const double *b,
+                 bool bScalar, double *result, int count) {
+  // A scalar is read as a vector of copies that the loop doesn't advance
+  // through
+  double aCopies[LANES], bCopies[LANES];
+  int aStep = 1, bStep = 1;
+  if (aScalar) {
+    for (int i = 0; i < LANES; i++)
+      aCopies[i] = *a;
+    a = aCopies;
+    aStep = 0;
+  }
+  if (bScalar) {
+    for (int i = 0; i < LANES; i++)
+      bCopies[i] = *b;
+    b = bCopies;
+    bStep = 0;
+  }
+
+  switch (op) {
+  case ARRAY_ADD:
+    BINARY_LOOP(x + y, x + y);
+    break;
+  case ARRAY_SUBTRACT:
+    BINARY_LOOP(x - y, x - y);
+    break;
+  case ARRAY_MULTIPLY:
+    BINARY_LOOP(x * y, x * y);
+    break;
+  case ARRAY_DIVIDE:
+    BINARY_LOOP(x / y, x / y);
+    break;
+  case ARRAY_GREATER:
+    BINARY_LOOP(MASK_TO_ONES(x > y), x > y ? 1.0 : 0.0);
+    break;
+  case ARRAY_LESS:
+    BINARY_LOOP(MASK_TO_ONES(x < y), x < y ? 1.0 : 0.0);
+    break;
+  }
+}
+
+SIMD_KERNEL
+void arrayNegate(const double *a, double *result, int count) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    STORE(result + i, -LOAD(a + i));
+  }
+  for (; i < count; i++) {
+    result[i] = -a[i];
+  }
+}
+
+SIMD_KERNEL
+void arrayNot(const double *a, double *result, int count) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    STORE(result + i, MASK_TO_ONES(LOAD(a + i) == SPLAT(0.0)));
+  }
+  for (; i < count; i++) {
+    result[i] = a[i] == 0 ? 1.0 : 0.0;
+  }
+}
+
+SIMD_KERNEL
+double arraySum(const double *a, int count) {
+  // Each lane adds up its own share of the elements
+  Vector sums = SPLAT(0.0);
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    sums += LOAD(a + i);
+  }
+  double sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  for (; i < count; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+/**
+ * Loop keeping the smallest (or largest, for >) element seen in each lane */
+#define EXTREME_LOOP(compare, start)                                           \
+  do {                                                                         \
+    Vector best = SPLAT(start);                                                \
+    int i = 0;                                                                 \
+    for (; i + LANES <= count; i += LANES) {                                   \
+      Vector x = LOAD(a + i);                                                  \
+      Mask better = x compare best;                                            \
+      best = (Vector)(((Mask)x & better) | ((Mask)best & ~better));            \
+    }                                                                          \
+    double result = start;                                                     \
+    for (int lane = 0; lane < LANES; lane++) {                                 \
+      if (best[lane] compare result)                                           \
+        result = best[lane];                                                   \
+    }                                                                          \
+    for (; i < count; i++) {                                                   \
+      if (a[i] compare result)                                                 \
+        result = a[i];                                                         \
+    }                                                                          \
+    return result;                                                             \
+  } while (false)
+
+SIMD_KERNEL
+double arrayMin(const double *a, int count) { EXTREME_LOOP(<, INFINITY); }
+
+SIMD_KERNEL
+double arrayMax(const double *a, int count) { EXTREME_LOOP(>, -INFINITY); }
+
+SIMD_KERNEL
+double arrayDot(const double *a, const double *b, int count) {
+  Vector sums = SPLAT(0.0);
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    sums += LOAD(a + i) * LOAD(b + i);
+  }
+  double sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  for (; i < count; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
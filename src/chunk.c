@@ -1,10 +1,12 @@
 // Std library includes
 #include <stdlib.h>
+#include <string.h>
 
 // Local Includes
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk) {
   // Chunk starts empty, with no capacity
@@ -16,12 +18,16 @@ void initChunk(Chunk *chunk) {
   chunk->lines = NULL;
   // Initialize the value array associated with the chunk
   initValueArray(&chunk->constants);
+  // Caches are allocated once the code is complete
+  chunk->caches = NULL;
+  chunk->cacheCount = 0;
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  free(chunk->caches);
   initChunk(chunk);
 }
 
@@ -40,6 +46,195 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 }
 
 int addConstant(Chunk *chunk, Value value) {
+  // Growing the array can start a collection, keep the value reachable
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
 }
+
+/**
+ * Round size up to the next multiple of alignment (a power of two) */
+static size_t alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+FrozenChunk *freezeChunk(Chunk *chunk) {
+  // Layout: header | code | constants | lines, with the code starting on its
+  // own cache line and every section sized exactly to its contents
+  size_t codeOffset = alignUp(sizeof(FrozenChunk), CACHE_LINE_SIZE);
+  size_t constantsOffset =
+      alignUp(codeOffset + sizeof(uint8_t) * chunk->count, _Alignof(Value));
+  size_t linesOffset = alignUp(
+      constantsOffset + sizeof(Value) * chunk->constants.count, _Alignof(int));
+  size_t size = alignUp(linesOffset + sizeof(int) * chunk->count,
+                        CACHE_LINE_SIZE);
+
+  char *blob = allocateAligned(CACHE_LINE_SIZE, size);
+  FrozenChunk *frozen = (FrozenChunk *)blob;
+  atomic_init(&frozen->refCount, 1);
+  frozen->size = size;
+
+  Chunk *view = &frozen->chunk;
+  view->count = chunk->count;
+  view->capacity = chunk->count;
+  view->code = (uint8_t *)(blob + codeOffset);
+  view->lines = (int *)(blob + linesOffset);
+  view->constants.count = chunk->constants.count;
+  view->constants.capacity = chunk->constants.count;
+  view->constants.values = (Value *)(blob + constantsOffset);
+  // The caches are written while running, so they move over rather than
+  // being packed with the rest
+  view->caches = chunk->caches;
+  view->cacheCount = chunk->cacheCount;
+  chunk->caches = NULL;
+
+  // memcpy with a NULL source is undefined, even for zero bytes
+  if (chunk->count > 0) {
+    memcpy(view->code, chunk->code, sizeof(uint8_t) * chunk->count);
+    memcpy(view->lines, chunk->lines, sizeof(int) * chunk->count);
+  }
+  if (chunk->constants.count > 0) {
+    memcpy(view->constants.values, chunk->constants.values,
+           sizeof(Value) * chunk->constants.count);
+  }
+
+  freeChunk(chunk);
+  return frozen;
+}
+
+FrozenChunk *retainChunk(FrozenChunk *frozen) {
+  atomic_fetch_add_explicit(&frozen->refCount, 1, memory_order_relaxed);
+  return frozen;
+}
+
+void releaseChunk(FrozenChunk *frozen) {
+  // The last owner to let go frees the blob, acquire ensures every other
+  // owner is done with it first
+  if (atomic_fetch_sub_explicit(&frozen->refCount, 1, memory_order_acq_rel) ==
+      1) {
+    free(frozen->chunk.caches);
+    freeAligned(frozen, frozen->size);
+  }
+}
+
+/**
+ * Get the offset of the cache operand of a property instruction
+ *
+ * @returns The offset, or -1 if the instruction has no cache */
+static int cacheOperand(uint8_t instruction) {
+  switch (instruction) {
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+    return 2;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    return 3;
+  default:
+    return -1;
+  }
+}
+
+void initCaches(Chunk *chunk) {
+  // The compiler numbers the caches in order, but code it dropped (of
+  // skipped operands) can leave gaps, so the count is the highest one's + 1
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    int operand = cacheOperand(chunk->code[offset]);
+    if (operand < 0)
+      continue;
+    int cache = (chunk->code[offset + operand] << 8) |
+                chunk->code[offset + operand + 1];
+    if (cache + 1 > count)
+      count = cache + 1;
+  }
+
+  // Not allocated with reallocate, the caches belong to the chunk rather
+  // than the heap (and the shapes and methods in them are marked with it)
+  free(chunk->caches);
+  chunk->caches = count > 0 ? calloc(count, sizeof(InlineCache)) : NULL;
+  if (count > 0 && chunk->caches == NULL)
+    exit(1);
+  chunk->cacheCount = count;
+}
+
+int instructionLength(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_ARRAY:
+  case OP_MAP:
+  case OP_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+    return 2;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    return 3;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+    return 4;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    return 5;
+  default:
+    return 1;
+  }
+}
+
+int stackEffect(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_CLASS:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_DOT:
+  case OP_GET_INDEX:
+    return -1;
+  case OP_ARRAY:
+    return 1 - chunk->code[offset + 1];
+  case OP_MAP:
+    return 1 - 2 * chunk->code[offset + 1];
+  case OP_INHERIT:
+  case OP_SET_INDEX:
+    return -2;
+  case OP_CALL:
+    // The arguments and the callee are replaced by the result
+    return -chunk->code[offset + 1];
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    // The arguments and the receiver are replaced by the result
+    return -chunk->code[offset + 2];
+  default:
+    return 0;
+  }
+}
+
+bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_JUMP_IF_TRUE;
+}
@@ -0,0 +1,265 @@
+// Std library includes
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "chunk.h"
+#include "clox.h"
+#include "fiber.h"
+#include "image.h"
+#include "native.h"
+#include "object.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+_Static_assert(sizeof(CloxValue) == sizeof(Value),
+               "CloxValue must be able to hold a Value");
+
+/**
+ * Lock a VM and make it the current VM
+ *
+ * @returns The previously current VM, for leaveVM */
+static VM *enterVM(VM *instance) {
+  pthread_mutex_lock(&instance->lock);
+  VM *previous = vm;
+  vm = instance;
+  return previous;
+}
+
+/**
+ * Unlock the current VM, and restore the previously current VM */
+static void leaveVM(VM *previous) {
+  pthread_mutex_unlock(&vm->lock);
+  vm = previous;
+}
+
+/**
+ * Convert a value to its host representation, flattening ropes so the host
+ * always sees the characters of a string in one piece */
+static CloxValue toHost(Value value) {
+  if (IS_ROPE(value))
+    value = OBJ_VAL(flattenString(value));
+  CloxValue result;
+  memcpy(&result, &value, sizeof(Value));
+  return result;
+}
+
+/**
+ * Convert a value from its host representation */
+static Value fromHost(CloxValue value) {
+  Value result;
+  memcpy(&result, &value, sizeof(Value));
+  return result;
+}
+
+/**
+ * Get the string value for the name of a global, without creating (heap)
+ * strings that can't be the name of any global
+ *
+ * @returns False if no global has the name */
+static bool findName(const char *name, Value *value) {
+  int length = (int)strlen(name);
+  if (length <= SMALL_STRING_MAX) {
+    *value = copyString(name, length);
+    return true;
+  }
+  ObjString *interned =
+      tableFindString(&vm->strings, name, length, hashString(name, length));
+  if (interned == NULL)
+    return false;
+  *value = OBJ_VAL(interned);
+  return true;
+}
+
+bool cloxRegisterNative(const char *name, int arity, CloxNative function) {
+  return registerNative(name, arity, NATIVE_HOST,
+                        (NativeFunction){.host = function});
+}
+
+bool cloxRegisterUnaryNative(const char *name, double (*function)(double)) {
+  return registerNative(name, 1, NATIVE_UNARY,
+                        (NativeFunction){.unary = function});
+}
+
+bool cloxRegisterBinaryNative(const char *name,
+                              double (*function)(double, double)) {
+  return registerNative(name, 2, NATIVE_BINARY,
+                        (NativeFunction){.binary = function});
+}
+
+CloxVM *cloxNewVM(void) { return cloxNewVMFromImage(NULL); }
+
+CloxVM *cloxNewVMFromImage(const char *path) {
+  VM *instance = malloc(sizeof(VM));
+  if (instance == NULL)
+    return NULL;
+  VM *previous = vm;
+  bool loaded = initVM(instance, path);
+  if (!loaded) {
+    freeVM();
+    free(instance);
+    instance = NULL;
+  }
+  vm = previous;
+  return instance;
+}
+
+bool cloxSaveImage(CloxVM *instance, const char *path) {
+  VM *previous = enterVM(instance);
+  bool saved = saveImage(path);
+  leaveVM(previous);
+  return saved;
+}
+
+void cloxFreeVM(CloxVM *instance) {
+  // Nothing else can be using a VM that's being freed, so it isn't locked
+  VM *previous = vm;
+  vm = instance;
+  freeVM();
+  free(instance);
+  vm = previous == instance ? NULL : previous;
+}
+
+CloxScript *cloxCompile(CloxVM *instance, const char *source) {
+  VM *previous = enterVM(instance);
+  FrozenChunk *frozen = compileSource(source);
+  if (frozen != NULL)
+    keepScript(frozen);
+  leaveVM(previous);
+  return frozen;
+}
+
+void cloxFreeScript(CloxVM *instance, CloxScript *script) {
+  VM *previous = enterVM(instance);
+  dropScript(script);
+  // Fibers still running the script hold their own reference
+  releaseChunk(script);
+  leaveVM(previous);
+}
+
+CloxStatus cloxEvaluate(CloxVM *instance, CloxScript *script,
+                        CloxValue *result) {
+  VM *previous = enterVM(instance);
+  InterpretResult status = runChunk(script);
+  flushOutput(&vm->output);
+  if (result != NULL)
+    *result = toHost(status == INTERPRET_OK ? vm->result : NIL_VAL);
+  leaveVM(previous);
+  return status == INTERPRET_OK ? CLOX_OK : CLOX_RUNTIME_ERROR;
+}
+
+bool cloxSetGlobal(CloxVM *instance, const char *name, CloxValue value) {
+  VM *previous = enterVM(instance);
+  Value global = fromHost(value);
+  // The value may be a new string, keep it reachable while the name is
+  // created
+  push(global);
+  int slot = globalSlot(copyString(name, (int)strlen(name)));
+  if (slot >= 0) {
+    WRITE_BARRIER(global);
+    vm->globalValues.values[slot] = global;
+  }
+  pop();
+  leaveVM(previous);
+  return slot >= 0;
+}
+
+bool cloxGetGlobal(CloxVM *instance, const char *name, CloxValue *value) {
+  VM *previous = enterVM(instance);
+  Value nameValue, slot;
+  bool found = findName(name, &nameValue) &&
+               tableGet(&vm->globalSlots, nameValue, &slot) &&
+               !IS_UNDEFINED(vm->globalValues.values[(int)AS_NUMBER(slot)]);
+  if (found)
+    *value = toHost(vm->globalValues.values[(int)AS_NUMBER(slot)]);
+  leaveVM(previous);
+  return found;
+}
+
+CloxScheduler *cloxNewScheduler(int workers, uint64_t quantum) {
+  Scheduler *scheduler = malloc(sizeof(Scheduler));
+  if (scheduler == NULL)
+    return NULL;
+  if (!startScheduler(scheduler, workers, quantum)) {
+    free(scheduler);
+    return NULL;
+  }
+  return scheduler;
+}
+
+void cloxFreeScheduler(CloxScheduler *scheduler) {
+  stopScheduler(scheduler);
+  free(scheduler);
+}
+
+CloxFiber *cloxSpawn(CloxScheduler *scheduler, CloxVM *instance,
+                     CloxScript *script) {
+  VM *previous = enterVM(instance);
+  Fiber *fiber = newFiber(script);
+  leaveVM(previous);
+  scheduleFiber(scheduler, fiber);
+  return fiber;
+}
+
+CloxStatus cloxJoin(CloxScheduler *scheduler, CloxFiber *fiber,
+                    CloxValue *result) {
+  waitForFiber(scheduler, fiber);
+  VM *previous = enterVM(fiber->vm);
+  InterpretResult status = fiber->status;
+  // Flatten while the fiber still keeps the result reachable
+  if (result != NULL)
+    *result = toHost(fiber->result);
+  freeFiber(fiber);
+  flushOutput(&vm->output);
+  leaveVM(previous);
+  return status == INTERPRET_OK ? CLOX_OK : CLOX_RUNTIME_ERROR;
+}
+
+CloxValue cloxNil(void) { return toHost(NIL_VAL); }
+
+CloxValue cloxBool(bool boolean) { return toHost(BOOL_VAL(boolean)); }
+
+CloxValue cloxNumber(double number) { return toHost(NUMBER_VAL(number)); }
+
+CloxValue cloxString(CloxVM *instance, const char *chars, size_t length) {
+  VM *previous = enterVM(instance);
+  CloxValue result = toHost(copyString(chars, (int)length));
+  leaveVM(previous);
+  return result;
+}
+
+CloxType cloxType(CloxValue value) {
+  Value internal = fromHost(value);
+  switch (internal.type) {
+  case VAL_BOOL:
+    return CLOX_BOOL;
+  case VAL_NUMBER:
+  case VAL_INT:
+    return CLOX_NUMBER;
+  case VAL_SMALL_STRING:
+    return CLOX_STRING;
+  case VAL_OBJ:
+    return IS_STRING(internal) ? CLOX_STRING : CLOX_OBJECT;
+  default:
+    return CLOX_NIL;
+  }
+}
+
+bool cloxAsBool(CloxValue value) { return AS_BOOL(fromHost(value)); }
+
+double cloxAsNumber(CloxValue value) { return AS_DOUBLE(fromHost(value)); }
+
+const char *cloxAsString(const CloxValue *value, size_t *length) {
+  // Small strings are read in place, from the host's copy of the value
+  Value internal = fromHost(*value);
+  if (IS_SMALL_STRING(internal)) {
+    *length = AS_SMALL_STRING(internal).length;
+    return (const char *)value + offsetof(Value, as.small.chars);
+  }
+  ObjString *string = AS_HEAP_STRING(internal);
+  *length = (size_t)string->length;
+  return string->chars;
+}
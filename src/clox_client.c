@@ -0,0 +1,207 @@
+/**
+ * @file clox_client.c
+ * @brief Client for the evaluation daemon (clox --serve)
+ *
+ * Sends each script to the daemon as a request, all of them before waiting
+ * for the first response, then prints what each printed (to stdout) and its
+ * errors (to stderr), in order. Without scripts, the source is read from
+ * stdin. Exits with the status of the first request that failed, like clox
+ * running the scripts one after another would (except that every script
+ * runs).
+ * */
+
+// Std lib includes
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Local Includes
+#include "serve.h"
+
+/**
+ * Print usage information and exit
+ * */
+static void usage() {
+  fprintf(stderr, "Usage: clox-client [--timeout=milliseconds] socket "
+                  "[path...]\n");
+  exit(64);
+}
+
+/**
+ * Read a whole file (or stdin, for NULL)
+ *
+ * @param path Path of the file
+ * @param length Set to the number of bytes read
+ *
+ * @return Contents of the file, to be freed by the caller
+ * */
+static char *readAll(const char *path, size_t *length) {
+  FILE *file = path != NULL ? fopen(path, "rb") : stdin;
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+  size_t capacity = 4096;
+  char *buffer = malloc(capacity);
+  *length = 0;
+  for (;;) {
+    if (buffer == NULL) {
+      fprintf(stderr, "Not enough memory to read the source.\n");
+      exit(74);
+    }
+    *length += fread(buffer + *length, 1, capacity - *length, file);
+    if (*length < capacity)
+      break;
+    capacity *= 2;
+    buffer = realloc(buffer, capacity);
+  }
+  if (ferror(file)) {
+    fprintf(stderr, "Could not read the source.\n");
+    exit(74);
+  }
+  if (path != NULL)
+    fclose(file);
+  return buffer;
+}
+
+/**
+ * Write all of a buffer to the socket
+ *
+ * @returns False if the connection failed
+ * */
+static bool sendAll(int fd, const void *data, size_t length) {
+  const char *bytes = data;
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return false;
+    bytes += sent;
+    length -= (size_t)sent;
+  }
+  return true;
+}
+
+/**
+ * Read exactly length bytes from the socket
+ *
+ * @returns False if the connection ended first
+ * */
+static bool receiveAll(int fd, void *data, size_t length) {
+  char *bytes = data;
+  while (length > 0) {
+    ssize_t received = recv(fd, bytes, length, 0);
+    if (received <= 0)
+      return false;
+    bytes += received;
+    length -= (size_t)received;
+  }
+  return true;
+}
+
+/**
+ * Send a request with the source of a script
+ *
+ * @returns False if the connection failed
+ * */
+static bool sendRequest(int fd, const char *path, uint32_t timeout) {
+  size_t length;
+  char *source = readAll(path, &length);
+  if (length > SERVE_SOURCE_MAX) {
+    fprintf(stderr, "Script \"%s\" is too long.\n", path ? path : "stdin");
+    exit(74);
+  }
+  uint8_t header[SERVE_REQUEST_HEADER];
+  putField(header, (uint32_t)length);
+  putField(header + 4, timeout);
+  bool sent =
+      sendAll(fd, header, sizeof(header)) && sendAll(fd, source, length);
+  free(source);
+  return sent;
+}
+
+/**
+ * Receive the response to a request, and print what it carries
+ *
+ * @returns Status of the request, or -1 if the connection failed
+ * */
+static int receiveResponse(int fd) {
+  uint8_t header[SERVE_RESPONSE_HEADER];
+  if (!receiveAll(fd, header, sizeof(header)))
+    return -1;
+  uint32_t status = getField(header);
+  size_t lengths[2] = {getField(header + 4), getField(header + 8)};
+  FILE *files[2] = {stdout, stderr};
+  for (int i = 0; i < 2; i++) {
+    char *text = malloc(lengths[i] + 1);
+    if (text == NULL || !receiveAll(fd, text, lengths[i])) {
+      free(text);
+      return -1;
+    }
+    fwrite(text, 1, lengths[i], files[i]);
+    fflush(files[i]);
+    free(text);
+  }
+  if (status == SERVE_TIMEOUT)
+    fprintf(stderr, "Timed out.\n");
+  return (int)status;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t timeout = 0;
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strncmp(argv[arg], "--timeout=", 10) == 0) {
+      char *end;
+      long milliseconds = strtol(argv[arg] + 10, &end, 10);
+      if (end == argv[arg] + 10 || *end != '\0' || milliseconds <= 0 ||
+          milliseconds > UINT32_MAX)
+        usage();
+      timeout = (uint32_t)milliseconds;
+    } else {
+      usage();
+    }
+  }
+  if (arg == argc)
+    usage();
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(argv[arg]) >= sizeof(address.sun_path))
+    usage();
+  strcpy(address.sun_path, argv[arg]);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Could not connect to \"%s\".\n", argv[arg]);
+    exit(74);
+  }
+  arg++;
+
+  // Every request goes out before the first response is read
+  int requests = arg == argc ? 1 : argc - arg;
+  for (int i = 0; i < requests; i++) {
+    if (!sendRequest(fd, arg == argc ? NULL : argv[arg + i], timeout)) {
+      fprintf(stderr, "Could not send the request.\n");
+      exit(74);
+    }
+  }
+  shutdown(fd, SHUT_WR);
+
+  int status = EXIT_SUCCESS;
+  for (int i = 0; i < requests; i++) {
+    int result = receiveResponse(fd);
+    if (result < 0) {
+      fprintf(stderr, "Lost the connection to the daemon.\n");
+      exit(74);
+    }
+    if (status == EXIT_SUCCESS)
+      status = result;
+  }
+  close(fd);
+  return status;
+}
@@ -0,0 +1,86 @@
+/**
+ * @file clox_trace.c
+ * @brief Decoder for binary execution traces
+ *
+ * Reads a trace file dumped by a VM built with DEBUG_BINARY_TRACE and prints
+ * each recorded instruction, with its time since the previous one and the
+ * stack depth, using the regular dissasembler. A line names the function
+ * (or script) whenever the events move to another chunk.
+ * */
+
+// Std lib includes
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Local Includes
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "trace.h"
+#include "vm.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: clox-trace [trace file]\n");
+    exit(64);
+  }
+
+  // The VM owns the chunks and string constants read from the trace
+  static VM traceVM;
+  initVM(&traceVM, NULL);
+
+  TracedChunk *chunks;
+  int chunkCount;
+  TraceEvent *events;
+  uint64_t eventCount, totalEvents;
+  uint32_t flags;
+  if (!loadTrace(argv[1], &chunks, &chunkCount, &events, &eventCount,
+                 &totalEvents, &flags)) {
+    fprintf(stderr, "Could not read trace file \"%s\".\n", argv[1]);
+    exit(74);
+  }
+
+  const char *unit = (flags & TRACE_CYCLES) ? "cycles" : "ns";
+  printf("== trace: %" PRIu64 " events in %d chunks", eventCount, chunkCount);
+  if (totalEvents > eventCount) {
+    printf(" (%" PRIu64 " older events overwritten)",
+           totalEvents - eventCount);
+  }
+  printf(" ==\n");
+  printf("%10s %12s %5s  instruction\n", "event", unit, "depth");
+
+  for (uint64_t i = 0; i < eventCount; i++) {
+    TraceEvent *event = &events[i];
+    // Calls and returns switch chunks, name the one that follows
+    if (i == 0 || event->chunk != events[i - 1].chunk) {
+      if (event->chunk == TRACE_CHUNK_UNKNOWN) {
+        printf("-- chunk not kept --\n");
+      } else if (chunks[event->chunk].name == NULL) {
+        printf("-- script --\n");
+      } else {
+        printf("-- <fn %s> --\n", chunks[event->chunk].name);
+      }
+    }
+    // Time spent in the previous instruction (nothing to compare the first to)
+    uint64_t delta = i > 0 ? event->timestamp - events[i - 1].timestamp : 0;
+    printf("%10" PRIu64 " %12" PRIu64 " %5u  ", totalEvents - eventCount + i,
+           delta, event->stackDepth);
+    if (event->chunk == TRACE_CHUNK_UNKNOWN) {
+      printf("%04u ?\n", event->offset);
+      continue;
+    }
+    dissasembleInstruction(&chunks[event->chunk].frozen->chunk,
+                           (int)event->offset);
+  }
+
+  printf("== End of trace ==\n");
+
+  FREE_ARRAY(TraceEvent, events, eventCount);
+  for (int i = 0; i < chunkCount; i++) {
+    free(chunks[i].name);
+  }
+  free(chunks);
+  freeVM();
+  return EXIT_SUCCESS;
+}
@@ -1,16 +1,29 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif // !DEBUG_PRINT_CODE
 
+// Deepest nesting of expressions the parser recurses into, keeping the C
+// stack bounded whatever the source (machine generated code can nest far
+// deeper than anything written by hand)
+#define MAX_NESTING 4096
+// Deepest nesting of function declarations (each one's compiler holds its
+// locals on the C stack)
+#define MAX_FUNCTION_NESTING 256
+
 /**
  * The Parser which parses the source code into bytecode*/
 typedef struct {
@@ -18,6 +31,10 @@ typedef struct {
   Token previous; //! The previous token parsed
   bool hadError;  //! Whether the parser (or scanner) has encountered an error
   bool panicMode; //! Flag indicating if the parser is panicing
+  int resultPop;  //! Offset just after the last expression statement
+  int constantAt; //! Offset of the last instruction pushing a constant
+  int jumpTarget; //! Offset the last patched jump lands on
+  int depth;      //! Nesting depth of the expression being parsed
 } Parser;
 
 typedef enum {
@@ -34,7 +51,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -42,13 +59,57 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk *compilingChunk;
+/**
+ * A local variable, living in a slot of its function's frame */
+typedef struct {
+  Token name; //! Name of the variable
+  int depth;  //! Scope depth it was declared at (-1 until it's initialized)
+} Local;
+
+/**
+ * Kinds of code a compiler compiles */
+typedef enum {
+  TYPE_SCRIPT,      //! The top level of the script
+  TYPE_FUNCTION,    //! A function declaration
+  TYPE_METHOD,      //! A method, with the instance as this
+  TYPE_INITIALIZER, //! The init method, which returns this
+} FunctionType;
+
+/**
+ * State of a function (or the script) being compiled. The compilers of
+ * nested function declarations are chained together, innermost first. */
+typedef struct Compiler {
+  struct Compiler *enclosing; //! Compiler of the enclosing function, if any
+  ObjFunction *function;      //! Function being compiled (NULL for the script)
+  FunctionType type;          //! What's being compiled
+  Chunk *chunk;               //! Chunk the code is written to
+  Local locals[FRAME_SLOTS];  //! Locals in scope, by slot
+  int localCount;             //! Number of locals in scope
+  int scopeDepth;             //! Number of blocks around the current code
+  int nesting;                //! Number of functions around this one
+  int cacheCount;             //! Inline caches numbered so far
+} Compiler;
+
+/**
+ * A class declaration being compiled. Those of nested declarations are
+ * chained together, innermost first. */
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing; //! Class declaration around this one
+  bool hasSuperclass;              //! Whether the class inherits
+} ClassCompiler;
+
+// Compiler state is per thread, so VMs on different threads can compile at
+// the same time
+static _Thread_local Parser parser;
+static _Thread_local Compiler *current;
+static _Thread_local ClassCompiler *currentClass;
+// Tokens of the whole source when it was scanned up front, otherwise NULL
+// (and tokens are scanned on demand)
+static _Thread_local TokenBuffer *scannedTokens;
 
 /**
- * Get the current chunk bring compiled (handled as global variable in this
- * file)*/
-static Chunk *currentChunk() { return compilingChunk; }
+ * Get the chunk of the function (or script) being compiled */
+static Chunk *currentChunk() { return current->chunk; }
 
 /**
  * Print an error message for a particular token
@@ -59,17 +120,17 @@ static void errorAt(Token *token, const char *message) {
   if (parser.panicMode)
     return;
   parser.panicMode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(vm->errors, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(vm->errors, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Intentionally empty
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(vm->errors, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  fprintf(vm->errors, ": %s\n", message);
   parser.hadError = true;
 }
 
@@ -93,7 +154,8 @@ static void advance() {
   parser.previous = parser.current;
 
   for (;;) {
-    parser.current = scanToken();
+    parser.current = scannedTokens != NULL ? readToken(scannedTokens)
+                                           : scanToken();
     if (parser.current.type != TOKEN_ERROR)
       break;
 
@@ -101,6 +163,21 @@ static void advance() {
   }
 }
 
+/**
+ * Check if the current token has the given type (without consuming it) */
+static bool check(TokenType type) { return parser.current.type == type; }
+
+/**
+ * Consume the current token if it has the given type
+ *
+ * @returns True if the token was consumed */
+static bool match(TokenType type) {
+  if (!check(type))
+    return false;
+  advance();
+  return true;
+}
+
 /**
  * Consume the expected next token, if the type is incorrect generate an error
  *
@@ -130,9 +207,70 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+/**
+ * Emit an instruction with a 16 bit operand (stored big endian) */
+static void emitShort(uint8_t instruction, uint16_t operand) {
+  emitByte(instruction);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
+/**
+ * Emit the operand numbering a new inline cache in the current chunk (see
+ * initCaches) */
+static void emitCache() {
+  if (current->cacheCount > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+    return;
+  }
+  emitByte((current->cacheCount >> 8) & 0xff);
+  emitByte(current->cacheCount & 0xff);
+  current->cacheCount++;
+}
+
+/**
+ * Emit a jump instruction with a placeholder offset, to be patched once the
+ * target is known
+ *
+ * @returns Offset of the jump's operand */
+static int emitJump(uint8_t instruction) {
+  emitByte(instruction);
+  emitByte(0xff);
+  emitByte(0xff);
+  emitByte(0xff);
+  emitByte(0xff);
+  return currentChunk()->count - 4;
+}
+
+/**
+ * Write a 32 bit jump offset (stored big endian) */
+static void writeJumpOffset(uint8_t *operand, uint32_t jump) {
+  operand[0] = (jump >> 24) & 0xff;
+  operand[1] = (jump >> 16) & 0xff;
+  operand[2] = (jump >> 8) & 0xff;
+  operand[3] = jump & 0xff;
+}
+
+/**
+ * Make a jump emitted by emitJump land on the next instruction emitted
+ *
+ * @param offset Offset of the jump's operand */
+static void patchJump(int offset) {
+  // Offsets are relative to the end of the operand. Chunks are indexed with
+  // an int, so any jump within one fits in 32 bits
+  uint32_t jump = (uint32_t)(currentChunk()->count - offset - 4);
+  writeJumpOffset(&currentChunk()->code[offset], jump);
+  parser.jumpTarget = currentChunk()->count;
+}
+
 /**
  * Add a return byte to the chunk*/
-static void emitReturn() { emitByte(OP_RETURN); }
+static void emitReturn() {
+  // An initializer always returns the instance
+  if (current->type == TYPE_INITIALIZER)
+    emitBytes(OP_GET_LOCAL, 0);
+  emitByte(OP_RETURN);
+}
 
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
@@ -149,24 +287,192 @@ static uint8_t makeConstant(Value value) {
  *
  * @param value Value being added to the chunk */
 static void emitConstant(Value value) {
+  parser.constantAt = currentChunk()->count;
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * Check whether the operand just compiled is a constant, so its truthiness is
+ * known at compile time
+ *
+ * @param truthy Set to whether the constant is truthy
+ *
+ * @returns False if the operand's value isn't known */
+static bool constantOperand(bool *truthy) {
+  Chunk *chunk = currentChunk();
+  int at = parser.constantAt;
+  // A jump landing at the end of the operand means the value can also come
+  // from somewhere else, e.g. (a and 1)
+  if (at < 0 || parser.jumpTarget == chunk->count)
+    return false;
+  switch (chunk->code[at]) {
+  case OP_CONSTANT:
+    // Numbers, strings and arrays are always truthy
+    *truthy = true;
+    return at + 2 == chunk->count;
+  case OP_TRUE:
+    *truthy = true;
+    return at + 1 == chunk->count;
+  case OP_FALSE:
+  case OP_NIL:
+    *truthy = false;
+    return at + 1 == chunk->count;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Get the offset a jump instruction lands on */
+static int jumpDestination(Chunk *chunk, int offset) {
+  uint8_t *operand = &chunk->code[offset + 1];
+  uint32_t jump = ((uint32_t)operand[0] << 24) | ((uint32_t)operand[1] << 16) |
+                  ((uint32_t)operand[2] << 8) | operand[3];
+  return offset + 5 + (int)jump;
+}
+
+/**
+ * Thread jumps that land on other jumps straight through to where control
+ * ends up, so a chain of and/or short-circuits in a single jump.
+ *
+ * A conditional jump tests the value it leaves on the stack, so one landing
+ * on a jump testing the same condition is certain to be taken again, and one
+ * landing on a jump testing the opposite condition is certain to fall
+ * through it. */
+static void threadJumps(Chunk *chunk) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    uint8_t instruction = chunk->code[offset];
+    if (!isJump(instruction))
+      continue;
+
+    // Jumps only go forward, so following them always terminates
+    int target = jumpDestination(chunk, offset);
+    for (;;) {
+      uint8_t next = chunk->code[target];
+      if (next == OP_JUMP ||
+          (next == instruction && instruction != OP_JUMP)) {
+        target = jumpDestination(chunk, target);
+      } else if (instruction != OP_JUMP &&
+                 (next == OP_JUMP_IF_FALSE || next == OP_JUMP_IF_TRUE)) {
+        target += 5;
+      } else {
+        break;
+      }
+    }
+    writeJumpOffset(&chunk->code[offset + 1], (uint32_t)(target - offset - 5));
+  }
+}
+
+/**
+ * Find the most values the code from start on holds on the stack at once.
+ * Jumps only skip over code that leaves the stack as deep as they found it,
+ * so the code can be followed straight through.
+ *
+ * @param depth Number of values on the stack at start */
+static int stackDepth(int start, int depth) {
+  Chunk *chunk = currentChunk();
+  int deepest = depth;
+  for (int offset = start; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    // OP_MAP keeps the new map above its pairs while it fills it
+    if (chunk->code[offset] == OP_MAP && depth + 1 > deepest)
+      deepest = depth + 1;
+    depth += stackEffect(chunk, offset);
+    if (depth > deepest)
+      deepest = depth;
+  }
+  return deepest;
+}
+
+/**
+ * Check that the code of a statement never holds more values than fit in a
+ * frame, which isn't checked while running */
+static void checkStackDepth(int start) {
+  if (stackDepth(start, current->localCount) > FRAME_SLOTS)
+    error("Expression needs too many values at once.");
+}
+
+/**
+ * Start compiling a function (or the script), making it the current one
+ *
+ * @param function Function being compiled, NULL for the script
+ * @param type What's being compiled
+ * @param chunk Chunk to write the code to */
+static void initCompiler(Compiler *compiler, ObjFunction *function,
+                         FunctionType type, Chunk *chunk) {
+  compiler->enclosing = current;
+  compiler->function = function;
+  compiler->type = type;
+  compiler->chunk = chunk;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  compiler->nesting = current != NULL ? current->nesting + 1 : 0;
+  compiler->cacheCount = 0;
+  current = compiler;
+
+  // A call's first slot holds the callee, which has no name, except that a
+  // method's holds the instance
+  if (type != TYPE_SCRIPT) {
+    Local *local = &compiler->locals[compiler->localCount++];
+    local->depth = 0;
+    if (type == TYPE_FUNCTION) {
+      local->name.start = "";
+      local->name.length = 0;
+    } else {
+      local->name.start = "this";
+      local->name.length = 4;
+    }
+  }
+}
+
 /**
  * End of compilation cleanup/token emission */
 static void endCompiler() {
+  // A final expression statement leaves its value on the stack instead, as
+  // the result of the script
+  if (parser.resultPop == currentChunk()->count)
+    currentChunk()->count--;
   emitReturn();
+  if (!parser.hadError) {
+    threadJumps(currentChunk());
+    initCaches(currentChunk());
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     dissasembleChunk(currentChunk(), "code");
   }
 #endif // !DEBUG_PRINT_CODE
+  current = current->enclosing;
+}
+
+/**
+ * Finish compiling a function, returning to its enclosing compiler */
+static void endFunction() {
+  // Falling off the end returns nil (or the instance, from an initializer)
+  if (current->type != TYPE_INITIALIZER)
+    emitByte(OP_NIL);
+  emitReturn();
+  ObjFunction *function = current->function;
+  if (!parser.hadError) {
+    threadJumps(currentChunk());
+    initCaches(currentChunk());
+    // Lets a call check the stack once, for everything the body pushes
+    function->maxSlots = stackDepth(0, 1 + function->arity);
+  }
+  current = current->enclosing;
 }
 
 // Forward declarations
 /**
  * Parse an expression into bytecode */
 static void expression();
+/**
+ * Parse a statement into bytecode */
+static void statement();
+/**
+ * Parse a declaration (or statement) into bytecode */
+static void declaration();
 /**
  * Get the rule for parsing a particular token type */
 static ParseRule *getRule(TokenType type);
@@ -175,10 +481,14 @@ static ParseRule *getRule(TokenType type);
  *
  * @param precedence Minimum precedence to parse*/
 static void parsePrecedence(Precedence precedence);
+/**
+ * Parse the infix operators following an already compiled operand, with at
+ * least precedence */
+static void parseInfix(Precedence precedence, bool canAssign);
 
 /**
  * Parse a binary expression into bytecode */
-static void binary() {
+static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
   parsePrecedence((Precedence)(rule->precedence + 1));
@@ -219,7 +529,8 @@ static void binary() {
   }
 }
 
-static void literal() {
+static void literal(bool canAssign) {
+  parser.constantAt = currentChunk()->count;
   switch (parser.previous.type) {
   case TOKEN_FALSE:
     emitByte(OP_FALSE);
@@ -235,23 +546,314 @@ static void literal() {
   }
 }
 
+/**
+ * Compile the right operand of and/or, when the left one is a constant that
+ * decides the result without it. The operand still has to be parsed, but its
+ * code is dropped, leaving the left constant as the value. */
+static void skipOperand(Precedence precedence) {
+  Chunk *chunk = currentChunk();
+  int count = chunk->count;
+  int constantAt = parser.constantAt;
+  int jumpTarget = parser.jumpTarget;
+  parsePrecedence(precedence);
+  chunk->count = count;
+  parser.constantAt = constantAt;
+  parser.jumpTarget = jumpTarget;
+}
+
+/**
+ * Compile a short-circuiting and, which only evaluates its right operand if
+ * the left one is truthy */
+static void and_(bool canAssign) {
+  bool truthy;
+  if (constantOperand(&truthy)) {
+    if (truthy) {
+      // true and b is b
+      currentChunk()->count = parser.constantAt;
+      parsePrecedence(PREC_AND);
+    } else {
+      skipOperand(PREC_AND);
+    }
+    return;
+  }
+
+  int endJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_AND);
+  patchJump(endJump);
+}
+
+/**
+ * Compile a short-circuiting or, which only evaluates its right operand if
+ * the left one is falsey */
+static void or_(bool canAssign) {
+  bool truthy;
+  if (constantOperand(&truthy)) {
+    if (truthy) {
+      skipOperand(PREC_OR);
+    } else {
+      // false or b is b
+      currentChunk()->count = parser.constantAt;
+      parsePrecedence(PREC_OR);
+    }
+    return;
+  }
+
+  int endJump = emitJump(OP_JUMP_IF_TRUE);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_OR);
+  patchJump(endJump);
+}
+
 /**
  * Handle parantheses grouping expression together */
-static void grouping() {
+static void grouping(bool canAssign) {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 /**
  * Compile a number expression into bytecode */
-static void number() {
-  double value = strtod(parser.previous.start, NULL);
+static void number(bool canAssign) {
+  // Integral literals stay exact as integers, as long as they fit
+  int64_t integer;
+  if (parseInteger(parser.previous.start, parser.previous.length, &integer)) {
+    emitConstant(INT_VAL(integer));
+    return;
+  }
+  double value = parseNumber(parser.previous.start, parser.previous.length);
   emitConstant(NUMBER_VAL(value));
 }
 
+/**
+ * Compile a string literal into bytecode */
+static void string(bool canAssign) {
+  // Strip the quotes
+  emitConstant(copyString(parser.previous.start + 1,
+                          parser.previous.length - 2));
+}
+
+/**
+ * Resolve an identifier to its global slot
+ *
+ * @param name Identifier token naming the global
+ *
+ * @returns Index of the slot */
+static uint16_t identifierSlot(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot < 0) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
+/**
+ * Add an identifier's name to the constants (reusing the constant if the
+ * name is already one, since every property access names one)
+ *
+ * @returns Index of the constant */
+static uint8_t identifierConstant(Token *name) {
+  Value string = copyString(name->start, name->length);
+  ValueArray *constants = &currentChunk()->constants;
+  for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+    // Names are never ropes, and equal strings are the same value
+    if (IS_STRING(constants->values[i]) &&
+        valuesEqual(constants->values[i], string))
+      return (uint8_t)i;
+  }
+  return makeConstant(string);
+}
+
+/**
+ * Check if two identifiers are the same name */
+static bool identifiersEqual(Token *a, Token *b) {
+  return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+/**
+ * Resolve an identifier to the slot of a local in a function's frame
+ *
+ * @returns Index of the slot, or -1 if it isn't one of the function's
+ * locals */
+static int resolveLocal(Compiler *compiler, Token *name) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1)
+        error("Can't read local variable in its own initializer.");
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Compile a read of (or assignment to) a named variable */
+static void namedVariable(Token name, bool canAssign) {
+  int local = resolveLocal(current, &name);
+  if (local != -1) {
+    if (canAssign && match(TOKEN_EQUAL)) {
+      expression();
+      emitBytes(OP_SET_LOCAL, (uint8_t)local);
+    } else {
+      emitBytes(OP_GET_LOCAL, (uint8_t)local);
+    }
+    return;
+  }
+
+  // There are no closures, a function only sees its own locals
+  for (Compiler *compiler = current->enclosing; compiler != NULL;
+       compiler = compiler->enclosing) {
+    if (resolveLocal(compiler, &name) != -1) {
+      error("Can't use a local variable of an enclosing function.");
+      return;
+    }
+  }
+
+  uint16_t slot = identifierSlot(&name);
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitShort(OP_SET_GLOBAL, slot);
+  } else {
+    emitShort(OP_GET_GLOBAL, slot);
+  }
+}
+
+/**
+ * Compile a call of a native array reduction, such as sum(a)
+ *
+ * The reductions are built in, so a call of one of their names always means
+ * the reduction (the names are still free to use for variables, but not to
+ * call).
+ *
+ * @returns False if the identifier just consumed isn't a reduction */
+static bool reduction() {
+  static const struct {
+    const char *name; //! Name of the reduction
+    OpCode opcode;    //! Instruction computing it
+    int arity;        //! Number of arrays it takes
+  } reductions[] = {
+      {"sum", OP_SUM, 1},
+      {"min", OP_MIN, 1},
+      {"max", OP_MAX, 1},
+      {"dot", OP_DOT, 2},
+  };
+
+  for (size_t i = 0; i < sizeof(reductions) / sizeof(reductions[0]); i++) {
+    if (parser.previous.length != (int)strlen(reductions[i].name) ||
+        memcmp(parser.previous.start, reductions[i].name,
+               parser.previous.length) != 0)
+      continue;
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after reduction name.");
+    expression();
+    for (int argument = 1; argument < reductions[i].arity; argument++) {
+      consume(TOKEN_COMMA, "Expect ',' between arguments.");
+      expression();
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    emitByte(reductions[i].opcode);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Compile a variable expression */
+static void variable(bool canAssign) {
+  if (check(TOKEN_LEFT_PAREN) && reduction())
+    return;
+  namedVariable(parser.previous, canAssign);
+}
+
+/**
+ * Compile the arguments of a call
+ *
+ * @returns Number of arguments */
+static uint8_t argumentList() {
+  int argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      expression();
+      if (argCount == FRAME_SLOTS - 1)
+        error("Can't have more than 255 arguments.");
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return (uint8_t)argCount;
+}
+
+/**
+ * Compile a call, whose callee is already on the stack */
+static void call(bool canAssign) {
+  uint8_t argCount = argumentList();
+  emitBytes(OP_CALL, argCount);
+}
+
+/**
+ * Compile a property access, set or method call, whose receiver is already
+ * on the stack. A call right after the name is compiled as a single invoke,
+ * so the method isn't bound just to be called. */
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitBytes(OP_SET_PROPERTY, name);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    emitBytes(OP_INVOKE, name);
+    emitByte(argCount);
+  } else {
+    emitBytes(OP_GET_PROPERTY, name);
+  }
+  emitCache();
+}
+
+/**
+ * Compile this, the instance a method was called on */
+static void this_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return;
+  }
+  // this can't be assigned to
+  namedVariable(parser.previous, false);
+}
+
+/**
+ * Compile a superclass method access or call, e.g. super.init(x) */
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  // The method is looked up from the superclass of the method's own class
+  // (see OP_GET_SUPER), and bound to this
+  Token self = {.type = TOKEN_THIS, .start = "this", .length = 4,
+                .line = parser.previous.line};
+  namedVariable(self, false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    emitBytes(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+  } else {
+    emitBytes(OP_GET_SUPER, name);
+  }
+  emitCache();
+}
+
 /**
  * Compile a unary expression */
-static void unary() {
+static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
 
   // Compile the operand of the unary operator
@@ -268,13 +870,124 @@ static void unary() {
     return;
   }
 }
+
+/**
+ * Compile an array literal, e.g. [1, 2, x * 3]
+ *
+ * An array of number literals is created while compiling and becomes a
+ * single constant. Otherwise the elements are pushed and packed by
+ * OP_ARRAY. */
+static void arrayLiteral(bool canAssign) {
+  // Leading number literals, until an element turns out not to be one
+  double *literals = NULL;
+  int literalCount = 0;
+  int literalCapacity = 0;
+  bool allLiterals = true;
+  int count = 0;
+
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      count++;
+      if (!allLiterals) {
+        expression();
+        continue;
+      }
+
+      bool negate = match(TOKEN_MINUS);
+      if (match(TOKEN_NUMBER) &&
+          (check(TOKEN_COMMA) || check(TOKEN_RIGHT_BRACKET))) {
+        if (literalCapacity < literalCount + 1) {
+          int oldCapacity = literalCapacity;
+          literalCapacity = GROW_CAPACITY(oldCapacity);
+          literals = GROW_ARRAY(double, literals, oldCapacity, literalCapacity);
+        }
+        double value =
+            parseNumber(parser.previous.start, parser.previous.length);
+        literals[literalCount++] = negate ? -value : value;
+        continue;
+      }
+
+      // Not a literal, the ones collected so far are pushed ahead of it
+      allLiterals = false;
+      for (int i = 0; i < literalCount; i++) {
+        emitConstant(NUMBER_VAL(literals[i]));
+      }
+      if (parser.previous.type == TOKEN_NUMBER) {
+        // A longer expression starting with a literal, e.g. 2 * x
+        number(true);
+        if (negate)
+          emitByte(OP_NEGATE);
+        parseInfix(PREC_ASSIGNMENT, true);
+      } else if (negate) {
+        unary(true);
+        parseInfix(PREC_ASSIGNMENT, true);
+      } else {
+        expression();
+      }
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+
+  if (allLiterals) {
+    ObjArray *array = newArray(literalCount);
+    if (literalCount > 0)
+      memcpy(array->elements, literals, sizeof(double) * literalCount);
+    emitConstant(OBJ_VAL(array));
+  } else if (count > UINT8_MAX) {
+    error("Too many elements in array literal.");
+  } else {
+    emitBytes(OP_ARRAY, (uint8_t)count);
+  }
+  FREE_ARRAY(double, literals, literalCapacity);
+}
+
+/**
+ * Compile a map literal, e.g. {"a": 1, "b": x * 2}
+ *
+ * Each key is pushed followed by its value, then OP_MAP adds the pairs to a
+ * new map in order (a repeated key keeps its last value). */
+static void mapLiteral(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      expression();
+      consume(TOKEN_COLON, "Expect ':' after map key.");
+      expression();
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+
+  if (count > UINT8_MAX) {
+    error("Too many entries in map literal.");
+  } else {
+    emitBytes(OP_MAP, (uint8_t)count);
+  }
+}
+
+/**
+ * Compile an index expression or assignment, whose map is already on the
+ * stack, e.g. m[key] or m[key] = value */
+static void index_(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
+  }
+}
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {arrayLiteral, index_, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -288,10 +1001,10 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_STRING] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+    [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
@@ -299,11 +1012,11 @@ ParseRule rules[] = {
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -312,6 +1025,12 @@ ParseRule rules[] = {
 };
 
 static void parsePrecedence(Precedence precedence) {
+  if (parser.depth == MAX_NESTING) {
+    errorAtCurrent("Expression nested too deeply.");
+    return;
+  }
+  parser.depth++;
+
   // Prime the pump (move a token into previous, since that will first be
   // evaluated as a unary)
   advance();
@@ -325,16 +1044,28 @@ static void parsePrecedence(Precedence precedence) {
   ParseFn prefixRule = getRule(parser.previous.type)->prefix;
   if (prefixRule == NULL) {
     error("Expect expression.");
+    parser.depth--;
     return;
   }
 
-  prefixRule();
+  // Only a variable parsed at the lowest precedence can be assigned to, in
+  // a * b = c the b is not an assignment target
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(canAssign);
+  parseInfix(precedence, canAssign);
+  parser.depth--;
+}
 
+static void parseInfix(Precedence precedence, bool canAssign) {
   // Parse infix expression
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule();
+    infixRule(canAssign);
+  }
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    error("Invalid assignment target.");
   }
 }
 
@@ -343,18 +1074,368 @@ static ParseRule *getRule(TokenType type) { return &rules[type]; }
 static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
 /**
- * Parse an expression into bytecode */
+ * Add a local variable to the current scope (it can't be read until it's
+ * marked initialized) */
+static void declareLocal(Token name) {
+  for (int i = current->localCount - 1; i >= 0; i--) {
+    Local *local = &current->locals[i];
+    if (local->depth != -1 && local->depth < current->scopeDepth)
+      break;
+    if (identifiersEqual(&name, &local->name))
+      error("Already a variable with this name in this scope.");
+  }
+
+  if (current->localCount == FRAME_SLOTS) {
+    error("Too many local variables in function.");
+    return;
+  }
+  Local *local = &current->locals[current->localCount++];
+  local->name = name;
+  local->depth = -1;
+}
+
+/**
+ * Make the local declared last readable */
+static void markInitialized() {
+  current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+static void beginScope() { current->scopeDepth++; }
+
+/**
+ * Leave a block, discarding the locals declared in it */
+static void endScope() {
+  current->scopeDepth--;
+  while (current->localCount > 0 &&
+         current->locals[current->localCount - 1].depth >
+             current->scopeDepth) {
+    emitByte(OP_POP);
+    current->localCount--;
+  }
+}
+
+/**
+ * Compile the declarations of a block, up to its closing brace */
+static void block() {
+  if (parser.depth == MAX_NESTING) {
+    errorAtCurrent("Blocks nested too deeply.");
+    return;
+  }
+  parser.depth++;
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    declaration();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  parser.depth--;
+}
+
+/**
+ * Compile a function's parameters and body, leaving the function on the
+ * stack
+ *
+ * @param name Name of the function
+ * @param type Kind of function (a plain function or a method) */
+static void function(Token name, FunctionType type) {
+  if (current->nesting == MAX_FUNCTION_NESTING) {
+    error("Functions nested too deeply.");
+    return;
+  }
+  // The function is reachable through the compiler before anything else is
+  // allocated
+  Compiler compiler;
+  ObjFunction *function = newFunction();
+  initCompiler(&compiler, function, type, &function->chunk);
+  function->name = copyString(name.start, name.length);
+
+  // What the parser tracks about the enclosing chunk's code picks up again
+  // after the body
+  int resultPop = parser.resultPop;
+  int constantAt = parser.constantAt;
+  int jumpTarget = parser.jumpTarget;
+  parser.resultPop = -1;
+  parser.constantAt = -1;
+  parser.jumpTarget = -1;
+
+  beginScope();
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      if (current->function->arity == FRAME_SLOTS - 1)
+        errorAtCurrent("Can't have more than 255 parameters.");
+      current->function->arity++;
+      consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+      declareLocal(parser.previous);
+      markInitialized();
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block();
+  endFunction();
+#ifdef DEBUG_PRINT_CODE
+  if (!parser.hadError) {
+    char title[64];
+    snprintf(title, sizeof(title), "%.*s", name.length, name.start);
+    dissasembleChunk(&function->chunk, title);
+  }
+#endif // !DEBUG_PRINT_CODE
+
+  parser.resultPop = resultPop;
+  parser.constantAt = constantAt;
+  parser.jumpTarget = jumpTarget;
+  emitConstant(OBJ_VAL(function));
+}
+
+/**
+ * Compile a function declaration, a global at the top level and otherwise a
+ * local */
+static void funDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect function name.");
+  Token name = parser.previous;
+  if (current->scopeDepth == 0) {
+    uint16_t slot = identifierSlot(&name);
+    function(name, TYPE_FUNCTION);
+    emitShort(OP_DEFINE_GLOBAL, slot);
+    return;
+  }
+
+  // In scope in its own body, where using it is reported (no closures)
+  declareLocal(name);
+  markInitialized();
+  function(name, TYPE_FUNCTION);
+}
+
+/**
+ * Compile a method of the class on top of the stack */
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  Token name = parser.previous;
+  uint8_t constant = identifierConstant(&name);
+  FunctionType type = name.length == 4 && memcmp(name.start, "init", 4) == 0
+                          ? TYPE_INITIALIZER
+                          : TYPE_METHOD;
+  function(name, type);
+  emitBytes(OP_METHOD, constant);
+}
+
+/**
+ * Compile a class declaration, a global at the top level and otherwise a
+ * local */
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  uint8_t nameConstant = identifierConstant(&className);
+  bool global = current->scopeDepth == 0;
+  uint16_t slot = 0;
+  if (global) {
+    slot = identifierSlot(&className);
+  } else {
+    declareLocal(className);
+  }
+  emitBytes(OP_CLASS, nameConstant);
+  if (global) {
+    emitShort(OP_DEFINE_GLOBAL, slot);
+  } else {
+    markInitialized();
+  }
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = currentClass;
+  classCompiler.hasSuperclass = false;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    if (identifiersEqual(&className, &parser.previous))
+      error("A class can't inherit from itself.");
+    namedVariable(parser.previous, false);
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  // The class stays on the stack while its methods are added
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    method();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  currentClass = currentClass->enclosing;
+}
+
+/**
+ * Compile a variable declaration, with an optional initializer. Variables
+ * are globals at the top level, and locals in a block or function. */
+static void varDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect variable name.");
+  Token name = parser.previous;
+  bool global = current->scopeDepth == 0;
+  uint16_t slot = 0;
+  if (global) {
+    slot = identifierSlot(&name);
+  } else {
+    declareLocal(name);
+  }
+
+  if (match(TOKEN_EQUAL)) {
+    expression();
+  } else {
+    emitByte(OP_NIL);
+  }
+  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  // A local is simply the initializer's value, left in its slot
+  if (global) {
+    emitShort(OP_DEFINE_GLOBAL, slot);
+  } else {
+    markInitialized();
+  }
+}
+
+/**
+ * Compile an expression statement (evaluated for its side effects) */
+static void expressionStatement() {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(OP_POP);
+  parser.resultPop = currentChunk()->count;
+}
+
+/**
+ * Compile a return statement */
+static void returnStatement() {
+  if (current->function == NULL)
+    error("Can't return from top-level code.");
+
+  if (match(TOKEN_SEMICOLON)) {
+    if (current->type != TYPE_INITIALIZER)
+      emitByte(OP_NIL);
+  } else {
+    if (current->type == TYPE_INITIALIZER)
+      error("Can't return a value from an initializer.");
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+  }
+  emitReturn();
+}
+
+/**
+ * Compile a print statement */
+static void printStatement() {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(OP_PRINT);
+}
+
+/**
+ * Skip tokens until a likely statement boundary, to leave panic mode after an
+ * error without reporting cascading errors */
+static void synchronize() {
+  parser.panicMode = false;
+
+  while (parser.current.type != TOKEN_EOF) {
+    if (parser.previous.type == TOKEN_SEMICOLON)
+      return;
+    switch (parser.current.type) {
+    case TOKEN_CLASS:
+    case TOKEN_FUN:
+    case TOKEN_VAR:
+    case TOKEN_FOR:
+    case TOKEN_IF:
+    case TOKEN_WHILE:
+    case TOKEN_PRINT:
+    case TOKEN_RETURN:
+      return;
+    default:; // Do nothing
+    }
+
+    advance();
+  }
+}
+
+static void declaration() {
+  int start = currentChunk()->count;
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
+    funDeclaration();
+  } else if (match(TOKEN_VAR)) {
+    varDeclaration();
+  } else {
+    statement();
+  }
+
+  // Checked once for each statement of the script or a function body, which
+  // covers the blocks inside it
+  int outermost = current->function == NULL ? 0 : 1;
+  if (!parser.panicMode && current->scopeDepth == outermost)
+    checkStackDepth(start);
+  if (parser.panicMode)
+    synchronize();
+}
+
+static void statement() {
+  if (match(TOKEN_PRINT)) {
+    printStatement();
+  } else if (match(TOKEN_RETURN)) {
+    returnStatement();
+  } else if (match(TOKEN_LEFT_BRACE)) {
+    beginScope();
+    block();
+    endScope();
+  } else {
+    expressionStatement();
+  }
+}
 
 bool compile(const char *source, Chunk *chunk) {
-  initScanner(source);
-  compilingChunk = chunk;
+  // Large sources are scanned in parallel before parsing
+  size_t length = strlen(source);
+  TokenBuffer tokens;
+  scannedTokens = NULL;
+  if (length >= SCAN_PARALLEL_MIN && scanTokens(source, length, &tokens)) {
+    scannedTokens = &tokens;
+  } else {
+    initScanner(source);
+  }
+  Compiler compiler;
+  current = NULL;
+  currentClass = NULL;
+  initCompiler(&compiler, NULL, TYPE_SCRIPT, chunk);
 
   parser.hadError = false;
   parser.panicMode = false;
+  parser.resultPop = -1;
+  parser.constantAt = -1;
+  parser.jumpTarget = -1;
+  parser.depth = 0;
 
   advance();
-  expression();
-  consume(TOKEN_EOF, "Expect end of expression.");
+  while (!match(TOKEN_EOF)) {
+    declaration();
+  }
   endCompiler();
+  if (scannedTokens != NULL) {
+    freeTokens(scannedTokens);
+    scannedTokens = NULL;
+  }
   return !parser.hadError;
 }
+
+void markCompilerRoots() {
+  // Nothing else references the functions being compiled yet, and constants
+  // are added to them without a barrier
+  for (Compiler *compiler = current; compiler != NULL;
+       compiler = compiler->enclosing) {
+    if (compiler->function != NULL) {
+      markObject((Obj *)compiler->function);
+      markValue(compiler->function->name);
+    }
+    for (int i = 0; i < compiler->chunk->constants.count; i++) {
+      markValue(compiler->chunk->constants.values[i]);
+    }
+  }
+}
@@ -5,6 +5,7 @@
 #include "chunk.h"
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 void dissasembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -29,6 +30,102 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+const char *opcodeName(uint8_t opcode) {
+  static const char *names[] = {
+      [OP_CONSTANT] = "OP_CONSTANT",
+      [OP_NIL] = "OP_NIL",
+      [OP_TRUE] = "OP_TRUE",
+      [OP_FALSE] = "OP_FALSE",
+      [OP_POP] = "OP_POP",
+      [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+      [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+      [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+      [OP_GET_LOCAL] = "OP_GET_LOCAL",
+      [OP_SET_LOCAL] = "OP_SET_LOCAL",
+      [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+      [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+      [OP_EQUAL] = "OP_EQUAL",
+      [OP_GREATER] = "OP_GREATER",
+      [OP_LESS] = "OP_LESS",
+      [OP_ADD] = "OP_ADD",
+      [OP_SUBTRACT] = "OP_SUBTRACT",
+      [OP_MULTIPLY] = "OP_MULTIPLY",
+      [OP_DIVIDE] = "OP_DIVIDE",
+      [OP_NOT] = "OP_NOT",
+      [OP_NEGATE] = "OP_NEGATE",
+      [OP_PRINT] = "OP_PRINT",
+      [OP_JUMP] = "OP_JUMP",
+      [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+      [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+      [OP_ARRAY] = "OP_ARRAY",
+      [OP_SUM] = "OP_SUM",
+      [OP_MIN] = "OP_MIN",
+      [OP_MAX] = "OP_MAX",
+      [OP_DOT] = "OP_DOT",
+      [OP_MAP] = "OP_MAP",
+      [OP_GET_INDEX] = "OP_GET_INDEX",
+      [OP_SET_INDEX] = "OP_SET_INDEX",
+      [OP_CALL] = "OP_CALL",
+      [OP_INVOKE] = "OP_INVOKE",
+      [OP_GET_SUPER] = "OP_GET_SUPER",
+      [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+      [OP_CLASS] = "OP_CLASS",
+      [OP_INHERIT] = "OP_INHERIT",
+      [OP_METHOD] = "OP_METHOD",
+      [OP_RETURN] = "OP_RETURN",
+  };
+  if (opcode >= sizeof(names) / sizeof(names[0]) || names[opcode] == NULL)
+    return "OP_UNKNOWN";
+  return names[opcode];
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                             chunk->code[offset + 2]);
+  printf("%-16s %4d", name, slot);
+  // Names are only known when dissasembling in the VM that compiled the code
+  if (slot < vm->globalNames.count) {
+    printf(" '");
+    printValue(vm->globalNames.values[slot]);
+    printf("'");
+  }
+  printf("\n");
+  return offset + 3;
+}
+
+static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t operand = chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, operand);
+  return offset + 2;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+static int jumpInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t *operand = &chunk->code[offset + 1];
+  uint32_t jump = ((uint32_t)operand[0] << 24) | ((uint32_t)operand[1] << 16) |
+                  ((uint32_t)operand[2] << 8) | operand[3];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 5 + (int)jump);
+  return offset + 5;
+}
+
 int dissasembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -47,6 +144,22 @@ int dissasembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_TRUE", offset);
   case OP_FALSE:
     return simpleInstruction("OP_FALSE", offset);
+  case OP_POP:
+    return simpleInstruction("OP_POP", offset);
+  case OP_DEFINE_GLOBAL:
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL:
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL:
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_GET_LOCAL:
+    return byteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL:
+    return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_GET_PROPERTY:
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_SET_PROPERTY:
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -65,6 +178,44 @@ int dissasembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_NOT", offset);
   case OP_NEGATE:
     return simpleInstruction("OP_NEGATE", offset);
+  case OP_PRINT:
+    return simpleInstruction("OP_PRINT", offset);
+  case OP_JUMP:
+    return jumpInstruction("OP_JUMP", chunk, offset);
+  case OP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
+  case OP_JUMP_IF_TRUE:
+    return jumpInstruction("OP_JUMP_IF_TRUE", chunk, offset);
+  case OP_ARRAY:
+    return byteInstruction("OP_ARRAY", chunk, offset);
+  case OP_SUM:
+    return simpleInstruction("OP_SUM", offset);
+  case OP_MIN:
+    return simpleInstruction("OP_MIN", offset);
+  case OP_MAX:
+    return simpleInstruction("OP_MAX", offset);
+  case OP_DOT:
+    return simpleInstruction("OP_DOT", offset);
+  case OP_MAP:
+    return byteInstruction("OP_MAP", chunk, offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_GET_INDEX", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_SET_INDEX", offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", chunk, offset);
+  case OP_INVOKE:
+    return invokeInstruction("OP_INVOKE", chunk, offset);
+  case OP_GET_SUPER:
+    return propertyInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_SUPER_INVOKE:
+    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_CLASS:
+    return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_INHERIT:
+    return simpleInstruction("OP_INHERIT", offset);
+  case OP_METHOD:
+    return constantInstruction("OP_METHOD", chunk, offset);
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
   default:
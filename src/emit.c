@@ -0,0 +1,743 @@
+// Std library includes
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Local Includes
+#include "chunk.h"
+#include "emit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * What the translation knows about the value in a stack slot
+ * */
+typedef enum {
+  TYPE_UNKNOWN, //! Could be anything
+  TYPE_NIL,     //! Always nil
+  TYPE_BOOL,    //! Always a boolean
+  TYPE_INT,     //! Always an integer
+  TYPE_DOUBLE,  //! Always a double
+  TYPE_NUMBER,  //! An integer or a double
+} StaticType;
+
+/**
+ * Whether a check holds, when that's known without testing it at run time
+ * */
+typedef enum {
+  NEVER,  //! Known not to hold
+  MAYBE,  //! Has to be tested
+  ALWAYS, //! Known to hold
+} Certainty;
+
+/**
+ * An if/else chain over the cases of an instruction, ending with the
+ * interpreter executing the instruction if no case applies
+ * */
+typedef struct {
+  FILE *file;  //! File the C source is written to
+  int cases;   //! Number of tested cases emitted so far
+  bool closed; //! Whether a case that always applies ended the chain
+} Chain;
+
+// Longest C statement or test written for a single case
+#define CASE_MAX 160
+// Longest C expression reading an operand
+#define OPERAND_MAX 40
+// Instructions after which the script moves on to a new C function (at the
+// next statement), since C compilers slow down badly on huge functions
+#define PART_INSTRUCTIONS 256
+
+static bool isNumeric(StaticType type) {
+  return type == TYPE_INT || type == TYPE_DOUBLE || type == TYPE_NUMBER;
+}
+
+/**
+ * Check whether the value in a slot is an integer (or any number)
+ *
+ * @param numeric Check for any number rather than an integer */
+static Certainty slotCertainty(StaticType type, bool numeric) {
+  if (type == TYPE_INT || (numeric && isNumeric(type)))
+    return ALWAYS;
+  if (type == TYPE_UNKNOWN || (!numeric && type == TYPE_NUMBER))
+    return MAYBE;
+  return NEVER;
+}
+
+/**
+ * Check whether both operands of a binary instruction are integers (or any
+ * numbers)
+ *
+ * @param test Filled with the test to run, when it has to be tested
+ * */
+static Certainty operandCertainty(StaticType *types, int slot, bool numeric,
+                                  char *test) {
+  const char *macro = numeric ? "IS_NUMERIC" : "IS_INT";
+  Certainty a = slotCertainty(types[slot], numeric);
+  Certainty b = slotCertainty(types[slot + 1], numeric);
+  if (a == NEVER || b == NEVER)
+    return NEVER;
+  if (a == ALWAYS && b == ALWAYS)
+    return ALWAYS;
+
+  if (a == MAYBE && b == MAYBE) {
+    snprintf(test, CASE_MAX, "%s(s[%d]) && %s(s[%d])", macro, slot, macro,
+             slot + 1);
+  } else {
+    snprintf(test, CASE_MAX, "%s(s[%d])", macro, a == MAYBE ? slot : slot + 1);
+  }
+  return MAYBE;
+}
+
+/**
+ * Write the C reading the value in a slot as a double */
+static void doubleOperand(StaticType type, int slot, char *operand) {
+  switch (type) {
+  case TYPE_DOUBLE:
+    snprintf(operand, OPERAND_MAX, "AS_NUMBER(s[%d])", slot);
+    break;
+  case TYPE_INT:
+    snprintf(operand, OPERAND_MAX, "(double)AS_INT(s[%d])", slot);
+    break;
+  default:
+    snprintf(operand, OPERAND_MAX, "AS_DOUBLE(s[%d])", slot);
+    break;
+  }
+}
+
+/**
+ * Add a case to a chain
+ *
+ * @param certainty Whether the case applies
+ * @param test Test for the case, if it has to be tested
+ * @param statement C for the case */
+static void addCase(Chain *chain, Certainty certainty, const char *test,
+                    const char *statement) {
+  if (chain->closed || certainty == NEVER)
+    return;
+  if (certainty == MAYBE) {
+    fprintf(chain->file,
+            chain->cases == 0 ? "  if (%s) {\n" : "  } else if (%s) {\n", test);
+    fprintf(chain->file, "    %s\n", statement);
+    chain->cases++;
+    return;
+  }
+
+  if (chain->cases == 0) {
+    fprintf(chain->file, "  %s\n", statement);
+  } else {
+    fprintf(chain->file, "  } else {\n    %s\n  }\n", statement);
+  }
+  chain->closed = true;
+}
+
+/**
+ * End a chain, handing the instruction to the interpreter if no case
+ * applied */
+static void endChain(Chain *chain, int offset, int depth) {
+  if (chain->closed)
+    return;
+  if (chain->cases == 0) {
+    fprintf(chain->file, "  AOT_STEP(%d, %d);\n", offset, depth);
+  } else {
+    fprintf(chain->file, "  } else {\n    AOT_STEP(%d, %d);\n  }\n", offset,
+            depth);
+  }
+}
+
+/**
+ * Emit an arithmetic instruction (numbers only, other operands go to the
+ * interpreter)
+ *
+ * @param intFunction aot.h function computing the result of two integers
+ * @param op C operator computing the result of two doubles */
+static void emitArithmetic(FILE *file, StaticType *types, int offset,
+                           int depth, const char *intFunction,
+                           const char *op) {
+  int slot = depth - 2;
+  char test[CASE_MAX];
+  char statement[CASE_MAX];
+  Chain chain = {file, 0, false};
+
+  Certainty ints = operandCertainty(types, slot, false, test);
+  snprintf(statement, CASE_MAX, "s[%d] = %s(AS_INT(s[%d]), AS_INT(s[%d]));",
+           slot, intFunction, slot, slot + 1);
+  addCase(&chain, ints, test, statement);
+
+  Certainty numbers = operandCertainty(types, slot, true, test);
+  char a[OPERAND_MAX], b[OPERAND_MAX];
+  doubleOperand(types[slot], slot, a);
+  doubleOperand(types[slot + 1], slot + 1, b);
+  snprintf(statement, CASE_MAX, "s[%d] = NUMBER_VAL(%s %s %s);", slot, a, op,
+           b);
+  addCase(&chain, numbers, test, statement);
+  endChain(&chain, offset, depth);
+
+  if (numbers != ALWAYS) {
+    types[slot] = TYPE_UNKNOWN;
+  } else if (types[slot] == TYPE_DOUBLE || types[slot + 1] == TYPE_DOUBLE) {
+    types[slot] = TYPE_DOUBLE;
+  } else {
+    types[slot] = TYPE_NUMBER;
+  }
+}
+
+/**
+ * Emit a comparison instruction (numbers only, arrays go to the
+ * interpreter)
+ *
+ * @param op C operator comparing the operands */
+static void emitComparison(FILE *file, StaticType *types, int offset,
+                           int depth, const char *op) {
+  int slot = depth - 2;
+  char test[CASE_MAX];
+  char statement[CASE_MAX];
+  Chain chain = {file, 0, false};
+
+  // Integers are compared exactly, as the interpreter does
+  Certainty ints = operandCertainty(types, slot, false, test);
+  snprintf(statement, CASE_MAX,
+           "s[%d] = BOOL_VAL(AS_INT(s[%d]) %s AS_INT(s[%d]));", slot, slot, op,
+           slot + 1);
+  addCase(&chain, ints, test, statement);
+
+  // Doubles are compared as doubles, and an integer with a double exactly
+  Certainty numbers = operandCertainty(types, slot, true, test);
+  if (types[slot] == TYPE_DOUBLE && types[slot + 1] == TYPE_DOUBLE) {
+    snprintf(statement, CASE_MAX,
+             "s[%d] = BOOL_VAL(AS_NUMBER(s[%d]) %s AS_NUMBER(s[%d]));", slot,
+             slot, op, slot + 1);
+  } else {
+    snprintf(statement, CASE_MAX,
+             "s[%d] = BOOL_VAL(compareNumbers(s[%d], s[%d]) %s 0);", slot, slot,
+             slot + 1, op);
+  }
+  addCase(&chain, numbers, test, statement);
+  endChain(&chain, offset, depth);
+
+  types[slot] = numbers == ALWAYS ? TYPE_BOOL : TYPE_UNKNOWN;
+}
+
+/**
+ * Emit an equality test */
+static void emitEqual(FILE *file, StaticType *types, int depth) {
+  int slot = depth - 2;
+  StaticType a = types[slot];
+  StaticType b = types[slot + 1];
+  if (a == TYPE_INT && b == TYPE_INT) {
+    fprintf(file, "  s[%d] = BOOL_VAL(AS_INT(s[%d]) == AS_INT(s[%d]));\n",
+            slot, slot, slot + 1);
+  } else if (a == TYPE_DOUBLE && b == TYPE_DOUBLE) {
+    fprintf(file,
+            "  s[%d] = BOOL_VAL(AS_NUMBER(s[%d]) == AS_NUMBER(s[%d]));\n",
+            slot, slot, slot + 1);
+  } else if (a == TYPE_BOOL && b == TYPE_BOOL) {
+    fprintf(file, "  s[%d] = BOOL_VAL(AS_BOOL(s[%d]) == AS_BOOL(s[%d]));\n",
+            slot, slot, slot + 1);
+  } else {
+    // Comparing ropes can allocate, so the operands stay on the stack
+    fprintf(file, "  vm->stackTop = s + %d;\n", depth);
+    fprintf(file, "  s[%d] = BOOL_VAL(valuesEqual(s[%d], s[%d]));\n", slot,
+            slot, slot + 1);
+  }
+  types[slot] = TYPE_BOOL;
+}
+
+/**
+ * Emit a logical not */
+static void emitNot(FILE *file, StaticType *types, int offset, int depth) {
+  int slot = depth - 1;
+  switch (types[slot]) {
+  case TYPE_BOOL:
+    fprintf(file, "  s[%d] = BOOL_VAL(!AS_BOOL(s[%d]));\n", slot, slot);
+    return;
+  case TYPE_NIL:
+    fprintf(file, "  s[%d] = BOOL_VAL(true);\n", slot);
+    types[slot] = TYPE_BOOL;
+    return;
+  case TYPE_UNKNOWN:
+    // On an array ! works element-wise
+    fprintf(file, "  if (IS_ARRAY(s[%d])) {\n", slot);
+    fprintf(file, "    AOT_STEP(%d, %d);\n", offset, depth);
+    fprintf(file, "  } else {\n");
+    fprintf(file, "    s[%d] = BOOL_VAL(isFalsey(s[%d]));\n", slot, slot);
+    fprintf(file, "  }\n");
+    return;
+  default:
+    // Numbers are truthy
+    fprintf(file, "  s[%d] = BOOL_VAL(false);\n", slot);
+    types[slot] = TYPE_BOOL;
+    return;
+  }
+}
+
+/**
+ * Emit a negation */
+static void emitNegate(FILE *file, StaticType *types, int offset, int depth) {
+  int slot = depth - 1;
+  char test[CASE_MAX];
+  char statement[CASE_MAX];
+  Chain chain = {file, 0, false};
+
+  Certainty isInt = slotCertainty(types[slot], false);
+  snprintf(test, CASE_MAX, "IS_INT(s[%d])", slot);
+  snprintf(statement, CASE_MAX, "s[%d] = aotNegate(AS_INT(s[%d]));", slot,
+           slot);
+  addCase(&chain, isInt, test, statement);
+
+  Certainty isNumber = slotCertainty(types[slot], true);
+  snprintf(test, CASE_MAX, "IS_NUMERIC(s[%d])", slot);
+  char operand[OPERAND_MAX];
+  doubleOperand(types[slot], slot, operand);
+  snprintf(statement, CASE_MAX, "s[%d] = NUMBER_VAL(-%s);", slot, operand);
+  addCase(&chain, isNumber, test, statement);
+  endChain(&chain, offset, depth);
+
+  if (isNumber != ALWAYS) {
+    types[slot] = TYPE_UNKNOWN;
+  } else if (types[slot] == TYPE_INT) {
+    types[slot] = TYPE_NUMBER;
+  }
+}
+
+/**
+ * Emit a conditional jump
+ *
+ * @param whenFalse Whether the jump is taken on a falsey value (rather than
+ * a truthy one) */
+static void emitConditionalJump(FILE *file, StaticType *types, int depth,
+                                int target, bool whenFalse) {
+  int slot = depth - 1;
+  switch (types[slot]) {
+  case TYPE_BOOL:
+    fprintf(file, "  if (%sAS_BOOL(s[%d]))\n    goto L%d;\n",
+            whenFalse ? "!" : "", slot, target);
+    break;
+  case TYPE_UNKNOWN:
+    fprintf(file, "  if (%sisFalsey(s[%d]))\n    goto L%d;\n",
+            whenFalse ? "" : "!", slot, target);
+    break;
+  case TYPE_NIL:
+    if (whenFalse)
+      fprintf(file, "  goto L%d;\n", target);
+    break;
+  default:
+    // Numbers are truthy
+    if (!whenFalse)
+      fprintf(file, "  goto L%d;\n", target);
+    break;
+  }
+}
+
+/**
+ * Write an integer as C */
+static void emitInt(FILE *file, int64_t integer) {
+  // The literal 9223372036854775808 doesn't fit, so can't be negated
+  if (integer == INT64_MIN) {
+    fprintf(file, "INT_VAL(INT64_MIN)");
+  } else {
+    fprintf(file, "INT_VAL(INT64_C(%" PRId64 "))", integer);
+  }
+}
+
+/**
+ * Emit a constant, spelling out numbers so the C compiler sees them */
+static void emitConstantLoad(FILE *file, StaticType *types, Value value,
+                             int constant, int slot) {
+  if (IS_INT(value)) {
+    fprintf(file, "  s[%d] = ", slot);
+    emitInt(file, AS_INT(value));
+    fprintf(file, ";\n");
+    types[slot] = TYPE_INT;
+  } else if (IS_NUMBER(value) && isfinite(AS_NUMBER(value))) {
+    fprintf(file, "  s[%d] = NUMBER_VAL(%a);\n", slot, AS_NUMBER(value));
+    types[slot] = TYPE_DOUBLE;
+  } else {
+    fprintf(file, "  s[%d] = constants[%d];\n", slot, constant);
+    types[slot] = IS_NUMBER(value) ? TYPE_DOUBLE : TYPE_UNKNOWN;
+  }
+}
+
+/**
+ * Get the operand of an instruction with a 16 bit operand */
+static uint16_t readShort(Chunk *chunk, int offset) {
+  return (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+/**
+ * Get the offset a jump instruction lands on */
+static int jumpTarget(Chunk *chunk, int offset) {
+  uint8_t *operand = &chunk->code[offset + 1];
+  uint32_t jump = ((uint32_t)operand[0] << 24) | ((uint32_t)operand[1] << 16) |
+                  ((uint32_t)operand[2] << 8) | operand[3];
+  return offset + 5 + (int)jump;
+}
+
+/**
+ * Start the C function running the next part of the script */
+static void beginPart(FILE *file, int part) {
+  fprintf(file,
+          "static InterpretResult part%d(Value *s, Value *constants, "
+          "Value *globals) {\n",
+          part);
+  fprintf(file, "  (void)constants;\n  (void)globals;\n");
+}
+
+/**
+ * Emit the function running the script */
+static void emitScript(Chunk *chunk, FILE *file) {
+  // Instructions jumped to get labels, and nothing is known about the
+  // values there
+  bool *targets = calloc(chunk->count + 1, sizeof(bool));
+  if (targets == NULL)
+    exit(1);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (isJump(chunk->code[offset]))
+      targets[jumpTarget(chunk, offset)] = true;
+  }
+
+  StaticType types[FRAME_SLOTS + 1];
+  int depth = 0;
+  int line = -1;
+  int parts = 1;
+  int partInstructions = 0;
+  // Furthest an instruction emitted so far jumps to
+  int jumpsTo = 0;
+  beginPart(file, 0);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    // Parts split between statements, where the stack is empty and no jump
+    // is pending
+    if (partInstructions >= PART_INSTRUCTIONS && depth == 0 &&
+        offset >= jumpsTo) {
+      fprintf(file, "  return INTERPRET_OK;\n}\n\n");
+      beginPart(file, parts++);
+      partInstructions = 0;
+      line = -1;
+    }
+    partInstructions++;
+    if (isJump(chunk->code[offset]) && jumpTarget(chunk, offset) > jumpsTo)
+      jumpsTo = jumpTarget(chunk, offset);
+
+    if (targets[offset]) {
+      fprintf(file, "L%d:;\n", offset);
+      for (int i = 0; i < depth; i++) {
+        types[i] = TYPE_UNKNOWN;
+      }
+    }
+    if (chunk->lines[offset] != line) {
+      line = chunk->lines[offset];
+      fprintf(file, "  // line %d\n", line);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    int top = depth - 1;
+    switch (instruction) {
+    case OP_CONSTANT: {
+      int constant = chunk->code[offset + 1];
+      emitConstantLoad(file, types, chunk->constants.values[constant],
+                       constant, depth);
+      break;
+    }
+    case OP_NIL:
+      fprintf(file, "  s[%d] = NIL_VAL;\n", depth);
+      types[depth] = TYPE_NIL;
+      break;
+    case OP_TRUE:
+    case OP_FALSE:
+      fprintf(file, "  s[%d] = BOOL_VAL(%s);\n", depth,
+              instruction == OP_TRUE ? "true" : "false");
+      types[depth] = TYPE_BOOL;
+      break;
+    case OP_POP:
+      break;
+    case OP_DEFINE_GLOBAL:
+      fprintf(file, "  WRITE_BARRIER(s[%d]);\n", top);
+      fprintf(file, "  globals[%d] = s[%d];\n", readShort(chunk, offset), top);
+      break;
+    case OP_GET_GLOBAL:
+      // Undefined globals are reported by the interpreter
+      fprintf(file, "  s[%d] = globals[%d];\n", depth,
+              readShort(chunk, offset));
+      fprintf(file, "  if (IS_UNDEFINED(s[%d]))\n    AOT_STEP(%d, %d);\n",
+              depth, offset, depth);
+      types[depth] = TYPE_UNKNOWN;
+      break;
+    case OP_SET_GLOBAL: {
+      uint16_t slot = readShort(chunk, offset);
+      fprintf(file, "  if (IS_UNDEFINED(globals[%d]))\n    AOT_STEP(%d, %d);\n",
+              slot, offset, depth);
+      fprintf(file, "  WRITE_BARRIER(s[%d]);\n", top);
+      fprintf(file, "  globals[%d] = s[%d];\n", slot, top);
+      break;
+    }
+    case OP_GET_LOCAL: {
+      int local = chunk->code[offset + 1];
+      fprintf(file, "  s[%d] = s[%d];\n", depth, local);
+      types[depth] = types[local];
+      break;
+    }
+    case OP_SET_LOCAL: {
+      int local = chunk->code[offset + 1];
+      fprintf(file, "  s[%d] = s[%d];\n", local, top);
+      types[local] = types[top];
+      break;
+    }
+    case OP_EQUAL:
+      emitEqual(file, types, depth);
+      break;
+    case OP_GREATER:
+      emitComparison(file, types, offset, depth, ">");
+      break;
+    case OP_LESS:
+      emitComparison(file, types, offset, depth, "<");
+      break;
+    case OP_ADD:
+      emitArithmetic(file, types, offset, depth, "aotAdd", "+");
+      break;
+    case OP_SUBTRACT:
+      emitArithmetic(file, types, offset, depth, "aotSubtract", "-");
+      break;
+    case OP_MULTIPLY:
+      emitArithmetic(file, types, offset, depth, "aotMultiply", "*");
+      break;
+    case OP_DIVIDE:
+      emitArithmetic(file, types, offset, depth, "aotDivide", "/");
+      break;
+    case OP_NOT:
+      emitNot(file, types, offset, depth);
+      break;
+    case OP_NEGATE:
+      emitNegate(file, types, offset, depth);
+      break;
+    case OP_PRINT:
+      fprintf(file, "  aotPrint(%d);\n", depth);
+      break;
+    case OP_JUMP:
+      fprintf(file, "  goto L%d;\n", jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      emitConditionalJump(file, types, depth, jumpTarget(chunk, offset),
+                          instruction == OP_JUMP_IF_FALSE);
+      break;
+    case OP_ARRAY:
+    case OP_SUM:
+    case OP_MIN:
+    case OP_MAX:
+    case OP_DOT:
+      // The work is in the array kernels, the interpreter runs these as well
+      // as any translation could
+      fprintf(file, "  AOT_STEP(%d, %d);\n", offset, depth);
+      types[depth + stackEffect(chunk, offset) - 1] =
+          instruction == OP_ARRAY ? TYPE_UNKNOWN : TYPE_DOUBLE;
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_MAP:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_INHERIT:
+    case OP_METHOD:
+      // Objects are left to the interpreter, with its inline caches
+      fprintf(file, "  AOT_STEP(%d, %d);\n", offset, depth);
+      if (depth + stackEffect(chunk, offset) > 0)
+        types[depth + stackEffect(chunk, offset) - 1] = TYPE_UNKNOWN;
+      break;
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      // Functions run in the interpreter, which comes back once they return
+      fprintf(file, "  AOT_CALL(%d, %d);\n", offset, depth);
+      types[depth + stackEffect(chunk, offset) - 1] = TYPE_UNKNOWN;
+      break;
+    case OP_RETURN:
+      if (depth > 0) {
+        fprintf(file, "  vm->result = s[%d];\n", top);
+      } else {
+        fprintf(file, "  vm->result = NIL_VAL;\n");
+      }
+      fprintf(file, "  return INTERPRET_OK;\n");
+      break;
+    }
+    depth += stackEffect(chunk, offset);
+  }
+  fprintf(file, "}\n\n");
+  free(targets);
+
+  fprintf(file, "static InterpretResult script() {\n");
+  fprintf(file, "  Value *s = vm->stack;\n");
+  fprintf(file, "  Value *constants = vm->chunk->constants.values;\n");
+  fprintf(file, "  Value *globals = vm->globalValues.values;\n");
+  for (int part = 0; part < parts - 1; part++) {
+    fprintf(file,
+            "  if (part%d(s, constants, globals) != INTERPRET_OK)\n"
+            "    return INTERPRET_RUNTIME_ERROR;\n",
+            part);
+  }
+  fprintf(file, "  return part%d(s, constants, globals);\n}\n\n", parts - 1);
+}
+
+/**
+ * Write characters as the contents of a C string literal */
+static void emitChars(FILE *file, const char *chars, int length) {
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      // ? could start a trigraph
+      fprintf(file, "\\%c", c);
+    } else if (c >= ' ' && c <= '~') {
+      fputc(c, file);
+    } else {
+      fprintf(file, "\\%03o", c);
+    }
+  }
+}
+
+/**
+ * Write a string value as a C string literal and its length */
+static void emitString(FILE *file, Value string) {
+  const char *chars;
+  int length;
+  if (IS_SMALL_STRING(string)) {
+    chars = AS_SMALL_STRING(string).chars;
+    length = AS_SMALL_STRING(string).length;
+  } else {
+    chars = AS_HEAP_STRING(string)->chars;
+    length = AS_HEAP_STRING(string)->length;
+  }
+  fputc('"', file);
+  emitChars(file, chars, length);
+  fprintf(file, "\", %d", length);
+}
+
+/**
+ * Write a double as C, exactly */
+static void emitDouble(FILE *file, double number) {
+  if (isnan(number)) {
+    fprintf(file, "NAN");
+  } else if (isinf(number)) {
+    fprintf(file, number < 0 ? "-INFINITY" : "INFINITY");
+  } else {
+    fprintf(file, "%a", number);
+  }
+}
+
+/**
+ * Emit the code that recreates the constants of the script (or a function)
+ *
+ * @param functions Number of functions emitted so far, in the order
+ * emitFunctionTables numbered them */
+static void emitConstants(Chunk *chunk, FILE *file, int *functions) {
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_FUNCTION(value)) {
+      ObjFunction *function = AS_FUNCTION(value);
+      int index = ++*functions;
+      fprintf(file, "  aotBeginFunction(");
+      emitString(file, function->name);
+      fprintf(file, ", %d, %d,\n                   code%d, lines%d, "
+                    "(int)sizeof(code%d));\n",
+              function->arity, function->maxSlots, index, index, index);
+      emitConstants(&function->chunk, file, functions);
+      fprintf(file, "  aotEndFunction();\n");
+    } else if (IS_INT(value)) {
+      fprintf(file, "  aotConstant(");
+      emitInt(file, AS_INT(value));
+      fprintf(file, ");\n");
+    } else if (IS_NUMBER(value)) {
+      fprintf(file, "  aotConstant(NUMBER_VAL(");
+      emitDouble(file, AS_NUMBER(value));
+      fprintf(file, "));\n");
+    } else if (IS_ARRAY(value)) {
+      ObjArray *array = AS_ARRAY(value);
+      if (array->count == 0) {
+        fprintf(file, "  aotArrayConstant(NULL, 0);\n");
+        continue;
+      }
+      fprintf(file, "  aotArrayConstant((const double[]){");
+      for (int element = 0; element < array->count; element++) {
+        fputs(element % 4 == 0 ? "\n      " : " ", file);
+        emitDouble(file, array->elements[element]);
+        fputc(',', file);
+      }
+      fprintf(file, "},\n                   %d);\n", array->count);
+    } else {
+      // Only strings are left
+      fprintf(file, "  aotStringConstant(");
+      emitString(file, value);
+      fprintf(file, ");\n");
+    }
+  }
+}
+
+/**
+ * Emit a table of the chunk's bytes or their lines
+ *
+ * @param function Number of the function the chunk belongs to, 0 for the
+ * script */
+static void emitTable(Chunk *chunk, FILE *file, bool lines, int function) {
+  fprintf(file, lines ? "static const int lines" : "static const uint8_t code");
+  if (function > 0)
+    fprintf(file, "%d", function);
+  fputs("[] = {", file);
+  for (int i = 0; i < chunk->count; i++) {
+    if (i % 12 == 0)
+      fputs("\n   ", file);
+    if (lines) {
+      fprintf(file, " %d,", chunk->lines[i]);
+    } else {
+      fprintf(file, " 0x%02x,", chunk->code[i]);
+    }
+  }
+  fprintf(file, "\n};\n\n");
+}
+
+/**
+ * Emit the tables of the functions among the constants of the script (or a
+ * function), and of the functions in their constants, numbering them from 1
+ *
+ * @param functions Number of functions emitted so far */
+static void emitFunctionTables(Chunk *chunk, FILE *file, int *functions) {
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!IS_FUNCTION(chunk->constants.values[i]))
+      continue;
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[i]);
+    int index = ++*functions;
+    emitTable(&function->chunk, file, false, index);
+    emitTable(&function->chunk, file, true, index);
+    emitFunctionTables(&function->chunk, file, functions);
+  }
+}
+
+bool emitC(Chunk *chunk, const char *sourcePath, FILE *file) {
+  fprintf(file, "// Translated from %s by clox --emit-c, build it against "
+                "libclox:\n",
+          sourcePath);
+  fprintf(file, "//   cc -O2 -I<clox>/include <this file> "
+                "<builddir>/libclox.a -lpthread -lm\n");
+  fprintf(file, "#include \"aot.h\"\n\n");
+  emitTable(chunk, file, false, 0);
+  emitTable(chunk, file, true, 0);
+  int functions = 0;
+  emitFunctionTables(chunk, file, &functions);
+  emitScript(chunk, file);
+
+  fprintf(file, "int main() {\n");
+  fprintf(file, "  aotInit(code, lines, (int)sizeof(code));\n");
+  functions = 0;
+  emitConstants(chunk, file, &functions);
+  for (int i = 0; i < vm->globalNames.count; i++) {
+    fprintf(file, "  aotGlobal(");
+    emitString(file, vm->globalNames.values[i]);
+    fprintf(file, ");\n");
+  }
+  fprintf(file, "  return aotRun(script);\n");
+  fprintf(file, "}\n");
+  return !ferror(file);
+}
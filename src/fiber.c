@@ -0,0 +1,448 @@
+// Std library includes
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Local Includes
+#include "chunk.h"
+#include "fiber.h"
+#include "value.h"
+#include "vm.h"
+
+Fiber *newFiber(FrozenChunk *frozen) {
+  // Fibers aren't objects on the VM's heap (their stacks are roots), so
+  // they're allocated directly
+  Fiber *fiber = malloc(sizeof(Fiber));
+  Value *stack = malloc(sizeof(Value) * FIBER_STACK_INITIAL);
+  CallFrame *frames = malloc(sizeof(CallFrame) * FIBER_FRAMES_INITIAL);
+  if (fiber == NULL || stack == NULL || frames == NULL)
+    exit(1);
+  fiber->vm = vm;
+  fiber->chunk = retainChunk(frozen);
+  fiber->ip = frozen->chunk.code;
+  fiber->stack = stack;
+  fiber->stackCapacity = FIBER_STACK_INITIAL;
+  fiber->frames = frames;
+  fiber->frameCapacity = FIBER_FRAMES_INITIAL;
+  fiber->stackTop = fiber->stack;
+  fiber->frames[0].function = NULL;
+  fiber->frames[0].chunk = &frozen->chunk;
+  fiber->frames[0].ip = NULL;
+  fiber->frames[0].slots = fiber->stack;
+  fiber->frameCount = 1;
+  fiber->status = INTERPRET_OK;
+  fiber->result = NIL_VAL;
+  atomic_init(&fiber->done, false);
+  fiber->scheduler = NULL;
+  fiber->io = NULL;
+  atomic_init(&fiber->ioHolds, 0);
+  fiber->nextParked = NULL;
+  fiber->hasTurn = false;
+
+  fiber->prev = NULL;
+  fiber->next = vm->fibers;
+  if (vm->fibers != NULL)
+    vm->fibers->prev = fiber;
+  vm->fibers = fiber;
+  return fiber;
+}
+
+void freeFiber(Fiber *fiber) {
+  if (fiber->prev != NULL) {
+    fiber->prev->next = fiber->next;
+  } else {
+    vm->fibers = fiber->next;
+  }
+  if (fiber->next != NULL)
+    fiber->next->prev = fiber->prev;
+  releaseChunk(fiber->chunk);
+  free(fiber->stack);
+  free(fiber->frames);
+  free(fiber);
+}
+
+bool growFiber(int slots) {
+  Fiber *fiber = vm->fiber;
+  if (fiber == NULL || vm->frameCount == FRAMES_MAX ||
+      slots > STACK_MAX + STACK_HEADROOM)
+    return false;
+
+  if (vm->frameCount == vm->frameCapacity) {
+    int capacity = vm->frameCapacity * 2;
+    if (capacity > FRAMES_MAX)
+      capacity = FRAMES_MAX;
+    CallFrame *frames = realloc(vm->frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL)
+      exit(1);
+    vm->frames = fiber->frames = frames;
+    vm->frameCapacity = fiber->frameCapacity = capacity;
+  }
+
+  if (slots > vm->stackCapacity) {
+    int capacity = vm->stackCapacity;
+    while (capacity < slots)
+      capacity *= 2;
+    if (capacity > STACK_MAX + STACK_HEADROOM)
+      capacity = STACK_MAX + STACK_HEADROOM;
+    // Moved by hand, as the frames and the top point into the stack
+    Value *stack = malloc(sizeof(Value) * capacity);
+    if (stack == NULL)
+      exit(1);
+    memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+    for (int i = 0; i < vm->frameCount; i++) {
+      vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+    free(vm->stack);
+    vm->stack = fiber->stack = stack;
+    vm->stackCapacity = fiber->stackCapacity = capacity;
+  }
+  return true;
+}
+
+InterpretResult resumeFiber(Fiber *fiber, uint64_t quantum) {
+  VM *previous = vm;
+  vm = fiber->vm;
+
+  // Switch the fiber's state into the VM
+  vm->fiber = fiber;
+  vm->frames = fiber->frames;
+  vm->frameCount = fiber->frameCount;
+  vm->frameCapacity = fiber->frameCapacity;
+  vm->chunk = vm->frames[vm->frameCount - 1].chunk;
+  vm->ip = fiber->ip;
+  vm->stack = fiber->stack;
+  vm->stackTop = fiber->stackTop;
+  vm->stackCapacity = fiber->stackCapacity;
+  vm->yieldAt = vm->instructionCount + quantum;
+
+  // A native that was waiting for I/O returns now
+  if (fiber->io != NULL) {
+    Value result = fiber->finishIo(fiber->io, fiber->ioArgs);
+    fiber->io = NULL;
+    vm->stackTop = fiber->ioArgs;
+    vm->stackTop[-1] = result;
+  }
+
+  InterpretResult result = run();
+
+  // And back out again
+  fiber->ip = vm->ip;
+  fiber->stackTop = vm->stackTop;
+  fiber->frameCount = vm->frameCount;
+  if (result != INTERPRET_YIELD) {
+    fiber->status = result;
+    fiber->result = result == INTERPRET_OK ? vm->result : NIL_VAL;
+  }
+  vm->fiber = NULL;
+  vm->chunk = NULL;
+  vm->frames = vm->baseFrames;
+  vm->frameCount = 0;
+  vm->frameCapacity = FRAMES_MAX;
+  vm->stack = vm->baseStack;
+  vm->stackTop = vm->stack;
+  vm->stackCapacity = STACK_MAX + STACK_HEADROOM;
+  vm->yieldAt = UINT64_MAX;
+
+  vm = previous;
+  return result;
+}
+
+/**
+ * Add a fiber to the tail of a queue */
+static void enqueue(FiberQueue *queue, Fiber *fiber) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == queue->capacity) {
+    // Grow, unwrapping the ring into the start of the new buffer
+    int capacity = queue->capacity < 8 ? 8 : queue->capacity * 2;
+    Fiber **fibers = malloc(sizeof(Fiber *) * capacity);
+    if (fibers == NULL)
+      exit(1);
+    for (int i = 0; i < queue->count; i++) {
+      fibers[i] = queue->fibers[(queue->head + i) & (queue->capacity - 1)];
+    }
+    free(queue->fibers);
+    queue->fibers = fibers;
+    queue->capacity = capacity;
+    queue->head = 0;
+  }
+  int tail = (queue->head + queue->count) & (queue->capacity - 1);
+  queue->fibers[tail] = fiber;
+  queue->count++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Take the fiber at the head (the owner) or the tail (a thief) of a queue
+ *
+ * @returns The fiber, or NULL if the queue is empty */
+static Fiber *dequeue(FiberQueue *queue, bool fromHead) {
+  Fiber *fiber = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0) {
+    queue->count--;
+    if (fromHead) {
+      fiber = queue->fibers[queue->head];
+      queue->head = (queue->head + 1) & (queue->capacity - 1);
+    } else {
+      fiber = queue->fibers[(queue->head + queue->count) &
+                            (queue->capacity - 1)];
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return fiber;
+}
+
+/**
+ * Queue a runnable fiber on a worker, waking a sleeping worker for it */
+static void pushFiber(Worker *worker, Fiber *fiber) {
+  Scheduler *scheduler = worker->scheduler;
+  enqueue(&worker->queue, fiber);
+  pthread_mutex_lock(&scheduler->idle);
+  atomic_fetch_add(&scheduler->queued, 1);
+  pthread_cond_signal(&scheduler->wake);
+  pthread_mutex_unlock(&scheduler->idle);
+}
+
+/**
+ * Find a fiber to run: the worker's own next one, or one stolen from
+ * another worker
+ *
+ * @returns The fiber, or NULL if there is nothing to run */
+static Fiber *nextFiber(Worker *worker) {
+  Scheduler *scheduler = worker->scheduler;
+  Fiber *fiber = dequeue(&worker->queue, true);
+  for (int i = 1; fiber == NULL && i < scheduler->workerCount; i++) {
+    Worker *victim =
+        &scheduler->workers[(worker->index + i) % scheduler->workerCount];
+    fiber = dequeue(&victim->queue, false);
+  }
+  if (fiber != NULL)
+    atomic_fetch_sub(&scheduler->queued, 1);
+  return fiber;
+}
+
+/**
+ * Mark a fiber as finished, waking anyone waiting for it */
+static void finishFiber(Scheduler *scheduler, Fiber *fiber) {
+  pthread_mutex_lock(&scheduler->idle);
+  atomic_store(&fiber->done, true);
+  pthread_cond_broadcast(&scheduler->finished);
+  pthread_mutex_unlock(&scheduler->idle);
+}
+
+/**
+ * Let go of a fiber suspended on I/O: once both the I/O and the worker that
+ * ran it have, it's queued again */
+static void releaseSuspended(Fiber *fiber) {
+  if (atomic_fetch_sub(&fiber->ioHolds, 1) != 1)
+    return;
+  // Queued before it stops counting as suspended, so the workers don't exit
+  // in between
+  Scheduler *scheduler = fiber->scheduler;
+  scheduleFiber(scheduler, fiber);
+  pthread_mutex_lock(&scheduler->idle);
+  // The last one lets stopping workers exit
+  if (atomic_fetch_sub(&scheduler->suspended, 1) == 1)
+    pthread_cond_broadcast(&scheduler->wake);
+  pthread_mutex_unlock(&scheduler->idle);
+}
+
+/**
+ * Take the turn of a fiber's VM, or park the fiber on the VM until the fiber
+ * that has it lets go
+ *
+ * @returns True if the fiber can run now */
+static bool takeTurn(Fiber *fiber) {
+  if (fiber->hasTurn) {
+    fiber->hasTurn = false;
+    return true;
+  }
+  VM *owner = fiber->vm;
+  pthread_mutex_lock(&owner->turnLock);
+  bool taken = !owner->fiberRunning;
+  if (taken) {
+    owner->fiberRunning = true;
+  } else {
+    fiber->nextParked = NULL;
+    if (owner->lastParked != NULL)
+      owner->lastParked->nextParked = fiber;
+    else
+      owner->parked = fiber;
+    owner->lastParked = fiber;
+  }
+  pthread_mutex_unlock(&owner->turnLock);
+  return taken;
+}
+
+/**
+ * Let go of a VM's turn, handing it to the fiber parked longest (which is
+ * queued again) if there is one */
+static void passTurn(Worker *worker, VM *owner) {
+  pthread_mutex_lock(&owner->turnLock);
+  Fiber *next = owner->parked;
+  if (next != NULL) {
+    owner->parked = next->nextParked;
+    if (owner->parked == NULL)
+      owner->lastParked = NULL;
+    next->hasTurn = true;
+  } else {
+    owner->fiberRunning = false;
+  }
+  pthread_mutex_unlock(&owner->turnLock);
+  if (next != NULL)
+    pushFiber(worker, next);
+}
+
+/**
+ * Main loop of a worker thread */
+static void *workerThread(void *argument) {
+  Worker *worker = argument;
+  Scheduler *scheduler = worker->scheduler;
+
+  for (;;) {
+    Fiber *fiber = nextFiber(worker);
+    if (fiber == NULL) {
+      pthread_mutex_lock(&scheduler->idle);
+      // Suspended fibers will be queued again, so they keep it running
+      while (atomic_load(&scheduler->queued) == 0 &&
+             (!scheduler->stopping ||
+              atomic_load(&scheduler->suspended) > 0)) {
+        pthread_cond_wait(&scheduler->wake, &scheduler->idle);
+      }
+      bool exit = atomic_load(&scheduler->queued) == 0;
+      pthread_mutex_unlock(&scheduler->idle);
+      if (exit)
+        return NULL;
+      continue;
+    }
+
+    // Another fiber of the same VM is running, this one is queued again
+    // when it's handed the turn
+    if (!takeTurn(fiber))
+      continue;
+    // Only the API can hold the lock now, and not for long
+    VM *owner = fiber->vm;
+    pthread_mutex_lock(&owner->lock);
+    InterpretResult result = resumeFiber(fiber, scheduler->quantum);
+    // Read while the fiber can't be queued again
+    bool suspended = fiber->io != NULL;
+    pthread_mutex_unlock(&owner->lock);
+    // Before the fiber can be queued again (or freed, once finished)
+    passTurn(worker, owner);
+
+    if (suspended) {
+      releaseSuspended(fiber);
+    } else if (result == INTERPRET_YIELD) {
+      pushFiber(worker, fiber);
+    } else {
+      finishFiber(scheduler, fiber);
+    }
+  }
+}
+
+bool startScheduler(Scheduler *scheduler, int workers, uint64_t quantum) {
+  if (workers <= 0)
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > SCHEDULER_WORKERS_MAX)
+    workers = SCHEDULER_WORKERS_MAX;
+  if (workers < 1)
+    workers = 1;
+
+  scheduler->quantum = quantum > 0 ? quantum : FIBER_QUANTUM_DEFAULT;
+  scheduler->workers = calloc(workers, sizeof(Worker));
+  if (scheduler->workers == NULL)
+    exit(1);
+  atomic_init(&scheduler->queued, 0);
+  atomic_init(&scheduler->suspended, 0);
+  atomic_init(&scheduler->nextWorker, 0);
+  pthread_mutex_init(&scheduler->idle, NULL);
+  pthread_cond_init(&scheduler->wake, NULL);
+  pthread_cond_init(&scheduler->finished, NULL);
+  scheduler->stopping = false;
+
+  // Workers can steal from every queue, so they're all set up first (the
+  // queues of workers whose threads don't start are emptied by thieves)
+  scheduler->workerCount = workers;
+  for (int i = 0; i < workers; i++) {
+    Worker *worker = &scheduler->workers[i];
+    worker->scheduler = scheduler;
+    worker->index = i;
+    pthread_mutex_init(&worker->queue.lock, NULL);
+  }
+  scheduler->threadCount = 0;
+  for (int i = 0; i < workers; i++) {
+    Worker *worker = &scheduler->workers[i];
+    if (pthread_create(&worker->thread, NULL, workerThread, worker) != 0)
+      break;
+    scheduler->threadCount++;
+  }
+  if (scheduler->threadCount == 0) {
+    stopScheduler(scheduler);
+    return false;
+  }
+  return true;
+}
+
+void stopScheduler(Scheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->idle);
+  scheduler->stopping = true;
+  pthread_cond_broadcast(&scheduler->wake);
+  pthread_mutex_unlock(&scheduler->idle);
+
+  for (int i = 0; i < scheduler->threadCount; i++) {
+    pthread_join(scheduler->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < scheduler->workerCount; i++) {
+    pthread_mutex_destroy(&scheduler->workers[i].queue.lock);
+    free(scheduler->workers[i].queue.fibers);
+  }
+  free(scheduler->workers);
+  scheduler->workers = NULL;
+  scheduler->workerCount = 0;
+  pthread_mutex_destroy(&scheduler->idle);
+  pthread_cond_destroy(&scheduler->wake);
+  pthread_cond_destroy(&scheduler->finished);
+}
+
+void scheduleFiber(Scheduler *scheduler, Fiber *fiber) {
+  fiber->scheduler = scheduler;
+  // New fibers are spread round robin, stealing evens out the rest
+  unsigned index = atomic_fetch_add(&scheduler->nextWorker, 1);
+  pushFiber(&scheduler->workers[index % scheduler->workerCount], fiber);
+}
+
+void waitForFiber(Scheduler *scheduler, Fiber *fiber) {
+  pthread_mutex_lock(&scheduler->idle);
+  while (!atomic_load(&fiber->done)) {
+    pthread_cond_wait(&scheduler->finished, &scheduler->idle);
+  }
+  pthread_mutex_unlock(&scheduler->idle);
+}
+
+/**
+ * Let go of the fiber that was waiting for a completed request */
+static void ioCompleted(IoRequest *request) { releaseSuspended(request->data); }
+
+void awaitIo(IoRequest *request, IoFinish finish, Value *args) {
+  Fiber *fiber = vm->fiber;
+  if (fiber == NULL || fiber->scheduler == NULL) {
+    bool inTime = waitForIo(request, vm->deadline);
+    args[-1] = finish(request, args);
+    if (!inTime)
+      vm->yieldAt = vm->instructionCount;
+    return;
+  }
+
+  fiber->io = request;
+  fiber->finishIo = finish;
+  fiber->ioArgs = args;
+  // Held by the I/O and by the worker running the fiber
+  atomic_store(&fiber->ioHolds, 2);
+  atomic_fetch_add(&fiber->scheduler->suspended, 1);
+  // run() gives up the thread before the next instruction
+  vm->yieldAt = vm->instructionCount;
+  request->complete = ioCompleted;
+  request->data = fiber;
+  submitIo(request);
+}
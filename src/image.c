@@ -0,0 +1,1121 @@
+// Std library includes
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local Includes
+#include "image.h"
+#include "map.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC "CLOXIMG1"
+#define IMAGE_VERSION 4
+// Objects start at multiples of this, so their fields stay aligned
+#define IMAGE_ALIGN 16
+
+/**
+ * Start of an image file.
+ *
+ * The objects follow the header, then the global names and values, then the
+ * entries of the interned strings and global slots tables, then the offsets
+ * of the objects relocated in place. In all of them object pointers are
+ * stored as offsets from the start of the image. Only strings are table
+ * keys, and their hashes don't depend on where they are, so the tables'
+ * entries can be used as they are once relocated.
+ *
+ * Strings and arrays hold no pointers and are used as they are. Functions,
+ * shapes, classes, instances, maps and bound methods are relocated in place:
+ * what they point at (a chunk's code, lines and constants, the entries of a
+ * table or a map, an instance's fields) follows them among the objects, by
+ * offset too. Whatever of theirs changes at runtime (tables, fields, maps
+ * and inline caches) is then copied to the heap, as the image's memory can't
+ * be reallocated. Maps are rebuilt rather than copied, since keys hashed by
+ * address have moved.
+ * Natives are relocated too, finding their implementation again by name, and
+ * files are written closed.
+ * */
+typedef struct {
+  char magic[8];          //! IMAGE_MAGIC
+  uint32_t version;       //! IMAGE_VERSION
+  uint16_t valueSize;     //! sizeof(Value) in the build that wrote it
+  uint16_t entrySize;     //! sizeof(Entry) in the build that wrote it
+  uint64_t size;          //! Size of the whole image in bytes
+  uint64_t objectsEnd;    //! Offset just past the last object
+  uint64_t globals;       //! Offset of the global names, then values
+  uint64_t strings;       //! Offset of the interned strings' entries
+  uint64_t slots;         //! Offset of the global slots' entries
+  uint64_t objects;       //! Offset of the relocated objects' offsets
+  int32_t globalCount;    //! Number of globals
+  int32_t stringCount;    //! Count of the interned strings table
+  int32_t stringCapacity; //! Capacity of the interned strings table
+  int32_t slotCount;      //! Count of the global slots table
+  int32_t slotCapacity;   //! Capacity of the global slots table
+  int32_t objectCount;    //! Number of relocated objects
+} ImageHeader;
+
+/**
+ * An image being built in memory.
+ * */
+typedef struct {
+  char *data;         //! Contents of the image so far
+  size_t size;        //! Number of bytes in data
+  size_t capacity;    //! Capacity of data
+  Table offsets;      //! Offset of each object already written, by object
+  uint64_t *objects;  //! Offset of each object relocated in place
+  int objectCount;    //! Number of objects relocated in place
+  int objectCapacity; //! Capacity of objects
+} ImageWriter;
+
+/**
+ * Add zeroed space to the end of the image
+ *
+ * @returns Offset of the space (aligned to IMAGE_ALIGN) */
+static size_t reserve(ImageWriter *writer, size_t size) {
+  size_t offset = (writer->size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+  if (writer->capacity < offset + size) {
+    size_t capacity = writer->capacity < 4096 ? 4096 : writer->capacity;
+    while (capacity < offset + size)
+      capacity *= 2;
+    // Not allocated with reallocate, it isn't part of the heap
+    writer->data = realloc(writer->data, capacity);
+    if (writer->data == NULL)
+      exit(1);
+    writer->capacity = capacity;
+  }
+  memset(writer->data + writer->size, 0, offset + size - writer->size);
+  writer->size = offset + size;
+  return offset;
+}
+
+/**
+ * Size of an object (a string or an array), with its inline contents */
+static size_t objectSize(Obj *object) {
+  if (object->type == OBJ_STRING)
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  return sizeof(ObjArray) + sizeof(double) * ((ObjArray *)object)->count;
+}
+
+static Value imageValue(ImageWriter *writer, Value value);
+
+/**
+ * Record where an object that's relocated in place is written, before what
+ * it points at (which may point back at it) */
+static void addRelocated(ImageWriter *writer, Value value, size_t at) {
+  tableSet(&writer->offsets, value, NUMBER_VAL((double)at));
+  if (writer->objectCapacity < writer->objectCount + 1) {
+    writer->objectCapacity = GROW_CAPACITY(writer->objectCapacity);
+    writer->objects =
+        realloc(writer->objects, sizeof(uint64_t) * writer->objectCapacity);
+    if (writer->objects == NULL)
+      exit(1);
+  }
+  writer->objects[writer->objectCount++] = at;
+}
+
+/**
+ * Convert an object pointer to its form in the image (see imageValue) */
+static void *imageObject(ImageWriter *writer, void *object) {
+  if (object == NULL)
+    return NULL;
+  return imageValue(writer, OBJ_VAL(object)).as.obj;
+}
+
+/**
+ * Write an array of values to the end of the image, in their image form
+ *
+ * @returns Offset of the values */
+static size_t writeValues(ImageWriter *writer, Value *values, int count) {
+  size_t offset = reserve(writer, sizeof(Value) * count);
+  for (int i = 0; i < count; i++) {
+    // Written one at a time, converting one can move the data
+    Value value = imageValue(writer, values[i]);
+    memcpy(writer->data + offset + sizeof(Value) * i, &value, sizeof(Value));
+  }
+  return offset;
+}
+
+/**
+ * Write the entries of a table to the end of the image, in their image form
+ *
+ * @returns Offset of the entries */
+static size_t writeEntries(ImageWriter *writer, Table *table) {
+  size_t offset = reserve(writer, sizeof(Entry) * table->capacity);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry entry = table->entries[i];
+    entry.key = imageValue(writer, entry.key);
+    entry.value = imageValue(writer, entry.value);
+    memcpy(writer->data + offset + sizeof(Entry) * i, &entry, sizeof(Entry));
+  }
+  return offset;
+}
+
+/**
+ * Convert a table held by an object to its form in the image, writing its
+ * entries */
+static Table imageTable(ImageWriter *writer, Table *table) {
+  Table copy = *table;
+  copy.entries = (Entry *)(uintptr_t)writeEntries(writer, table);
+  return copy;
+}
+
+/**
+ * Write a function to the image, followed by its code, lines and constants
+ *
+ * @returns Offset of the function */
+static size_t writeFunction(ImageWriter *writer, Value value) {
+  ObjFunction *function = AS_FUNCTION(value);
+  Chunk *chunk = &function->chunk;
+  size_t at = reserve(writer, sizeof(ObjFunction));
+  addRelocated(writer, value, at);
+
+  size_t code = reserve(writer, chunk->count);
+  memcpy(writer->data + code, chunk->code, chunk->count);
+  size_t lines = reserve(writer, sizeof(int) * chunk->count);
+  memcpy(writer->data + lines, chunk->lines, sizeof(int) * chunk->count);
+  int count = chunk->constants.count;
+  size_t constants = writeValues(writer, chunk->constants.values, count);
+
+  ObjFunction copy = *function;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.name = imageValue(writer, function->name);
+  copy.owner = imageObject(writer, function->owner);
+  copy.chunk.capacity = chunk->count;
+  copy.chunk.code = (uint8_t *)(uintptr_t)code;
+  copy.chunk.lines = (int *)(uintptr_t)lines;
+  copy.chunk.constants.capacity = count;
+  copy.chunk.constants.values = (Value *)(uintptr_t)constants;
+  // Caches are made afresh when the image is loaded
+  copy.chunk.caches = NULL;
+  copy.chunk.cacheCount = 0;
+  memcpy(writer->data + at, &copy, sizeof(ObjFunction));
+  return at;
+}
+
+/**
+ * Write a shape to the image, followed by its transitions' entries
+ *
+ * @returns Offset of the shape */
+static size_t writeShape(ImageWriter *writer, Value value) {
+  ObjShape *shape = (ObjShape *)AS_OBJ(value);
+  size_t at = reserve(writer, sizeof(ObjShape));
+  addRelocated(writer, value, at);
+
+  ObjShape copy = *shape;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.klass = imageObject(writer, shape->klass);
+  copy.parent = imageObject(writer, shape->parent);
+  copy.name = imageValue(writer, shape->name);
+  copy.transitions = imageTable(writer, &shape->transitions);
+  memcpy(writer->data + at, &copy, sizeof(ObjShape));
+  return at;
+}
+
+/**
+ * Write a class to the image, followed by its methods' entries
+ *
+ * @returns Offset of the class */
+static size_t writeClass(ImageWriter *writer, Value value) {
+  ObjClass *klass = AS_CLASS(value);
+  size_t at = reserve(writer, sizeof(ObjClass));
+  addRelocated(writer, value, at);
+
+  ObjClass copy = *klass;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.name = imageValue(writer, klass->name);
+  copy.superclass = imageObject(writer, klass->superclass);
+  copy.shape = imageObject(writer, klass->shape);
+  copy.initializer = imageObject(writer, klass->initializer);
+  copy.methods = imageTable(writer, &klass->methods);
+  memcpy(writer->data + at, &copy, sizeof(ObjClass));
+  return at;
+}
+
+/**
+ * Write an instance to the image, followed by the fields its shape names
+ *
+ * @returns Offset of the instance */
+static size_t writeInstance(ImageWriter *writer, Value value) {
+  ObjInstance *instance = AS_INSTANCE(value);
+  size_t at = reserve(writer, sizeof(ObjInstance));
+  addRelocated(writer, value, at);
+
+  int count = instance->shape->count;
+  size_t fields = writeValues(writer, instance->fields, count);
+  ObjInstance copy = *instance;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.shape = imageObject(writer, instance->shape);
+  copy.fields = (Value *)(uintptr_t)fields;
+  copy.capacity = count;
+  memcpy(writer->data + at, &copy, sizeof(ObjInstance));
+  return at;
+}
+
+/**
+ * Write a map to the image, followed by its control bytes and entries
+ *
+ * @returns Offset of the map */
+static size_t writeMap(ImageWriter *writer, Value value) {
+  ObjMap *map = AS_MAP(value);
+  size_t at = reserve(writer, sizeof(ObjMap));
+  addRelocated(writer, value, at);
+
+  size_t control = reserve(writer, map->capacity);
+  if (map->capacity > 0)
+    memcpy(writer->data + control, map->control, map->capacity);
+  size_t entries = reserve(writer, sizeof(MapEntry) * map->capacity);
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->control[i] & 0x80)
+      continue;
+    // Written one at a time, converting one can move the data
+    MapEntry entry = map->entries[i];
+    entry.key = imageValue(writer, entry.key);
+    entry.value = imageValue(writer, entry.value);
+    memcpy(writer->data + entries + sizeof(MapEntry) * i, &entry,
+           sizeof(MapEntry));
+  }
+
+  ObjMap copy = *map;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.control = (uint8_t *)(uintptr_t)control;
+  copy.entries = (MapEntry *)(uintptr_t)entries;
+  memcpy(writer->data + at, &copy, sizeof(ObjMap));
+  return at;
+}
+
+/**
+ * Write a bound method to the image
+ *
+ * @returns Offset of the bound method */
+static size_t writeBoundMethod(ImageWriter *writer, Value value) {
+  ObjBoundMethod *bound = AS_BOUND_METHOD(value);
+  size_t at = reserve(writer, sizeof(ObjBoundMethod));
+  addRelocated(writer, value, at);
+
+  ObjBoundMethod copy = *bound;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.receiver = imageValue(writer, bound->receiver);
+  copy.method = imageObject(writer, bound->method);
+  memcpy(writer->data + at, &copy, sizeof(ObjBoundMethod));
+  return at;
+}
+
+/**
+ * Write a native to the image, without its implementation (the address
+ * means nothing to another process), which is found by name when loading
+ *
+ * @returns Offset of the native */
+static size_t writeNative(ImageWriter *writer, Value value) {
+  ObjNative *native = AS_NATIVE(value);
+  size_t at = reserve(writer, sizeof(ObjNative));
+  addRelocated(writer, value, at);
+
+  ObjNative copy = *native;
+  copy.obj.mark = 0;
+  copy.obj.next = NULL;
+  copy.name = imageValue(writer, native->name);
+  copy.function.values = NULL;
+  memcpy(writer->data + at, &copy, sizeof(ObjNative));
+  return at;
+}
+
+/**
+ * Write a file to the image, closed (its descriptor means nothing to another
+ * process), so that it has no lines left
+ *
+ * @returns Offset of the file */
+static size_t writeClosedFile(ImageWriter *writer, Value value) {
+  size_t at = reserve(writer, sizeof(ObjFile));
+  tableSet(&writer->offsets, value, NUMBER_VAL((double)at));
+
+  ObjFile copy;
+  memset(&copy, 0, sizeof(ObjFile));
+  copy.obj.type = OBJ_FILE;
+  copy.fd = -1;
+  memcpy(writer->data + at, &copy, sizeof(ObjFile));
+  return at;
+}
+
+/**
+ * Convert a value to its form in the image, writing its object to the image
+ * the first time it's seen */
+static Value imageValue(ImageWriter *writer, Value value) {
+  if (!IS_OBJ(value))
+    return value;
+  if (IS_ROPE(value))
+    value = OBJ_VAL(flattenString(value));
+
+  Value offset;
+  if (!tableGet(&writer->offsets, value, &offset)) {
+    size_t at;
+    switch (OBJ_TYPE(value)) {
+    case OBJ_FUNCTION:
+      at = writeFunction(writer, value);
+      break;
+    case OBJ_SHAPE:
+      at = writeShape(writer, value);
+      break;
+    case OBJ_CLASS:
+      at = writeClass(writer, value);
+      break;
+    case OBJ_INSTANCE:
+      at = writeInstance(writer, value);
+      break;
+    case OBJ_MAP:
+      at = writeMap(writer, value);
+      break;
+    case OBJ_BOUND_METHOD:
+      at = writeBoundMethod(writer, value);
+      break;
+    case OBJ_NATIVE:
+      at = writeNative(writer, value);
+      break;
+    case OBJ_FILE:
+      at = writeClosedFile(writer, value);
+      break;
+    default: {
+      size_t size = objectSize(AS_OBJ(value));
+      at = reserve(writer, size);
+      memcpy(writer->data + at, AS_OBJ(value), size);
+      Obj *copy = (Obj *)(writer->data + at);
+      copy->mark = 0;
+      copy->next = NULL;
+      tableSet(&writer->offsets, value, NUMBER_VAL((double)at));
+      break;
+    }
+    }
+    offset = NUMBER_VAL((double)at);
+  }
+  value.as.obj = (Obj *)(uintptr_t)AS_NUMBER(offset);
+  return value;
+}
+
+bool saveImage(const char *path) {
+  ImageWriter writer;
+  writer.data = NULL;
+  writer.size = 0;
+  writer.capacity = 0;
+  initTable(&writer.offsets);
+  writer.objects = NULL;
+  writer.objectCount = 0;
+  writer.objectCapacity = 0;
+  reserve(&writer, sizeof(ImageHeader));
+
+  // Objects are written as the globals reach them, so the globals themselves
+  // are converted before they're added
+  int count = vm->globalValues.count;
+  Value *globals = malloc(sizeof(Value) * 2 * count + 1);
+  if (globals == NULL)
+    exit(1);
+  for (int i = 0; i < count; i++) {
+    globals[i] = imageValue(&writer, vm->globalNames.values[i]);
+    globals[count + i] = imageValue(&writer, vm->globalValues.values[i]);
+  }
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(ImageHeader));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.valueSize = sizeof(Value);
+  header.entrySize = sizeof(Entry);
+  header.objectsEnd = writer.size;
+  header.globalCount = count;
+  header.globals = reserve(&writer, sizeof(Value) * 2 * count);
+  memcpy(writer.data + header.globals, globals, sizeof(Value) * 2 * count);
+  free(globals);
+
+  // Only the strings in the image are interned when it's restored
+  Table strings;
+  initTable(&strings);
+  for (int i = 0; i < writer.offsets.capacity; i++) {
+    Value key = writer.offsets.entries[i].key;
+    if (IS_HEAP_STRING(key))
+      tableSet(&strings, key, NIL_VAL);
+  }
+  header.stringCount = strings.count;
+  header.stringCapacity = strings.capacity;
+  header.strings = writeEntries(&writer, &strings);
+  freeTable(&strings);
+
+  header.slotCount = vm->globalSlots.count;
+  header.slotCapacity = vm->globalSlots.capacity;
+  header.slots = writeEntries(&writer, &vm->globalSlots);
+  header.objectCount = writer.objectCount;
+  header.objects = reserve(&writer, sizeof(uint64_t) * writer.objectCount);
+  if (writer.objectCount > 0)
+    memcpy(writer.data + header.objects, writer.objects,
+           sizeof(uint64_t) * writer.objectCount);
+  free(writer.objects);
+  header.size = writer.size;
+  memcpy(writer.data, &header, sizeof(ImageHeader));
+  freeTable(&writer.offsets);
+
+  FILE *file = fopen(path, "wb");
+  bool written = file != NULL &&
+                 fwrite(writer.data, 1, writer.size, file) == writer.size;
+  if (file != NULL)
+    written = fclose(file) == 0 && written;
+  free(writer.data);
+  return written;
+}
+
+/**
+ * Check that size bytes at offset lie before end (without overflowing) */
+static bool within(uint64_t offset, uint64_t size, uint64_t end) {
+  return offset <= end && size <= end - offset;
+}
+
+/**
+ * Check that an image's sections lie within it */
+static bool validHeader(ImageHeader *header, size_t size) {
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != IMAGE_VERSION ||
+      header->valueSize != sizeof(Value) ||
+      header->entrySize != sizeof(Entry) || header->size != size)
+    return false;
+  if (header->globalCount < 0 || header->globalCount > GLOBALS_MAX ||
+      header->stringCount < 0 ||
+      header->stringCapacity < header->stringCount ||
+      header->slotCount < 0 || header->slotCapacity < header->slotCount ||
+      header->objectCount < 0)
+    return false;
+  // Tables are probed with a mask, so capacities are powers of two
+  if ((header->stringCapacity & (header->stringCapacity - 1)) != 0 ||
+      (header->slotCapacity & (header->slotCapacity - 1)) != 0)
+    return false;
+  return header->objectsEnd >= sizeof(ImageHeader) &&
+         header->objectsEnd <= header->globals &&
+         within(header->globals, sizeof(Value) * 2 * header->globalCount,
+                header->strings) &&
+         within(header->strings, sizeof(Entry) * header->stringCapacity,
+                header->slots) &&
+         within(header->slots, sizeof(Entry) * header->slotCapacity,
+                header->objects) &&
+         within(header->objects, sizeof(uint64_t) * header->objectCount,
+                size);
+}
+
+// Bit for each IMAGE_ALIGN bytes of the objects of the image being loaded
+// (by this thread), set where an object to relocate in place starts
+static _Thread_local uint8_t *inPlace;
+
+/**
+ * Record where the objects to relocate in place start
+ *
+ * @returns False if an offset is outside the image's objects, or repeated
+ * (its pointers would be relocated twice) */
+static bool findInPlace(char *image) {
+  ImageHeader *header = (ImageHeader *)image;
+  uint64_t *offsets = (uint64_t *)(image + header->objects);
+  inPlace = calloc(header->objectsEnd / IMAGE_ALIGN / 8 + 1, 1);
+  if (inPlace == NULL)
+    exit(1);
+  for (int i = 0; i < header->objectCount; i++) {
+    uint64_t offset = offsets[i];
+    if (offset < sizeof(ImageHeader) || offset % IMAGE_ALIGN != 0 ||
+        !within(offset, sizeof(Obj), header->objectsEnd))
+      return false;
+    uint64_t bit = offset / IMAGE_ALIGN;
+    if (inPlace[bit / 8] & (1 << (bit % 8)))
+      return false;
+    inPlace[bit / 8] |= 1 << (bit % 8);
+  }
+  return true;
+}
+
+static bool isString(Value value) {
+  return IS_SMALL_STRING(value) || IS_HEAP_STRING(value);
+}
+
+/**
+ * Check the object at an offset of an image: one of the types images hold,
+ * with its inline contents within the objects. Objects with pointers must be
+ * listed to be relocated in place, where the rest of them is checked
+ * */
+static bool validObject(char *image, uint64_t offset) {
+  uint64_t end = ((ImageHeader *)image)->objectsEnd;
+  Obj *object = (Obj *)(image + offset);
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    return within(offset, sizeof(ObjString), end) && string->length >= 0 &&
+           within(offset + sizeof(ObjString), (uint64_t)string->length + 1,
+                  end) &&
+           string->chars[string->length] == '\0';
+  }
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *)object;
+    return within(offset, sizeof(ObjArray), end) && array->count >= 0 &&
+           within(offset + sizeof(ObjArray),
+                  sizeof(double) * (uint64_t)array->count, end);
+  }
+  case OBJ_FILE: {
+    // Saved closed, with nothing read
+    ObjFile *file = (ObjFile *)object;
+    return within(offset, sizeof(ObjFile), end) && file->fd == -1 &&
+           !file->reading && file->buffer == NULL;
+  }
+  case OBJ_MAP:
+  case OBJ_FUNCTION:
+  case OBJ_SHAPE:
+  case OBJ_CLASS:
+  case OBJ_INSTANCE:
+  case OBJ_BOUND_METHOD:
+  case OBJ_NATIVE: {
+    uint64_t bit = offset / IMAGE_ALIGN;
+    return (inPlace[bit / 8] & (1 << (bit % 8))) != 0;
+  }
+  default:
+    // Ropes are flattened when saving
+    return false;
+  }
+}
+
+/**
+ * Relocate a value read from an image to where the image is mapped
+ *
+ * @returns False if it isn't a valid value, points outside the image's
+ * objects, or at something that isn't a valid object */
+static bool relocate(char *image, Value *value) {
+  if ((unsigned)value->type > VAL_OBJ)
+    return false;
+  if (IS_BOOL(*value)) {
+    // Any other byte is a bool that's neither true nor false
+    uint8_t byte;
+    memcpy(&byte, &value->as, 1);
+    return byte <= 1;
+  }
+  if (IS_SMALL_STRING(*value))
+    return value->as.small.length <= SMALL_STRING_MAX;
+  if (!IS_OBJ(*value))
+    return true;
+  uintptr_t offset = (uintptr_t)value->as.obj;
+  if (offset < sizeof(ImageHeader) || offset % IMAGE_ALIGN != 0 ||
+      !within(offset, sizeof(Obj), ((ImageHeader *)image)->objectsEnd) ||
+      !validObject(image, offset))
+    return false;
+  value->as.obj = (Obj *)(image + offset);
+  return true;
+}
+
+/**
+ * Relocate an offset of part of an object (a function's code, lines or
+ * constants, a table's entries or an instance's fields)
+ *
+ * @returns False if the part doesn't lie within the image's objects */
+static bool relocatePart(char *image, void *part, size_t size) {
+  // The pointer has the part's own type, so it's read and written as bytes
+  // (through a void ** the compiler may keep using what it loaded before)
+  uintptr_t offset;
+  memcpy(&offset, part, sizeof(offset));
+  if (offset < sizeof(ImageHeader) || offset % IMAGE_ALIGN != 0 ||
+      !within(offset, size, ((ImageHeader *)image)->objectsEnd))
+    return false;
+  char *relocated = image + offset;
+  memcpy(part, &relocated, sizeof(relocated));
+  return true;
+}
+
+/**
+ * Relocate a pointer to an object of an image, which can't be NULL
+ *
+ * @returns False if it doesn't point at an object of the given type */
+static bool relocateObject(char *image, void *pointer, ObjType type) {
+  // As with relocatePart, the pointer is to a more specific type than Obj, so
+  // writing it through an Obj ** could leave the field's old value in use
+  Obj *object;
+  memcpy(&object, pointer, sizeof(object));
+  Value value = OBJ_VAL(object);
+  if (!relocate(image, &value) || OBJ_TYPE(value) != type)
+    return false;
+  object = AS_OBJ(value);
+  memcpy(pointer, &object, sizeof(object));
+  return true;
+}
+
+/**
+ * Relocate the entries of a table
+ *
+ * @returns False if one points outside the image's objects, or none is empty
+ * (probing for a missing key would never stop) */
+static bool relocateEntries(char *image, Entry *entries, int capacity) {
+  bool empty = capacity == 0;
+  for (int i = 0; i < capacity; i++) {
+    if (!relocate(image, &entries[i].key) ||
+        !relocate(image, &entries[i].value))
+      return false;
+    empty |= IS_NIL(entries[i].key) && IS_NIL(entries[i].value);
+  }
+  return empty;
+}
+
+/**
+ * Relocate a table held by an object of an image in place, with its entries
+ *
+ * @returns False if it points outside the image's objects */
+static bool relocateTable(char *image, Table *table) {
+  // Tables are probed with a mask, so capacities are powers of two
+  if (table->count < 0 || table->capacity < table->count ||
+      (table->capacity & (table->capacity - 1)) != 0 ||
+      !relocatePart(image, &table->entries, sizeof(Entry) * table->capacity))
+    return false;
+  return relocateEntries(image, table->entries, table->capacity);
+}
+
+static uint32_t jumpOperand(uint8_t *code) {
+  return (uint32_t)code[1] << 24 | (uint32_t)code[2] << 16 |
+         (uint32_t)code[3] << 8 | code[4];
+}
+
+/**
+ * Check the operands of an instruction of a function read only what the
+ * function has: constants of its chunk (strings where they name something),
+ * globals of the image, slots of its frame and code after the jump
+ * */
+static bool validOperands(ObjFunction *function, int offset,
+                          int globalCount) {
+  Chunk *chunk = &function->chunk;
+  uint8_t *code = chunk->code + offset;
+  switch (*code) {
+  case OP_CONSTANT:
+    return code[1] < chunk->constants.count;
+  case OP_GET_SUPER:
+  case OP_SUPER_INVOKE:
+    // The lookup starts at the superclass of the method's class
+    if (function->owner == NULL || function->owner->superclass == NULL)
+      return false;
+    // Fall through
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_INVOKE:
+  case OP_CLASS:
+  case OP_METHOD:
+    return code[1] < chunk->constants.count &&
+           isString(chunk->constants.values[code[1]]);
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    return (code[1] << 8 | code[2]) < globalCount;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    return code[1] < function->maxSlots;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    return jumpOperand(code) < (uint32_t)(chunk->count - offset - 5);
+  default:
+    return *code <= OP_RETURN;
+  }
+}
+
+/**
+ * Check a function's bytecode: every instruction is one the VM knows with
+ * valid operands, the last is a return ending where the code does (so
+ * neither running nor walking them to number the caches leaves it) and jumps
+ * land on instructions
+ *
+ * What the instructions do to the stack is not checked: an image can still
+ * make a function pop more than it pushed.
+ * */
+static bool validCode(ObjFunction *function, int globalCount) {
+  Chunk *chunk = &function->chunk;
+  if (function->arity < 0 || function->maxSlots <= function->arity ||
+      function->maxSlots > STACK_MAX)
+    return false;
+  // Where each instruction starts
+  bool *starts = calloc(chunk->count + 1, sizeof(bool));
+  if (starts == NULL)
+    exit(1);
+  bool valid = true;
+  int offset = 0;
+  int last = -1;
+  while (valid && offset < chunk->count) {
+    starts[offset] = true;
+    last = offset;
+    int length = instructionLength(chunk->code[offset]);
+    valid = offset + length <= chunk->count &&
+            validOperands(function, offset, globalCount);
+    offset += length;
+  }
+  valid = valid && last >= 0 && chunk->code[last] == OP_RETURN;
+  // Jumps only go forward, so their targets are all known now
+  for (offset = 0; valid && offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    uint8_t *code = chunk->code + offset;
+    if (*code == OP_JUMP || *code == OP_JUMP_IF_FALSE ||
+        *code == OP_JUMP_IF_TRUE) {
+      valid = starts[offset + 5 + jumpOperand(code)];
+    }
+  }
+  free(starts);
+  return valid;
+}
+
+/**
+ * Relocate an object of an image in place, with what follows it
+ *
+ * @returns False if it points outside the image's objects */
+static bool relocateInPlace(char *image, Obj *object) {
+  size_t end = ((ImageHeader *)image)->objectsEnd;
+  size_t offset = (char *)object - image;
+  switch (object->type) {
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    Chunk *chunk = &function->chunk;
+    int count = chunk->constants.count;
+    if (offset + sizeof(ObjFunction) > end || chunk->count < 0 ||
+        count < 0 ||
+        !relocatePart(image, &chunk->code, chunk->count) ||
+        !relocatePart(image, &chunk->lines, sizeof(int) * chunk->count) ||
+        !relocatePart(image, &chunk->constants.values, sizeof(Value) * count) ||
+        !relocate(image, &function->name) ||
+        !(IS_NIL(function->name) || isString(function->name)) ||
+        (function->owner != NULL &&
+         !relocateObject(image, &function->owner, OBJ_CLASS)) ||
+        chunk->caches != NULL)
+      return false;
+    for (int constant = 0; constant < count; constant++) {
+      if (!relocate(image, &chunk->constants.values[constant]))
+        return false;
+    }
+    return validCode(function, ((ImageHeader *)image)->globalCount);
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    // Each shape has one field more than its parent (and the root none), so
+    // chains end and field indices stay within an instance's fields
+    return offset + sizeof(ObjShape) <= end &&
+           relocateObject(image, &shape->klass, OBJ_CLASS) &&
+           (shape->parent == NULL
+                ? shape->count == 0
+                : relocateObject(image, &shape->parent, OBJ_SHAPE) &&
+                      shape->count > 0 &&
+                      shape->parent->count == shape->count - 1) &&
+           relocate(image, &shape->name) &&
+           (IS_NIL(shape->name) || isString(shape->name)) &&
+           relocateTable(image, &shape->transitions);
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    return offset + sizeof(ObjClass) <= end && klass->fieldCount >= 0 &&
+           relocate(image, &klass->name) && isString(klass->name) &&
+           (klass->superclass == NULL ||
+            relocateObject(image, &klass->superclass, OBJ_CLASS)) &&
+           relocateObject(image, &klass->shape, OBJ_SHAPE) &&
+           (klass->initializer == NULL ||
+            relocateObject(image, &klass->initializer, OBJ_FUNCTION)) &&
+           relocateTable(image, &klass->methods);
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    if (offset + sizeof(ObjInstance) > end ||
+        !relocateObject(image, &instance->shape, OBJ_SHAPE) ||
+        instance->capacity < instance->shape->count ||
+        !relocatePart(image, &instance->fields,
+                      sizeof(Value) * instance->capacity))
+      return false;
+    for (int i = 0; i < instance->capacity; i++) {
+      if (!relocate(image, &instance->fields[i]))
+        return false;
+    }
+    return true;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    // Maps are probed a whole group at a time, with a mask
+    if (offset + sizeof(ObjMap) > end || map->capacity < 0 ||
+        (map->capacity & (map->capacity - 1)) != 0 ||
+        map->capacity % MAP_GROUP_SIZE != 0 ||
+        !relocatePart(image, &map->control, map->capacity) ||
+        !relocatePart(image, &map->entries, sizeof(MapEntry) * map->capacity))
+      return false;
+    for (int i = 0; i < map->capacity; i++) {
+      if (!(map->control[i] & 0x80) &&
+          (!relocate(image, &map->entries[i].key) ||
+           !relocate(image, &map->entries[i].value)))
+        return false;
+    }
+    return true;
+  }
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    return offset + sizeof(ObjBoundMethod) <= end &&
+           relocate(image, &bound->receiver) &&
+           relocateObject(image, &bound->method, OBJ_FUNCTION);
+  }
+  case OBJ_NATIVE: {
+    ObjNative *native = (ObjNative *)object;
+    if (offset + sizeof(ObjNative) > end ||
+        !relocate(image, &native->name) || !isString(native->name))
+      return false;
+    // Natives of the build (and those the host registered before loading)
+    // are the same in every process
+    return findNative(native);
+  }
+  default:
+    return false;
+  }
+}
+
+/**
+ * Check that each of a shape's transitions leads to a child of it, so adding
+ * a field moves an instance to a shape counting one more field */
+static bool validTransitions(ObjShape *shape) {
+  Table *transitions = &shape->transitions;
+  for (int i = 0; i < transitions->capacity; i++) {
+    Entry *entry = &transitions->entries[i];
+    if (!IS_NIL(entry->key) &&
+        (!isObjType(entry->value, OBJ_SHAPE) ||
+         ((ObjShape *)AS_OBJ(entry->value))->parent != shape))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Relocate the objects of an image that hold pointers in place
+ *
+ * @returns False if one of them points outside the image's objects */
+static bool relocateObjects(char *image) {
+  ImageHeader *header = (ImageHeader *)image;
+  uint64_t *offsets = (uint64_t *)(image + header->objects);
+  for (int i = 0; i < header->objectCount; i++) {
+    Value value;
+    value.type = VAL_OBJ;
+    value.as.obj = (Obj *)(uintptr_t)offsets[i];
+    if (!relocate(image, &value) || !relocateInPlace(image, AS_OBJ(value)))
+      return false;
+  }
+  // Once every parent is relocated, a shape's transitions can be checked to
+  // lead to its children
+  for (int i = 0; i < header->objectCount; i++) {
+    Obj *object = (Obj *)(image + offsets[i]);
+    if (object->type == OBJ_SHAPE && !validTransitions((ObjShape *)object))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Copy a table held by an object of an image to the heap */
+static void copyTable(Table *table) {
+  Entry *entries = table->entries;
+  table->entries =
+      table->capacity > 0 ? ALLOCATE(Entry, table->capacity) : NULL;
+  if (table->capacity > 0)
+    memcpy(table->entries, entries, sizeof(Entry) * table->capacity);
+}
+
+/**
+ * Give the relocated objects of an image what they change at runtime on the
+ * heap, or free it again
+ *
+ * @param release True to free what an earlier call allocated */
+static void copyObjects(char *image, bool release) {
+  ImageHeader *header = (ImageHeader *)image;
+  uint64_t *offsets = (uint64_t *)(image + header->objects);
+  for (int i = 0; i < header->objectCount; i++) {
+    Obj *object = (Obj *)(image + offsets[i]);
+    switch (object->type) {
+    case OBJ_FUNCTION: {
+      Chunk *chunk = &((ObjFunction *)object)->chunk;
+      if (release)
+        free(chunk->caches);
+      else
+        initCaches(chunk);
+      break;
+    }
+    case OBJ_SHAPE: {
+      Table *transitions = &((ObjShape *)object)->transitions;
+      if (release)
+        freeTable(transitions);
+      else
+        copyTable(transitions);
+      break;
+    }
+    case OBJ_CLASS: {
+      Table *methods = &((ObjClass *)object)->methods;
+      if (release)
+        freeTable(methods);
+      else
+        copyTable(methods);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance *)object;
+      Value *fields = instance->fields;
+      if (release) {
+        FREE_ARRAY(Value, fields, instance->capacity);
+      } else {
+        instance->fields = instance->capacity > 0
+                               ? ALLOCATE(Value, instance->capacity)
+                               : NULL;
+        if (instance->capacity > 0)
+          memcpy(instance->fields, fields,
+                 sizeof(Value) * instance->capacity);
+      }
+      break;
+    }
+    case OBJ_MAP:
+      if (release)
+        clearMap((ObjMap *)object);
+      else
+        rebuildMap((ObjMap *)object);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/**
+ * Copy a table's entries out of an image, relocating them
+ *
+ * @returns False if an entry points outside the image's objects */
+static bool loadTable(char *image, size_t offset, int count, int capacity,
+                      Table *table) {
+  table->count = count;
+  table->capacity = capacity;
+  table->entries = capacity > 0 ? ALLOCATE(Entry, capacity) : NULL;
+  if (capacity > 0)
+    memcpy(table->entries, image + offset, sizeof(Entry) * capacity);
+  return relocateEntries(image, table->entries, capacity);
+}
+
+/**
+ * Copy an array of values out of an image, relocating them
+ *
+ * @returns False if a value points outside the image's objects */
+static bool loadValues(char *image, size_t offset, int count,
+                       ValueArray *array) {
+  array->count = count;
+  array->capacity = count;
+  array->values = count > 0 ? ALLOCATE(Value, count) : NULL;
+  if (count > 0)
+    memcpy(array->values, image + offset, sizeof(Value) * count);
+  for (int i = 0; i < count; i++) {
+    if (!relocate(image, &array->values[i]))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Check what the VM assumes of the tables and arrays copied out of an image:
+ * interned strings are heap strings, every global is named by a string, and
+ * the slot of each name is one of the globals
+ * */
+static bool validGlobals(Table *strings, Table *slots, ValueArray *names) {
+  for (int i = 0; i < strings->capacity; i++) {
+    Entry *entry = &strings->entries[i];
+    if (!IS_NIL(entry->key) && !IS_HEAP_STRING(entry->key))
+      return false;
+  }
+  for (int i = 0; i < names->count; i++) {
+    if (!isString(names->values[i]))
+      return false;
+  }
+  for (int i = 0; i < slots->capacity; i++) {
+    Entry *entry = &slots->entries[i];
+    if (IS_NIL(entry->key))
+      continue;
+    if (!isString(entry->key) || !IS_NUMBER(entry->value))
+      return false;
+    double slot = AS_NUMBER(entry->value);
+    if (!(slot >= 0 && slot < names->count) || slot != (int)slot)
+      return false;
+  }
+  return true;
+}
+
+bool loadImage(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      (size_t)status.st_size < sizeof(ImageHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)status.st_size;
+  // Private and writable, since the collector marks the objects in place
+  char *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return false;
+
+  ImageHeader *header = (ImageHeader *)image;
+  inPlace = NULL;
+  if (!validHeader(header, size) || !findInPlace(image)) {
+    free(inPlace);
+    inPlace = NULL;
+    munmap(image, size);
+    return false;
+  }
+
+  // Nothing in the VM can reach the new arrays until they're all loaded
+  Table strings, slots;
+  ValueArray names, values;
+  initTable(&strings);
+  initTable(&slots);
+  initValueArray(&names);
+  initValueArray(&values);
+  int count = header->globalCount;
+  bool valid =
+      loadTable(image, header->strings, header->stringCount,
+                header->stringCapacity, &strings) &&
+      loadTable(image, header->slots, header->slotCount,
+                header->slotCapacity, &slots) &&
+      loadValues(image, header->globals, count, &names) &&
+      loadValues(image, header->globals + sizeof(Value) * count, count,
+                 &values) &&
+      validGlobals(&strings, &slots, &names) && relocateObjects(image);
+  free(inPlace);
+  inPlace = NULL;
+  if (!valid) {
+    freeTable(&strings);
+    freeTable(&slots);
+    freeValueArray(&names);
+    freeValueArray(&values);
+    munmap(image, size);
+    return false;
+  }
+
+  copyObjects(image, false);
+  freeTable(&vm->strings);
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->globalValues);
+  vm->strings = strings;
+  vm->globalSlots = slots;
+  vm->globalNames = names;
+  vm->globalValues = values;
+  vm->image = image;
+  vm->imageSize = size;
+  return true;
+}
+
+void unmapImage() {
+  if (vm->image == NULL)
+    return;
+  copyObjects(vm->image, true);
+  munmap(vm->image, vm->imageSize);
+  vm->image = NULL;
+  vm->imageSize = 0;
+}
@@ -0,0 +1,464 @@
+// Std library includes
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local Includes
+#include "io.h"
+
+// Completions carrying this are the I/O thread's own wake up reads
+#define IO_WAKE_DATA 0
+// Completions carrying this are of the I/O thread's cancellations
+#define IO_CANCEL_DATA 1
+// Most bytes one transfer on the ring asks for (lengths are 32 bit)
+#define IO_TRANSFER_MAX (1u << 30)
+
+/**
+ * The process's I/O engine, started by the first request.
+ * */
+typedef struct {
+  pthread_once_t once;       //! Starts the engine
+  bool uring;                //! Whether requests go through io_uring
+  pthread_mutex_t lock;      //! Protects the queue
+  pthread_cond_t queued;     //! Signalled when requests are queued (pool)
+  IoRequest *head;           //! First queued request
+  IoRequest *tail;           //! Last queued request
+  IoRequest *cancels;        //! Requests to cancel (through nextCancel)
+  int ring;                  //! io_uring file descriptor
+  int wake;                  //! eventfd the I/O thread keeps a read pending on
+  uint64_t wakeCount;        //! Buffer of that read
+  unsigned *sqTail;          //! Submission queue tail
+  unsigned sqMask;           //! Submission queue index mask
+  unsigned *sqArray;         //! Submission queue, of indices into sqes
+  struct io_uring_sqe *sqes; //! Submission queue entries
+  unsigned *cqHead;          //! Completion queue head
+  unsigned *cqTail;          //! Completion queue tail (moved by the kernel)
+  unsigned cqMask;           //! Completion queue index mask
+  struct io_uring_cqe *cqes; //! Completion queue entries
+  unsigned entries;          //! Size of the submission queue
+} IoEngine;
+
+static IoEngine io = {.once = PTHREAD_ONCE_INIT,
+                      .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .queued = PTHREAD_COND_INITIALIZER};
+
+/**
+ * A thread waiting for a request in waitForIo.
+ * */
+typedef struct {
+  pthread_mutex_t lock; //! Protects done
+  pthread_cond_t woken; //! Signalled when the request completes
+  bool done;            //! Whether the request completed
+} IoWaiter;
+
+/**
+ * Fail a request that's being cancelled
+ *
+ * @returns True if it's done (cancelled), false if it can go on */
+static bool stopIfCancelled(IoRequest *request) {
+  if (!__atomic_load_n(&request->cancelled, __ATOMIC_ACQUIRE))
+    return false;
+  request->error = ECANCELED;
+  return true;
+}
+
+/**
+ * Account for one transfer of a request
+ *
+ * @param transferred Bytes transferred, or -errno
+ *
+ * @returns True if the request is done, false if it needs another transfer
+ * */
+static bool advance(IoRequest *request, ssize_t transferred) {
+  if (stopIfCancelled(request))
+    return true;
+  if (transferred == -EINTR || transferred == -EAGAIN)
+    return false;
+  if (transferred < 0) {
+    request->error = (int)-transferred;
+    return true;
+  }
+  size_t start = request->length;
+  request->length += (size_t)transferred;
+  if (request->operation == IO_WRITE) {
+    // A write that can't make progress would loop forever
+    if (transferred == 0 && request->length < request->size)
+      request->error = EIO;
+    return transferred == 0 || request->length == request->size;
+  }
+
+  if (transferred == 0) {
+    request->end = true;
+    return true;
+  }
+  if (request->until >= 0 &&
+      memchr(request->buffer + start, request->until, transferred) != NULL)
+    return true;
+  if (request->length == request->size) {
+    // Not allocated with reallocate, the I/O thread has no VM
+    request->size *= 2;
+    request->buffer = realloc(request->buffer, request->size);
+    if (request->buffer == NULL)
+      exit(1);
+  }
+  return false;
+}
+
+/**
+ * Take everything queued
+ *
+ * @returns The first request taken (linked through next), or NULL */
+static IoRequest *takeQueued() {
+  pthread_mutex_lock(&io.lock);
+  IoRequest *requests = io.head;
+  io.head = NULL;
+  io.tail = NULL;
+  pthread_mutex_unlock(&io.lock);
+  return requests;
+}
+
+/**
+ * Main loop of a thread of the pool, used without io_uring */
+static void *poolThread(void *unused) {
+  for (;;) {
+    pthread_mutex_lock(&io.lock);
+    while (io.head == NULL) {
+      pthread_cond_wait(&io.queued, &io.lock);
+    }
+    IoRequest *request = io.head;
+    io.head = request->next;
+    if (io.head == NULL)
+      io.tail = NULL;
+    pthread_mutex_unlock(&io.lock);
+
+    // A request cancelled while queued is over already
+    bool done = stopIfCancelled(request);
+    while (!done) {
+      char *at = request->buffer + request->length;
+      size_t left = request->size - request->length;
+      ssize_t transferred = request->operation == IO_READ
+                                ? read(request->fd, at, left)
+                                : write(request->fd, at, left);
+      done = advance(request, transferred < 0 ? -errno : transferred);
+    }
+    request->complete(request);
+  }
+  return NULL;
+}
+
+/**
+ * Add a request's next transfer to the submission queue (which has room)
+ *
+ * @param request The request, or NULL for a read of the wake up eventfd */
+static void prepareTransfer(IoRequest *request) {
+  unsigned tail = *io.sqTail;
+  unsigned index = tail & io.sqMask;
+  struct io_uring_sqe *sqe = &io.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  if (request == NULL) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = io.wake;
+    sqe->addr = (uint64_t)(uintptr_t)&io.wakeCount;
+    sqe->len = sizeof(io.wakeCount);
+    sqe->user_data = IO_WAKE_DATA;
+  } else {
+    size_t left = request->size - request->length;
+    sqe->opcode =
+        request->operation == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(request->buffer + request->length);
+    sqe->len = (uint32_t)(left > IO_TRANSFER_MAX ? IO_TRANSFER_MAX : left);
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+  }
+  // The file's current position
+  sqe->off = (uint64_t)-1;
+  io.sqArray[index] = index;
+  __atomic_store_n(io.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Add the cancellation of a request's transfer in flight to the submission
+ * queue (which has room) */
+static void prepareCancel(IoRequest *request) {
+  unsigned tail = *io.sqTail;
+  unsigned index = tail & io.sqMask;
+  struct io_uring_sqe *sqe = &io.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uint64_t)(uintptr_t)request;
+  sqe->user_data = IO_CANCEL_DATA;
+  io.sqArray[index] = index;
+  __atomic_store_n(io.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Main loop of the I/O thread, with io_uring */
+static void *ringThread(void *unused) {
+  // Requests waiting for room on the ring, in order
+  IoRequest *backlog = NULL;
+  IoRequest **backlogEnd = &backlog;
+  bool wakeArmed = false;
+  unsigned inFlight = 0;
+  unsigned prepared = 0;
+
+  for (;;) {
+    // Everything queued since the last time goes out in the next submission
+    IoRequest *queued = takeQueued();
+    *backlogEnd = queued;
+    while (*backlogEnd != NULL) {
+      backlogEnd = &(*backlogEnd)->next;
+    }
+    if (!wakeArmed) {
+      prepareTransfer(NULL);
+      wakeArmed = true;
+      inFlight++;
+      prepared++;
+    }
+    // Requests submitted from here on only go out in the next submission,
+    // so a cancelled request freed before this one can't be mistaken for
+    // one in flight (its waiter takes it off the list once it's complete)
+    pthread_mutex_lock(&io.lock);
+    while (io.cancels != NULL && inFlight < io.entries) {
+      prepareCancel(io.cancels);
+      io.cancels = io.cancels->nextCancel;
+      inFlight++;
+      prepared++;
+    }
+    pthread_mutex_unlock(&io.lock);
+    while (backlog != NULL && inFlight < io.entries) {
+      IoRequest *request = backlog;
+      backlog = request->next;
+      if (backlog == NULL)
+        backlogEnd = &backlog;
+      // A request cancelled before its next transfer is over already
+      if (stopIfCancelled(request)) {
+        request->complete(request);
+        continue;
+      }
+      prepareTransfer(request);
+      inFlight++;
+      prepared++;
+    }
+
+    int submitted = (int)syscall(__NR_io_uring_enter, io.ring, prepared, 1,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted > 0)
+      prepared -= (unsigned)submitted;
+
+    unsigned head = *io.cqHead;
+    unsigned tail = __atomic_load_n(io.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &io.cqes[head & io.cqMask];
+      inFlight--;
+      if (cqe->user_data == IO_WAKE_DATA) {
+        wakeArmed = false;
+        continue;
+      }
+      if (cqe->user_data == IO_CANCEL_DATA)
+        continue;
+      IoRequest *request = (IoRequest *)(uintptr_t)cqe->user_data;
+      if (advance(request, cqe->res)) {
+        request->complete(request);
+      } else {
+        // Next transfer first, ahead of what's waiting
+        request->next = backlog;
+        if (backlog == NULL)
+          backlogEnd = &request->next;
+        backlog = request;
+      }
+    }
+    __atomic_store_n(io.cqHead, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/**
+ * Set up io_uring and map its queues
+ *
+ * @returns False if io_uring can't be used */
+static bool setupRing() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  io.ring = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+  if (io.ring < 0)
+    return false;
+  // Transfers rely on the kernel keeping track of the file position
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(io.ring);
+    return false;
+  }
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cqSize > sqSize)
+    sqSize = cqSize;
+  char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io.ring, IORING_OFF_SQ_RING);
+  char *cq = single ? sq
+                    : mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, io.ring,
+                           IORING_OFF_CQ_RING);
+  io.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io.ring,
+                 IORING_OFF_SQES);
+  io.wake = eventfd(0, EFD_CLOEXEC);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || io.sqes == MAP_FAILED ||
+      io.wake < 0) {
+    // Nothing was submitted yet, so the mappings just stay unused
+    close(io.ring);
+    return false;
+  }
+
+  io.sqTail = (unsigned *)(sq + params.sq_off.tail);
+  io.sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  io.sqArray = (unsigned *)(sq + params.sq_off.array);
+  io.cqHead = (unsigned *)(cq + params.cq_off.head);
+  io.cqTail = (unsigned *)(cq + params.cq_off.tail);
+  io.cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  io.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  io.entries = params.sq_entries;
+  return true;
+}
+
+/**
+ * Start the I/O thread (or the pool), once per process */
+static void startIo() {
+#ifdef DEBUG_IO_THREADS
+  io.uring = false;
+#else
+  io.uring = setupRing();
+#endif
+  int threads = io.uring ? 1 : IO_POOL_THREADS;
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, io.uring ? ringThread : poolThread,
+                       NULL) == 0) {
+      pthread_detach(thread);
+      started++;
+    }
+  }
+  // Requests would never complete
+  if (started == 0)
+    exit(1);
+}
+
+void submitIo(IoRequest *request) {
+  if (request->operation == IO_WRITE && request->size == 0) {
+    request->complete(request);
+    return;
+  }
+  pthread_once(&io.once, startIo);
+
+  request->next = NULL;
+  request->nextCancel = NULL;
+  request->cancelled = false;
+  pthread_mutex_lock(&io.lock);
+  bool first = io.head == NULL;
+  if (io.tail != NULL) {
+    io.tail->next = request;
+  } else {
+    io.head = request;
+  }
+  io.tail = request;
+  if (!io.uring)
+    pthread_cond_signal(&io.queued);
+  pthread_mutex_unlock(&io.lock);
+
+  // The I/O thread takes the whole queue when it wakes up, so only the
+  // first request since then needs to wake it
+  if (io.uring && first) {
+    uint64_t one = 1;
+    if (write(io.wake, &one, sizeof(one)) < 0)
+      exit(1);
+  }
+}
+
+/**
+ * Wake the thread waiting for a request */
+static void wakeWaiter(IoRequest *request) {
+  IoWaiter *waiter = request->data;
+  pthread_mutex_lock(&waiter->lock);
+  waiter->done = true;
+  pthread_cond_signal(&waiter->woken);
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+/**
+ * Have a request stop as soon as it can: before its next transfer, or at
+ * once for a transfer on the ring */
+static void cancelIo(IoRequest *request) {
+  pthread_mutex_lock(&io.lock);
+  __atomic_store_n(&request->cancelled, true, __ATOMIC_RELEASE);
+  if (io.uring) {
+    request->nextCancel = io.cancels;
+    io.cancels = request;
+  }
+  pthread_mutex_unlock(&io.lock);
+  if (io.uring) {
+    uint64_t one = 1;
+    if (write(io.wake, &one, sizeof(one)) < 0)
+      exit(1);
+  }
+}
+
+/**
+ * Take a completed request off the list of requests to cancel, if the I/O
+ * thread hasn't yet */
+static void forgetCancel(IoRequest *request) {
+  pthread_mutex_lock(&io.lock);
+  for (IoRequest **link = &io.cancels; *link != NULL;
+       link = &(*link)->nextCancel) {
+    if (*link == request) {
+      *link = request->nextCancel;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&io.lock);
+}
+
+bool waitForIo(IoRequest *request, uint64_t deadline) {
+  IoWaiter waiter;
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.woken, &attributes);
+  pthread_condattr_destroy(&attributes);
+  waiter.done = false;
+  request->complete = wakeWaiter;
+  request->data = &waiter;
+  submitIo(request);
+
+  struct timespec until = {.tv_sec = (time_t)(deadline / 1000000000u),
+                           .tv_nsec = (long)(deadline % 1000000000u)};
+  bool cancelled = false;
+  pthread_mutex_lock(&waiter.lock);
+  while (!waiter.done) {
+    if (deadline == 0 || cancelled) {
+      pthread_cond_wait(&waiter.woken, &waiter.lock);
+    } else if (pthread_cond_timedwait(&waiter.woken, &waiter.lock, &until) ==
+                   ETIMEDOUT &&
+               !waiter.done) {
+      // Still waited for, the request has the buffer until it completes
+      cancelIo(request);
+      cancelled = true;
+    }
+  }
+  pthread_mutex_unlock(&waiter.lock);
+  pthread_mutex_destroy(&waiter.lock);
+  pthread_cond_destroy(&waiter.woken);
+  if (cancelled)
+    forgetCancel(request);
+  return !cancelled;
+}
@@ -16,14 +16,26 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "emit.h"
+#include "image.h"
+#include "output.h"
+#include "perf.h"
+#include "profile.h"
+#include "scanner.h"
+#include "serve.h"
 #include "vm.h"
 
+// The one VM used by the interpreter
+static VM mainVM;
+
 /**
  * Run the repl (Read-Eval-Print-Loop)
  * */
 static void repl() {
   char line[1024];
   for (;;) {
+    // Results of the previous line need to show up before the prompt
+    flushOutput(&vm->output);
     printf("> ");
 
     if (!fgets(line, sizeof(line), stdin)) {
@@ -84,30 +96,200 @@ static char *readFile(const char *path) {
  * Run the code in a lox file
  *
  * @param char* Path to file to run
+ *
+ * @return Exit status for the process
  * */
-static void runFile(const char *path) {
+static int runFile(const char *path) {
   char *source = readFile(path);
   InterpretResult result = interpret(source);
   free(source);
 
   if (result == INTERPRET_COMPILE_ERROR)
-    exit(65);
+    return 65;
   if (result == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+    return 70;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Translate a lox file into a C program
+ *
+ * @param char* Path to the file to translate
+ * @param char* Path of the C file to write (NULL for stdout)
+ *
+ * @return Exit status for the process
+ * */
+static int emitFile(const char *path, const char *outputPath) {
+  char *source = readFile(path);
+  FrozenChunk *frozen = compileSource(source);
+  free(source);
+  if (frozen == NULL)
+    return 65;
+
+  FILE *file = outputPath != NULL ? fopen(outputPath, "w") : stdout;
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+    releaseChunk(frozen);
+    return 74;
+  }
+  bool written = emitC(&frozen->chunk, path, file);
+  if (outputPath != NULL)
+    written = fclose(file) == 0 && written;
+  releaseChunk(frozen);
+
+  if (!written) {
+    fprintf(stderr, "Could not write the C translation.\n");
+    return 74;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Print usage information and exit
+ * */
+static void usage() {
+  fprintf(stderr, "Usage: clox [--sample-profile[=file]] "
+                  "[--perf-stats[=file]] [--gc-stats] "
+                  "[--gc-pause=microseconds] [--lex-threads=count] "
+                  "[--emit-c[=file]] [--image=file] [--save-image=file] "
+                  "[path]\n"
+                  "       clox --serve [--image=file] [--workers=count] "
+                  "[--timeout=milliseconds] socket\n");
+  exit(64);
 }
 
 int main(int argc, char *argv[]) {
-  initVM();
+  // Options come before the path
+  const char *profilePath = NULL;
+  const char *perfPath = NULL;
+  bool gcStats = false;
+  long gcPause = -1;
+  bool emit = false;
+  const char *emitPath = NULL;
+  const char *imagePath = NULL;
+  const char *saveImagePath = NULL;
+  bool daemon = false;
+  ServeOptions serveOptions = {NULL, 0, 0};
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--sample-profile") == 0) {
+      profilePath = PROFILE_FILE_DEFAULT;
+    } else if (strncmp(argv[arg], "--sample-profile=", 17) == 0) {
+      profilePath = argv[arg] + 17;
+    } else if (strcmp(argv[arg], "--perf-stats") == 0) {
+      perfPath = PERF_FILE_DEFAULT;
+    } else if (strncmp(argv[arg], "--perf-stats=", 13) == 0) {
+      perfPath = argv[arg] + 13;
+    } else if (strcmp(argv[arg], "--emit-c") == 0) {
+      emit = true;
+    } else if (strncmp(argv[arg], "--emit-c=", 9) == 0) {
+      emit = true;
+      emitPath = argv[arg] + 9;
+    } else if (strncmp(argv[arg], "--image=", 8) == 0) {
+      imagePath = argv[arg] + 8;
+    } else if (strncmp(argv[arg], "--save-image=", 13) == 0) {
+      saveImagePath = argv[arg] + 13;
+    } else if (strcmp(argv[arg], "--serve") == 0) {
+      daemon = true;
+    } else if (strncmp(argv[arg], "--workers=", 10) == 0) {
+      char *end;
+      long workers = strtol(argv[arg] + 10, &end, 10);
+      if (end == argv[arg] + 10 || *end != '\0' || workers <= 0)
+        usage();
+      serveOptions.workers = workers > INT32_MAX ? INT32_MAX : (int)workers;
+    } else if (strncmp(argv[arg], "--timeout=", 10) == 0) {
+      char *end;
+      long timeout = strtol(argv[arg] + 10, &end, 10);
+      if (end == argv[arg] + 10 || *end != '\0' || timeout <= 0 ||
+          timeout > UINT32_MAX)
+        usage();
+      serveOptions.timeout = (uint32_t)timeout;
+    } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strncmp(argv[arg], "--lex-threads=", 14) == 0) {
+      char *end;
+      long threads = strtol(argv[arg] + 14, &end, 10);
+      if (end == argv[arg] + 14 || *end != '\0' || threads <= 0)
+        usage();
+      scanThreads = threads > SCAN_THREADS_MAX ? SCAN_THREADS_MAX : threads;
+    } else if (strncmp(argv[arg], "--gc-pause=", 11) == 0) {
+      char *end;
+      gcPause = strtol(argv[arg] + 11, &end, 10);
+      if (end == argv[arg] + 11 || *end != '\0' || gcPause <= 0)
+        usage();
+    } else {
+      usage();
+    }
+  }
 
-  if (argc == 1) {
+  if (daemon) {
+    // Workers have VMs of their own, started from the image
+    if (arg != argc - 1)
+      usage();
+    serveOptions.imagePath = imagePath;
+    return serve(argv[arg], &serveOptions);
+  }
+
+  // The script runs with the globals of the image already defined
+  if (!initVM(&mainVM, imagePath)) {
+    fprintf(stderr, "Could not load image \"%s\".\n", imagePath);
+    freeVM();
+    return 74;
+  }
+  vm->gc.logCycles = gcStats;
+  if (gcPause > 0)
+    vm->gc.pauseBudgetNs = (uint64_t)gcPause * 1000;
+  if (profilePath != NULL)
+    startProfile();
+  if (perfPath != NULL)
+    startPerf();
+
+  int status = EXIT_SUCCESS;
+  if (emit) {
+    // Translating needs a script to translate
+    if (arg != argc - 1)
+      usage();
+    status = emitFile(argv[arg], emitPath);
+  } else if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (arg == argc - 1) {
+    status = runFile(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    usage();
+  }
+
+  // The image holds the globals left by a script that ran successfully
+  if (saveImagePath != NULL && status == EXIT_SUCCESS &&
+      !saveImage(saveImagePath)) {
+    fprintf(stderr, "Could not write image \"%s\".\n", saveImagePath);
+    status = 74;
+  }
+
+  if (profilePath != NULL) {
+    stopProfile();
+    writeProfileReport(stderr);
+    if (!writeProfileStacks(profilePath)) {
+      fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+    }
+  }
+
+  if (perfPath != NULL && !stopPerf(perfPath, vm->instructionCount)) {
+    fprintf(stderr, "Could not write performance counters \"%s\".\n",
+            perfPath);
+  }
+
+  if (gcStats) {
+    fprintf(stderr, "gc: %llu cycles, heap %zu bytes\n",
+            (unsigned long long)vm->gc.cycles, vm->gc.bytesAllocated);
+    SlabStats slabs;
+    slabStats(&vm->slabs, &slabs);
+    fprintf(stderr,
+            "slabs: %zu blocks (%zu bytes), %zu bytes asked for in %zu bytes "
+            "of slots, %.1f%% fragmentation; %zu bytes from malloc\n",
+            slabs.blocks, slabs.blockBytes, slabs.requestedBytes,
+            slabs.slotBytes, slabs.fragmentation * 100, slabs.largeBytes);
   }
 
   freeVM();
-  return EXIT_SUCCESS;
+  return status;
 }
@@ -0,0 +1,264 @@
+// Std library includes
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Local Includes
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Control bytes of full slots, the hash bits kept in them
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+// Rest of the hash, picking the first group probed
+#define H1(hash) ((hash) >> 7)
+
+#if defined(__SSE2__)
+
+// The control bytes of a group, in one register
+typedef __m128i Group;
+
+static inline Group loadGroup(const uint8_t *control) {
+  return _mm_loadu_si128((const __m128i *)control);
+}
+
+/**
+ * Find the slots of a group with a given control byte
+ *
+ * @returns A bit for each slot of the group, set where it matches */
+static inline uint32_t matchByte(Group group, uint8_t byte) {
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+/**
+ * Find the empty and deleted slots of a group (the control bytes with the
+ * top bit set) */
+static inline uint32_t matchFree(Group group) {
+  return (uint32_t)_mm_movemask_epi8(group);
+}
+
+#else
+
+// The control bytes of a group, read where they are
+typedef const uint8_t *Group;
+
+static inline Group loadGroup(const uint8_t *control) { return control; }
+
+static inline uint32_t matchByte(Group group, uint8_t byte) {
+  uint32_t mask = 0;
+  for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] == byte) << i;
+  }
+  return mask;
+}
+
+static inline uint32_t matchFree(Group group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+}
+
+#endif
+
+/**
+ * Hash a key, mixing the bits of hashValue (whose low bits are all zero for
+ * many numbers) so that both the control byte and the group are spread */
+static inline uint32_t mapHash(Value key) {
+  uint32_t hash = hashValue(key);
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/**
+ * Find the slot holding a key
+ *
+ * @returns The slot, or -1 if the key isn't in the map */
+static int findSlot(ObjMap *map, Value key, uint32_t hash) {
+  if (map->count == 0)
+    return -1;
+  size_t mask = (size_t)map->capacity / MAP_GROUP_SIZE - 1;
+  size_t group = H1(hash) & mask;
+  // Triangular steps over a power of two visit every group
+  for (size_t step = 1;; step++) {
+    const uint8_t *control = map->control + group * MAP_GROUP_SIZE;
+    Group bytes = loadGroup(control);
+    for (uint32_t match = matchByte(bytes, H2(hash)); match != 0;
+         match &= match - 1) {
+      int slot = (int)(group * MAP_GROUP_SIZE) + __builtin_ctz(match);
+      MapEntry *entry = &map->entries[slot];
+      if (entry->hash == hash && valuesEqual(entry->key, key))
+        return slot;
+    }
+    if (matchByte(bytes, MAP_EMPTY) != 0)
+      return -1;
+    group = (group + step) & mask;
+  }
+}
+
+/**
+ * Find the first empty or deleted slot a key with the given hash can go in
+ * (there's always one, the map is never full) */
+static int findFree(const uint8_t *control, int capacity, uint32_t hash) {
+  size_t mask = (size_t)capacity / MAP_GROUP_SIZE - 1;
+  size_t group = H1(hash) & mask;
+  for (size_t step = 1;; step++) {
+    uint32_t match = matchFree(loadGroup(control + group * MAP_GROUP_SIZE));
+    if (match != 0)
+      return (int)(group * MAP_GROUP_SIZE) + __builtin_ctz(match);
+    group = (group + step) & mask;
+  }
+}
+
+/**
+ * Move the entries to new slots, dropping the tombstones */
+static void resizeMap(ObjMap *map, int capacity) {
+  uint8_t *control = ALLOCATE(uint8_t, capacity);
+  MapEntry *entries = ALLOCATE(MapEntry, capacity);
+  memset(control, MAP_EMPTY, capacity);
+  // The cached hashes save hashing every key again
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->control[i] & 0x80)
+      continue;
+    int slot = findFree(control, capacity, map->entries[i].hash);
+    control[slot] = map->control[i];
+    entries[slot] = map->entries[i];
+  }
+
+  FREE_ARRAY(uint8_t, map->control, map->capacity);
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->control = control;
+  map->entries = entries;
+  map->capacity = capacity;
+  map->deleted = 0;
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value) {
+  if (IS_ROPE(key))
+    key = OBJ_VAL(flattenString(key));
+  int slot = findSlot(map, key, mapHash(key));
+  if (slot < 0)
+    return false;
+  *value = map->entries[slot].value;
+  return true;
+}
+
+bool mapSet(ObjMap *map, Value key, Value value) {
+  if (IS_ROPE(key))
+    key = OBJ_VAL(flattenString(key));
+  uint32_t hash = mapHash(key);
+  int slot = findSlot(map, key, hash);
+  if (slot >= 0) {
+    WRITE_BARRIER(value);
+    map->entries[slot].value = value;
+    return false;
+  }
+
+  if ((map->count + map->deleted + 1) * MAP_MAX_LOAD_DENOMINATOR >
+      map->capacity * MAP_MAX_LOAD_NUMERATOR) {
+    // Twice the slots, unless dropping the tombstones leaves the map at
+    // most half full
+    int capacity = map->capacity == 0 ? MAP_GROUP_SIZE : map->capacity;
+    if ((map->count + 1) * 2 * MAP_MAX_LOAD_DENOMINATOR >
+        capacity * MAP_MAX_LOAD_NUMERATOR)
+      capacity *= 2;
+    resizeMap(map, capacity);
+  }
+
+  slot = findFree(map->control, map->capacity, hash);
+  if (map->control[slot] == MAP_DELETED)
+    map->deleted--;
+  map->control[slot] = H2(hash);
+  map->entries[slot] = (MapEntry){key, value, hash};
+  map->count++;
+  WRITE_BARRIER(key);
+  WRITE_BARRIER(value);
+  return true;
+}
+
+bool mapDelete(ObjMap *map, Value key) {
+  if (IS_ROPE(key))
+    key = OBJ_VAL(flattenString(key));
+  int slot = findSlot(map, key, mapHash(key));
+  if (slot < 0)
+    return false;
+
+  // A lookup stops at the first group with an empty slot, so none went past
+  // this group if it has one, and the slot can be empty again
+  const uint8_t *group = map->control + (slot & ~(MAP_GROUP_SIZE - 1));
+  if (matchByte(loadGroup(group), MAP_EMPTY) != 0) {
+    map->control[slot] = MAP_EMPTY;
+  } else {
+    map->control[slot] = MAP_DELETED;
+    map->deleted++;
+  }
+  map->entries[slot].key = NIL_VAL;
+  map->entries[slot].value = NIL_VAL;
+  map->count--;
+  return true;
+}
+
+void rebuildMap(ObjMap *map) {
+  uint8_t *control = map->control;
+  MapEntry *entries = map->entries;
+  int capacity = map->capacity;
+  map->count = 0;
+  map->deleted = 0;
+  map->capacity = 0;
+  map->control = NULL;
+  map->entries = NULL;
+  for (int i = 0; i < capacity; i++) {
+    if (!(control[i] & 0x80))
+      mapSet(map, entries[i].key, entries[i].value);
+  }
+}
+
+void clearMap(ObjMap *map) {
+  FREE_ARRAY(uint8_t, map->control, map->capacity);
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->count = 0;
+  map->deleted = 0;
+  map->capacity = 0;
+  map->control = NULL;
+  map->entries = NULL;
+}
+
+void mapStats(ObjMap *map, MapStats *stats) {
+  stats->count = map->count;
+  stats->capacity = map->capacity;
+  stats->deleted = map->deleted;
+  stats->load = map->capacity > 0 ? (double)map->count / map->capacity : 0;
+  stats->maxProbe = 0;
+  stats->meanProbe = 0;
+  if (map->count == 0)
+    return;
+
+  // Each key is in the first group of its sequence that has it, so the
+  // probes to find it are the steps to its group
+  size_t mask = (size_t)map->capacity / MAP_GROUP_SIZE - 1;
+  long total = 0;
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->control[i] & 0x80)
+      continue;
+    size_t group = H1(map->entries[i].hash) & mask;
+    int probes = 1;
+    for (size_t step = 1; group != (size_t)i / MAP_GROUP_SIZE; step++) {
+      group = (group + step) & mask;
+      probes++;
+    }
+    total += probes;
+    if (probes > stats->maxProbe)
+      stats->maxProbe = probes;
+  }
+  stats->meanProbe = (double)total / map->count;
+}
@@ -1,22 +1,480 @@
 // Std library Includes
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 // Local Includes
+#include "compiler.h"
+#include "fiber.h"
+#include "map.h"
 #include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Units of work (objects traced or swept) between checks of the clock
+#define GC_CLOCK_INTERVAL 64
+
+#ifndef DEBUG_STRESS_GC
+static void gcStep();
+#endif
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  // If new size is, free the pointer, this can't use realloc with 0 directly
-  // as that may not free depending on implementation
-  // Also makes detecting error state below easier
-  if (newSize == 0) {
-    free(pointer);
-    return NULL;
+  vm->gc.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#else
+    if (vm->gc.bytesAllocated > vm->gc.nextStep)
+      gcStep();
+#endif
   }
 
-  // Use the built in realloc function in the cast where newSize is greater than
-  // 0
-  void *result = realloc(pointer, newSize);
+  return slabReallocate(&vm->slabs, pointer, oldSize, newSize);
+}
+
+void *allocateAligned(size_t alignment, size_t size) {
+  void *result = aligned_alloc(alignment, size);
   if (result == NULL)
     exit(1);
   return result;
 }
+
+void freeAligned(void *pointer, size_t size) { free(pointer); }
+
+/**
+ * Free a single object */
+static void freeObject(Obj *object) {
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+    break;
+  }
+  case OBJ_ROPE:
+    FREE(ObjRope, object);
+    break;
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *)object;
+    reallocate(object, sizeof(ObjArray) + sizeof(double) * array->count, 0);
+    break;
+  }
+  case OBJ_MAP:
+    clearMap((ObjMap *)object);
+    FREE(ObjMap, object);
+    break;
+  case OBJ_FUNCTION:
+    freeChunk(&((ObjFunction *)object)->chunk);
+    FREE(ObjFunction, object);
+    break;
+  case OBJ_SHAPE:
+    freeTable(&((ObjShape *)object)->transitions);
+    FREE(ObjShape, object);
+    break;
+  case OBJ_CLASS:
+    freeTable(&((ObjClass *)object)->methods);
+    FREE(ObjClass, object);
+    break;
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+    FREE(ObjInstance, object);
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+    FREE(ObjBoundMethod, object);
+    break;
+  case OBJ_NATIVE:
+    FREE(ObjNative, object);
+    break;
+  case OBJ_FILE: {
+    // Files being read are on a fiber's stack, so never collected
+    ObjFile *file = (ObjFile *)object;
+    if (file->fd >= 0)
+      close(file->fd);
+    free(file->buffer);
+    FREE(ObjFile, object);
+    break;
+  }
+  }
+}
+
+void initGC() {
+  vm->gc.phase = GC_IDLE;
+  vm->gc.epoch = 0;
+  vm->gc.bytesAllocated = 0;
+  vm->gc.nextGC = GC_INITIAL_HEAP;
+  vm->gc.nextStep = GC_INITIAL_HEAP;
+  vm->gc.lastStep = 0;
+  vm->gc.debt = 0;
+  vm->gc.pauseBudgetNs = GC_PAUSE_BUDGET_DEFAULT;
+  vm->gc.grayStack = NULL;
+  vm->gc.grayCount = 0;
+  vm->gc.grayCapacity = 0;
+  vm->gc.sweepLink = NULL;
+  vm->gc.cycles = 0;
+  vm->gc.logCycles = false;
+}
+
+/**
+ * Monotonic time in nanoseconds */
+static uint64_t gcClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void markObject(Obj *object) {
+  // Outside of a cycle everything counts as reachable
+  if (object == NULL || vm->gc.phase == GC_IDLE ||
+      object->mark == vm->gc.epoch)
+    return;
+  object->mark = vm->gc.epoch;
+
+  // Strings and arrays have no references, so they're finished as soon as
+  // they're marked (while sweeping, marking just keeps an object alive)
+  if (object->type == OBJ_STRING || object->type == OBJ_ARRAY ||
+      vm->gc.phase != GC_MARK)
+    return;
+
+  if (vm->gc.grayCapacity < vm->gc.grayCount + 1) {
+    // Not allocated with reallocate, growing it mustn't start an increment
+    vm->gc.grayCapacity = GROW_CAPACITY(vm->gc.grayCapacity);
+    vm->gc.grayStack = (Obj **)realloc(
+        vm->gc.grayStack, sizeof(Obj *) * vm->gc.grayCapacity);
+    if (vm->gc.grayStack == NULL)
+      exit(1);
+  }
+  vm->gc.grayStack[vm->gc.grayCount++] = object;
+}
+
+void markValue(Value value) {
+  if (IS_OBJ(value))
+    markObject(AS_OBJ(value));
+}
+
+/**
+ * Mark every value in an array */
+static void markArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
+}
+
+/**
+ * Mark the keys and values of a table */
+static void markTable(Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    markValue(table->entries[i].key);
+    markValue(table->entries[i].value);
+  }
+}
+
+/**
+ * Mark the constants of a chunk, and the shapes and methods its inline
+ * caches hold (a shape left in a cache mustn't be freed, or a new one could
+ * take its place and be mistaken for it) */
+static void markChunk(Chunk *chunk) {
+  markArray(&chunk->constants);
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    for (int way = 0; way < CACHE_WAYS; way++) {
+      CacheEntry *entry = &chunk->caches[i].entries[way];
+      markObject((Obj *)entry->shape);
+      markObject((Obj *)entry->next);
+      markObject((Obj *)entry->method);
+    }
+  }
+}
+
+/**
+ * Mark the objects referenced by a gray object */
+static void blackenObject(Obj *object) {
+  switch (object->type) {
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    markValue(rope->left);
+    markValue(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    for (int i = 0; i < map->capacity; i++) {
+      if (map->control[i] & 0x80)
+        continue;
+      markValue(map->entries[i].key);
+      markValue(map->entries[i].value);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    markValue(function->name);
+    markObject((Obj *)function->owner);
+    markChunk(&function->chunk);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markObject((Obj *)shape->klass);
+    markObject((Obj *)shape->parent);
+    markValue(shape->name);
+    markTable(&shape->transitions);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    markValue(klass->name);
+    markObject((Obj *)klass->superclass);
+    markObject((Obj *)klass->shape);
+    markObject((Obj *)klass->initializer);
+    markTable(&klass->methods);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    markObject((Obj *)instance->shape);
+    for (int i = 0; i < instance->shape->count; i++) {
+      markValue(instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    markValue(bound->receiver);
+    markObject((Obj *)bound->method);
+    break;
+  }
+  case OBJ_NATIVE:
+    markValue(((ObjNative *)object)->name);
+    break;
+  case OBJ_STRING:
+  case OBJ_ARRAY:
+  case OBJ_FILE:
+    break;
+  }
+}
+
+/**
+ * Mark the chunks some calls in progress are running (the functions are on
+ * the stack too, but the script's chunk isn't an object) */
+static void markFrames(CallFrame *frames, int count) {
+  for (int i = 0; i < count; i++) {
+    markChunk(frames[i].chunk);
+  }
+}
+
+/**
+ * Mark the roots that are written without a barrier (so are rescanned before
+ * sweeping) */
+static void markVolatileRoots() {
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(*slot);
+  }
+  // Suspended fibers (the running one's state is in the VM)
+  for (Fiber *fiber = vm->fibers; fiber != NULL; fiber = fiber->next) {
+    markValue(fiber->result);
+    if (fiber == vm->fiber)
+      continue;
+    for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++) {
+      markValue(*slot);
+    }
+    markFrames(fiber->frames, fiber->frameCount);
+  }
+  markValue(vm->result);
+  markFrames(vm->frames, vm->frameCount);
+#ifdef DEBUG_BINARY_TRACE
+  // Chunks are added to the trace as they run, without a barrier
+  markTrace(&vm->trace);
+#endif
+  if (vm->chunk != NULL)
+    markChunk(vm->chunk);
+  for (int i = 0; i < vm->scriptCount; i++) {
+    markChunk(&vm->scripts[i]->chunk);
+  }
+  markCompilerRoots();
+}
+
+/**
+ * Start a cycle, marking the roots */
+static void beginCycle() {
+  vm->gc.phase = GC_MARK;
+  vm->gc.epoch++;
+  vm->gc.current = (GCCycleStats){0};
+  vm->gc.current.heapBefore = vm->gc.bytesAllocated;
+
+  // Globals are behind the write barrier, so only need marking once
+  markArray(&vm->globalNames);
+  markArray(&vm->globalValues);
+  markArray(&vm->savedGlobals);
+  markVolatileRoots();
+}
+
+/**
+ * Finish marking, switching to sweeping */
+static void finishMark() {
+  markVolatileRoots();
+  while (vm->gc.grayCount > 0) {
+    blackenObject(vm->gc.grayStack[--vm->gc.grayCount]);
+  }
+  vm->gc.phase = GC_SWEEP;
+  vm->gc.sweepLink = &vm->objects;
+}
+
+/**
+ * Sweep the next object, freeing it if it wasn't marked */
+static void sweepObject() {
+  Obj *object = *vm->gc.sweepLink;
+  if (object->mark == vm->gc.epoch) {
+    vm->gc.sweepLink = &object->next;
+    return;
+  }
+
+  *vm->gc.sweepLink = object->next;
+  // The strings table is weak, dead strings just disappear from it
+  if (object->type == OBJ_STRING)
+    tableDelete(&vm->strings, OBJ_VAL(object));
+  size_t before = vm->gc.bytesAllocated;
+  freeObject(object);
+  vm->gc.current.bytesReclaimed += before - vm->gc.bytesAllocated;
+}
+
+/**
+ * Finish a cycle, setting the heap size that starts the next one */
+static void finishCycle() {
+  vm->gc.phase = GC_IDLE;
+  vm->gc.sweepLink = NULL;
+  vm->gc.nextGC = vm->gc.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if (vm->gc.nextGC < GC_INITIAL_HEAP)
+    vm->gc.nextGC = GC_INITIAL_HEAP;
+  vm->gc.current.heapAfter = vm->gc.bytesAllocated;
+}
+
+/**
+ * Publish the statistics of the cycle that just finished */
+static void reportCycle() {
+  vm->gc.last = vm->gc.current;
+  vm->gc.cycles++;
+  if (vm->gc.logCycles)
+    writeGCStats(stderr, vm->gc.cycles, &vm->gc.last);
+}
+/**
+ * Do one unit of collection work
+ *
+ * @returns False once the cycle is complete
+ * */
+static bool gcWork() {
+  switch (vm->gc.phase) {
+  case GC_IDLE:
+    beginCycle();
+    break;
+  case GC_MARK:
+    if (vm->gc.grayCount > 0) {
+      blackenObject(vm->gc.grayStack[--vm->gc.grayCount]);
+    } else {
+      finishMark();
+    }
+    break;
+  case GC_SWEEP:
+    if (*vm->gc.sweepLink == NULL) {
+      finishCycle();
+      return false;
+    }
+    sweepObject();
+    break;
+  }
+  return true;
+}
+
+/**
+ * Record the length of an increment */
+static void recordPause(uint64_t start) {
+  uint64_t pause = gcClock() - start;
+  vm->gc.current.increments++;
+  vm->gc.current.totalPauseNs += pause;
+  if (pause > vm->gc.current.maxPauseNs)
+    vm->gc.current.maxPauseNs = pause;
+}
+
+// Stress builds collect fully on every allocation instead
+#ifndef DEBUG_STRESS_GC
+/**
+ * Run one increment: work off what the allocations since the last one owe,
+ * stopping early if the pause budget is used up or the cycle completes */
+static void gcStep() {
+  uint64_t start = gcClock();
+  uint64_t deadline = start + vm->gc.pauseBudgetNs;
+  if (vm->gc.phase == GC_IDLE) {
+    // A new cycle starts with the work of one ordinary increment
+    vm->gc.debt = GC_STEP_BYTES / GC_BYTES_PER_UNIT;
+    vm->gc.lastStep = vm->gc.bytesAllocated;
+  }
+  if (vm->gc.bytesAllocated > vm->gc.lastStep) {
+    vm->gc.debt += (int64_t)((vm->gc.bytesAllocated - vm->gc.lastStep) /
+                            GC_BYTES_PER_UNIT);
+  }
+
+  bool working = true;
+  for (int work = 1; vm->gc.debt > 0 || vm->gc.phase == GC_IDLE; work++) {
+    vm->gc.debt--;
+    if (!(working = gcWork()))
+      break;
+    if (work % GC_CLOCK_INTERVAL == 0 && gcClock() >= deadline)
+      break;
+  }
+  recordPause(start);
+  vm->gc.lastStep = vm->gc.bytesAllocated;
+
+  if (!working) {
+    reportCycle();
+    vm->gc.nextStep = vm->gc.nextGC;
+  } else if (vm->gc.debt > 0) {
+    // Out of time, come back sooner rather than doing more in one pause
+    vm->gc.nextStep = vm->gc.bytesAllocated + GC_CATCH_UP_BYTES;
+  } else {
+    vm->gc.nextStep = vm->gc.bytesAllocated + GC_STEP_BYTES;
+  }
+}
+#endif
+
+/**
+ * Run the rest of the current cycle (or a whole new one) in one pause */
+static void runCycle() {
+  uint64_t start = gcClock();
+  while (gcWork())
+    ;
+  recordPause(start);
+  reportCycle();
+}
+
+void collectGarbage() {
+  // A cycle in progress is finished first, its marks are stale
+  if (vm->gc.phase != GC_IDLE)
+    runCycle();
+  runCycle();
+  vm->gc.nextStep = vm->gc.nextGC;
+}
+
+void writeGCStats(FILE *file, uint64_t cycle, const GCCycleStats *stats) {
+  fprintf(file,
+          "gc %llu: %llu pauses (max %.3f ms, total %.3f ms), reclaimed %zu "
+          "bytes, heap %zu -> %zu bytes\n",
+          (unsigned long long)cycle, (unsigned long long)stats->increments,
+          stats->maxPauseNs / 1e6, stats->totalPauseNs / 1e6,
+          stats->bytesReclaimed, stats->heapBefore, stats->heapAfter);
+}
+
+void freeObjects() {
+  Obj *object = vm->objects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    freeObject(object);
+    object = next;
+  }
+  vm->objects = NULL;
+  free(vm->gc.grayStack);
+  vm->gc.grayStack = NULL;
+  vm->gc.grayCount = 0;
+  vm->gc.grayCapacity = 0;
+  vm->gc.phase = GC_IDLE;
+}
@@ -0,0 +1,437 @@
+// Std library includes
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local Includes
+#include "fiber.h"
+#include "io.h"
+#include "map.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * A native every VM defines.
+ * */
+typedef struct {
+  const char *name;        //! Name of the global
+  int arity;               //! Number of parameters
+  NativeKind kind;         //! How the native is called
+  NativeFunction function; //! The implementation
+} NativeEntry;
+
+/**
+ * Natives the host registered, after the built-in ones (only ever growing,
+ * so an entry found stays valid)
+ * */
+static struct {
+  NativeEntry *entries; //! The natives
+  int count;            //! Number of natives
+  int capacity;         //! Number of natives there's room for
+} registered;
+static pthread_mutex_t registeredLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Copy the characters of a string value, null-terminated
+ *
+ * @param string The string (can allocate, flattening a rope)
+ * @param length If not NULL, set to the number of characters
+ *
+ * @returns The characters, to be freed by the caller (with free, so they
+ * can be handed to the I/O thread)
+ * */
+static char *copyChars(Value string, size_t *length) {
+  const char *chars;
+  size_t count;
+  if (IS_SMALL_STRING(string)) {
+    chars = AS_SMALL_STRING(string).chars;
+    count = AS_SMALL_STRING(string).length;
+  } else {
+    ObjString *heap = flattenString(string);
+    chars = heap->chars;
+    count = heap->length;
+  }
+  char *copy = malloc(count + 1);
+  if (copy == NULL)
+    exit(1);
+  memcpy(copy, chars, count);
+  copy[count] = '\0';
+  if (length != NULL)
+    *length = count;
+  return copy;
+}
+
+/**
+ * Open the file a path argument names
+ *
+ * @returns The file descriptor, -1 if it can't be opened, or -2 if the path
+ * isn't a string (after reporting the error) */
+static int openPath(Value path, int flags) {
+  if (!IS_STRING(path)) {
+    runtimeError("Path must be a string.");
+    return -2;
+  }
+  char *chars = copyChars(path, NULL);
+  // Without blocking, as opening a FIFO waits for its other end (with no
+  // deadline), then transfers block as usual, on the I/O thread
+  int fd = open(chars, flags | O_CLOEXEC | O_NONBLOCK, 0666);
+  free(chars);
+  if (fd >= 0)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * Allocate a request (with the C allocator, it outlives the call)
+ * */
+static IoRequest *newRequest(IoOperation operation, int fd, int until,
+                             char *buffer, size_t size) {
+  IoRequest *request = calloc(1, sizeof(IoRequest));
+  if (request == NULL || buffer == NULL)
+    exit(1);
+  request->operation = operation;
+  request->fd = fd;
+  request->until = until;
+  request->buffer = buffer;
+  request->size = size;
+  return request;
+}
+
+/**
+ * Make readFile's result from its completed read */
+static Value finishReadFile(IoRequest *request, Value *args) {
+  Value contents = NIL_VAL;
+  if (request->error == 0 && request->length <= INT_MAX)
+    contents = copyString(request->buffer, (int)request->length);
+  close(request->fd);
+  free(request->buffer);
+  free(request);
+  return contents;
+}
+
+static bool readFileNative(int argCount, Value *args) {
+  int fd = openPath(args[0], O_RDONLY);
+  if (fd == -2)
+    return false;
+  if (fd < 0) {
+    args[-1] = NIL_VAL;
+    return true;
+  }
+  // One more byte than the file has, to find the end in as few reads as
+  // possible
+  struct stat status;
+  size_t size = fstat(fd, &status) == 0 && status.st_size > 0
+                    ? (size_t)status.st_size + 1
+                    : NATIVE_READ_SIZE;
+  awaitIo(newRequest(IO_READ, fd, -1, malloc(size), size), finishReadFile,
+          args);
+  return true;
+}
+
+/**
+ * Make writeFile's result from its completed write */
+static Value finishWriteFile(IoRequest *request, Value *args) {
+  bool written = close(request->fd) == 0 && request->error == 0;
+  free(request->buffer);
+  free(request);
+  return BOOL_VAL(written);
+}
+
+static bool writeFileNative(int argCount, Value *args) {
+  if (!IS_STRING(args[1])) {
+    runtimeError("Text must be a string.");
+    return false;
+  }
+  int fd = openPath(args[0], O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -2)
+    return false;
+  if (fd < 0) {
+    args[-1] = BOOL_VAL(false);
+    return true;
+  }
+  size_t length;
+  char *text = copyChars(args[1], &length);
+  awaitIo(newRequest(IO_WRITE, fd, -1, text, length), finishWriteFile, args);
+  return true;
+}
+
+static bool openFileNative(int argCount, Value *args) {
+  int fd = openPath(args[0], O_RDONLY);
+  if (fd == -2)
+    return false;
+  args[-1] = fd < 0 ? NIL_VAL : OBJ_VAL(newFile(fd));
+  return true;
+}
+
+/**
+ * Take the next line out of what was read of a file
+ *
+ * @param line Set to the line, or to nil if the file has no more
+ *
+ * @returns False if more of the file has to be read first */
+static bool takeLine(ObjFile *file, Value *line) {
+  char *start = file->buffer + file->start;
+  size_t count = file->end - file->start;
+  char *newline = count > 0 ? memchr(start, '\n', count) : NULL;
+  if (newline == NULL && file->fd >= 0)
+    return false;
+  // The last line doesn't need a newline
+  size_t length = newline != NULL ? (size_t)(newline - start) : count;
+  *line = count > 0 ? copyString(start, (int)length) : NIL_VAL;
+  file->start += newline != NULL ? length + 1 : length;
+  return true;
+}
+
+/**
+ * Make readLine's result once more of the file was read */
+static Value finishReadLine(IoRequest *request, Value *args) {
+  ObjFile *file = AS_FILE(args[0]);
+  file->buffer = request->buffer;
+  file->capacity = request->size;
+  file->end = request->length;
+  file->reading = false;
+  if (request->end || request->error != 0) {
+    close(file->fd);
+    file->fd = -1;
+  }
+  free(request);
+  Value line;
+  takeLine(file, &line);
+  return line;
+}
+
+static bool readLineNative(int argCount, Value *args) {
+  if (!IS_FILE(args[0])) {
+    runtimeError("Can only read lines from a file.");
+    return false;
+  }
+  ObjFile *file = AS_FILE(args[0]);
+  if (file->reading) {
+    runtimeError("File is already being read.");
+    return false;
+  }
+  if (takeLine(file, &args[-1]))
+    return true;
+
+  // Keep the partial line, at the start of a buffer with room for a read
+  size_t count = file->end - file->start;
+  if (count > 0)
+    memmove(file->buffer, file->buffer + file->start, count);
+  file->start = 0;
+  file->end = count;
+  if (file->capacity < count + NATIVE_READ_SIZE) {
+    file->capacity = count + NATIVE_READ_SIZE;
+    file->buffer = realloc(file->buffer, file->capacity);
+  }
+  IoRequest *request =
+      newRequest(IO_READ, file->fd, '\n', file->buffer, file->capacity);
+  request->length = count;
+  // The request has the buffer until it completes
+  file->buffer = NULL;
+  file->reading = true;
+  awaitIo(request, finishReadLine, args);
+  return true;
+}
+
+/**
+ * Check the first argument of a map native is a map
+ *
+ * @returns False if it isn't (after reporting the error) */
+static bool isMapArgument(Value *args) {
+  if (IS_MAP(args[0]))
+    return true;
+  runtimeError("Argument must be a map.");
+  return false;
+}
+
+static bool hasKeyNative(int argCount, Value *args) {
+  if (!isMapArgument(args))
+    return false;
+  Value value;
+  args[-1] = BOOL_VAL(mapGet(AS_MAP(args[0]), args[1], &value));
+  return true;
+}
+
+static bool removeKeyNative(int argCount, Value *args) {
+  if (!isMapArgument(args))
+    return false;
+  args[-1] = BOOL_VAL(mapDelete(AS_MAP(args[0]), args[1]));
+  return true;
+}
+
+static bool mapSizeNative(int argCount, Value *args) {
+  if (!isMapArgument(args))
+    return false;
+  args[-1] = INT_VAL(AS_MAP(args[0])->count);
+  return true;
+}
+
+/**
+ * Add a statistic to the map mapStats returns (which is on the stack) */
+static void addStat(ObjMap *stats, const char *name, Value value) {
+  Value key = copyString(name, (int)strlen(name));
+  push(key);
+  mapSet(stats, key, value);
+  pop();
+}
+
+static bool mapStatsNative(int argCount, Value *args) {
+  if (!isMapArgument(args))
+    return false;
+  MapStats stats;
+  mapStats(AS_MAP(args[0]), &stats);
+  ObjMap *result = newMap();
+  push(OBJ_VAL(result));
+  addStat(result, "count", INT_VAL(stats.count));
+  addStat(result, "capacity", INT_VAL(stats.capacity));
+  addStat(result, "deleted", INT_VAL(stats.deleted));
+  addStat(result, "load", NUMBER_VAL(stats.load));
+  addStat(result, "maxProbe", INT_VAL(stats.maxProbe));
+  addStat(result, "meanProbe", NUMBER_VAL(stats.meanProbe));
+  pop();
+  args[-1] = OBJ_VAL(result);
+  return true;
+}
+
+static const NativeEntry natives[] = {
+    {"readFile", 1, NATIVE_VALUES, {.values = readFileNative}},
+    {"writeFile", 2, NATIVE_VALUES, {.values = writeFileNative}},
+    {"openFile", 1, NATIVE_VALUES, {.values = openFileNative}},
+    {"readLine", 1, NATIVE_VALUES, {.values = readLineNative}},
+    {"hasKey", 2, NATIVE_VALUES, {.values = hasKeyNative}},
+    {"removeKey", 2, NATIVE_VALUES, {.values = removeKeyNative}},
+    {"mapSize", 1, NATIVE_VALUES, {.values = mapSizeNative}},
+    {"mapStats", 1, NATIVE_VALUES, {.values = mapStatsNative}},
+    {"sqrt", 1, NATIVE_UNARY, {.unary = sqrt}},
+    {"exp", 1, NATIVE_UNARY, {.unary = exp}},
+    {"log", 1, NATIVE_UNARY, {.unary = log}},
+    {"sin", 1, NATIVE_UNARY, {.unary = sin}},
+    {"cos", 1, NATIVE_UNARY, {.unary = cos}},
+    {"tan", 1, NATIVE_UNARY, {.unary = tan}},
+    {"atan", 1, NATIVE_UNARY, {.unary = atan}},
+    {"floor", 1, NATIVE_UNARY, {.unary = floor}},
+    {"ceil", 1, NATIVE_UNARY, {.unary = ceil}},
+    {"abs", 1, NATIVE_UNARY, {.unary = fabs}},
+    {"pow", 2, NATIVE_BINARY, {.binary = pow}},
+    {"atan2", 2, NATIVE_BINARY, {.binary = atan2}},
+    {"hypot", 2, NATIVE_BINARY, {.binary = hypot}},
+};
+
+/**
+ * Find a native by name, built-in or registered (with registeredLock held)
+ *
+ * @returns The native, or NULL if there's no such native */
+static const NativeEntry *lookupNative(const char *chars, size_t length) {
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++) {
+    if (strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, chars, length) == 0)
+      return &natives[i];
+  }
+  for (int i = 0; i < registered.count; i++) {
+    if (strlen(registered.entries[i].name) == length &&
+        memcmp(registered.entries[i].name, chars, length) == 0)
+      return &registered.entries[i];
+  }
+  return NULL;
+}
+
+/**
+ * Define a native as a global of the current VM */
+static void defineNative(const NativeEntry *entry) {
+  Value name = copyString(entry->name, (int)strlen(entry->name));
+  push(name);
+  ObjNative *native =
+      newNative(name, entry->arity, entry->kind, entry->function);
+  push(OBJ_VAL(native));
+  int slot = globalSlot(name);
+  if (slot >= 0) {
+    WRITE_BARRIER(OBJ_VAL(native));
+    vm->globalValues.values[slot] = OBJ_VAL(native);
+  }
+  pop();
+  pop();
+}
+
+void defineNatives() {
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++)
+    defineNative(&natives[i]);
+  pthread_mutex_lock(&registeredLock);
+  for (int i = 0; i < registered.count; i++)
+    defineNative(&registered.entries[i]);
+  pthread_mutex_unlock(&registeredLock);
+}
+
+bool registerNative(const char *name, int arity, NativeKind kind,
+                    NativeFunction function) {
+  if (arity < 0 || arity > UINT8_MAX)
+    return false;
+  pthread_mutex_lock(&registeredLock);
+  size_t length = strlen(name);
+  bool added = lookupNative(name, length) == NULL;
+  if (added && registered.count == registered.capacity) {
+    registered.capacity = GROW_CAPACITY(registered.capacity);
+    registered.entries = realloc(registered.entries,
+                                 sizeof(NativeEntry) * registered.capacity);
+    if (registered.entries == NULL)
+      exit(1);
+  }
+  if (added) {
+    char *copy = malloc(length + 1);
+    if (copy == NULL)
+      exit(1);
+    memcpy(copy, name, length + 1);
+    registered.entries[registered.count++] =
+        (NativeEntry){copy, arity, kind, function};
+  }
+  pthread_mutex_unlock(&registeredLock);
+  return added;
+}
+
+bool findNative(ObjNative *native) {
+  Value name = native->name;
+  const char *chars = IS_SMALL_STRING(name) ? AS_SMALL_STRING(name).chars
+                                            : AS_HEAP_STRING(name)->chars;
+  size_t length = IS_SMALL_STRING(name) ? AS_SMALL_STRING(name).length
+                                        : (size_t)AS_HEAP_STRING(name)->length;
+  pthread_mutex_lock(&registeredLock);
+  const NativeEntry *entry = lookupNative(chars, length);
+  if (entry != NULL) {
+    native->arity = entry->arity;
+    native->kind = entry->kind;
+    native->function = entry->function;
+  }
+  pthread_mutex_unlock(&registeredLock);
+  return entry != NULL;
+}
+
+bool callHostNative(ObjNative *native, int argCount, Value *args) {
+  // The host reads the characters of a string in one piece
+  for (int i = 0; i < argCount; i++) {
+    if (IS_ROPE(args[i]))
+      args[i] = OBJ_VAL(flattenString(args[i]));
+  }
+  Value value = NIL_VAL;
+  CloxValue result;
+  memcpy(&result, &value, sizeof(Value));
+  bool succeeded =
+      native->function.host(vm, argCount, (const CloxValue *)args, &result);
+  memcpy(&value, &result, sizeof(Value));
+  if (succeeded) {
+    args[-1] = value;
+  } else if (IS_STRING(value)) {
+    char *message = copyChars(value, NULL);
+    runtimeError("%s", message);
+    free(message);
+  } else {
+    runtimeError("Native function failed.");
+  }
+  return succeeded;
+}
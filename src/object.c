@@ -0,0 +1,406 @@
+// Std library includes
+#include <stdio.h>
+#include <string.h>
+
+// Local Includes
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define ALLOCATE_OBJ(type, objectType)                                         \
+  (type *)allocateObject(sizeof(type), objectType)
+
+/**
+ * Allocate an object and add it to the VM's list of objects
+ *
+ * @param size Size of the object (in bytes)
+ * @param type Type of the object
+ * */
+static Obj *allocateObject(size_t size, ObjType type) {
+  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  object->type = type;
+  // Objects allocated while marking start white (they're reachable through
+  // the stack, which is rescanned, or a write barrier), but the sweep in
+  // progress must not free them
+  object->mark = vm->gc.phase == GC_SWEEP ? vm->gc.epoch
+                                         : (uint8_t)(vm->gc.epoch - 1);
+  object->next = vm->objects;
+  vm->objects = object;
+  return object;
+}
+
+uint32_t hashString(const char *chars, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)chars[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return AS_BOOL(value) ? 3 : 5;
+  case VAL_NUMBER:
+  case VAL_INT: {
+    // Equal numbers need the same hash: 0 and -0, and integers and doubles
+    // of the same value
+    double number;
+    if (IS_INT(value)) {
+      if (!isExactDouble(AS_INT(value))) {
+        uint64_t bits = (uint64_t)AS_INT(value);
+        return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+      }
+      number = (double)AS_INT(value);
+    } else {
+      number = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+    }
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+  }
+  case VAL_SMALL_STRING:
+    return hashString(AS_SMALL_STRING(value).chars,
+                      AS_SMALL_STRING(value).length);
+  case VAL_OBJ:
+    if (IS_HEAP_STRING(value))
+      return AS_HEAP_STRING(value)->hash;
+    if (IS_ARRAY(value)) {
+      // Arrays are equal by their elements, so that's what's hashed
+      ObjArray *array = AS_ARRAY(value);
+      uint32_t hash = 2166136261u;
+      for (int i = 0; i < array->count; i++) {
+        hash = (hash ^ hashValue(NUMBER_VAL(array->elements[i]))) * 16777619;
+      }
+      return hash;
+    }
+    return (uint32_t)((uintptr_t)AS_OBJ(value) >> 3) * 2654435761u;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Create a small string value (length must be at most SMALL_STRING_MAX) */
+static Value smallString(const char *chars, int length) {
+  Value value;
+  value.type = VAL_SMALL_STRING;
+  value.as.bits = 0;
+  memcpy(value.as.small.chars, chars, length);
+  value.as.small.length = (uint8_t)length;
+  return value;
+}
+
+/**
+ * Find or create the interned heap string with the given characters */
+static ObjString *internString(const char *chars, int length) {
+  uint32_t hash = hashString(chars, length);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+  if (interned != NULL) {
+    // The table is weak, so it can hand back a string the collector has
+    // already found unreachable, which is about to be swept
+    markObject((Obj *)interned);
+    return interned;
+  }
+
+  ObjString *string = (ObjString *)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = hash;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  // Growing the table can start a collection, keep the string reachable
+  push(OBJ_VAL(string));
+  tableSet(&vm->strings, OBJ_VAL(string), NIL_VAL);
+  pop();
+  return string;
+}
+
+Value copyString(const char *chars, int length) {
+  if (length <= SMALL_STRING_MAX)
+    return smallString(chars, length);
+  return OBJ_VAL(internString(chars, length));
+}
+
+int stringLength(Value string) {
+  if (IS_SMALL_STRING(string))
+    return AS_SMALL_STRING(string).length;
+  if (IS_ROPE(string))
+    return AS_ROPE(string)->length;
+  return AS_HEAP_STRING(string)->length;
+}
+
+/**
+ * Copy the characters of any string value into a buffer
+ *
+ * @param string String to copy
+ * @param dest Buffer with room for stringLength(string) characters
+ * */
+static void copyChars(Value string, char *dest) {
+  // Fill the buffer from the end, walking down the left side of ropes in a
+  // loop (long chains of concatenations lean left) and only recursing right
+  char *end = dest + stringLength(string);
+  for (;;) {
+    if (IS_SMALL_STRING(string)) {
+      SmallString small = AS_SMALL_STRING(string);
+      memcpy(end - small.length, small.chars, small.length);
+      return;
+    }
+    if (IS_HEAP_STRING(string)) {
+      ObjString *heap = AS_HEAP_STRING(string);
+      memcpy(end - heap->length, heap->chars, heap->length);
+      return;
+    }
+
+    ObjRope *rope = AS_ROPE(string);
+    if (rope->flat != NULL) {
+      string = OBJ_VAL(rope->flat);
+      continue;
+    }
+    int rightLength = stringLength(rope->right);
+    end -= rightLength;
+    copyChars(rope->right, end);
+    string = rope->left;
+  }
+}
+
+Value concatenateStrings(Value a, Value b) {
+  int length = stringLength(a) + stringLength(b);
+
+  if (length >= ROPE_MIN_LENGTH) {
+    // Defer the copy, the rope is flattened once when its characters are
+    // needed
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+  }
+
+  char chars[ROPE_MIN_LENGTH];
+  copyChars(a, chars);
+  copyChars(b, chars + stringLength(a));
+  return copyString(chars, length);
+}
+
+ObjString *flattenString(Value string) {
+  if (IS_HEAP_STRING(string))
+    return AS_HEAP_STRING(string);
+
+  ObjRope *rope = AS_ROPE(string);
+  if (rope->flat == NULL) {
+    char *chars = GROW_ARRAY(char, NULL, 0, rope->length);
+    copyChars(string, chars);
+    rope->flat = internString(chars, rope->length);
+    WRITE_BARRIER(OBJ_VAL(rope->flat));
+    FREE_ARRAY(char, chars, rope->length);
+
+    // The parts are no longer needed
+    rope->left = NIL_VAL;
+    rope->right = NIL_VAL;
+  }
+  return rope->flat;
+}
+
+ObjArray *newArray(int count) {
+  ObjArray *array = (ObjArray *)allocateObject(
+      sizeof(ObjArray) + sizeof(double) * count, OBJ_ARRAY);
+  array->count = count;
+  return array;
+}
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  map->count = 0;
+  map->deleted = 0;
+  map->capacity = 0;
+  map->control = NULL;
+  map->entries = NULL;
+  return map;
+}
+
+ObjFunction *newFunction() {
+  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+  function->arity = 0;
+  function->maxSlots = 0;
+  function->name = NIL_VAL;
+  function->owner = NULL;
+  initChunk(&function->chunk);
+  return function;
+}
+
+/**
+ * Allocate a shape, with no transitions yet */
+static ObjShape *newShape(ObjClass *klass, ObjShape *parent, Value name,
+                          int count) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->count = count;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+ObjClass *newClass(Value name) {
+  ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  klass->superclass = NULL;
+  klass->shape = NULL;
+  klass->initializer = NULL;
+  klass->fieldCount = 0;
+  initTable(&klass->methods);
+  // Allocating the root shape can start a collection
+  push(OBJ_VAL(klass));
+  klass->shape = newShape(klass, NULL, NIL_VAL, 0);
+  pop();
+  return klass;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->shape = klass->shape;
+  instance->fields = NULL;
+  instance->capacity = 0;
+  // Room for as many fields as the class's instances have had, so they
+  // don't grow one field at a time
+  if (klass->fieldCount > 0) {
+    push(OBJ_VAL(instance));
+    instance->fields = ALLOCATE(Value, klass->fieldCount);
+    instance->capacity = klass->fieldCount;
+    pop();
+  }
+  return instance;
+}
+
+ObjBoundMethod *newBoundMethod(Value receiver, ObjFunction *method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjNative *newNative(Value name, int arity, NativeKind kind,
+                     NativeFunction function) {
+  ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+  native->name = name;
+  native->arity = arity;
+  native->kind = kind;
+  native->function = function;
+  return native;
+}
+
+ObjFile *newFile(int fd) {
+  ObjFile *file = ALLOCATE_OBJ(ObjFile, OBJ_FILE);
+  file->fd = fd;
+  file->reading = false;
+  file->buffer = NULL;
+  file->start = 0;
+  file->end = 0;
+  file->capacity = 0;
+  return file;
+}
+
+int shapeField(ObjShape *shape, Value name) {
+  // Only instruction caches missing get here, so the chain is just walked
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (valuesEqual(shape->name, name))
+      return shape->count - 1;
+  }
+  return -1;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, Value name) {
+  Value child;
+  if (tableGet(&shape->transitions, name, &child))
+    return (ObjShape *)AS_OBJ(child);
+
+  ObjShape *added = newShape(shape->klass, shape, name, shape->count + 1);
+  // Growing the table can start a collection, and the parent may already be
+  // marked
+  push(OBJ_VAL(added));
+  tableSet(&shape->transitions, name, OBJ_VAL(added));
+  WRITE_BARRIER(OBJ_VAL(added));
+  pop();
+  return added;
+}
+
+void writeObject(OutputBuffer *output, Value value) {
+  switch (OBJ_TYPE(value)) {
+  case OBJ_STRING:
+  case OBJ_ROPE: {
+    ObjString *string = flattenString(value);
+    writeOutput(output, string->chars, string->length);
+    break;
+  }
+  case OBJ_ARRAY: {
+    ObjArray *array = AS_ARRAY(value);
+    writeOutputChar(output, '[');
+    for (int i = 0; i < array->count; i++) {
+      if (i > 0)
+        writeOutput(output, ", ", 2);
+      char buffer[NUMBER_BUFFER_SIZE];
+      int length = formatNumber(array->elements[i], buffer);
+      writeOutput(output, buffer, length);
+    }
+    writeOutputChar(output, ']');
+    break;
+  }
+  case OBJ_MAP: {
+    // Maps in a map are abbreviated, a map can hold itself
+    ObjMap *map = AS_MAP(value);
+    writeOutputChar(output, '{');
+    bool first = true;
+    for (int i = 0; i < map->capacity; i++) {
+      if (map->control[i] & 0x80)
+        continue;
+      if (!first)
+        writeOutput(output, ", ", 2);
+      first = false;
+      MapEntry *entry = &map->entries[i];
+      if (IS_MAP(entry->key))
+        writeOutput(output, "{...}", 5);
+      else
+        writeValue(output, entry->key);
+      writeOutput(output, ": ", 2);
+      if (IS_MAP(entry->value))
+        writeOutput(output, "{...}", 5);
+      else
+        writeValue(output, entry->value);
+    }
+    writeOutputChar(output, '}');
+    break;
+  }
+  case OBJ_FUNCTION:
+    writeOutput(output, "<fn ", 4);
+    writeValue(output, AS_FUNCTION(value)->name);
+    writeOutputChar(output, '>');
+    break;
+  case OBJ_SHAPE:
+    // Never a value Lox sees
+    writeOutput(output, "<shape>", 7);
+    break;
+  case OBJ_CLASS:
+    writeValue(output, AS_CLASS(value)->name);
+    break;
+  case OBJ_INSTANCE:
+    writeValue(output, AS_INSTANCE(value)->shape->klass->name);
+    writeOutput(output, " instance", 9);
+    break;
+  case OBJ_BOUND_METHOD:
+    writeValue(output, OBJ_VAL(AS_BOUND_METHOD(value)->method));
+    break;
+  case OBJ_NATIVE:
+    writeOutput(output, "<native fn>", 11);
+    break;
+  case OBJ_FILE:
+    writeOutput(output, "<file>", 6);
+    break;
+  }
+}
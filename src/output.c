@@ -0,0 +1,42 @@
+// Std library includes
+#include <stdio.h>
+#include <string.h>
+
+// Local Includes
+#include "output.h"
+
+void initOutput(OutputBuffer *output, FILE *file, char *data,
+                size_t capacity) {
+  output->file = file;
+  output->data = data;
+  output->count = 0;
+  output->capacity = capacity;
+}
+
+void writeOutput(OutputBuffer *output, const char *chars, size_t length) {
+  if (output->count + length > output->capacity) {
+    flushOutput(output);
+    // Anything that can't fit even in an empty buffer goes straight out
+    if (length > output->capacity) {
+      fwrite(chars, sizeof(char), length, output->file);
+      return;
+    }
+  }
+
+  memcpy(output->data + output->count, chars, length);
+  output->count += length;
+}
+
+void writeOutputChar(OutputBuffer *output, char c) {
+  if (output->count == output->capacity)
+    flushOutput(output);
+  output->data[output->count++] = c;
+}
+
+void flushOutput(OutputBuffer *output) {
+  if (output->count == 0)
+    return;
+  fwrite(output->data, sizeof(char), output->count, output->file);
+  fflush(output->file);
+  output->count = 0;
+}
@@ -0,0 +1,252 @@
+// Std library includes
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Local Includes
+#include "perf.h"
+
+/**
+ * A counter's value, with how long it was enabled and actually counting
+ * (less when the kernel multiplexed it with other events) */
+typedef struct {
+  uint64_t value;   //! Events counted
+  uint64_t enabled; //! Nanoseconds the counter was enabled
+  uint64_t running; //! Nanoseconds it was on the hardware
+} CounterReading;
+
+/**
+ * Totals for one phase */
+typedef struct {
+  uint64_t counts[PERF_COUNTER_COUNT]; //! Summed (scaled) counter values
+  uint64_t enabledNs;                  //! Summed time the group was enabled
+  uint64_t runningNs;                  //! Summed time the group counted
+  double seconds;                      //! Summed wall clock time
+  uint64_t runs;                       //! Number of times it was entered
+  struct timespec start;               //! When the current run started
+  // Readings of the counters when the current run started
+  CounterReading begin[PERF_COUNTER_COUNT];
+} PhaseTotals;
+
+static const char *counterNames[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = "cycles",
+    [PERF_INSTRUCTIONS] = "instructions",
+    [PERF_BRANCHES] = "branches",
+    [PERF_BRANCH_MISSES] = "branchMisses",
+    [PERF_L1I_MISSES] = "l1iMisses",
+    [PERF_CACHE_MISSES] = "cacheMisses",
+};
+
+static const char *phaseNames[PERF_PHASE_COUNT] = {
+    [PERF_PHASE_COMPILE] = "compile",
+    [PERF_PHASE_RUN] = "run",
+};
+
+static bool enabled = false;
+static int counterFds[PERF_COUNTER_COUNT];
+// Counter the others are grouped under, the first one opened
+static int leaderFd = -1;
+static PhaseTotals phases[PERF_PHASE_COUNT];
+
+#ifdef __linux__
+static const uint32_t counterTypes[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = PERF_TYPE_HARDWARE,
+    [PERF_INSTRUCTIONS] = PERF_TYPE_HARDWARE,
+    [PERF_BRANCHES] = PERF_TYPE_HARDWARE,
+    [PERF_BRANCH_MISSES] = PERF_TYPE_HARDWARE,
+    [PERF_L1I_MISSES] = PERF_TYPE_HW_CACHE,
+    [PERF_CACHE_MISSES] = PERF_TYPE_HARDWARE,
+};
+
+static const uint64_t counterConfigs[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF_BRANCHES] = PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+    [PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    [PERF_L1I_MISSES] = PERF_COUNT_HW_CACHE_L1I |
+                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    [PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+
+/**
+ * Open a counter for this process (user space only) in the group of leader,
+ * or as the leader of a new group (disabled until a phase begins)
+ *
+ * All the counters of a group are on the hardware at the same time, so
+ * ratios between them (IPC, misses per branch) are over the same interval
+ * even when the kernel multiplexes them with other events. Counters are
+ * inherited by the threads started later (the lexer threads of
+ * --lex-threads), which the kernel doesn't allow together with reading the
+ * group at once, so each counter is read on its own.
+ *
+ * @returns The counter's file descriptor, or -1 if it isn't available (or
+ * doesn't fit on the hardware with the rest of the group) */
+static int openCounter(uint32_t type, uint64_t config, int leader) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  // Members count whenever the leader does
+  attr.disabled = leader < 0;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+static bool readCounter(int fd, CounterReading *reading) {
+  return read(fd, reading, sizeof(*reading)) == sizeof(*reading);
+}
+#endif
+
+void startPerf() {
+  enabled = true;
+  memset(phases, 0, sizeof(phases));
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counterFds[i] = -1;
+  }
+  leaderFd = -1;
+
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counterFds[i] = openCounter(counterTypes[i], counterConfigs[i], leaderFd);
+    if (leaderFd < 0)
+      leaderFd = counterFds[i];
+  }
+#endif
+}
+
+bool perfEnabled() { return enabled; }
+
+void beginPerfPhase(PerfPhase phase) {
+#ifdef __linux__
+  // Resetting leaves the times, so phases add up differences of readings
+  CounterReading *begin = phases[phase].begin;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counterFds[i] >= 0 && !readCounter(counterFds[i], &begin[i]))
+      memset(&begin[i], 0, sizeof(CounterReading));
+  }
+  if (leaderFd >= 0)
+    ioctl(leaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &phases[phase].start);
+}
+
+void endPerfPhase(PerfPhase phase) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  PhaseTotals *totals = &phases[phase];
+
+#ifdef __linux__
+  if (leaderFd >= 0)
+    ioctl(leaderFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    CounterReading reading;
+    if (counterFds[i] < 0 || !readCounter(counterFds[i], &reading))
+      continue;
+    uint64_t value = reading.value - totals->begin[i].value;
+    uint64_t enabledNs = reading.enabled - totals->begin[i].enabled;
+    uint64_t runningNs = reading.running - totals->begin[i].running;
+    // Estimate what a counter the hardware wasn't always running for would
+    // have counted, the whole group was off for the same time
+    if (runningNs > 0 && runningNs < enabledNs)
+      value = (uint64_t)((double)value * enabledNs / runningNs);
+    totals->counts[i] += value;
+    if (counterFds[i] == leaderFd) {
+      totals->enabledNs += enabledNs;
+      totals->runningNs += runningNs;
+    }
+  }
+#endif
+
+  totals->seconds += (double)(end.tv_sec - totals->start.tv_sec) +
+                     (double)(end.tv_nsec - totals->start.tv_nsec) / 1e9;
+  totals->runs++;
+}
+
+/**
+ * Write an object of counter values, optionally divided by the number of
+ * executed instructions (null for counters that aren't available) */
+static void writeCounters(FILE *file, PhaseTotals *totals,
+                          uint64_t executedInstructions, bool normalize) {
+  fprintf(file, "{");
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    fprintf(file, "%s\"%s\": ", i > 0 ? ", " : "", counterNames[i]);
+    if (counterFds[i] < 0) {
+      fprintf(file, "null");
+    } else if (normalize) {
+      fprintf(file, "%.4f",
+              (double)totals->counts[i] / (double)executedInstructions);
+    } else {
+      fprintf(file, "%llu", (unsigned long long)totals->counts[i]);
+    }
+  }
+  fprintf(file, "}");
+}
+
+bool stopPerf(const char *path, uint64_t executedInstructions) {
+  FILE *file = fopen(path, "w");
+  bool ok = file != NULL;
+
+  if (ok) {
+    fprintf(file, "{\n  \"executedInstructions\": %llu,\n",
+            (unsigned long long)executedInstructions);
+    fprintf(file, "  \"phases\": {\n");
+    for (int phase = 0; phase < PERF_PHASE_COUNT; phase++) {
+      PhaseTotals *totals = &phases[phase];
+      fprintf(file, "    \"%s\": {\n", phaseNames[phase]);
+      fprintf(file, "      \"runs\": %llu,\n",
+              (unsigned long long)totals->runs);
+      fprintf(file, "      \"seconds\": %.9f,\n", totals->seconds);
+      // Below 1 when counts were scaled up from part of the time
+      fprintf(file, "      \"counterRunning\": ");
+      if (totals->enabledNs > 0) {
+        fprintf(file, "%.4f,\n", (double)totals->runningNs / totals->enabledNs);
+      } else {
+        fprintf(file, "null,\n");
+      }
+
+      fprintf(file, "      \"ipc\": ");
+      if (counterFds[PERF_CYCLES] >= 0 && counterFds[PERF_INSTRUCTIONS] >= 0 &&
+          totals->counts[PERF_CYCLES] > 0) {
+        fprintf(file, "%.4f,\n",
+                (double)totals->counts[PERF_INSTRUCTIONS] /
+                    totals->counts[PERF_CYCLES]);
+      } else {
+        fprintf(file, "null,\n");
+      }
+
+      fprintf(file, "      \"counters\": ");
+      writeCounters(file, totals, executedInstructions, false);
+      // Normalizing only makes sense for the phase executing the bytecode
+      if (phase == PERF_PHASE_RUN && executedInstructions > 0) {
+        fprintf(file, ",\n      \"perInstruction\": ");
+        writeCounters(file, totals, executedInstructions, true);
+      }
+      fprintf(file, "\n    }%s\n", phase < PERF_PHASE_COUNT - 1 ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+    ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+  }
+
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counterFds[i] >= 0)
+      close(counterFds[i]);
+    counterFds[i] = -1;
+  }
+  leaderFd = -1;
+  enabled = false;
+  return ok;
+}
@@ -0,0 +1,322 @@
+// Std library includes
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Local Includes
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "profile.h"
+
+/**
+ * Number of samples taken at one source line while executing one opcode,
+ * in one call stack
+ * */
+typedef struct {
+  int line;       //! Source line (0 marks an empty slot)
+  uint8_t opcode; //! Opcode being executed
+  int stack;      //! Call stack it was executed in
+  uint64_t count; //! Number of samples
+} ProfileEntry;
+
+/**
+ * A call stack samples were taken in: a function called from a shorter
+ * stack. Stack 0 is the script alone, so the others start at 1.
+ * */
+typedef struct {
+  int parent;    //! Stack the function was called from
+  char *name;    //! Name of the function (copied, as functions can be freed)
+  int length;    //! Length of the name
+  uint32_t hash; //! Hash of the parent and name
+} ProfileStack;
+
+/**
+ * Samples aggregated by (line, opcode, stack), in an open addressing hash
+ * table, and the call stacks they were taken in
+ * */
+typedef struct {
+  int count;             //! Number of entries in use
+  int capacity;          //! Number of slots (a power of two)
+  ProfileEntry *entries; //! Slots of the table
+  uint64_t samples;      //! Total number of samples
+  ProfileStack *stacks;  //! Call stacks, by number (stack 0 unused)
+  int stackCount;        //! Number of stacks, counting stack 0
+  int stackCapacity;     //! Capacity of stacks
+  int *stackSlots;       //! Number of each stack, by hash (0 if empty)
+  int stackSlotCount;    //! Number of slots in stackSlots (a power of two)
+} Profile;
+
+volatile sig_atomic_t profileSamplePending = 0;
+
+static Profile profile;
+
+/**
+ * Timer signal handler, the sample is taken by the VM */
+static void requestSample(int signal) { profileSamplePending = 1; }
+
+static void setTimer(long interval) {
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void startProfile() {
+  FREE_ARRAY(ProfileEntry, profile.entries, profile.capacity);
+  profile.count = 0;
+  profile.capacity = 0;
+  profile.entries = NULL;
+  profile.samples = 0;
+  for (int i = 1; i < profile.stackCount; i++) {
+    FREE_ARRAY(char, profile.stacks[i].name, profile.stacks[i].length);
+  }
+  FREE_ARRAY(ProfileStack, profile.stacks, profile.stackCapacity);
+  FREE_ARRAY(int, profile.stackSlots, profile.stackSlotCount);
+  profile.stacks = NULL;
+  profile.stackCount = 1;
+  profile.stackCapacity = 0;
+  profile.stackSlots = NULL;
+  profile.stackSlotCount = 0;
+  profileSamplePending = 0;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestSample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+  setTimer(PROFILE_INTERVAL_US);
+}
+
+void stopProfile() {
+  setTimer(0);
+  profileSamplePending = 0;
+}
+
+/**
+ * Find the slot for a (line, opcode, stack), either its entry or the empty
+ * slot it belongs in */
+static ProfileEntry *findEntry(ProfileEntry *entries, int capacity, int line,
+                               uint8_t opcode, int stack) {
+  uint32_t index =
+      ((uint32_t)stack * 961 + (uint32_t)line * 31 + opcode) & (capacity - 1);
+  for (;;) {
+    ProfileEntry *entry = &entries[index];
+    if (entry->line == 0 || (entry->line == line && entry->opcode == opcode &&
+                             entry->stack == stack))
+      return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+/**
+ * Find the slot of the stack calling a function from a parent stack, either
+ * its number or the empty slot it belongs in */
+static int *findStack(int *slots, int slotCount, int parent, const char *name,
+                      int length, uint32_t hash) {
+  uint32_t index = hash & (slotCount - 1);
+  for (;;) {
+    int *slot = &slots[index];
+    ProfileStack *stack = &profile.stacks[*slot];
+    if (*slot == 0 ||
+        (stack->hash == hash && stack->parent == parent &&
+         stack->length == length && memcmp(stack->name, name, length) == 0))
+      return slot;
+    index = (index + 1) & (slotCount - 1);
+  }
+}
+
+static void growStackSlots() {
+  int slotCount = GROW_CAPACITY(profile.stackSlotCount);
+  int *slots = GROW_ARRAY(int, NULL, 0, slotCount);
+  memset(slots, 0, sizeof(int) * slotCount);
+  for (int i = 1; i < profile.stackCount; i++) {
+    ProfileStack *stack = &profile.stacks[i];
+    *findStack(slots, slotCount, stack->parent, stack->name, stack->length,
+               stack->hash) = i;
+  }
+  FREE_ARRAY(int, profile.stackSlots, profile.stackSlotCount);
+  profile.stackSlots = slots;
+  profile.stackSlotCount = slotCount;
+}
+
+/**
+ * Number the stack calling a function from a parent stack, adding it the
+ * first time */
+static int childStack(int parent, Value name) {
+  // Names of functions are never ropes
+  const char *chars = IS_SMALL_STRING(name) ? AS_SMALL_STRING(name).chars
+                                            : AS_HEAP_STRING(name)->chars;
+  int length = stringLength(name);
+  uint32_t hash = (uint32_t)parent * 16777619u;
+  for (int i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)chars[i]) * 16777619u;
+  }
+
+  // Keep the slots at most half full
+  if (profile.stackCount * 2 > profile.stackSlotCount)
+    growStackSlots();
+  int *slot = findStack(profile.stackSlots, profile.stackSlotCount, parent,
+                        chars, length, hash);
+  if (*slot != 0)
+    return *slot;
+
+  if (profile.stackCount >= profile.stackCapacity) {
+    int capacity = GROW_CAPACITY(profile.stackCapacity);
+    profile.stacks = GROW_ARRAY(ProfileStack, profile.stacks,
+                                profile.stackCapacity, capacity);
+    profile.stackCapacity = capacity;
+  }
+  ProfileStack *stack = &profile.stacks[profile.stackCount];
+  stack->parent = parent;
+  stack->name = GROW_ARRAY(char, NULL, 0, length);
+  memcpy(stack->name, chars, length);
+  stack->length = length;
+  stack->hash = hash;
+  *slot = profile.stackCount;
+  return profile.stackCount++;
+}
+
+static void growProfile() {
+  int capacity = GROW_CAPACITY(profile.capacity);
+  ProfileEntry *entries = GROW_ARRAY(ProfileEntry, NULL, 0, capacity);
+  memset(entries, 0, sizeof(ProfileEntry) * capacity);
+
+  for (int i = 0; i < profile.capacity; i++) {
+    ProfileEntry *entry = &profile.entries[i];
+    if (entry->line == 0)
+      continue;
+    *findEntry(entries, capacity, entry->line, entry->opcode, entry->stack) =
+        *entry;
+  }
+
+  FREE_ARRAY(ProfileEntry, profile.entries, profile.capacity);
+  profile.entries = entries;
+  profile.capacity = capacity;
+}
+
+void recordProfileSample(CallFrame *frames, int frameCount, int offset) {
+  profileSamplePending = 0;
+
+  // The script's frame is the root of every stack
+  int stack = 0;
+  for (int i = 1; i < frameCount; i++) {
+    stack = childStack(stack, frames[i].function->name);
+  }
+
+  // Keep the table at most half full
+  if ((profile.count + 1) * 2 > profile.capacity)
+    growProfile();
+
+  Chunk *chunk = frames[frameCount - 1].chunk;
+  int line = chunk->lines[offset];
+  uint8_t opcode = chunk->code[offset];
+  ProfileEntry *entry =
+      findEntry(profile.entries, profile.capacity, line, opcode, stack);
+  if (entry->line == 0) {
+    entry->line = line;
+    entry->opcode = opcode;
+    entry->stack = stack;
+    entry->count = 0;
+    profile.count++;
+  }
+  entry->count++;
+  profile.samples++;
+}
+
+/**
+ * Samples at a single line, for the report */
+typedef struct {
+  int line;           //! Source line
+  uint64_t count;     //! Samples at the line
+  uint8_t hotOpcode;  //! Opcode with the most samples at the line
+  uint64_t hotCount;  //! Samples of that opcode
+} LineSamples;
+
+static int compareLines(const void *a, const void *b) {
+  const LineSamples *left = a;
+  const LineSamples *right = b;
+  if (left->count != right->count)
+    return left->count < right->count ? 1 : -1;
+  return left->line - right->line;
+}
+
+void writeProfileReport(FILE *file) {
+  // Merge the entries of each line (lines are few, a linear scan is fine)
+  LineSamples *lines = GROW_ARRAY(LineSamples, NULL, 0, profile.count);
+  int lineCount = 0;
+  for (int i = 0; i < profile.capacity; i++) {
+    ProfileEntry *entry = &profile.entries[i];
+    if (entry->line == 0)
+      continue;
+
+    LineSamples *line = NULL;
+    for (int j = 0; j < lineCount; j++) {
+      if (lines[j].line == entry->line) {
+        line = &lines[j];
+        break;
+      }
+    }
+    if (line == NULL) {
+      line = &lines[lineCount++];
+      line->line = entry->line;
+      line->count = 0;
+      line->hotCount = 0;
+    }
+    line->count += entry->count;
+    if (entry->count > line->hotCount) {
+      line->hotOpcode = entry->opcode;
+      line->hotCount = entry->count;
+    }
+  }
+  qsort(lines, lineCount, sizeof(LineSamples), compareLines);
+
+  fprintf(file, "== sample profile: %llu samples every %d us ==\n",
+          (unsigned long long)profile.samples, PROFILE_INTERVAL_US);
+  fprintf(file, "%6s %10s %8s  %s\n", "line", "samples", "percent",
+          "hottest opcode");
+  for (int i = 0; i < lineCount; i++) {
+    fprintf(file, "%6d %10llu %7.2f%%  %s\n", lines[i].line,
+            (unsigned long long)lines[i].count,
+            100.0 * lines[i].count / profile.samples,
+            opcodeName(lines[i].hotOpcode));
+  }
+  fprintf(file, "== End of sample profile ==\n");
+
+  FREE_ARRAY(LineSamples, lines, profile.count);
+}
+
+/**
+ * Write the frames of a call stack, outermost first */
+static void writeStack(FILE *file, int stack) {
+  if (stack == 0) {
+    fputs("script", file);
+    return;
+  }
+  writeStack(file, profile.stacks[stack].parent);
+  fprintf(file, ";%.*s", profile.stacks[stack].length,
+          profile.stacks[stack].name);
+}
+
+bool writeProfileStacks(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+
+  for (int i = 0; i < profile.capacity; i++) {
+    ProfileEntry *entry = &profile.entries[i];
+    if (entry->line == 0)
+      continue;
+    writeStack(file, entry->stack);
+    fprintf(file, ";line %d;%s %llu\n", entry->line,
+            opcodeName(entry->opcode), (unsigned long long)entry->count);
+  }
+
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
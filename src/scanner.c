@@ -1,6 +1,9 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "scanner.h"
@@ -12,8 +15,16 @@ typedef struct {
 } Scanner;
 
 // Use a global scanner variable to avoid need to
-// pass it around
-Scanner scanner;
+// pass it around (one per thread, so pieces can be scanned in parallel)
+static _Thread_local Scanner scanner;
+
+int scanThreads = 0;
+
+// Messages of error tokens, error tokens in a TokenBlock store the index
+static const char *errorMessages[] = {
+    "Unterminated string.",
+    "Unexpected character.",
+};
 
 void initScanner(const char *source) {
   scanner.start = source;   // Pointer to the start of the stirng
@@ -224,7 +235,7 @@ static Token string() {
   }
 
   if (isAtEnd())
-    return errorToken("Unterminated string.");
+    return errorToken(errorMessages[0]);
 
   // Consume the final quote
   advance();
@@ -254,10 +265,16 @@ Token scanToken() {
     return makeToken(TOKEN_LEFT_BRACE);
   case '}':
     return makeToken(TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(TOKEN_RIGHT_BRACKET);
   case ';':
     return makeToken(TOKEN_SEMICOLON);
   case ',':
     return makeToken(TOKEN_COMMA);
+  case ':':
+    return makeToken(TOKEN_COLON);
   case '.':
     return makeToken(TOKEN_DOT);
   case '-':
@@ -280,5 +297,200 @@ Token scanToken() {
     return string();
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(errorMessages[1]);
+}
+
+/**
+ * Add a token to a block, growing its arrays as needed
+ *
+ * Blocks are filled on scanning threads, so they use the C allocator rather
+ * than reallocate (which can start a collection).
+ * */
+static void appendToken(TokenBlock *block, const char *source, Token token) {
+  if (block->capacity < block->count + 1) {
+    block->capacity = block->capacity < 1024 ? 1024 : block->capacity * 2;
+    block->types = realloc(block->types, sizeof(uint8_t) * block->capacity);
+    block->starts =
+        realloc(block->starts, sizeof(uint32_t) * block->capacity);
+    block->lengths =
+        realloc(block->lengths, sizeof(uint32_t) * block->capacity);
+    block->lines = realloc(block->lines, sizeof(uint32_t) * block->capacity);
+    if (block->types == NULL || block->starts == NULL ||
+        block->lengths == NULL || block->lines == NULL)
+      exit(1);
+  }
+
+  size_t index = block->count++;
+  block->types[index] = (uint8_t)token.type;
+  if (token.type == TOKEN_ERROR) {
+    // The start of an error token is its message, not part of the source
+    block->starts[index] = (uint32_t)(scanner.start - source);
+    block->lengths[index] = token.start == errorMessages[0] ? 0 : 1;
+  } else {
+    block->starts[index] = (uint32_t)(token.start - source);
+    block->lengths[index] = (uint32_t)token.length;
+  }
+  block->lines[index] = (uint32_t)token.line;
+}
+
+/**
+ * A piece of a source for a thread to scan */
+typedef struct {
+  const char *source; //! Whole source
+  uint32_t limit;     //! Offset of the next piece (or the length if last)
+  bool last;          //! Whether the piece runs to the end of the source
+  TokenBlock *block;  //! Block to fill (from is set)
+} ScanJob;
+
+/**
+ * Scan the tokens starting in [block->from, limit), plus TOKEN_EOF for the
+ * last piece */
+static void scanPiece(ScanJob *job) {
+  TokenBlock *block = job->block;
+  block->count = 0;
+  initScanner(job->source + block->from);
+
+  const char *limit = job->source + job->limit;
+  skipWhitespace();
+  // The previous piece stops here too, past the same whitespace and comments,
+  // unless this piece started inside one of its tokens
+  block->start = (uint32_t)(scanner.current - job->source);
+  block->startLine = (uint32_t)scanner.line;
+  for (;;) {
+    // The token after the limit belongs to the next piece (a token started
+    // before it may run past it though)
+    if (!job->last && scanner.current >= limit)
+      break;
+    Token token = scanToken();
+    appendToken(block, job->source, token);
+    if (token.type == TOKEN_EOF)
+      break;
+    skipWhitespace();
+  }
+  block->stop = (uint32_t)(scanner.current - job->source);
+  block->stopLine = (uint32_t)scanner.line;
+}
+
+/**
+ * Thread entry point for scanPiece */
+static void *scanThread(void *job) {
+  scanPiece((ScanJob *)job);
+  return NULL;
+}
+
+/**
+ * Number of pieces to split a source of the given length into */
+static int pieceCount(size_t length) {
+  long threads = scanThreads;
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > SCAN_THREADS_MAX)
+    threads = SCAN_THREADS_MAX;
+  long pieces = (long)(length / SCAN_PIECE_MIN);
+  if (pieces > threads)
+    pieces = threads;
+  return pieces < 1 ? 1 : (int)pieces;
+}
+
+bool scanTokens(const char *source, size_t length, TokenBuffer *tokens) {
+  if (length > UINT32_MAX)
+    return false;
+
+  int count = pieceCount(length);
+  TokenBlock *blocks = calloc(count, sizeof(TokenBlock));
+  ScanJob *jobs = calloc(count, sizeof(ScanJob));
+  pthread_t *threads = calloc(count, sizeof(pthread_t));
+  if (blocks == NULL || jobs == NULL || threads == NULL)
+    exit(1);
+
+  // Each piece after the first starts just after a newline
+  uint32_t from = 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t limit = (uint32_t)length;
+    if (i < count - 1) {
+      size_t split = length / count * (i + 1);
+      const char *newline =
+          split < from ? NULL : memchr(source + split, '\n', length - split);
+      if (newline != NULL)
+        limit = (uint32_t)(newline - source) + 1;
+    }
+    blocks[i].from = from;
+    jobs[i] = (ScanJob){source, limit, i == count - 1, &blocks[i]};
+    from = limit;
+  }
+
+  // The calling thread scans the first piece itself
+  int started = 1;
+  for (int i = 1; i < count; i++) {
+    if (pthread_create(&threads[i], NULL, scanThread, &jobs[i]) != 0)
+      break;
+    started++;
+  }
+  scanPiece(&jobs[0]);
+  for (int i = started; i < count; i++) {
+    scanPiece(&jobs[i]);
+  }
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // A piece that started in the middle of a token (a string spanning its
+  // first newline) is scanned again from where the token really ended
+  blocks[0].firstLine = 1;
+  for (int i = 1; i < count; i++) {
+    if (blocks[i].start != blocks[i - 1].stop) {
+      blocks[i].from = blocks[i - 1].stop;
+      scanPiece(&jobs[i]);
+    }
+    // The previous piece stopped on the line of this piece's first token
+    blocks[i].firstLine = blocks[i - 1].firstLine +
+                          (int)blocks[i - 1].stopLine -
+                          (int)blocks[i].startLine;
+  }
+
+  free(jobs);
+  free(threads);
+  tokens->source = source;
+  tokens->blocks = blocks;
+  tokens->blockCount = count;
+  tokens->block = 0;
+  tokens->next = 0;
+  return true;
+}
+
+Token readToken(TokenBuffer *tokens) {
+  // Skip to the next block with tokens left, staying on the final TOKEN_EOF
+  TokenBlock *block = &tokens->blocks[tokens->block];
+  while (tokens->next >= block->count &&
+         tokens->block < tokens->blockCount - 1) {
+    block = &tokens->blocks[++tokens->block];
+    tokens->next = 0;
+  }
+  size_t index = tokens->next;
+  if (index < block->count - 1 || block->types[index] != TOKEN_EOF)
+    tokens->next++;
+
+  Token token;
+  token.type = (TokenType)block->types[index];
+  if (token.type == TOKEN_ERROR) {
+    token.start = errorMessages[block->lengths[index]];
+    token.length = (int)strlen(token.start);
+  } else {
+    token.start = tokens->source + block->starts[index];
+    token.length = (int)block->lengths[index];
+  }
+  token.line = block->firstLine + (int)block->lines[index] - 1;
+  return token;
+}
+
+void freeTokens(TokenBuffer *tokens) {
+  for (int i = 0; i < tokens->blockCount; i++) {
+    free(tokens->blocks[i].types);
+    free(tokens->blocks[i].starts);
+    free(tokens->blocks[i].lengths);
+    free(tokens->blocks[i].lines);
+  }
+  free(tokens->blocks);
+  tokens->blocks = NULL;
+  tokens->blockCount = 0;
 }
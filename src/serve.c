@@ -0,0 +1,735 @@
+// Std library includes
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local Includes
+#include "chunk.h"
+#include "fiber.h"
+#include "object.h"
+#include "output.h"
+#include "serve.h"
+#include "vm.h"
+
+// Scripts each worker keeps compiled (a power of two)
+#define SCRIPT_CACHE_SIZE 64
+// Instructions a request runs between checks of its deadline
+#define SERVE_QUANTUM FIBER_QUANTUM_DEFAULT
+// Most events handled per wait of the event loop
+#define SERVE_EVENTS 64
+// Bytes read from a connection at a time
+#define SERVE_READ_SIZE 65536
+
+typedef struct Connection Connection;
+
+/**
+ * A request, from when it's read until its response is queued to be sent.
+ * */
+typedef struct Job {
+  Connection *connection; //! Connection the request came in on
+  char *source;           //! Source to evaluate (null-terminated)
+  uint32_t length;        //! Length of the source
+  uint64_t deadline;      //! Time to give up at (monotonic ns), or 0
+  uint32_t status;        //! Exit status of the evaluation (once done)
+  char *output;           //! What the evaluation printed (once done)
+  size_t outputLength;    //! Length of output
+  char *errors;           //! Error messages of the evaluation (once done)
+  size_t errorsLength;    //! Length of errors
+  bool done;              //! Whether a worker has finished the job
+  struct Job *next;       //! Next request of the same connection
+  struct Job *queued;     //! Next job in the work queue or the done list
+} Job;
+
+/**
+ * A client connection.
+ *
+ * A connection outlives its socket while workers still have its requests.
+ * */
+struct Connection {
+  int fd;                  //! Socket (-1 once closed)
+  bool reading;            //! Whether the client can still send requests
+  bool writing;            //! Whether waiting for the socket to be writable
+  uint8_t *in;             //! Bytes received that aren't a whole request yet
+  size_t inCount;          //! Number of bytes in in
+  size_t inCapacity;       //! Capacity of in
+  uint8_t *out;            //! Responses not sent yet
+  size_t outStart;         //! Offset of the first unsent byte in out
+  size_t outCount;         //! Offset just past the last unsent byte in out
+  size_t outCapacity;      //! Capacity of out
+  Job *first;              //! Oldest request not answered yet
+  Job *last;               //! Newest request not answered yet
+  struct Connection *prev; //! Previous connection of the server
+  struct Connection *next; //! Next connection of the server
+};
+
+/**
+ * A compiled script a worker keeps, with the source it was compiled from.
+ * */
+typedef struct {
+  char *source;       //! Source of the script (NULL for an empty entry)
+  uint32_t length;    //! Length of the source
+  uint32_t hash;      //! Hash of the source
+  FrozenChunk *chunk; //! The compiled script
+} CachedScript;
+
+typedef struct Server Server;
+
+/**
+ * A worker thread, evaluating requests in its own VM.
+ * */
+typedef struct {
+  Server *server;                          //! Server the worker belongs to
+  VM vm;                                   //! The worker's warm VM
+  CachedScript scripts[SCRIPT_CACHE_SIZE]; //! Compiled scripts, by hash
+  pthread_t thread;                        //! The worker thread
+} ServeWorker;
+
+/**
+ * State of the daemon.
+ * */
+struct Server {
+  ServeWorker *workers;    //! The worker threads
+  int workerCount;         //! Number of workers
+  int threadCount;         //! Number of workers whose thread started
+  uint32_t timeout;        //! Default timeout in milliseconds (0 for none)
+  int epoll;               //! Event loop's epoll instance
+  int listener;            //! Listening socket
+  int signals;             //! signalfd for the signals stopping the daemon
+  int doneEvent;           //! eventfd signalled when jobs are done
+  pthread_mutex_t lock;    //! Protects the queue, done list and stopping
+  pthread_cond_t wake;     //! Signalled when jobs are queued
+  Job *queueHead;          //! Oldest job waiting for a worker
+  Job *queueTail;          //! Newest job waiting for a worker
+  Job *done;               //! Jobs the workers finished
+  bool stopping;           //! Set when the workers should exit
+  Connection *connections; //! Every connection, open or waiting on jobs
+  Connection *closed;      //! Connections to free after the current events
+};
+
+/**
+ * Current time, in nanoseconds of the monotonic clock */
+static uint64_t now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/**
+ * Get the compiled script for a job's source, compiling it the first time
+ * (in the worker's VM, which numbered its globals)
+ *
+ * @returns The script, or NULL if it didn't compile */
+static FrozenChunk *compiledScript(ServeWorker *worker, Job *job) {
+  uint32_t hash = hashString(job->source, (int)job->length);
+  CachedScript *cached = &worker->scripts[hash & (SCRIPT_CACHE_SIZE - 1)];
+  if (cached->source != NULL && cached->hash == hash &&
+      cached->length == job->length &&
+      memcmp(cached->source, job->source, job->length) == 0)
+    return cached->chunk;
+
+  FrozenChunk *frozen = compileSource(job->source);
+  if (frozen == NULL)
+    return NULL;
+  // Scripts sharing a slot replace each other
+  if (cached->source != NULL) {
+    dropScript(cached->chunk);
+    releaseChunk(cached->chunk);
+    free(cached->source);
+  }
+  keepScript(frozen);
+  cached->source = job->source;
+  cached->length = job->length;
+  cached->hash = hash;
+  cached->chunk = frozen;
+  job->source = NULL;
+  return frozen;
+}
+
+/**
+ * Evaluate a job's source in the worker's VM, a quantum at a time until it
+ * finishes or runs out of time, then put the globals back as they were
+ *
+ * @returns Exit status of the evaluation */
+static uint32_t evaluate(ServeWorker *worker, Job *job) {
+  if (job->deadline != 0 && now() >= job->deadline)
+    return SERVE_TIMEOUT;
+  FrozenChunk *frozen = compiledScript(worker, job);
+  if (frozen == NULL)
+    return 65;
+
+  pthread_mutex_lock(&vm->lock);
+  // Reading and writing files gives up at the deadline too
+  vm->deadline = job->deadline;
+  Fiber *fiber = newFiber(frozen);
+  InterpretResult result;
+  while ((result = resumeFiber(fiber, SERVE_QUANTUM)) == INTERPRET_YIELD) {
+    if (job->deadline != 0 && now() >= job->deadline)
+      break;
+  }
+  freeFiber(fiber);
+  vm->deadline = 0;
+  restoreGlobals();
+  pthread_mutex_unlock(&vm->lock);
+
+  if (result == INTERPRET_YIELD)
+    return SERVE_TIMEOUT;
+  return result == INTERPRET_OK ? 0 : 70;
+}
+
+/**
+ * Run a job, capturing what it prints and the errors it reports */
+static void runJob(ServeWorker *worker, Job *job) {
+  FILE *output = open_memstream(&job->output, &job->outputLength);
+  FILE *errors = open_memstream(&job->errors, &job->errorsLength);
+  if (output == NULL || errors == NULL)
+    exit(1);
+  vm->output.file = output;
+  vm->errors = errors;
+  job->status = evaluate(worker, job);
+  flushOutput(&vm->output);
+  vm->output.file = stdout;
+  vm->errors = stderr;
+  fclose(output);
+  fclose(errors);
+}
+
+/**
+ * Body of a worker thread: run queued jobs until the server stops */
+static void *workerMain(void *argument) {
+  ServeWorker *worker = argument;
+  Server *server = worker->server;
+  vm = &worker->vm;
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (server->queueHead == NULL && !server->stopping)
+      pthread_cond_wait(&server->wake, &server->lock);
+    if (server->stopping) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    Job *job = server->queueHead;
+    server->queueHead = job->queued;
+    if (server->queueHead == NULL)
+      server->queueTail = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    runJob(worker, job);
+
+    pthread_mutex_lock(&server->lock);
+    job->queued = server->done;
+    server->done = job;
+    pthread_mutex_unlock(&server->lock);
+    // Can only fail if the counter is about to overflow, when the loop has
+    // a wake up pending anyway
+    uint64_t one = 1;
+    if (write(server->doneEvent, &one, sizeof(one)) < 0)
+      continue;
+  }
+  return NULL;
+}
+
+/**
+ * Free a job and everything it holds */
+static void freeJob(Job *job) {
+  free(job->source);
+  free(job->output);
+  free(job->errors);
+  free(job);
+}
+
+/**
+ * Retire a connection whose socket is closed and jobs answered. It's only
+ * freed after the current batch of events, which may still mention it. */
+static void retireConnection(Server *server, Connection *connection) {
+  if (connection->prev != NULL) {
+    connection->prev->next = connection->next;
+  } else {
+    server->connections = connection->next;
+  }
+  if (connection->next != NULL)
+    connection->next->prev = connection->prev;
+  connection->prev = NULL;
+  connection->next = server->closed;
+  server->closed = connection;
+}
+
+/**
+ * Free the connections retired so far */
+static void freeClosedConnections(Server *server) {
+  while (server->closed != NULL) {
+    Connection *connection = server->closed;
+    server->closed = connection->next;
+    free(connection->in);
+    free(connection->out);
+    free(connection);
+  }
+}
+
+/**
+ * Close a connection's socket, freeing the connection unless workers still
+ * have its requests (then it's freed once they're done) */
+static void closeConnection(Server *server, Connection *connection) {
+  epoll_ctl(server->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  connection->fd = -1;
+  connection->reading = false;
+  connection->outStart = connection->outCount = 0;
+  if (connection->first == NULL)
+    retireConnection(server, connection);
+}
+
+/**
+ * Wait for the events the connection is interested in now */
+static void updateEvents(Server *server, Connection *connection) {
+  struct epoll_event event;
+  event.events = (connection->reading ? EPOLLIN : 0) |
+                 (connection->writing ? EPOLLOUT : 0);
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/**
+ * Send as much of the connection's responses as the socket takes, closing
+ * the connection once everything is answered and the client is done */
+static void sendResponses(Server *server, Connection *connection) {
+  while (connection->outStart < connection->outCount) {
+    ssize_t sent = send(connection->fd, connection->out + connection->outStart,
+                        connection->outCount - connection->outStart,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!connection->writing) {
+        connection->writing = true;
+        updateEvents(server, connection);
+      }
+      return;
+    }
+    if (sent < 0) {
+      closeConnection(server, connection);
+      return;
+    }
+    connection->outStart += (size_t)sent;
+  }
+  connection->outStart = connection->outCount = 0;
+
+  if (!connection->reading && connection->first == NULL) {
+    closeConnection(server, connection);
+  } else if (connection->writing) {
+    connection->writing = false;
+    updateEvents(server, connection);
+  }
+}
+
+/**
+ * Append bytes to the responses of a connection */
+static void appendOutput(Connection *connection, const void *bytes,
+                         size_t length) {
+  if (connection->outCapacity < connection->outCount + length) {
+    size_t capacity = connection->outCapacity < 256 ? 256
+                                                    : connection->outCapacity;
+    while (capacity < connection->outCount + length)
+      capacity *= 2;
+    connection->out = realloc(connection->out, capacity);
+    if (connection->out == NULL)
+      exit(1);
+    connection->outCapacity = capacity;
+  }
+  if (length > 0)
+    memcpy(connection->out + connection->outCount, bytes, length);
+  connection->outCount += length;
+}
+
+/**
+ * Answer the finished requests at the head of a connection, in order */
+static void answerRequests(Server *server, Connection *connection) {
+  while (connection->first != NULL && connection->first->done) {
+    Job *job = connection->first;
+    connection->first = job->next;
+    if (connection->first == NULL)
+      connection->last = NULL;
+
+    if (connection->fd >= 0) {
+      uint8_t header[SERVE_RESPONSE_HEADER];
+      putField(header, job->status);
+      putField(header + 4, (uint32_t)job->outputLength);
+      putField(header + 8, (uint32_t)job->errorsLength);
+      appendOutput(connection, header, sizeof(header));
+      appendOutput(connection, job->output, job->outputLength);
+      appendOutput(connection, job->errors, job->errorsLength);
+    }
+    freeJob(job);
+  }
+
+  if (connection->fd >= 0) {
+    sendResponses(server, connection);
+  } else if (connection->first == NULL) {
+    retireConnection(server, connection);
+  }
+}
+
+/**
+ * Answer the jobs the workers finished */
+static void finishJobs(Server *server) {
+  // Resetting the counter can only fail if it's already reset
+  uint64_t count;
+  if (read(server->doneEvent, &count, sizeof(count)) < 0)
+    count = 0;
+  pthread_mutex_lock(&server->lock);
+  Job *job = server->done;
+  server->done = NULL;
+  pthread_mutex_unlock(&server->lock);
+
+  // A connection's later jobs aren't marked done yet, so answering one can't
+  // free a job (or connection) further down the list
+  while (job != NULL) {
+    Job *next = job->queued;
+    job->done = true;
+    answerRequests(server, job->connection);
+    job = next;
+  }
+}
+
+/**
+ * Turn the whole requests received on a connection into jobs, and queue
+ * them for the workers
+ *
+ * @returns False if a request is too long */
+static bool parseRequests(Server *server, Connection *connection) {
+  size_t offset = 0;
+  Job *first = NULL;
+  Job *last = NULL;
+  while (connection->inCount - offset >= SERVE_REQUEST_HEADER) {
+    uint8_t *request = connection->in + offset;
+    uint32_t length = getField(request);
+    uint32_t timeout = getField(request + 4);
+    if (length > SERVE_SOURCE_MAX)
+      return false;
+    if (connection->inCount - offset < SERVE_REQUEST_HEADER + length)
+      break;
+
+    Job *job = calloc(1, sizeof(Job));
+    char *source = malloc(length + 1);
+    if (job == NULL || source == NULL)
+      exit(1);
+    memcpy(source, request + SERVE_REQUEST_HEADER, length);
+    source[length] = '\0';
+    job->connection = connection;
+    job->source = source;
+    job->length = length;
+    if (timeout == 0)
+      timeout = server->timeout;
+    if (timeout != 0)
+      job->deadline = now() + (uint64_t)timeout * 1000000u;
+
+    if (connection->last != NULL) {
+      connection->last->next = job;
+    } else {
+      connection->first = job;
+    }
+    connection->last = job;
+    if (last != NULL) {
+      last->queued = job;
+    } else {
+      first = job;
+    }
+    last = job;
+    offset += SERVE_REQUEST_HEADER + length;
+  }
+
+  memmove(connection->in, connection->in + offset,
+          connection->inCount - offset);
+  connection->inCount -= offset;
+  if (first == NULL)
+    return true;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->queueTail != NULL) {
+    server->queueTail->queued = first;
+  } else {
+    server->queueHead = first;
+  }
+  server->queueTail = last;
+  pthread_cond_broadcast(&server->wake);
+  pthread_mutex_unlock(&server->lock);
+  return true;
+}
+
+/**
+ * Read what a client sent, queueing every complete request */
+static void readRequests(Server *server, Connection *connection) {
+  for (;;) {
+    if (connection->inCapacity - connection->inCount < SERVE_READ_SIZE) {
+      connection->inCapacity = connection->inCount + SERVE_READ_SIZE;
+      connection->in = realloc(connection->in, connection->inCapacity);
+      if (connection->in == NULL)
+        exit(1);
+    }
+    ssize_t count = read(connection->fd, connection->in + connection->inCount,
+                         SERVE_READ_SIZE);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (count < 0) {
+      closeConnection(server, connection);
+      return;
+    }
+    if (count == 0) {
+      // The client is done sending, answer what it sent then close
+      connection->reading = false;
+      updateEvents(server, connection);
+      if (connection->first == NULL && connection->outCount == 0)
+        closeConnection(server, connection);
+      return;
+    }
+    connection->inCount += (size_t)count;
+    if (!parseRequests(server, connection)) {
+      closeConnection(server, connection);
+      return;
+    }
+  }
+}
+
+/**
+ * Accept every pending connection */
+static void acceptConnections(Server *server) {
+  for (;;) {
+    int fd = accept(server->listener, NULL, NULL);
+    if (fd < 0)
+      return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (connection == NULL)
+      exit(1);
+    connection->fd = fd;
+    connection->reading = true;
+    connection->next = server->connections;
+    if (server->connections != NULL)
+      server->connections->prev = connection;
+    server->connections = connection;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+/**
+ * Create the listening socket, replacing a socket left by a daemon that's
+ * no longer running
+ *
+ * @returns The socket, or -1 if it couldn't be created */
+static int listenOn(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, path);
+
+  struct stat status;
+  if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 &&
+                connect(probe, (struct sockaddr *)&address,
+                        sizeof(address)) == 0;
+    if (probe >= 0)
+      close(probe);
+    if (live)
+      return -1;
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Watch a file descriptor for input in the event loop */
+static void watch(Server *server, int fd, void *tag) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = tag;
+  epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Start the worker threads, each with a VM
+ *
+ * @returns False if a VM couldn't load the image, or no thread started */
+static bool startWorkers(Server *server, const ServeOptions *options) {
+  int count = options->workers;
+  if (count <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 0 ? (int)online : 1;
+  }
+  if (count > SCHEDULER_WORKERS_MAX)
+    count = SCHEDULER_WORKERS_MAX;
+  server->workers = calloc(count, sizeof(ServeWorker));
+  if (server->workers == NULL)
+    exit(1);
+
+  bool loaded = true;
+  for (int i = 0; i < count; i++) {
+    server->workers[i].server = server;
+    loaded = initVM(&server->workers[i].vm, options->imagePath) && loaded;
+    // What every request starts from
+    saveGlobals();
+  }
+  vm = NULL;
+  server->workerCount = count;
+  if (!loaded)
+    return false;
+
+  for (int i = 0; i < count; i++) {
+    ServeWorker *worker = &server->workers[i];
+    if (pthread_create(&worker->thread, NULL, workerMain, worker) != 0)
+      break;
+    server->threadCount++;
+  }
+  return server->threadCount > 0;
+}
+
+/**
+ * Stop the worker threads and free their VMs */
+static void stopWorkers(Server *server) {
+  pthread_mutex_lock(&server->lock);
+  server->stopping = true;
+  pthread_cond_broadcast(&server->wake);
+  pthread_mutex_unlock(&server->lock);
+  for (int i = 0; i < server->threadCount; i++) {
+    pthread_join(server->workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < server->workerCount; i++) {
+    ServeWorker *worker = &server->workers[i];
+    vm = &worker->vm;
+    for (int j = 0; j < SCRIPT_CACHE_SIZE; j++) {
+      free(worker->scripts[j].source);
+    }
+    // The VM releases the scripts it keeps
+    freeVM();
+  }
+  vm = NULL;
+  free(server->workers);
+}
+
+/**
+ * Handle events until a signal stops the daemon */
+static void runEventLoop(Server *server) {
+  struct epoll_event events[SERVE_EVENTS];
+  for (;;) {
+    int count = epoll_wait(server->epoll, events, SERVE_EVENTS, -1);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0)
+      return;
+
+    for (int i = 0; i < count; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag == &server->signals) {
+        freeClosedConnections(server);
+        return;
+      }
+      if (tag == &server->listener) {
+        acceptConnections(server);
+      } else if (tag == &server->doneEvent) {
+        finishJobs(server);
+      } else {
+        Connection *connection = tag;
+        // Events for a connection closed earlier in this batch are stale
+        if (connection->fd < 0)
+          continue;
+        // Once the client hung up entirely, responses can't be delivered
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+          closeConnection(server, connection);
+          continue;
+        }
+        if (events[i].events & EPOLLOUT)
+          sendResponses(server, connection);
+        if (connection->fd >= 0 && (events[i].events & EPOLLIN))
+          readRequests(server, connection);
+      }
+    }
+    freeClosedConnections(server);
+  }
+}
+
+int serve(const char *socketPath, const ServeOptions *options) {
+  Server server;
+  memset(&server, 0, sizeof(Server));
+  server.timeout = options->timeout;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.wake, NULL);
+
+  server.listener = listenOn(socketPath);
+  if (server.listener < 0) {
+    fprintf(stderr, "Could not listen on \"%s\".\n", socketPath);
+    return 74;
+  }
+
+  // Blocked before any worker starts, so the signals only reach the loop
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  server.signals = signalfd(-1, &signals, SFD_CLOEXEC);
+  server.doneEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.epoll = epoll_create1(EPOLL_CLOEXEC);
+  watch(&server, server.listener, &server.listener);
+  watch(&server, server.signals, &server.signals);
+  watch(&server, server.doneEvent, &server.doneEvent);
+
+  int status = EXIT_SUCCESS;
+  if (startWorkers(&server, options)) {
+    runEventLoop(&server);
+  } else {
+    fprintf(stderr, "Could not start the workers.\n");
+    status = 70;
+  }
+  stopWorkers(&server);
+
+  // Every job is still on its connection's list until it's answered
+  while (server.connections != NULL) {
+    Connection *connection = server.connections;
+    while (connection->first != NULL) {
+      Job *job = connection->first;
+      connection->first = job->next;
+      freeJob(job);
+    }
+    if (connection->fd >= 0)
+      close(connection->fd);
+    retireConnection(&server, connection);
+  }
+  freeClosedConnections(&server);
+
+  close(server.epoll);
+  close(server.doneEvent);
+  close(server.signals);
+  close(server.listener);
+  unlink(socketPath);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+  pthread_cond_destroy(&server.wake);
+  pthread_mutex_destroy(&server.lock);
+  return status;
+}
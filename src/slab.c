@@ -0,0 +1,293 @@
+// Std library includes
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Local Includes
+#include "slab.h"
+
+/**
+ * Header at the start of every block, followed by its slots.
+ * */
+struct SlabBlock {
+  SlabBlock *next;              //! Next block of the heap
+  SlabBlock *previous;          //! Previous block of the heap
+  SlabBlock *nextAvailable;     //! Next block of the class with free slots
+  SlabBlock *previousAvailable; //! Previous such block
+  void *free;                   //! Freed slots, each pointing to the next
+  char *bump;                   //! First slot never allocated
+  char *end;                    //! End of the last slot that fits
+  int sizeClass;                //! Index of the slot size
+  int live;                     //! Slots allocated and not freed
+  bool available;               //! On its class's list of available blocks
+};
+
+// Bytes of the header, keeping the slots on cache lines
+#define HEADER_SIZE                                                            \
+  ((sizeof(SlabBlock) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1))
+
+// The block a slot is in
+#define BLOCK_OF(pointer)                                                      \
+  ((SlabBlock *)((uintptr_t)(pointer) & ~(uintptr_t)(SLAB_BLOCK_SIZE - 1)))
+
+#ifdef DEBUG_NO_SLABS
+#define IS_SMALL(size) false
+#else
+#define IS_SMALL(size) ((size) <= SLAB_MAX_SIZE)
+#endif
+
+// Steps of 16 bytes, then 32 and 64, so rounding up wastes at most 1/8
+static const size_t slotSizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+/**
+ * Find the class of the smallest slots a size fits in (1 to SLAB_MAX_SIZE)
+ * */
+static inline int sizeClass(size_t size) {
+  if (size <= 128)
+    return (int)((size + 15) / 16) - 1;
+  if (size <= 256)
+    return 8 + (int)((size - 129) / 32);
+  return 12 + (int)((size - 257) / 64);
+}
+
+/**
+ * Map a block aligned to its size, from a region twice as large with the
+ * unaligned ends unmapped */
+static SlabBlock *mapBlock() {
+  size_t size = 2 * SLAB_BLOCK_SIZE;
+  char *region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    exit(1);
+  char *block = (char *)(((uintptr_t)region + SLAB_BLOCK_SIZE - 1) &
+                         ~(uintptr_t)(SLAB_BLOCK_SIZE - 1));
+  if (block > region)
+    munmap(region, block - region);
+  if (block + SLAB_BLOCK_SIZE < region + size)
+    munmap(block + SLAB_BLOCK_SIZE, region + size - block - SLAB_BLOCK_SIZE);
+  return (SlabBlock *)block;
+}
+
+static void addAvailable(SlabClass *class, SlabBlock *block) {
+  block->previousAvailable = NULL;
+  block->nextAvailable = class->available;
+  if (class->available != NULL)
+    class->available->previousAvailable = block;
+  class->available = block;
+  block->available = true;
+}
+
+static void removeAvailable(SlabClass *class, SlabBlock *block) {
+  if (block->previousAvailable != NULL)
+    block->previousAvailable->nextAvailable = block->nextAvailable;
+  else
+    class->available = block->nextAvailable;
+  if (block->nextAvailable != NULL)
+    block->nextAvailable->previousAvailable = block->previousAvailable;
+  block->available = false;
+}
+
+/**
+ * Start a block of a class, reusing the heap's spare block if there is one */
+static SlabBlock *newBlock(SlabHeap *heap, int index) {
+  SlabBlock *block = heap->spare;
+  if (block != NULL) {
+    heap->spare = NULL;
+  } else {
+    block = mapBlock();
+    heap->blockCount++;
+  }
+  block->previous = NULL;
+  block->next = heap->blocks;
+  if (heap->blocks != NULL)
+    heap->blocks->previous = block;
+  heap->blocks = block;
+
+  char *slots = (char *)block + HEADER_SIZE;
+  size_t count = (SLAB_BLOCK_SIZE - HEADER_SIZE) / slotSizes[index];
+  block->free = NULL;
+  block->bump = slots;
+  block->end = slots + count * slotSizes[index];
+  block->sizeClass = index;
+  block->live = 0;
+  block->available = false;
+  return block;
+}
+
+/**
+ * Give back a block with no slots in use: the first becomes the spare, so a
+ * heap going back and forth over a block's worth of slots doesn't map and
+ * unmap a block each time */
+static void releaseBlock(SlabHeap *heap, SlabBlock *block) {
+  if (block->previous != NULL)
+    block->previous->next = block->next;
+  else
+    heap->blocks = block->next;
+  if (block->next != NULL)
+    block->next->previous = block->previous;
+
+  if (heap->spare == NULL) {
+    heap->spare = block;
+  } else {
+    munmap(block, SLAB_BLOCK_SIZE);
+    heap->blockCount--;
+  }
+}
+
+/**
+ * Allocate a slot once the current block of its class has none left */
+static void *refill(SlabHeap *heap, int index) {
+  SlabClass *class = &heap->classes[index];
+  // The current block is full, so it only goes back on the list of
+  // available blocks once one of its slots is freed
+  SlabBlock *block = class->available;
+  if (block != NULL) {
+    removeAvailable(class, block);
+  } else {
+    block = newBlock(heap, index);
+  }
+  class->current = block;
+
+  void *slot;
+  if (block->free != NULL) {
+    slot = block->free;
+    block->free = *(void **)slot;
+  } else {
+    slot = block->bump;
+    block->bump += slotSizes[index];
+  }
+  block->live++;
+  return slot;
+}
+
+static inline void *allocateSlot(SlabHeap *heap, int index) {
+  SlabBlock *block = heap->classes[index].current;
+  if (block != NULL) {
+    if (block->free != NULL) {
+      void *slot = block->free;
+      block->free = *(void **)slot;
+      block->live++;
+      return slot;
+    }
+    if (block->bump < block->end) {
+      void *slot = block->bump;
+      block->bump += slotSizes[index];
+      block->live++;
+      return slot;
+    }
+  }
+  return refill(heap, index);
+}
+
+static inline void freeSlot(SlabHeap *heap, void *pointer) {
+  SlabBlock *block = BLOCK_OF(pointer);
+  SlabClass *class = &heap->classes[block->sizeClass];
+  *(void **)pointer = block->free;
+  block->free = pointer;
+  block->live--;
+  if (block == class->current)
+    return;
+
+  if (block->live == 0) {
+    if (block->available)
+      removeAvailable(class, block);
+    releaseBlock(heap, block);
+  } else if (!block->available) {
+    addAvailable(class, block);
+  }
+}
+
+static void *allocate(SlabHeap *heap, size_t size) {
+  if (IS_SMALL(size)) {
+    heap->requestedBytes += size;
+    return allocateSlot(heap, sizeClass(size));
+  }
+  void *result = malloc(size);
+  if (result == NULL)
+    exit(1);
+  heap->largeBytes += size;
+  return result;
+}
+
+static void release(SlabHeap *heap, void *pointer, size_t size) {
+  if (pointer == NULL)
+    return;
+  if (IS_SMALL(size)) {
+    heap->requestedBytes -= size;
+    freeSlot(heap, pointer);
+  } else {
+    free(pointer);
+    heap->largeBytes -= size;
+  }
+}
+
+void initSlabs(SlabHeap *heap) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    heap->classes[i].current = NULL;
+    heap->classes[i].available = NULL;
+  }
+  heap->blocks = NULL;
+  heap->spare = NULL;
+  heap->blockCount = 0;
+  heap->requestedBytes = 0;
+  heap->largeBytes = 0;
+}
+
+void freeSlabs(SlabHeap *heap) {
+  SlabBlock *block = heap->blocks;
+  while (block != NULL) {
+    SlabBlock *next = block->next;
+    munmap(block, SLAB_BLOCK_SIZE);
+    block = next;
+  }
+  if (heap->spare != NULL)
+    munmap(heap->spare, SLAB_BLOCK_SIZE);
+  initSlabs(heap);
+}
+
+void *slabReallocate(SlabHeap *heap, void *pointer, size_t oldSize,
+                     size_t newSize) {
+  if (newSize == 0) {
+    release(heap, pointer, oldSize);
+    return NULL;
+  }
+  if (pointer == NULL)
+    return allocate(heap, newSize);
+
+  if (IS_SMALL(oldSize) && IS_SMALL(newSize) &&
+      sizeClass(oldSize) == sizeClass(newSize)) {
+    // Still fits its slot
+    heap->requestedBytes += newSize - oldSize;
+    return pointer;
+  }
+  if (!IS_SMALL(oldSize) && !IS_SMALL(newSize)) {
+    void *result = realloc(pointer, newSize);
+    if (result == NULL)
+      exit(1);
+    heap->largeBytes += newSize - oldSize;
+    return result;
+  }
+
+  // Moving between slot sizes, or between a slot and malloc
+  void *result = allocate(heap, newSize);
+  memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  release(heap, pointer, oldSize);
+  return result;
+}
+
+void slabStats(SlabHeap *heap, SlabStats *stats) {
+  stats->blocks = heap->blockCount;
+  stats->blockBytes = heap->blockCount * SLAB_BLOCK_SIZE;
+  stats->slotBytes = 0;
+  for (SlabBlock *block = heap->blocks; block != NULL; block = block->next) {
+    stats->slotBytes += (size_t)block->live * slotSizes[block->sizeClass];
+  }
+  stats->requestedBytes = heap->requestedBytes;
+  stats->largeBytes = heap->largeBytes;
+  stats->fragmentation =
+      stats->blockBytes > 0
+          ? 1 - (double)stats->requestedBytes / stats->blockBytes
+          : 0;
+}
@@ -0,0 +1,142 @@
+// Std library includes
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+// Grow the table when it becomes more than 75% full
+#define TABLE_MAX_LOAD 0.75
+
+void initTable(Table *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeTable(Table *table) {
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  initTable(table);
+}
+
+/**
+ * Find the slot for a key, either its entry or the slot it should go in
+ * (reusing the first tombstone passed on the way)
+ * */
+static Entry *findEntry(Entry *entries, int capacity, Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
+  Entry *tombstone = NULL;
+
+  for (;;) {
+    Entry *entry = &entries[index];
+    if (IS_NIL(entry->key)) {
+      if (IS_NIL(entry->value)) {
+        // Empty entry
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        // Found a tombstone
+        if (tombstone == NULL)
+          tombstone = entry;
+      }
+    } else if (valuesEqual(entry->key, key)) {
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+bool tableGet(Table *table, Value key, Value *value) {
+  if (table->count == 0)
+    return false;
+
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  if (IS_NIL(entry->key))
+    return false;
+
+  *value = entry->value;
+  return true;
+}
+
+/**
+ * Resize the table, rehashing every entry (and dropping tombstones) */
+static void adjustCapacity(Table *table, int capacity) {
+  Entry *entries = GROW_ARRAY(Entry, NULL, 0, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NIL_VAL;
+    entries[i].value = NIL_VAL;
+  }
+
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (IS_NIL(entry->key))
+      continue;
+
+    Entry *dest = findEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+bool tableSet(Table *table, Value key, Value value) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    adjustCapacity(table, capacity);
+  }
+
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  bool isNewKey = IS_NIL(entry->key);
+  // Reusing a tombstone doesn't change the count, it was already counted
+  if (isNewKey && IS_NIL(entry->value))
+    table->count++;
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool tableDelete(Table *table, Value key) {
+  if (table->count == 0)
+    return false;
+
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  if (IS_NIL(entry->key))
+    return false;
+
+  // Leave a tombstone so probe sequences through this slot keep working
+  entry->key = NIL_VAL;
+  entry->value = BOOL_VAL(true);
+  return true;
+}
+
+ObjString *tableFindString(Table *table, const char *chars, int length,
+                           uint32_t hash) {
+  if (table->count == 0)
+    return NULL;
+
+  uint32_t index = hash & (table->capacity - 1);
+  for (;;) {
+    Entry *entry = &table->entries[index];
+    if (IS_NIL(entry->key)) {
+      // Stop at an empty, non-tombstone entry
+      if (IS_NIL(entry->value))
+        return NULL;
+    } else if (IS_HEAP_STRING(entry->key)) {
+      ObjString *key = AS_HEAP_STRING(entry->key);
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0)
+        return key;
+    }
+
+    index = (index + 1) & (table->capacity - 1);
+  }
+}
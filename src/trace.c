@@ -0,0 +1,396 @@
+// Std library includes
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+// A trace file is (in host byte order):
+//   magic, version, flags, eventCount, totalEvents, chunkCount
+//   chunks (chunkCount of them, by index), each:
+//     name (a constant, nil for a script), codeCount, constantCount
+//     code (codeCount bytes), lines (codeCount ints)
+//     constants (constantCount of type byte + 8 byte payload, heap strings
+//                are followed by payload characters, arrays by payload
+//                doubles)
+//   globalCount, global names (globalCount constants)
+//   events (eventCount TraceEvents, oldest first)
+#define TRACE_MAGIC "CLOXTRC1"
+#define TRACE_VERSION 6
+// Type byte of array constants (other constants use their ValueType)
+#define ARRAY_CONSTANT 0x80
+
+volatile sig_atomic_t traceDumpRequested = 0;
+
+/**
+ * Signal handler requesting a trace dump, the VM writes it out at the next
+ * instruction (writing files isn't safe inside a signal handler) */
+static void requestTraceDump(int signal) { traceDumpRequested = 1; }
+
+void initTrace(TraceBuffer *trace) {
+  atomic_store_explicit(&trace->head, 0, memory_order_relaxed);
+  trace->current = NULL;
+  trace->currentIndex = TRACE_CHUNK_UNKNOWN;
+  trace->chunkCount = 0;
+  memset(trace->slots, 0, sizeof(trace->slots));
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestTraceDump;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+void resetTrace(TraceBuffer *trace) {
+  for (int i = 0; i < trace->chunkCount; i++) {
+    if (trace->chunks[i].script != NULL)
+      releaseChunk(trace->chunks[i].script);
+  }
+  atomic_store_explicit(&trace->head, 0, memory_order_relaxed);
+  trace->current = NULL;
+  trace->currentIndex = TRACE_CHUNK_UNKNOWN;
+  trace->chunkCount = 0;
+  memset(trace->slots, 0, sizeof(trace->slots));
+}
+
+void markTrace(TraceBuffer *trace) {
+  for (int i = 0; i < trace->chunkCount; i++) {
+    TraceChunk *traced = &trace->chunks[i];
+    if (traced->function != NULL) {
+      markObject((Obj *)traced->function);
+    } else {
+      ValueArray *constants = &traced->script->chunk.constants;
+      for (int j = 0; j < constants->count; j++) {
+        markValue(constants->values[j]);
+      }
+    }
+  }
+}
+
+/**
+ * The chunk events with an index were recorded in */
+static Chunk *tracedChunk(TraceChunk *traced) {
+  return traced->function != NULL ? &traced->function->chunk
+                                  : &traced->script->chunk;
+}
+
+void traceChunk(TraceBuffer *trace, Chunk *chunk, ObjFunction *function) {
+  trace->current = chunk;
+  uint32_t slot = (uint32_t)((uintptr_t)chunk >> 4) & (TRACE_CHUNK_SLOTS - 1);
+  for (; trace->slots[slot] != 0; slot = (slot + 1) & (TRACE_CHUNK_SLOTS - 1)) {
+    if (tracedChunk(&trace->chunks[trace->slots[slot] - 1]) == chunk) {
+      trace->currentIndex = trace->slots[slot] - 1;
+      return;
+    }
+  }
+  if (trace->chunkCount == TRACE_CHUNKS_MAX) {
+    trace->currentIndex = TRACE_CHUNK_UNKNOWN;
+    return;
+  }
+
+  TraceChunk *traced = &trace->chunks[trace->chunkCount];
+  traced->function = function;
+  // Only frozen chunks run without a function, and the trace keeps them
+  // alive like the functions it marks
+  traced->script =
+      function == NULL
+          ? retainChunk((FrozenChunk *)((char *)chunk -
+                                        offsetof(FrozenChunk, chunk)))
+          : NULL;
+  trace->currentIndex = (uint16_t)trace->chunkCount++;
+  trace->slots[slot] = (uint16_t)trace->chunkCount;
+}
+
+const char *traceFilePath() {
+  const char *path = getenv(TRACE_FILE_ENV);
+  return path != NULL ? path : TRACE_FILE_DEFAULT;
+}
+
+/**
+ * Write a constant as a type byte followed by 8 bytes of payload */
+static void writeConstant(FILE *file, Value value) {
+  // A function is written as its name, its code isn't part of the trace
+  if (IS_FUNCTION(value))
+    value = AS_FUNCTION(value)->name;
+  uint8_t type = (uint8_t)value.type;
+  uint64_t payload = 0;
+  switch (value.type) {
+  case VAL_BOOL:
+    payload = AS_BOOL(value);
+    break;
+  case VAL_NIL:
+  case VAL_UNDEFINED:
+    break;
+  case VAL_NUMBER:
+    memcpy(&payload, &AS_NUMBER(value), sizeof(double));
+    break;
+  case VAL_INT:
+    payload = (uint64_t)AS_INT(value);
+    break;
+  case VAL_SMALL_STRING:
+    payload = value.as.bits;
+    break;
+  case VAL_OBJ:
+    // Otherwise only interned strings and arrays end up in a chunk's
+    // constants
+    if (IS_ARRAY(value)) {
+      type = ARRAY_CONSTANT;
+      payload = (uint64_t)AS_ARRAY(value)->count;
+    } else {
+      payload = (uint64_t)AS_HEAP_STRING(value)->length;
+    }
+    break;
+  }
+  fwrite(&type, sizeof(type), 1, file);
+  fwrite(&payload, sizeof(payload), 1, file);
+  if (IS_ARRAY(value)) {
+    fwrite(AS_ARRAY(value)->elements, sizeof(double), payload, file);
+    return;
+  }
+  if (IS_OBJ(value)) {
+    fwrite(AS_HEAP_STRING(value)->chars, sizeof(char), payload, file);
+  }
+}
+
+/**
+ * Read a constant written by writeConstant
+ *
+ * @returns True if a valid constant was read */
+static bool readConstant(FILE *file, Value *value) {
+  uint8_t type;
+  uint64_t payload;
+  if (fread(&type, sizeof(type), 1, file) != 1 ||
+      fread(&payload, sizeof(payload), 1, file) != 1)
+    return false;
+
+  switch (type) {
+  case VAL_BOOL:
+    *value = BOOL_VAL(payload != 0);
+    return true;
+  case VAL_NIL:
+    *value = NIL_VAL;
+    return true;
+  case VAL_NUMBER: {
+    double number;
+    memcpy(&number, &payload, sizeof(double));
+    *value = NUMBER_VAL(number);
+    return true;
+  }
+  case VAL_INT:
+    *value = INT_VAL((int64_t)payload);
+    return true;
+  case VAL_SMALL_STRING:
+    value->type = VAL_SMALL_STRING;
+    value->as.bits = payload;
+    return true;
+  case VAL_OBJ: {
+    if (payload > INT32_MAX)
+      return false;
+    int length = (int)payload;
+    char *chars = GROW_ARRAY(char, NULL, 0, length);
+    bool ok = fread(chars, sizeof(char), length, file) == (size_t)length;
+    if (ok)
+      *value = copyString(chars, length);
+    FREE_ARRAY(char, chars, length);
+    return ok;
+  }
+  case ARRAY_CONSTANT: {
+    if (payload > INT32_MAX)
+      return false;
+    ObjArray *array = newArray((int)payload);
+    *value = OBJ_VAL(array);
+    return fread(array->elements, sizeof(double), payload, file) == payload;
+  }
+  default:
+    return false;
+  }
+}
+
+/**
+ * Write a chunk events were recorded in, as its name, code and constants */
+static void writeTracedChunk(FILE *file, TraceChunk *traced) {
+  Chunk *chunk = tracedChunk(traced);
+  writeConstant(file, traced->function != NULL ? traced->function->name
+                                               : NIL_VAL);
+  uint32_t codeCount = (uint32_t)chunk->count;
+  uint32_t constantCount = (uint32_t)chunk->constants.count;
+  fwrite(&codeCount, sizeof(codeCount), 1, file);
+  fwrite(&constantCount, sizeof(constantCount), 1, file);
+  fwrite(chunk->code, sizeof(uint8_t), codeCount, file);
+  fwrite(chunk->lines, sizeof(int), codeCount, file);
+  for (uint32_t i = 0; i < constantCount; i++) {
+    writeConstant(file, chunk->constants.values[i]);
+  }
+}
+
+bool dumpTrace(TraceBuffer *trace, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+
+  uint64_t totalEvents =
+      atomic_load_explicit(&trace->head, memory_order_acquire);
+  uint64_t eventCount =
+      totalEvents < TRACE_CAPACITY ? totalEvents : TRACE_CAPACITY;
+  uint32_t version = TRACE_VERSION;
+  uint32_t flags = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  flags |= TRACE_CYCLES;
+#endif
+  uint32_t chunkCount = (uint32_t)trace->chunkCount;
+
+  fwrite(TRACE_MAGIC, sizeof(char), 8, file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(&flags, sizeof(flags), 1, file);
+  fwrite(&eventCount, sizeof(eventCount), 1, file);
+  fwrite(&totalEvents, sizeof(totalEvents), 1, file);
+  fwrite(&chunkCount, sizeof(chunkCount), 1, file);
+  for (uint32_t i = 0; i < chunkCount; i++) {
+    writeTracedChunk(file, &trace->chunks[i]);
+  }
+  // Global names, so instructions can be shown with the name of their slot
+  uint32_t globalCount = (uint32_t)vm->globalNames.count;
+  fwrite(&globalCount, sizeof(globalCount), 1, file);
+  for (uint32_t i = 0; i < globalCount; i++) {
+    writeConstant(file, vm->globalNames.values[i]);
+  }
+
+  // Oldest surviving event first, wrapping around the ring
+  for (uint64_t i = totalEvents - eventCount; i < totalEvents; i++) {
+    fwrite(&trace->events[i & (TRACE_CAPACITY - 1)], sizeof(TraceEvent), 1,
+           file);
+  }
+
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
+/**
+ * Copy the characters of a function's name read from a trace
+ *
+ * @returns The name, NULL for nil (a script's) */
+static char *copyName(Value name) {
+  if (IS_NIL(name))
+    return NULL;
+  const char *chars = IS_SMALL_STRING(name) ? AS_SMALL_STRING(name).chars
+                                            : AS_HEAP_STRING(name)->chars;
+  int length = IS_SMALL_STRING(name) ? AS_SMALL_STRING(name).length
+                                     : AS_HEAP_STRING(name)->length;
+  char *copy = malloc(length + 1);
+  if (copy == NULL)
+    exit(1);
+  memcpy(copy, chars, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+/**
+ * Read a chunk written by writeTracedChunk, which the VM keeps
+ *
+ * @returns True if a valid chunk was read */
+static bool readTracedChunk(FILE *file, TracedChunk *traced) {
+  Value name;
+  uint32_t codeCount, constantCount;
+  if (!readConstant(file, &name) ||
+      !(IS_NIL(name) || IS_SMALL_STRING(name) || IS_HEAP_STRING(name)) ||
+      fread(&codeCount, sizeof(codeCount), 1, file) != 1 ||
+      fread(&constantCount, sizeof(constantCount), 1, file) != 1)
+    return false;
+  traced->name = copyName(name);
+
+  // Constants of the current chunk are roots, so the collector keeps them
+  Chunk chunk;
+  initChunk(&chunk);
+  vm->chunk = &chunk;
+  uint8_t *code = GROW_ARRAY(uint8_t, NULL, 0, codeCount);
+  int *lines = GROW_ARRAY(int, NULL, 0, codeCount);
+  bool ok = fread(code, sizeof(uint8_t), codeCount, file) == codeCount &&
+            fread(lines, sizeof(int), codeCount, file) == codeCount;
+  for (uint32_t i = 0; ok && i < codeCount; i++) {
+    writeChunk(&chunk, code[i], lines[i]);
+  }
+  FREE_ARRAY(uint8_t, code, codeCount);
+  FREE_ARRAY(int, lines, codeCount);
+
+  for (uint32_t i = 0; ok && i < constantCount; i++) {
+    Value value;
+    ok = readConstant(file, &value);
+    if (ok)
+      addConstant(&chunk, value);
+  }
+  traced->frozen = freezeChunk(&chunk);
+  keepScript(traced->frozen);
+  vm->chunk = NULL;
+  return ok;
+}
+
+bool loadTrace(const char *path, TracedChunk **chunks, int *chunkCount,
+               TraceEvent **events, uint64_t *eventCount,
+               uint64_t *totalEvents, uint32_t *flags) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+
+  char magic[8];
+  uint32_t version, count;
+  if (fread(magic, sizeof(char), 8, file) != 8 ||
+      memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+      fread(&version, sizeof(version), 1, file) != 1 ||
+      version != TRACE_VERSION || fread(flags, sizeof(*flags), 1, file) != 1 ||
+      fread(eventCount, sizeof(*eventCount), 1, file) != 1 ||
+      fread(totalEvents, sizeof(*totalEvents), 1, file) != 1 ||
+      fread(&count, sizeof(count), 1, file) != 1 ||
+      *eventCount > TRACE_CAPACITY || count > TRACE_CHUNKS_MAX) {
+    fclose(file);
+    return false;
+  }
+
+  *chunks = calloc(count > 0 ? count : 1, sizeof(TracedChunk));
+  if (*chunks == NULL)
+    exit(1);
+  *chunkCount = 0;
+  bool ok = true;
+  while (ok && *chunkCount < (int)count) {
+    ok = readTracedChunk(file, &(*chunks)[*chunkCount]);
+    (*chunkCount)++;
+  }
+
+  // Recreate the global slots in the same order
+  uint32_t globalCount = 0;
+  ok = ok && fread(&globalCount, sizeof(globalCount), 1, file) == 1;
+  for (uint32_t i = 0; ok && i < globalCount; i++) {
+    Value name;
+    ok = readConstant(file, &name) && globalSlot(name) == (int)i;
+  }
+
+  *events = GROW_ARRAY(TraceEvent, NULL, 0, *eventCount);
+  ok = ok && fread(*events, sizeof(TraceEvent), *eventCount, file) ==
+                 *eventCount;
+  fclose(file);
+
+  // Events must point at real instructions for the dissasembler (or at a
+  // chunk the trace didn't keep)
+  for (uint64_t i = 0; ok && i < *eventCount; i++) {
+    TraceEvent *event = &(*events)[i];
+    if (event->chunk == TRACE_CHUNK_UNKNOWN)
+      continue;
+    ok = event->chunk < *chunkCount &&
+         event->offset <
+             (uint32_t)(*chunks)[event->chunk].frozen->chunk.count;
+  }
+
+  if (!ok) {
+    FREE_ARRAY(TraceEvent, *events, *eventCount);
+    *events = NULL;
+  }
+  return ok;
+}
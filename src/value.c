@@ -3,6 +3,9 @@
 
 #include "common.h"
 #include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "output.h"
 #include "value.h"
 
 void initValueArray(ValueArray *array) {
@@ -29,29 +32,101 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
+  // Go through a small buffer, flushed right away so the value lands in order
+  // with any other output printed to stdout
+  char data[64];
+  OutputBuffer output;
+  initOutput(&output, stdout, data, sizeof(data));
+  writeValue(&output, value);
+  flushOutput(&output);
+}
+
+void writeValue(OutputBuffer *output, Value value) {
   switch (value.type) {
   case VAL_BOOL:
-    printf(AS_BOOL(value) ? "true" : "false");
+    if (AS_BOOL(value)) {
+      writeOutput(output, "true", 4);
+    } else {
+      writeOutput(output, "false", 5);
+    }
     break;
   case VAL_NIL:
-    printf("nil");
+    writeOutput(output, "nil", 3);
     break;
-  case VAL_NUMBER:
-    printf("%g", AS_NUMBER(value));
+  case VAL_UNDEFINED:
+    writeOutput(output, "<undefined>", 11);
+    break;
+  case VAL_NUMBER: {
+    char buffer[NUMBER_BUFFER_SIZE];
+    int length = formatNumber(AS_NUMBER(value), buffer);
+    writeOutput(output, buffer, length);
     break;
   }
+  case VAL_INT: {
+    char buffer[NUMBER_BUFFER_SIZE];
+    int length = formatInteger(AS_INT(value), buffer);
+    writeOutput(output, buffer, length);
+    break;
+  }
+  case VAL_SMALL_STRING:
+    writeOutput(output, AS_SMALL_STRING(value).chars,
+                AS_SMALL_STRING(value).length);
+    break;
+  case VAL_OBJ:
+    writeObject(output, value);
+    break;
+  }
+}
+
+/**
+ * Check whether an integer and a double are the same number */
+static bool intEqualsDouble(int64_t integer, double number) {
+  return isExactDouble(integer) && (double)integer == number;
 }
 
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type)
+  if (a.type != b.type) {
+    // Integers and doubles are two representations of the same numbers
+    if (IS_INT(a) && IS_NUMBER(b))
+      return intEqualsDouble(AS_INT(a), AS_NUMBER(b));
+    if (IS_NUMBER(a) && IS_INT(b))
+      return intEqualsDouble(AS_INT(b), AS_NUMBER(a));
     return false;
+  }
   switch (a.type) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
+  case VAL_INT:
+    return AS_INT(a) == AS_INT(b);
+  case VAL_SMALL_STRING:
+    return a.as.bits == b.as.bits;
+  case VAL_OBJ:
+    if (AS_OBJ(a) == AS_OBJ(b))
+      return true;
+    // Heap strings are interned, so distinct ones differ, but a rope first
+    // has to be flattened to its interned string (unless the lengths differ)
+    if ((IS_ROPE(a) && IS_STRING(b)) || (IS_ROPE(b) && IS_STRING(a))) {
+      return stringLength(a) == stringLength(b) &&
+             flattenString(a) == flattenString(b);
+    }
+    // Arrays are equal when all their elements are
+    if (IS_ARRAY(a) && IS_ARRAY(b)) {
+      ObjArray *left = AS_ARRAY(a);
+      ObjArray *right = AS_ARRAY(b);
+      if (left->count != right->count)
+        return false;
+      for (int i = 0; i < left->count; i++) {
+        if (left->elements[i] != right->elements[i])
+          return false;
+      }
+      return true;
+    }
+    return false;
   default:
     return false;
   }
@@ -1,78 +1,646 @@
 // Stdlib includes
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 // Local Includes
+#include "array.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "fiber.h"
+#include "image.h"
+#include "map.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "output.h"
+#include "perf.h"
+#include "profile.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
+_Thread_local VM *vm;
 
-static void resetStack() { vm.stackTop = vm.stack; }
+static void resetStack() {
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+}
+
+/**
+ * Write the name of a function, which is never a rope */
+static void writeName(FILE *file, Value name) {
+  // Small strings aren't null-terminated
+  if (IS_SMALL_STRING(name)) {
+    fprintf(file, "%.*s", (int)AS_SMALL_STRING(name).length,
+            AS_SMALL_STRING(name).chars);
+  } else {
+    fputs(AS_HEAP_STRING(name)->chars, file);
+  }
+}
+
+void runtimeError(const char *format, ...) {
+  // Make sure results printed before the error show up before it
+  flushOutput(&vm->output);
 
-static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm->errors, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fputs("\n", vm->errors);
 
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction];
-  fprintf(stderr, "[line %d] in script\n", line);
+  // The innermost call first, vm->ip is at the failing instruction and the
+  // callers' ips just past their calls
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm->frames[i];
+    size_t instruction = i == vm->frameCount - 1
+                             ? (size_t)(vm->ip - frame->chunk->code)
+                             : (size_t)(frame->ip - frame->chunk->code - 1);
+    fprintf(vm->errors, "[line %d] in ", frame->chunk->lines[instruction]);
+    if (frame->function == NULL) {
+      fputs("script\n", vm->errors);
+    } else {
+      writeName(vm->errors, frame->function->name);
+      fputs("()\n", vm->errors);
+    }
+  }
+#ifdef DEBUG_BINARY_TRACE
+  if (dumpTrace(&vm->trace, traceFilePath())) {
+    fprintf(vm->errors, "Trace written to %s\n", traceFilePath());
+  }
+#endif
   resetStack();
 }
 
-void initVM() { resetStack(); }
+/**
+ * Report a use of a global that hasn't been defined yet
+ *
+ * @param slot Slot of the global */
+static void undefinedVariable(uint16_t slot) {
+  // Names are never ropes, and small strings aren't null-terminated
+  Value *name = &vm->globalNames.values[slot];
+  if (IS_SMALL_STRING(*name)) {
+    runtimeError("Undefined variable '%.*s'.",
+                 (int)AS_SMALL_STRING(*name).length,
+                 AS_SMALL_STRING(*name).chars);
+  } else {
+    runtimeError("Undefined variable '%s'.", AS_HEAP_STRING(*name)->chars);
+  }
+}
+
+/**
+ * Report a property an instance doesn't have
+ *
+ * @param name Name of the property (a string, never a rope) */
+static void undefinedProperty(Value name) {
+  if (IS_SMALL_STRING(name)) {
+    runtimeError("Undefined property '%.*s'.",
+                 (int)AS_SMALL_STRING(name).length,
+                 AS_SMALL_STRING(name).chars);
+  } else {
+    runtimeError("Undefined property '%s'.", AS_HEAP_STRING(name)->chars);
+  }
+}
+
+bool initVM(VM *instance, const char *imagePath) {
+  vm = instance;
+  initSlabs(&vm->slabs);
+  initGC();
+  vm->chunk = NULL;
+  vm->stack = vm->baseStack;
+  vm->stackCapacity = STACK_MAX + STACK_HEADROOM;
+  vm->frames = vm->baseFrames;
+  vm->frameCapacity = FRAMES_MAX;
+  vm->returnFrames = 0;
+  vm->yieldAt = UINT64_MAX;
+  vm->deadline = 0;
+  vm->fiber = NULL;
+  vm->fibers = NULL;
+  // Natives added by the host use the embedding API, locking the VM again
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&vm->lock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  pthread_mutex_init(&vm->turnLock, NULL);
+  vm->fiberRunning = false;
+  vm->parked = NULL;
+  vm->lastParked = NULL;
+  resetStack();
+  vm->instructionCount = 0;
+  vm->objects = NULL;
+  initTable(&vm->strings);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalNames);
+  initValueArray(&vm->globalValues);
+  initValueArray(&vm->savedGlobals);
+  vm->result = NIL_VAL;
+  vm->scripts = NULL;
+  vm->scriptCount = 0;
+  vm->scriptCapacity = 0;
+  vm->image = NULL;
+  vm->imageSize = 0;
+#ifdef DEBUG_BINARY_TRACE
+  initTrace(&vm->trace);
+#endif
+  char *outputData = reallocate(NULL, 0, OUTPUT_BUFFER_SIZE);
+  initOutput(&vm->output, stdout, outputData, OUTPUT_BUFFER_SIZE);
+  vm->errors = stderr;
+  if (imagePath != NULL && !loadImage(imagePath))
+    return false;
+  // After the image, whose natives are the ones of the process that saved it
+  defineNatives();
+  return true;
+}
+
+void freeVM() {
+  flushOutput(&vm->output);
+  reallocate(vm->output.data, vm->output.capacity, 0);
+  freeTable(&vm->strings);
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->globalValues);
+  freeValueArray(&vm->savedGlobals);
+  for (int i = 0; i < vm->scriptCount; i++) {
+    releaseChunk(vm->scripts[i]);
+  }
+  free(vm->scripts);
+#ifdef DEBUG_BINARY_TRACE
+  resetTrace(&vm->trace);
+#endif
+  while (vm->fibers != NULL) {
+    freeFiber(vm->fibers);
+  }
+  pthread_mutex_destroy(&vm->lock);
+  pthread_mutex_destroy(&vm->turnLock);
+  freeObjects();
+  // After the objects, which may point into the image
+  unmapImage();
+  // Last, anything still in a slot goes with it
+  freeSlabs(&vm->slabs);
+}
+
+void keepScript(FrozenChunk *frozen) {
+  // The C allocator is used so growing the list can't start a collection
+  // before the chunk's constants are reachable from it
+  if (vm->scriptCapacity < vm->scriptCount + 1) {
+    int capacity = vm->scriptCapacity < 8 ? 8 : vm->scriptCapacity * 2;
+    FrozenChunk **scripts =
+        realloc(vm->scripts, sizeof(FrozenChunk *) * capacity);
+    if (scripts == NULL)
+      exit(1);
+    vm->scripts = scripts;
+    vm->scriptCapacity = capacity;
+  }
+  vm->scripts[vm->scriptCount++] = frozen;
+}
+
+void dropScript(FrozenChunk *frozen) {
+  for (int i = 0; i < vm->scriptCount; i++) {
+    if (vm->scripts[i] == frozen) {
+      vm->scripts[i] = vm->scripts[--vm->scriptCount];
+      break;
+    }
+  }
+}
 
-void freeVM() {}
+int globalSlot(Value name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot))
+    return (int)AS_NUMBER(slot);
+
+  if (vm->globalValues.count == GLOBALS_MAX)
+    return -1;
+  // Growing the arrays can start a collection, keep the name reachable
+  push(name);
+  WRITE_BARRIER(name);
+  writeValueArray(&vm->globalNames, name);
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  int index = vm->globalValues.count - 1;
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
+void saveGlobals() {
+  // Growing the array can start a collection, which the values survive as
+  // globals
+  freeValueArray(&vm->savedGlobals);
+  for (int i = 0; i < vm->globalValues.count; i++) {
+    writeValueArray(&vm->savedGlobals, vm->globalValues.values[i]);
+  }
+}
+
+void restoreGlobals() {
+  // The saved values are roots marked with the globals, so a collection in
+  // progress has already marked them
+  for (int i = 0; i < vm->globalValues.count; i++) {
+    vm->globalValues.values[i] = i < vm->savedGlobals.count
+                                     ? vm->savedGlobals.values[i]
+                                     : UNDEFINED_VAL;
+  }
+}
 
 void push(Value value) {
   // Add value to top of stack, and increment the pointer
-  *vm.stackTop = value;
-  vm.stackTop++;
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
 Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
+}
+
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
+
+/**
+ * Apply a binary operation element-wise to the top two values of the stack,
+ * at least one of which is an array. The other one can be an array of the
+ * same length, or a number used with every element.
+ *
+ * @returns False if the operands don't fit (after reporting the error) */
+static bool arrayBinaryOp(ArrayOp op) {
+  Value b = peek(0);
+  Value a = peek(1);
+  if ((!IS_ARRAY(a) && !IS_NUMERIC(a)) || (!IS_ARRAY(b) && !IS_NUMERIC(b))) {
+    runtimeError("Operands must be numbers or arrays.");
+    return false;
+  }
+  if (IS_ARRAY(a) && IS_ARRAY(b) &&
+      AS_ARRAY(a)->count != AS_ARRAY(b)->count) {
+    runtimeError("Arrays must have the same length.");
+    return false;
+  }
+
+  double aNumber = IS_ARRAY(a) ? 0 : AS_DOUBLE(a);
+  double bNumber = IS_ARRAY(b) ? 0 : AS_DOUBLE(b);
+  int count = IS_ARRAY(a) ? AS_ARRAY(a)->count : AS_ARRAY(b)->count;
+  // The operands stay on the stack while the result is allocated
+  ObjArray *result = newArray(count);
+  arrayBinary(op, IS_ARRAY(a) ? AS_ARRAY(a)->elements : &aNumber, !IS_ARRAY(a),
+              IS_ARRAY(b) ? AS_ARRAY(b)->elements : &bNumber, !IS_ARRAY(b),
+              result->elements, count);
+  pop();
+  pop();
+  push(OBJ_VAL(result));
+  return true;
+}
+
+/**
+ * Replace the array on top of the stack with the result of a kernel applied
+ * to its elements */
+static void arrayUnaryOp(void (*kernel)(const double *, double *, int)) {
+  ObjArray *operand = AS_ARRAY(peek(0));
+  ObjArray *result = newArray(operand->count);
+  kernel(operand->elements, result->elements, operand->count);
+  pop();
+  push(OBJ_VAL(result));
+}
+
+/**
+ * Find what an inline cache remembers for a receiver shape
+ *
+ * @returns The entry, or NULL if the cache hasn't seen the shape */
+static inline CacheEntry *cachedEntry(InlineCache *cache, ObjShape *shape) {
+  for (int way = 0; way < CACHE_WAYS; way++) {
+    if (cache->entries[way].shape == shape)
+      return &cache->entries[way];
+  }
+  return NULL;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+/**
+ * Take the entry of an inline cache for a shape it hasn't seen, replacing
+ * the oldest one once the cache is full */
+static CacheEntry *replaceEntry(InlineCache *cache, ObjShape *shape) {
+  CacheEntry *entry = &cache->entries[cache->next];
+  cache->next = (cache->next + 1) % CACHE_WAYS;
+  // The chunk holding the cache may already be marked
+  WRITE_BARRIER(OBJ_VAL(shape));
+  entry->shape = shape;
+  entry->next = NULL;
+  entry->method = NULL;
+  entry->index = 0;
+  return entry;
+}
+
+/**
+ * Look up a property (a field, or else a method of the class) on receivers
+ * of a shape, remembering it in an inline cache
+ *
+ * @returns The cache entry, or NULL if there's no such property */
+static CacheEntry *lookupProperty(InlineCache *cache, ObjShape *shape,
+                                  Value name) {
+  CacheEntry *entry = cachedEntry(cache, shape);
+  if (entry != NULL)
+    return entry;
+
+  int index = shapeField(shape, name);
+  Value method = NIL_VAL;
+  if (index < 0 && !tableGet(&shape->klass->methods, name, &method))
+    return NULL;
+  entry = replaceEntry(cache, shape);
+  if (index >= 0) {
+    entry->index = index;
+  } else {
+    WRITE_BARRIER(method);
+    entry->method = AS_FUNCTION(method);
+  }
+  return entry;
+}
+
+/**
+ * Look up where assigning a field stores it on receivers of a shape,
+ * remembering it in an inline cache. A new field gets the next index, and
+ * moves the receiver to the shape with the field.
+ *
+ * @returns The cache entry */
+static CacheEntry *lookupField(InlineCache *cache, ObjShape *shape,
+                               Value name) {
+  CacheEntry *entry = cachedEntry(cache, shape);
+  if (entry != NULL)
+    return entry;
+
+  int index = shapeField(shape, name);
+  // The transition can allocate, so it's found before the entry is taken
+  ObjShape *next = index < 0 ? shapeTransition(shape, name) : NULL;
+  entry = replaceEntry(cache, shape);
+  if (next != NULL) {
+    WRITE_BARRIER(OBJ_VAL(next));
+    entry->next = next;
+    entry->index = shape->count;
+  } else {
+    entry->index = index;
+  }
+  return entry;
+}
+
+/**
+ * Assign a field of an instance, as found by lookupField
+ *
+ * @param value Value of the field (kept on the stack by the caller) */
+static void setField(ObjInstance *instance, CacheEntry *entry, Value value) {
+  ObjShape *next = entry->next;
+  if (next != NULL && instance->capacity < next->count) {
+    int capacity = GROW_CAPACITY(instance->capacity);
+    instance->fields =
+        GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+    instance->capacity = capacity;
+  }
+  // The field is stored before the shape counts it, for the collector
+  WRITE_BARRIER(value);
+  instance->fields[entry->index] = value;
+  if (next != NULL) {
+    WRITE_BARRIER(OBJ_VAL(next));
+    instance->shape = next;
+    if (next->klass->fieldCount < next->count)
+      next->klass->fieldCount = next->count;
+  }
+}
+
+/**
+ * Push a frame calling a function, whose callee slot and arguments are on
+ * top of the stack
+ *
+ * @returns False if the call can't be made (after reporting the error) */
+static inline bool callFunction(ObjFunction *function, int argCount) {
+  // Calls with the right number of arguments that fit are the fast path,
+  // checked with two compares
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+  // The compiler worked out how deep the callee's stack gets, so the stack
+  // is checked once per call rather than on every push (leaving the headroom
+  // for the runtime's own pushes)
+  Value *base = vm->stackTop - argCount - 1;
+  if (vm->frameCount == vm->frameCapacity ||
+      base + function->maxSlots + STACK_HEADROOM >
+          vm->stack + vm->stackCapacity) {
+    if (!growFiber((int)(base - vm->stack) + function->maxSlots +
+                   STACK_HEADROOM)) {
+      runtimeError("Stack overflow.");
+      return false;
+    }
+    base = vm->stackTop - argCount - 1;
+  }
+
+  // The callee and its arguments become the new frame's first slots
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.code;
+  frame->slots = base;
+  return true;
+}
+
+/**
+ * Call a value, whose arguments are on top of the stack. Functions and
+ * methods push a frame, natives run at once (leaving their result in place
+ * of the callee), calling a class creates an instance in place of the class
+ * (and runs its initializer, if it has one).
+ *
+ * @returns False if the call can't be made (after reporting the error) */
+static bool callValue(Value callee, int argCount) {
+  if (IS_FUNCTION(callee))
+    return callFunction(AS_FUNCTION(callee), argCount);
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+    // The method sees the instance as this, in the callee's slot
+    vm->stackTop[-argCount - 1] = bound->receiver;
+    return callFunction(bound->method, argCount);
+  }
+  if (IS_NATIVE(callee)) {
+    ObjNative *native = AS_NATIVE(callee);
+    if (argCount != native->arity) {
+      runtimeError("Expected %d arguments but got %d.", native->arity,
+                   argCount);
+      return false;
+    }
+    Value *args = vm->stackTop - argCount;
+    switch (native->kind) {
+    case NATIVE_UNARY:
+      // Numeric natives skip boxing, taking and returning plain doubles
+      if (!IS_NUMERIC(args[0])) {
+        runtimeError("Operand must be a number.");
+        return false;
+      }
+      args[-1] = NUMBER_VAL(native->function.unary(AS_DOUBLE(args[0])));
+      vm->stackTop = args;
+      return true;
+    case NATIVE_BINARY:
+      if (!IS_NUMERIC(args[0]) || !IS_NUMERIC(args[1])) {
+        runtimeError("Operands must be numbers.");
+        return false;
+      }
+      args[-1] = NUMBER_VAL(
+          native->function.binary(AS_DOUBLE(args[0]), AS_DOUBLE(args[1])));
+      vm->stackTop = args;
+      return true;
+    case NATIVE_HOST:
+      if (!callHostNative(native, argCount, args))
+        return false;
+      vm->stackTop = args;
+      return true;
+    case NATIVE_VALUES:
+      if (!native->function.values(argCount, args))
+        return false;
+      // A native suspended on I/O keeps its arguments until it's resumed
+      if (vm->fiber == NULL || vm->fiber->io == NULL)
+        vm->stackTop = args;
+      return true;
+    }
+  }
+  if (IS_CLASS(callee)) {
+    ObjClass *klass = AS_CLASS(callee);
+    // The class stays in the callee slot while the instance is allocated
+    vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+    if (klass->initializer != NULL)
+      return callFunction(klass->initializer, argCount);
+    if (argCount != 0) {
+      runtimeError("Expected 0 arguments but got %d.", argCount);
+      return false;
+    }
+    return true;
+  }
+  runtimeError("Can only call functions and classes.");
+  return false;
+}
 
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+/**
+ * Call a property of a receiver, as found by lookupProperty: a method
+ * directly (without binding it), or the value of a field
+ *
+ * @returns False if the call can't be made (after reporting the error) */
+static inline bool invokeEntry(ObjInstance *instance, CacheEntry *entry,
+                               int argCount) {
+  if (entry->method != NULL)
+    return callFunction(entry->method, argCount);
+  Value callee = instance->fields[entry->index];
+  vm->stackTop[-argCount - 1] = callee;
+  return callValue(callee, argCount);
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(valueType, op)                                               \
+InterpretResult run() {
+  // The top frame's ip, slots and constants live in locals (registers), the
+  // frame itself is only written when it makes a call
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  uint8_t *ip = vm->ip;
+  Value *slots = frame->slots;
+  Value *constants = vm->chunk->constants.values;
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_WORD()                                                            \
+  (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) |              \
+                ((uint32_t)ip[-2] << 8) | ip[-1])
+// Arrays are the slow path, whatever the operation does to numbers it does
+// to each element
+#define DOUBLE_OP(valueType, op, arrayOp)                                      \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+    if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))) {                        \
+      if (IS_ARRAY(peek(0)) || IS_ARRAY(peek(1))) {                            \
+        if (!arrayBinaryOp(arrayOp))                                           \
+          return INTERPRET_RUNTIME_ERROR;                                      \
+        break;                                                                 \
+      }                                                                        \
       runtimeError("Operands must be numbers.");                               \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    Value b = pop();                                                           \
+    Value a = pop();                                                           \
+    push(valueType(AS_DOUBLE(a) op AS_DOUBLE(b)));                             \
+  } while (false)
+// Integers are compared as integers, doubles as doubles, and an integer
+// with a double exactly (as valuesEqual does)
+#define BINARY_OP(valueType, op, arrayOp)                                      \
+  do {                                                                         \
+    if (IS_INT(peek(0)) && IS_INT(peek(1))) {                                  \
+      int64_t b = AS_INT(pop());                                               \
+      int64_t a = AS_INT(pop());                                               \
+      push(valueType(a op b));                                                 \
+      break;                                                                   \
+    }                                                                          \
+    if (IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1)) &&                          \
+        IS_INT(peek(0)) != IS_INT(peek(1))) {                                  \
+      Value b = pop();                                                         \
+      Value a = pop();                                                         \
+      push(valueType(compareNumbers(a, b) op 0));                              \
+      break;                                                                   \
+    }                                                                          \
+    DOUBLE_OP(valueType, op, arrayOp);                                         \
+  } while (false)
+// Integer arithmetic, falling back to doubles when the result doesn't fit
+// (overflow is one of the overflow checking builtins, or works the same way)
+#define INT_OP(op, overflow, arrayOp)                                          \
+  do {                                                                         \
+    if (IS_INT(peek(0)) && IS_INT(peek(1))) {                                  \
+      int64_t b = AS_INT(peek(0));                                             \
+      int64_t a = AS_INT(peek(1));                                             \
+      int64_t result;                                                          \
+      if (!overflow(a, b, &result)) {                                          \
+        pop();                                                                 \
+        pop();                                                                 \
+        push(INT_VAL(result));                                                 \
+        break;                                                                 \
+      }                                                                        \
+    }                                                                          \
+    DOUBLE_OP(NUMBER_VAL, op, arrayOp);                                        \
+  } while (false)
+// Reload the registers from the top frame, after a call or return changed it
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frameCount - 1];                                   \
+    vm->chunk = frame->chunk;                                                  \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->chunk->constants.values;                                \
+  } while (false)
+// A caller outside the interpreter gets control back once its call is done
+// (calling a class without an initializer pushes no frame, so is done at
+// once)
+#define CALL_RETURNED()                                                        \
+  do {                                                                         \
+    if (vm->frameCount == vm->returnFrames) {                                  \
+      vm->ip = ip;                                                             \
+      return INTERPRET_OK;                                                     \
+    }                                                                          \
   } while (false)
 
   for (;;) {
+    // The only store of the ip per instruction, for runtime errors (and the
+    // fiber, when it yields) to find it
+    vm->ip = ip;
+    // Fibers give up the thread after their quantum of instructions
+    if (vm->instructionCount == vm->yieldAt)
+      return INTERPRET_YIELD;
 #ifdef DEBUG_TRACE_EXECUTION
     printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
       printf("[ ");
       printValue(*slot);
       printf(" ]");
     }
     printf("\n");
-    dissasembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    dissasembleInstruction(vm->chunk, (int)(ip - vm->chunk->code));
+#endif
+    if (profileSamplePending) {
+      recordProfileSample(vm->frames, vm->frameCount,
+                          (int)(ip - vm->chunk->code));
+    }
+#ifdef DEBUG_BINARY_TRACE
+    traceInstruction(&vm->trace, vm->chunk, frame->function,
+                     (uint32_t)(ip - vm->chunk->code),
+                     (uint16_t)(vm->stackTop - vm->stack));
+    if (traceDumpRequested) {
+      traceDumpRequested = 0;
+      dumpTrace(&vm->trace, traceFilePath());
+    }
 #endif
+    vm->instructionCount++;
     uint8_t instruction;
     switch (instruction = READ_BYTE()) {
     case OP_CONSTANT: {
@@ -89,66 +657,450 @@ static InterpretResult run() {
     case OP_FALSE:
       push(BOOL_VAL(false));
       break;
+    case OP_POP:
+      pop();
+      break;
+    case OP_DEFINE_GLOBAL: {
+      uint16_t slot = READ_SHORT();
+      WRITE_BARRIER(peek(0));
+      vm->globalValues.values[slot] = pop();
+      break;
+    }
+    case OP_GET_GLOBAL: {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      // Slots exist as soon as a name is compiled, but stay undefined until
+      // the declaration runs
+      if (IS_UNDEFINED(value)) {
+        undefinedVariable(slot);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(value);
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+        undefinedVariable(slot);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      WRITE_BARRIER(peek(0));
+      vm->globalValues.values[slot] = peek(0);
+      break;
+    }
+    case OP_GET_LOCAL:
+      push(slots[READ_BYTE()]);
+      break;
+    case OP_SET_LOCAL:
+      // The stack is a root that's rescanned, so no barrier
+      slots[READ_BYTE()] = peek(0);
+      break;
     case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+      // Comparing ropes can allocate, so the operands stay on the stack
+      bool equal = valuesEqual(peek(1), peek(0));
+      pop();
+      pop();
+      push(BOOL_VAL(equal));
       break;
     }
     case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
+      BINARY_OP(BOOL_VAL, >, ARRAY_GREATER);
       break;
     case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
+      BINARY_OP(BOOL_VAL, <, ARRAY_LESS);
       break;
-    case OP_ADD:
-      BINARY_OP(NUMBER_VAL, +);
+    case OP_ADD: {
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+        INT_OP(+, __builtin_add_overflow, ARRAY_ADD);
+      } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        Value b = peek(0);
+        Value a = peek(1);
+        Value result = concatenateStrings(a, b);
+        pop();
+        pop();
+        push(result);
+      } else if (IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1))) {
+        DOUBLE_OP(NUMBER_VAL, +, ARRAY_ADD);
+      } else if (IS_ARRAY(peek(0)) || IS_ARRAY(peek(1))) {
+        if (!arrayBinaryOp(ARRAY_ADD))
+          return INTERPRET_RUNTIME_ERROR;
+      } else {
+        runtimeError("Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       break;
+    }
     case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
+      INT_OP(-, __builtin_sub_overflow, ARRAY_SUBTRACT);
       break;
     case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
+      INT_OP(*, intProduct, ARRAY_MULTIPLY);
       break;
     case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
+      // Only exact quotients stay integers, 7 / 2 is still 3.5
+      INT_OP(/, exactQuotient, ARRAY_DIVIDE);
       break;
     case OP_NOT:
+      // On an array (a mask) ! works element-wise, so that a >= b (compiled
+      // as !(a < b)) does too
+      if (IS_ARRAY(peek(0))) {
+        arrayUnaryOp(arrayNot);
+        break;
+      }
       push(BOOL_VAL(isFalsey(pop())));
       break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
+    case OP_NEGATE: {
+      // -0 and -INT64_MIN are only doubles
+      if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 &&
+          AS_INT(peek(0)) != INT64_MIN) {
+        push(INT_VAL(-AS_INT(pop())));
+        break;
+      }
+      if (IS_ARRAY(peek(0))) {
+        arrayUnaryOp(arrayNegate);
+        break;
+      }
+      if (!IS_NUMERIC(peek(0))) {
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      Value operand = pop();
+      push(NUMBER_VAL(-AS_DOUBLE(operand)));
+      break;
+    }
+    case OP_PRINT: {
+      // Writing a rope flattens (allocates) it, so it stays on the stack
+      writeValue(&vm->output, peek(0));
+      pop();
+      writeOutputChar(&vm->output, '\n');
+#ifdef DEBUG_TRACE_EXECUTION
+      // Keep results in order with the trace
+      flushOutput(&vm->output);
+#endif
+      break;
+    }
+    case OP_JUMP: {
+      uint32_t offset = READ_WORD();
+      ip += offset;
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      uint32_t offset = READ_WORD();
+      if (isFalsey(peek(0)))
+        ip += offset;
+      break;
+    }
+    case OP_JUMP_IF_TRUE: {
+      uint32_t offset = READ_WORD();
+      if (!isFalsey(peek(0)))
+        ip += offset;
+      break;
+    }
+    case OP_ARRAY: {
+      int count = READ_BYTE();
+      Value *elements = vm->stackTop - count;
+      for (int i = 0; i < count; i++) {
+        if (!IS_NUMERIC(elements[i])) {
+          runtimeError("Array elements must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      }
+      ObjArray *array = newArray(count);
+      for (int i = 0; i < count; i++) {
+        array->elements[i] = AS_DOUBLE(elements[i]);
+      }
+      vm->stackTop = elements;
+      push(OBJ_VAL(array));
+      break;
+    }
+    case OP_SUM:
+    case OP_MIN:
+    case OP_MAX: {
+      if (!IS_ARRAY(peek(0))) {
+        runtimeError("Operand must be an array.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjArray *array = AS_ARRAY(pop());
+      double result = instruction == OP_SUM   ? arraySum(array->elements,
+                                                         array->count)
+                      : instruction == OP_MIN ? arrayMin(array->elements,
+                                                         array->count)
+                                              : arrayMax(array->elements,
+                                                         array->count);
+      push(NUMBER_VAL(result));
+      break;
+    }
+    case OP_DOT: {
+      if (!IS_ARRAY(peek(0)) || !IS_ARRAY(peek(1))) {
+        runtimeError("Operands must be arrays.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjArray *b = AS_ARRAY(pop());
+      ObjArray *a = AS_ARRAY(pop());
+      if (a->count != b->count) {
+        runtimeError("Arrays must have the same length.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(NUMBER_VAL(arrayDot(a->elements, b->elements, a->count)));
       break;
+    }
+    case OP_MAP: {
+      int count = READ_BYTE();
+      // The pairs and the map stay on the stack while the map grows
+      Value *pairs = vm->stackTop - 2 * count;
+      ObjMap *map = newMap();
+      push(OBJ_VAL(map));
+      for (int i = 0; i < count; i++) {
+        mapSet(map, pairs[2 * i], pairs[2 * i + 1]);
+      }
+      vm->stackTop = pairs;
+      push(OBJ_VAL(map));
+      break;
+    }
+    case OP_GET_INDEX: {
+      if (!IS_MAP(peek(1))) {
+        runtimeError("Only maps can be indexed.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // Keys that aren't in the map read as nil
+      Value value;
+      if (!mapGet(AS_MAP(peek(1)), peek(0), &value))
+        value = NIL_VAL;
+      pop();
+      vm->stackTop[-1] = value;
+      break;
+    }
+    case OP_SET_INDEX: {
+      if (!IS_MAP(peek(2))) {
+        runtimeError("Only maps can be indexed.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // All three stay on the stack while the map grows
+      mapSet(AS_MAP(peek(2)), peek(1), peek(0));
+      // The value of the assignment replaces the map
+      vm->stackTop[-3] = peek(0);
+      vm->stackTop -= 2;
+      break;
+    }
+    case OP_CALL: {
+      int argCount = READ_BYTE();
+      frame->ip = ip;
+      if (!callValue(peek(argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      CALL_RETURNED();
+      break;
+    }
+    case OP_INVOKE: {
+      Value name = READ_CONSTANT();
+      int argCount = READ_BYTE();
+      InlineCache *cache = &vm->chunk->caches[READ_SHORT()];
+      if (!IS_INSTANCE(peek(argCount))) {
+        runtimeError("Only instances have methods.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjInstance *instance = AS_INSTANCE(peek(argCount));
+      CacheEntry *entry = lookupProperty(cache, instance->shape, name);
+      if (entry == NULL) {
+        undefinedProperty(name);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame->ip = ip;
+      if (!invokeEntry(instance, entry, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      CALL_RETURNED();
+      break;
+    }
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE: {
+      // The receiver is this, but the lookup starts at the superclass of
+      // the method's class. Its root shape stands for it in the cache (a
+      // root has no fields, so only methods are found).
+      Value name = READ_CONSTANT();
+      int argCount = instruction == OP_SUPER_INVOKE ? READ_BYTE() : 0;
+      InlineCache *cache = &vm->chunk->caches[READ_SHORT()];
+      ObjClass *superclass = frame->function->owner->superclass;
+      CacheEntry *entry = lookupProperty(cache, superclass->shape, name);
+      if (entry == NULL) {
+        undefinedProperty(name);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (instruction == OP_GET_SUPER) {
+        // The receiver stays on the stack while the method is bound
+        ObjBoundMethod *bound = newBoundMethod(peek(0), entry->method);
+        vm->stackTop[-1] = OBJ_VAL(bound);
+        break;
+      }
+      frame->ip = ip;
+      if (!callFunction(entry->method, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      Value name = READ_CONSTANT();
+      InlineCache *cache = &vm->chunk->caches[READ_SHORT()];
+      if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjInstance *instance = AS_INSTANCE(peek(0));
+      CacheEntry *entry = lookupProperty(cache, instance->shape, name);
+      if (entry == NULL) {
+        undefinedProperty(name);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (entry->method == NULL) {
+        vm->stackTop[-1] = instance->fields[entry->index];
+        break;
+      }
+      // The instance stays on the stack while the method is bound
+      ObjBoundMethod *bound = newBoundMethod(peek(0), entry->method);
+      vm->stackTop[-1] = OBJ_VAL(bound);
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      Value name = READ_CONSTANT();
+      InlineCache *cache = &vm->chunk->caches[READ_SHORT()];
+      if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // Both stay on the stack while a new shape or the fields allocate
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      CacheEntry *entry = lookupField(cache, instance->shape, name);
+      setField(instance, entry, peek(0));
+      // The value of the assignment replaces the instance
+      vm->stackTop[-2] = peek(0);
+      pop();
+      break;
+    }
+    case OP_CLASS:
+      push(OBJ_VAL(newClass(READ_CONSTANT())));
+      break;
+    case OP_INHERIT: {
+      if (!IS_CLASS(peek(1))) {
+        runtimeError("Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjClass *superclass = AS_CLASS(peek(1));
+      ObjClass *subclass = AS_CLASS(peek(0));
+      // Inherited methods are copied down, so a lookup is a single table
+      // (both classes stay on the stack while it grows)
+      Table *methods = &superclass->methods;
+      for (int i = 0; i < methods->capacity; i++) {
+        if (IS_NIL(methods->entries[i].key))
+          continue;
+        WRITE_BARRIER(methods->entries[i].value);
+        tableSet(&subclass->methods, methods->entries[i].key,
+                 methods->entries[i].value);
+      }
+      WRITE_BARRIER(peek(1));
+      subclass->superclass = superclass;
+      subclass->initializer = superclass->initializer;
+      pop();
+      pop();
+      break;
+    }
+    case OP_METHOD: {
+      Value name = READ_CONSTANT();
+      ObjClass *klass = AS_CLASS(peek(1));
+      ObjFunction *method = AS_FUNCTION(peek(0));
+      WRITE_BARRIER(peek(1));
+      method->owner = klass;
+      // The method stays on the stack while the table grows
+      WRITE_BARRIER(peek(0));
+      tableSet(&klass->methods, name, peek(0));
+      // "init" is short enough to be a small string, never allocated
+      if (valuesEqual(name, copyString("init", 4)))
+        klass->initializer = method;
+      pop();
+      break;
+    }
     case OP_RETURN: {
-      printValue(pop());
-      printf("\n");
-      return INTERPRET_OK;
+      if (vm->frameCount == 1) {
+        // The value of a final expression statement is the script's result
+        vm->result = vm->stackTop > vm->stack ? pop() : NIL_VAL;
+        vm->frameCount = 0;
+        return INTERPRET_OK;
+      }
+
+      // The return value replaces the callee
+      Value result = pop();
+      vm->stackTop = slots;
+      push(result);
+      vm->frameCount--;
+      LOAD_FRAME();
+      CALL_RETURNED();
+      break;
     }
     }
   }
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_WORD
+#undef DOUBLE_OP
 #undef BINARY_OP
+#undef INT_OP
+#undef LOAD_FRAME
+#undef CALL_RETURNED
 }
 
-InterpretResult interpret(const char *source) {
+FrozenChunk *compileSource(const char *source) {
   Chunk chunk;
   initChunk(&chunk);
 
-  if (!compile(source, &chunk)) {
+  // Phases are only measured when asked to, so they can be told apart
+  bool measure = perfEnabled();
+  if (measure)
+    beginPerfPhase(PERF_PHASE_COMPILE);
+  bool compiled = compile(source, &chunk);
+  if (measure)
+    endPerfPhase(PERF_PHASE_COMPILE);
+
+  if (!compiled) {
     freeChunk(&chunk);
-    return INTERPRET_COMPILE_ERROR;
+    return NULL;
   }
+  // Execute from the packed, exactly sized copy of the compiled chunk
+  return freezeChunk(&chunk);
+}
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+InterpretResult runChunk(FrozenChunk *frozen) {
+  vm->chunk = &frozen->chunk;
+  vm->ip = vm->chunk->code;
+  vm->frames[0].function = NULL;
+  vm->frames[0].chunk = vm->chunk;
+  vm->frames[0].ip = NULL;
+  vm->frames[0].slots = vm->stack;
+  vm->frameCount = 1;
+  vm->result = NIL_VAL;
+  // A sample due while compiling doesn't belong to the first instruction
+  profileSamplePending = 0;
+#ifdef DEBUG_BINARY_TRACE
+  // Each run starts a trace of its own
+  resetTrace(&vm->trace);
+#endif
 
+  bool measure = perfEnabled();
+  if (measure)
+    beginPerfPhase(PERF_PHASE_RUN);
   InterpretResult result = run();
+  if (measure)
+    endPerfPhase(PERF_PHASE_RUN);
+
+  vm->chunk = NULL;
+  return result;
+}
+
+InterpretResult interpret(const char *source) {
+  FrozenChunk *frozen = compileSource(source);
+  if (frozen == NULL)
+    return INTERPRET_COMPILE_ERROR;
 
-  freeChunk(&chunk);
+  InterpretResult result = runChunk(frozen);
+  releaseChunk(frozen);
   return result;
 }
@@ -0,0 +1,115 @@
+/**
+ * @file number_compare.c
+ * @brief Checks integers and doubles are ordered exactly against each other
+ *
+ * Compares integers with doubles they round onto, or that are past the range
+ * of integers, with compareIntDouble, then runs the comparison operators of
+ * the language on such pairs, whose results must agree with == (which
+ * compares them exactly too).
+ *
+ * Usage: number-compare
+ * */
+
+// Std lib includes
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Local Includes
+#include "clox.h"
+#include "value.h"
+
+/**
+ * An integer, a double, and how they compare.
+ * */
+typedef struct {
+  int64_t integer; //! The integer
+  double number;   //! The double
+  int expected;    //! -1, 0 or 1 as the integer is less, equal or greater
+} Case;
+
+static const Case cases[] = {
+    // 2^53 + 1 rounds onto 2^53 as a double
+    {9007199254740993, 9007199254740992.0, 1},
+    {9007199254740992, 9007199254740992.0, 0},
+    {-9007199254740993, -9007199254740992.0, -1},
+    {4611686018427387905, 4611686018427387904.0, 1},
+    // INT64_MAX rounds onto 2^63, which is past every integer
+    {INT64_MAX, 9223372036854775808.0, -1},
+    {INT64_MIN, -9223372036854775808.0, 0},
+    {INT64_MIN, -9223372036854777856.0, 1},
+    {INT64_MAX, INFINITY, -1},
+    {INT64_MIN, -INFINITY, 1},
+    // Fractions break ties with the whole part
+    {0, 0.5, -1},
+    {0, -0.5, 1},
+    {-1, -0.5, -1},
+    {0, -0.0, 0},
+    // Neither less nor greater than NaN
+    {3, NAN, 0},
+};
+
+// Each comparison operator adds its bit when true
+#define ORDERING_SCRIPT                                                        \
+  "(a == b and 1 or 0) + (a < b and 2 or 0) + (a > b and 4 or 0) + "           \
+  "(a <= b and 8 or 0) + (a >= b and 16 or 0);"
+
+/**
+ * The bits ORDERING_SCRIPT sets for operands that compare as given */
+static int orderingBits(int order) {
+  return (order == 0 ? 1 : 0) + (order < 0 ? 2 : 0) + (order > 0 ? 4 : 0) +
+         (order <= 0 ? 8 : 0) + (order >= 0 ? 16 : 0);
+}
+
+/**
+ * Run the comparison operators on a and b
+ *
+ * @param definitions Source defining a and b
+ *
+ * @returns The bits of the operators that were true, or -1 on errors */
+static int runOrdering(const char *definitions) {
+  char source[256];
+  snprintf(source, sizeof(source), "%s\n%s", definitions, ORDERING_SCRIPT);
+  CloxVM *vm = cloxNewVM();
+  CloxScript *script = cloxCompile(vm, source);
+  CloxValue result;
+  int bits = -1;
+  if (script != NULL && cloxEvaluate(vm, script, &result) == CLOX_OK &&
+      cloxType(result) == CLOX_NUMBER)
+    bits = (int)cloxAsNumber(result);
+  if (script != NULL)
+    cloxFreeScript(vm, script);
+  cloxFreeVM(vm);
+  return bits;
+}
+
+int main(void) {
+  int failures = 0;
+  int count = (int)(sizeof(cases) / sizeof(cases[0]));
+  for (int i = 0; i < count; i++) {
+    const Case *test = &cases[i];
+    int order = compareIntDouble(test->integer, test->number);
+    if (order != test->expected) {
+      fprintf(stderr, "%lld vs %.17g: compareIntDouble %d, expected %d\n",
+              (long long)test->integer, test->number, order, test->expected);
+      failures++;
+    }
+  }
+
+  // The 2^53 + 1 case through the interpreter, both ways round
+  int forward =
+      runOrdering("var a = 9007199254740993; var b = 9007199254740992.0;");
+  int backward =
+      runOrdering("var a = 9007199254740992.0; var b = 9007199254740993;");
+  if (forward != orderingBits(1) || backward != orderingBits(-1)) {
+    fprintf(stderr,
+            "2^53 + 1 and 2^53.0: operators gave %d and %d, expected %d and "
+            "%d\n",
+            forward, backward, orderingBits(1), orderingBits(-1));
+    failures++;
+  }
+
+  printf("%d cases, %d failures\n", count + 1, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,212 @@
+/**
+ * @file number_fuzz.c
+ * @brief Checks parseNumber against strtod
+ *
+ * Parses hand-picked edge cases and random literals (of the form the scanner
+ * produces, digits with an optional decimal point) with both, and fails if
+ * any result differs in a single bit.
+ *
+ * Usage: number-fuzz [count] [seed]
+ * */
+
+// Std lib includes
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "number.h"
+
+// Random literals checked when no count is given
+#define DEFAULT_COUNT 1000000
+// Longest literal generated (subnormals need over 320 digits)
+#define LITERAL_MAX 400
+// Mismatches reported before the rest are only counted
+#define REPORT_MAX 10
+
+static const char *edgeCases[] = {
+    "0",
+    "0.0",
+    "1",
+    "0.1",
+    "0.3",
+    "123.456",
+    // Largest exact integers, and a tie between them and the next double
+    "9007199254740992",
+    "9007199254740993",
+    "9007199254740993.0000000000000000000001",
+    "9007199254740995",
+    "9007199254740994.9999999999999999999999",
+    // Limits of the mantissa fitting in 19 digits
+    "9999999999999999999",
+    "18446744073709551615",
+    "18446744073709551616",
+    "12345678901234567890123456789",
+    // Halfway between 1 and the next double
+    "1.00000000000000011102230246251565404236316680908203125",
+    "1.00000000000000011102230246251565404236316680908203124",
+    "1.00000000000000011102230246251565404236316680908203126",
+    // Where Clinger's fast path stops
+    "10000000000000000000000",
+    "100000000000000000000000",
+    "0.0000000000000000000001",
+    "0.00000000000000000000001",
+    // Largest double, and the tie with infinity
+    "179769313486231570814527423731704356798070567525844996598917476803157260"
+    "780028538760589558632766878171540458953514382464234321326889464182768467"
+    "546703537516986049910576551282076245490090389328944075868508455133942304"
+    "583236903222948165808559332123348274797826204144723168738177180919299881"
+    "250404026184124858368",
+    "179769313486231575804128197568503885939002350117941411767545627891801114"
+    "536396644853619288305177042633935372685103635187590438437370702292699562"
+    "517687521668833979406288629832876259672468103520237920172119362601898937"
+    "975098263032931492834697134299320496935997324255116936540444370309403987"
+    "146642102044149678080",
+};
+
+static uint64_t state;
+
+/**
+ * Next pseudo-random number (xorshift64*), the same for a seed everywhere */
+static uint64_t nextRandom() {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+static void randomDigits(char *buffer, int count) {
+  for (int i = 0; i < count; i++) {
+    buffer[i] = (char)('0' + nextRandom() % 10);
+  }
+}
+
+/**
+ * Random digits, with a decimal point somewhere half the time */
+static int randomLiteral(char *buffer) {
+  int length = 1 + (int)(nextRandom() % 40);
+  randomDigits(buffer, length);
+  if (length > 1 && nextRandom() % 2 == 0) {
+    int point = 1 + (int)(nextRandom() % (length - 1));
+    memmove(buffer + point + 1, buffer + point, length - point);
+    buffer[point] = '.';
+    length++;
+  }
+  return length;
+}
+
+/**
+ * A subnormal (or a number that rounds to zero or the smallest normal) */
+static int subnormalLiteral(char *buffer) {
+  int zeros = 300 + (int)(nextRandom() % 26);
+  int length = 0;
+  buffer[length++] = '0';
+  buffer[length++] = '.';
+  memset(buffer + length, '0', zeros);
+  length += zeros;
+  int digits = 1 + (int)(nextRandom() % 30);
+  randomDigits(buffer + length, digits);
+  return length + digits;
+}
+
+/**
+ * An integer around the largest double, which may overflow to infinity */
+static int hugeLiteral(char *buffer) {
+  int length = 306 + (int)(nextRandom() % 5);
+  randomDigits(buffer, length);
+  buffer[0] = (char)('1' + nextRandom() % 9);
+  return length;
+}
+
+/**
+ * The exact decimal value halfway between a random double and the next one,
+ * which rounds to whichever of the two is even, or a literal just off it */
+static int tieLiteral(char *buffer) {
+#if LDBL_MANT_DIG >= 54
+  // Positive doubles in [2^-20, 2^60), whose halves need at most 54 bits
+  uint64_t bits = (uint64_t)(1003 + nextRandom() % 80) << 52 |
+                  (nextRandom() & (((uint64_t)1 << 52) - 1));
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  long double half =
+      ((long double)value + (long double)nextafter(value, INFINITY)) / 2;
+  int length = snprintf(buffer, LITERAL_MAX, "%.80Lf", half);
+  while (buffer[length - 1] == '0')
+    length--;
+  if (buffer[length - 1] == '.')
+    length--;
+  int nudge = (int)(nextRandom() % 4);
+  if (nudge == 1 && buffer[length - 1] != '0') {
+    buffer[length - 1]--;
+  } else if (nudge == 2 && length + 20 < LITERAL_MAX) {
+    if (memchr(buffer, '.', length) == NULL)
+      buffer[length++] = '.';
+    memset(buffer + length, '0', 19);
+    length += 19;
+    buffer[length++] = '1';
+  }
+  return length;
+#else
+  return randomLiteral(buffer);
+#endif
+}
+
+/**
+ * Parse a literal both ways, printing it if the results differ and report is
+ * set
+ *
+ * @returns True if the results are the same double */
+static bool check(const char *literal, int length, bool report) {
+  char terminated[LITERAL_MAX + 1];
+  memcpy(terminated, literal, length);
+  terminated[length] = '\0';
+  double expected = strtod(terminated, NULL);
+  double actual = parseNumber(literal, length);
+  if (memcmp(&expected, &actual, sizeof(double)) == 0)
+    return true;
+  if (report)
+    fprintf(stderr, "%s: parseNumber %.17g, strtod %.17g\n", terminated,
+            actual, expected);
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  long count = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_COUNT;
+  state = argc > 2 ? strtoull(argv[2], NULL, 10) : 0x9e3779b97f4a7c15ULL;
+  if (state == 0)
+    state = 1;
+
+  long failures = 0;
+  for (size_t i = 0; i < sizeof(edgeCases) / sizeof(edgeCases[0]); i++) {
+    failures += !check(edgeCases[i], (int)strlen(edgeCases[i]), true);
+  }
+
+  char buffer[LITERAL_MAX];
+  for (long i = 0; i < count; i++) {
+    int length;
+    switch (i % 8) {
+    case 0:
+      length = subnormalLiteral(buffer);
+      break;
+    case 1:
+      length = hugeLiteral(buffer);
+      break;
+    case 2:
+    case 3:
+      length = tieLiteral(buffer);
+      break;
+    default:
+      length = randomLiteral(buffer);
+      break;
+    }
+    failures += !check(buffer, length, failures < REPORT_MAX);
+  }
+
+  printf("%ld literals, %ld mismatches\n",
+         count + (long)(sizeof(edgeCases) / sizeof(edgeCases[0])), failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
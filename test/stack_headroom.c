@@ -0,0 +1,114 @@
+/**
+ * @file stack_headroom.c
+ * @brief Checks frames using every slot leave room for the runtime's pushes
+ *
+ * Runs scripts whose frames use all FRAME_SLOTS values, and whose deepest
+ * instruction allocates (concatenating heap strings, which pushes the string
+ * while interning it), on the VM's own stack and in a fiber, whose stack
+ * starts small and grows. Without headroom past the frames those pushes
+ * write past the end of the stack, which a sanitizer build reports.
+ *
+ * Usage: stack-headroom
+ * */
+
+// Std lib includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "clox.h"
+#include "vm.h"
+
+// Bytes of the generated scripts
+#define SCRIPT_MAX 8192
+// A number made by concatenating two globals into a new heap string (arrays
+// only hold numbers, and constants would be folded), needing two slots on
+// top of the ones before it
+#define CONCATENATION "(s + s and 1)"
+
+/**
+ * Append count copies of an element (each followed by a comma) */
+static void repeat(char *script, const char *element, int count) {
+  for (int i = 0; i < count; i++) {
+    strcat(script, element);
+  }
+}
+
+/**
+ * A call whose frame takes every slot: the callee, then the elements of an
+ * array literal up to the two strings being concatenated */
+static void fullScript(char *script) {
+  strcpy(script, "var s = \"abcd\"; var x = 1;\n"
+                 "fun f() { return [");
+  repeat(script, "x, ", FRAME_SLOTS - 3);
+  strcat(script, CONCATENATION "] and 1; }\nf();");
+}
+
+/**
+ * FRAMES_MAX full frames: each call is made as the last element of an array
+ * literal, so the callee's frame starts where its caller's ends */
+static void deepScript(char *script) {
+  char start[128];
+  snprintf(start, sizeof(start),
+           "var s = \"abcd\"; var x = 1; var depth = %d;\n"
+           "fun d() { depth = depth - 1; return depth == 0 and ([",
+           FRAMES_MAX - 1);
+  strcpy(script, start);
+  repeat(script, "x, ", FRAME_SLOTS - 3);
+  strcat(script, CONCATENATION "] and 1) or ([");
+  repeat(script, "x, ", FRAME_SLOTS - 2);
+  strcat(script, "d()] and 1); }\nd();");
+}
+
+/**
+ * Run a script on a new VM, on the VM's stack or as a fiber (each with its
+ * own VM, so the concatenated string isn't interned already)
+ *
+ * @returns How the script ran, or CLOX_COMPILE_ERROR */
+static CloxStatus runScript(const char *source, bool fiber) {
+  CloxVM *vm = cloxNewVM();
+  CloxScript *script = cloxCompile(vm, source);
+  if (script == NULL) {
+    cloxFreeVM(vm);
+    return CLOX_COMPILE_ERROR;
+  }
+  CloxStatus status;
+  if (fiber) {
+    CloxScheduler *scheduler = cloxNewScheduler(1, 0);
+    if (scheduler == NULL)
+      exit(EXIT_FAILURE);
+    status = cloxJoin(scheduler, cloxSpawn(scheduler, vm, script), NULL);
+    cloxFreeScheduler(scheduler);
+  } else {
+    status = cloxEvaluate(vm, script, NULL);
+  }
+  cloxFreeScript(vm, script);
+  cloxFreeVM(vm);
+  return status;
+}
+
+/**
+ * Run a script on a VM's stack, then as a fiber
+ *
+ * @returns True if both runs succeed */
+static bool check(const char *name, const char *source) {
+  CloxStatus evaluated = runScript(source, false);
+  CloxStatus joined = runScript(source, true);
+  if (evaluated != CLOX_OK || joined != CLOX_OK) {
+    fprintf(stderr, "%s: evaluate %d, fiber %d\n", name, evaluated, joined);
+    return false;
+  }
+  return true;
+}
+
+int main(void) {
+  static char script[SCRIPT_MAX];
+  int failures = 0;
+  fullScript(script);
+  failures += !check("full frame", script);
+  deepScript(script);
+  failures += !check("deep frames", script);
+  printf("%d failures\n", failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}